@@ -0,0 +1,1191 @@
+/******************************************************************************
+ * bench.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Benchmark entry point.  Runs a fixed suite of generated scenes and image
+ * sizes, timing each phase of a render, or micro-benchmarks of the
+ * individual techniques the tracer uses.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <json/reader.h>
+#include <json/value.h>
+
+#include "file/compiledScene.h"
+#include "file/reader.h"
+#include "image/colour.h"
+#include "image/image.h"
+#include "image/imageSize.h"
+#include "image/pipeline.h"
+#include "image/rayImage.h"
+#include "image/resample.h"
+#include "trace/gbuffer.h"
+#include "trace/generator.h"
+#include "trace/light_sources.h"
+#include "trace/object.h"
+#include "trace/ray.h"
+#include "trace/render.h"
+#include "trace/sphere.h"
+#include "trace/view.h"
+#include "trace/world.h"
+#include "util/clock.h"
+#include "util/parallel.h"
+#include "util/trace.h"
+
+using namespace std;
+
+//! Wall clock time, in seconds
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec*1E-6;
+}
+
+//! Uniform random double in [lo, hi)
+static double uniform(double lo, double hi) {
+    return lo + (hi-lo)*(rand() / (RAND_MAX + 1.0));
+}
+
+/* Fill a world with count unit-ish spheres, in a cube which grows with
+ * count so that the density of the scene stays constant */
+static void fillWorld(World &world, unsigned count,
+                      const RayColour &diffusivity = RayColour(0,0,0)) {
+    double side = 4.0 * pow((double)count, 1.0/3.0);
+    for (unsigned i=0; i<count; ++i) {
+        world.addSphere(
+            Coord(uniform(0, side), uniform(0, side), uniform(0, side)),
+            uniform(0.2, 1.0), diffusivity);
+    }
+}
+
+//! Random rays, starting outside the scene and aimed across it
+static void makeRays(vector<Ray*> &rays, unsigned count, unsigned objects) {
+    double side = 4.0 * pow((double)objects, 1.0/3.0);
+    for (unsigned i=0; i<count; ++i) {
+        Ray *ray = new Ray();
+        ray->m_endpoint = Coord(-1.0, uniform(0, side), uniform(0, side));
+        Coord target (side, uniform(0, side), uniform(0, side));
+        ray->m_dir = (target - ray->m_endpoint).unitify();
+        rays.push_back(ray);
+    }
+}
+
+/* Times loading a sphere scene: adding the spheres one at a time as
+ * separately allocated objects, or from the world's pool, then building
+ * the search structures. */
+static void benchLoad() {
+    const unsigned sizes[] = { 100000, 1000000 };
+    const unsigned numSizes = sizeof(sizes)/sizeof(sizes[0]);
+
+    printf("Scene load\n");
+    printf("%10s %16s %16s %16s\n", "objects", "addObject (ms)",
+           "addSphere (ms)", "finalize (ms)");
+
+    for (unsigned s=0; s<numSizes; ++s) {
+        double side = 4.0 * pow((double)sizes[s], 1.0/3.0);
+        vector<Coord> centres;
+        vector<double> radii;
+        srand(s+1);
+        for (unsigned i=0; i<sizes[s]; ++i) {
+            centres.push_back(Coord(uniform(0, side), uniform(0, side),
+                                    uniform(0, side)));
+            radii.push_back(uniform(0.2, 1.0));
+        }
+
+        double start = now();
+        {
+            World world;
+            for (unsigned i=0; i<sizes[s]; ++i) {
+                auto_ptr<RayObject> sph (new Sphere(centres[i], radii[i]));
+                world.addObject(sph);
+            }
+        }
+        double added = now() - start;
+
+        World world;
+        start = now();
+        for (unsigned i=0; i<sizes[s]; ++i) {
+            world.addSphere(centres[i], radii[i]);
+        }
+        double pooled = now() - start;
+        start = now();
+        world.finalize();
+        double finalized = now() - start;
+
+        printf("%10u %16.2f %16.2f %16.2f\n", sizes[s], added*1E3,
+               pooled*1E3, finalized*1E3);
+    }
+}
+
+//! JSON scene text for a field of random spheres
+static string sphereSceneText(unsigned count, unsigned seed) {
+    double side = 4.0 * pow((double)count, 1.0/3.0);
+    srand(seed);
+    ostringstream doc;
+    doc << "{ \"world\": { \"objects\": [\n";
+    for (unsigned i=0; i<count; ++i) {
+        doc << (i ? ",\n" : "") << "{ \"type\": \"sphere\", \"origin\": ["
+            << uniform(0, side) << ", " << uniform(0, side) << ", "
+            << uniform(0, side) << "], \"radius\": "
+            << uniform(0.2, 1.0) << ", \"diffusivity\": [0.5, 0.5, 0.5] }";
+    }
+    doc << "] },\n \"view\": { \"type\": \"parallel\", "
+        << "\"origin\": [0,0,0], \"xVec\": [1,0,0], \"yVec\": [0,1,0] } }";
+    return doc.str();
+}
+
+/* Times reading a scene file of random spheres with SceneReader, which
+ * adds each sphere to the world as it's read, and parsing the same file
+ * into a whole Json::Value document, as a DOM-based reader would first. */
+static void benchSceneRead() {
+    const unsigned sizes[] = { 10000, 300000 };
+    const unsigned numSizes = sizeof(sizes)/sizeof(sizes[0]);
+
+    printf("\nScene file read\n");
+    printf("%10s %12s %18s %16s\n", "spheres", "size (MB)",
+           "SceneReader (ms)", "DOM parse (ms)");
+
+    for (unsigned s=0; s<numSizes; ++s) {
+        string text = sphereSceneText(sizes[s], s+1);
+
+        double start = now();
+        {
+            istringstream in (text);
+            SceneReader reader ("");
+            if (!reader.parse(in)) {
+                printf("%s\n", reader.getErrors().c_str());
+                return;
+            }
+        }
+        double streamed = now() - start;
+
+        start = now();
+        {
+            Json::Value root;
+            Json::Reader dom;
+            dom.parse(text, root);
+        }
+        double parsed = now() - start;
+
+        printf("%10u %12.1f %18.2f %16.2f\n", sizes[s],
+               text.size() / 1048576.0, streamed*1E3, parsed*1E3);
+    }
+}
+
+/* Times getting a sphere scene ready to trace through a SceneCache: on a
+ * miss, reading its JSON, building the hierarchy and compiling it into the
+ * cache; loading the compiled file alone; and a hit, which also hashes the
+ * JSON. */
+/* Renders a small image of a loaded scene, which is the first thing a
+ * viewer would do with it, and gives the time taken. */
+static double firstExecute(Render &render) {
+    render.m_renderSize = ImageSize(64, 64);
+    render.m_processedSize = render.m_renderSize;
+    double start = now();
+    render.execute();
+    return now() - start;
+}
+
+/* Times loading a scene and rendering it the first time, from JSON, from
+ * a compiled scene, and through the cache when it misses and when it
+ * hits.  The render includes building the hierarchy, where the load
+ * hasn't restored it. */
+static void benchCompiledLoad() {
+    const unsigned sizes[] = { 10000, 300000 };
+    const unsigned numSizes = sizeof(sizes)/sizeof(sizes[0]);
+    char dir[] = "/tmp/benchSceneXXXXXX";
+    if (!mkdtemp(dir)) return;
+    string jsonPath = string(dir) + "/scene.json";
+
+    printf("\nCompiled scene load + first render\n");
+    printf("%10s %12s %16s %16s %16s %14s\n", "spheres", "JSON (ms)",
+           "cache miss (ms)", "compiled (ms)", "cache hit (ms)", "file (MB)");
+
+    for (unsigned s=0; s<numSizes; ++s) {
+        {
+            ofstream out (jsonPath.c_str());
+            out << sphereSceneText(sizes[s], s+1);
+        }
+
+        double start = now();
+        double json;
+        {
+            SceneReader reader (jsonPath.c_str());
+            if (!reader.parse()) {
+                printf("%s\n", reader.getErrors().c_str());
+                break;
+            }
+            json = now() - start + firstExecute(reader.getRender());
+        }
+
+        double miss;
+        string cachePath;
+        {
+            SceneCache cache (dir);
+            start = now();
+            if (!cache.load(jsonPath.c_str())) {
+                printf("%s\n", cache.getErrors().c_str());
+                break;
+            }
+            miss = now() - start + firstExecute(cache.getRender());
+            cachePath = cache.cachePath();
+        }
+
+        double loaded;
+        {
+            CompiledScene compiled (cachePath.c_str());
+            start = now();
+            if (!compiled.load()) {
+                printf("%s\n", compiled.getErrors().c_str());
+                break;
+            }
+            loaded = now() - start + firstExecute(compiled.getRender());
+        }
+
+        double hit;
+        {
+            SceneCache cache (dir);
+            start = now();
+            cache.load(jsonPath.c_str());
+            hit = now() - start + firstExecute(cache.getRender());
+            if (!cache.hit()) hit = -1.0;
+        }
+
+        struct stat st;
+        stat(cachePath.c_str(), &st);
+        printf("%10u %12.2f %16.2f %16.2f %16.2f %14.1f\n", sizes[s],
+               json*1E3, miss*1E3, loaded*1E3, hit < 0 ? hit : hit*1E3,
+               st.st_size / 1048576.0);
+        unlink(cachePath.c_str());
+    }
+    unlink(jsonPath.c_str());
+    rmdir(dir);
+}
+
+/* Times closest-hit queries through World::intersect, and through a
+ * plain linear search of the world's objects for comparison. */
+static void benchIntersect() {
+    const unsigned sizes[] = { 100, 1000, 10000, 100000, 1000000 };
+    const unsigned numSizes = sizeof(sizes)/sizeof(sizes[0]);
+    const unsigned numRays = 20000;
+    // Linear search gets slow; skip it beyond this size.
+    const unsigned maxLinear = 10000;
+
+    printf("\nWorld::intersect scaling (%u rays)\n", numRays);
+    printf("%10s %12s %14s %14s\n", "objects", "build (ms)",
+           "bvh (ns/ray)", "linear (ns/ray)");
+
+    for (unsigned s=0; s<numSizes; ++s) {
+        srand(s+1);
+        World world;
+        fillWorld(world, sizes[s]);
+        vector<Ray*> rays;
+        makeRays(rays, numRays, sizes[s]);
+
+        double start = now();
+        world.finalize();
+        double build = now() - start;
+
+        start = now();
+        for (unsigned i=0; i<rays.size(); ++i) {
+            world.intersect(*rays[i]);
+        }
+        double bvh = now() - start;
+
+        double linear = -1.0;
+        if (sizes[s] <= maxLinear) {
+            const vector<RayObject*> &objs = world.objects();
+            start = now();
+            for (unsigned i=0; i<rays.size(); ++i) {
+                double closest = -1.0;
+                for (unsigned j=0; j<objs.size(); ++j) {
+                    double d = objs[j]->intersectDist(*rays[i]);
+                    if ((d >= 0.0) && ((closest < 0.0) || (d < closest))) {
+                        closest = d;
+                    }
+                }
+            }
+            linear = now() - start;
+        }
+
+        printf("%10u %12.2f %14.1f ", sizes[s], build*1E3, bvh*1E9/numRays);
+        if (linear >= 0.0) {
+            printf("%14.1f\n", linear*1E9/numRays);
+        } else {
+            printf("%14s\n", "-");
+        }
+
+        for (unsigned i=0; i<rays.size(); ++i) delete rays[i];
+    }
+}
+
+/* Times shadow ray queries, done as a closest-hit search followed by a
+ * distance check, and as an any-hit search with World::occluded */
+static void benchOcclusion() {
+    const unsigned sizes[] = { 1000, 100000 };
+    const unsigned numSizes = sizeof(sizes)/sizeof(sizes[0]);
+    const unsigned numRays = 20000;
+
+    printf("\nShadow rays (%u rays)\n", numRays);
+    printf("%10s %10s %18s %18s\n", "objects", "occluded",
+           "closest (ns/ray)", "occluded (ns/ray)");
+
+    for (unsigned s=0; s<numSizes; ++s) {
+        srand(s+1);
+        World world;
+        fillWorld(world, sizes[s]);
+        world.finalize();
+        vector<Ray*> rays;
+        makeRays(rays, numRays, sizes[s]);
+
+        // Each 'light' is somewhere along the ray, inside the scene
+        vector<double> lightDist;
+        double side = 4.0 * pow((double)sizes[s], 1.0/3.0);
+        for (unsigned i=0; i<rays.size(); ++i) {
+            lightDist.push_back(uniform(0, side));
+        }
+
+        unsigned blocked = 0;
+        double start = now();
+        for (unsigned i=0; i<rays.size(); ++i) {
+            if (world.intersect(*rays[i]) &&
+                (rays[i]->m_intersectDist < lightDist[i])) {
+                ++blocked;
+            }
+        }
+        double closest = now() - start;
+
+        start = now();
+        for (unsigned i=0; i<rays.size(); ++i) {
+            world.occluded(rays[i]->m_endpoint, rays[i]->m_dir, lightDist[i]);
+        }
+        double occluded = now() - start;
+
+        printf("%10u %9.1f%% %18.1f %18.1f\n", sizes[s],
+               100.0*blocked/numRays,
+               closest*1E9/numRays, occluded*1E9/numRays);
+
+        for (unsigned i=0; i<rays.size(); ++i) delete rays[i];
+    }
+}
+
+/* Times primary rays from a ParallelView looking into a sphere field,
+ * traced one at a time and in packets.  There are no lights, so this
+ * is almost entirely the cost of finding the closest object. */
+static void benchPackets() {
+    const unsigned sizes[] = { 1000, 100000 };
+    const unsigned numSizes = sizeof(sizes)/sizeof(sizes[0]);
+    const unsigned dim = 256;
+
+    printf("\nPrimary rays, %ux%u ParallelView, 1 thread\n", dim, dim);
+    printf("%10s %18s %18s\n", "objects", "single (Mrays/s)",
+           "packet (Mrays/s)");
+
+    for (unsigned s=0; s<numSizes; ++s) {
+        srand(s+1);
+        World world;
+        fillWorld(world, sizes[s]);
+        world.finalize();
+
+        double side = 4.0 * pow((double)sizes[s], 1.0/3.0);
+        // Rays are cast along xVec x yVec, i.e. -x
+        ParallelView view;
+        view.m_origin = Coord(side + 1.0, 0, side);
+        view.m_xVec = RayVector(0, side, 0);
+        view.m_yVec = RayVector(0, 0, -side);
+
+        double rate[2];
+        for (int packets=0; packets<2; ++packets) {
+            RayImage image (dim, dim);
+            view.m_packets = packets;
+            double start = now();
+            view.render(image, world, 0, 1);
+            rate[packets] = dim*dim / (now() - start) / 1E6;
+        }
+
+        printf("%10u %18.3f %18.3f\n", sizes[s], rate[0], rate[1]);
+    }
+}
+
+/* Times primary rays from an AngleView in the middle of a sphere field,
+ * traced one at a time and in packets, and the cost of working out the
+ * ray directions from AngleView's tables against working each out with
+ * trig and normalising it. */
+static void benchAngleView() {
+    const unsigned sizes[] = { 1000, 100000 };
+    const unsigned numSizes = sizeof(sizes)/sizeof(sizes[0]);
+    const unsigned dim = 256;
+
+    printf("\nPrimary rays, %ux%u AngleView, 1 thread\n", dim, dim);
+    printf("%10s %18s %18s\n", "objects", "single (Mrays/s)",
+           "packet (Mrays/s)");
+
+    for (unsigned s=0; s<numSizes; ++s) {
+        srand(s+1);
+        World world;
+        fillWorld(world, sizes[s]);
+        world.finalize();
+
+        double side = 4.0 * pow((double)sizes[s], 1.0/3.0);
+        AngleView view;
+        view.m_origin = Coord(side/2, side/2, side/2);
+        view.m_xvec = RayVector(0, 1, 0);
+        view.m_yvec = RayVector(0, 0, -1);
+        view.m_xFov = 1.2;
+        view.m_yFov = 1.2;
+
+        double rate[2];
+        for (int packets=0; packets<2; ++packets) {
+            RayImage image (dim, dim);
+            view.m_packets = packets;
+            double start = now();
+            view.render(image, world, 0, 1);
+            rate[packets] = dim*dim / (now() - start) / 1E6;
+        }
+
+        printf("%10u %18.3f %18.3f\n", sizes[s], rate[0], rate[1]);
+    }
+
+    // Directions for a 1024x1024 image
+    const unsigned side = 1024;
+    const double fov = 1.2;
+    RayVector right (0, 1, 0), down (0, 0, -1), forward (-1, 0, 0);
+    double sum = 0.0;
+    double start = now();
+    for (unsigned i=0; i<side; ++i) {
+        for (unsigned j=0; j<side; ++j) {
+            double ax = ((j + 0.5)/side - 0.5) * fov;
+            double ay = ((i + 0.5)/side - 0.5) * fov;
+            RayVector dir = forward + tan(ax)*right + tan(ay)*down;
+            dir.unitify();
+            sum += dir.x();
+        }
+    }
+    double naive = now() - start;
+
+    start = now();
+    vector<RayVector> columns (side);
+    vector<double> rowCos (side), rowSin (side);
+    for (unsigned j=0; j<side; ++j) {
+        double angle = ((j + 0.5)/side - 0.5) * fov;
+        columns[j] = cos(angle)*forward + sin(angle)*right;
+    }
+    for (unsigned i=0; i<side; ++i) {
+        double angle = ((i + 0.5)/side - 0.5) * fov;
+        rowCos[i] = cos(angle);
+        rowSin[i] = sin(angle);
+    }
+    for (unsigned i=0; i<side; ++i) {
+        double c = rowCos[i], s = rowSin[i];
+        for (unsigned j=0; j<side; ++j) {
+            RayVector dir (c*columns[j].x() + s*down.x(),
+                           c*columns[j].y() + s*down.y(),
+                           c*columns[j].z() + s*down.z());
+            sum += dir.x();
+        }
+    }
+    double tables = now() - start;
+    printf("%22s %18s (checksum %.3g)\n", "trig+unitify (ns/ray)",
+           "tables (ns/ray)", sum);
+    printf("%22.2f %18.2f\n", naive*1E9/(side*side), tables*1E9/(side*side));
+}
+
+//! Scalar linear tone map, for comparison with LinearHDRToDisplay
+static void scalarLinear(double samples[], unsigned count,
+                         double min, double max) {
+    for (unsigned i=0; i < count; ++i) {
+        double val = (samples[i]-min) / (max - min);
+        if (val > 1.0) val = 1.0;
+        if (val < 0.0) val = 0;
+        samples[i] = val;
+    }
+}
+
+/* Times the tone mapping kernels on one block of samples at a time, as
+ * the image pipeline runs them. */
+static void benchToneMap() {
+    const unsigned block = 1024;
+    const unsigned blocks = 4096;
+    vector<double> source (block*blocks);
+    vector<double> samples (block*blocks);
+    srand(1);
+    for (unsigned i=0; i<source.size(); ++i) source[i] = uniform(0, 20.0);
+
+    LinearHDRToDisplay linear (0.0, 10.0);
+    LogHDRToDisplay exact (0.0, 10.0);
+    LogHDRToDisplay fast (0.0, 10.0, LogHDRToDisplay::FAST_LOG);
+    LogHDRToDisplay table (0.0, 10.0, LogHDRToDisplay::TABLE_LOG);
+    const char *names[] = { "linear, scalar", "linear, SSE2",
+        "log, libm", "log, SSE2 poly", "log, table" };
+    const ImageTransform *kernels[] = { 0, &linear, &exact, &fast, &table };
+
+    printf("\nTone mapping, %u blocks of %u samples\n", blocks, block);
+    printf("%16s %16s\n", "kernel", "Msamples/s");
+    for (unsigned k=0; k<5; ++k) {
+        samples = source;
+        double start = now();
+        for (unsigned b=0; b<blocks; ++b) {
+            if (kernels[k]) {
+                kernels[k]->mapSamples(&samples[b*block], block);
+            } else {
+                scalarLinear(&samples[b*block], block, 0.0, 10.0);
+            }
+        }
+        double elapsed = now() - start;
+        printf("%16s %16.1f\n", names[k], block*blocks / elapsed / 1E6);
+    }
+}
+
+/* Times each resampler enlarging a render to display size, as every
+ * frame is.  Separable resamplers work out their weights on the first
+ * frame, so the second is timed. */
+static void benchResample() {
+    const unsigned srcWidth = 960, srcHeight = 540;
+    const unsigned dstWidth = 1920, dstHeight = 1080;
+    Image source (srcWidth, srcHeight);
+    srand(1);
+    for (unsigned k=0; k<source.colours(); ++k) {
+        double *plane = source.doublePlane(k);
+        for (unsigned i=0; i<srcWidth*srcHeight; ++i) plane[i] = uniform(0, 1);
+    }
+
+    NearestNeighbor nearest;
+    BilinearInterpolator bilinear;
+    BoxResampler box;
+    MitchellResampler mitchell;
+    LanczosResampler lanczos;
+    Resampler *resamplers[] = { &nearest, &bilinear, &box, &mitchell,
+                                &lanczos };
+    const char *names[] = { "nearest", "bilinear", "box", "mitchell",
+                            "lanczos3" };
+
+    printf("\nResample %ux%u to %ux%u\n", srcWidth, srcHeight,
+           dstWidth, dstHeight);
+    printf("%16s %16s %16s\n", "resampler", "first (ms)", "next (ms)");
+    for (unsigned r=0; r<5; ++r) {
+        double times[2];
+        resamplers[r]->setResolution(dstWidth, dstHeight);
+        for (unsigned frame=0; frame<2; ++frame) {
+            Image img (source);
+            double start = now();
+            resamplers[r]->apply(img);
+            times[frame] = now() - start;
+        }
+        printf("%16s %16.1f %16.1f\n", names[r], times[0]*1E3, times[1]*1E3);
+    }
+}
+
+/* Times the display pipeline (linear then log tone mapping, then a
+ * nearest neighbour resample to half size) on large renders: one full
+ * pass per stage, as each transform's apply() does on its own, against
+ * ImagePipeline's fused pass. */
+static void benchPipeline() {
+    const ImageSize sizes[] = { ImageSize(3840, 2160), ImageSize(7680, 4320) };
+    const char *names[] = { "4K", "8K" };
+    const unsigned numSizes = sizeof(sizes)/sizeof(sizes[0]);
+
+    printf("\nImage pipeline, tone map and halve\n");
+    printf("%10s %16s %16s\n", "image", "separate (ms)", "fused (ms)");
+
+    for (unsigned s=0; s<numSizes; ++s) {
+        ImageSize half (sizes[s].m_width/2, sizes[s].m_height/2);
+        Image source (sizes[s].m_width, sizes[s].m_height);
+        srand(s+1);
+        for (unsigned k=0; k<source.colours(); ++k) {
+            double *plane = source.doublePlane(k);
+            size_t samples = (size_t)(source.width()) * source.height();
+            for (size_t i=0; i<samples; ++i) plane[i] = uniform(0, 20.0);
+        }
+
+        double separate;
+        {
+            Image img (source);
+            double start = now();
+            LinearHDRToDisplay(0.0, 10.0).apply(img);
+            LogHDRToDisplay(0.0, 1.0).apply(img);
+            NearestNeighbor(half.m_width, half.m_height).apply(img);
+            separate = now() - start;
+        }
+
+        double fused;
+        {
+            ImagePipeline pipeline;
+            pipeline.push(auto_ptr<ImageTransform>(
+                new LinearHDRToDisplay(0.0, 10.0)));
+            pipeline.push(auto_ptr<ImageTransform>(
+                new LogHDRToDisplay(0.0, 1.0)));
+            pipeline.setResampler(auto_ptr<Resampler>(new NearestNeighbor()));
+            RayImage traced;
+            traced.image() = source;
+            double start = now();
+            auto_ptr<Image> img = pipeline.process(traced, half);
+            fused = now() - start;
+        }
+
+        printf("%10s %16.1f %16.1f\n", names[s], separate*1E3, fused*1E3);
+    }
+}
+
+/* Times post-processing a 1200x800 render to twice the size (log tone
+ * map and Mitchell resample) with increasing numbers of threads. */
+static void benchPipelineThreads() {
+    const unsigned threads[] = { 1, 2, 4, 8 };
+    const unsigned numThreads = sizeof(threads)/sizeof(threads[0]);
+    Image source (1200, 800);
+    srand(1);
+    for (unsigned k=0; k<source.colours(); ++k) {
+        double *plane = source.doublePlane(k);
+        for (unsigned i=0; i<1200*800; ++i) plane[i] = uniform(0, 20.0);
+    }
+
+    ImagePipeline pipeline;
+    pipeline.push(auto_ptr<ImageTransform>(new LogHDRToDisplay(0.0, 1.0)));
+    pipeline.setResampler(auto_ptr<Resampler>(new MitchellResampler()));
+
+    printf("\nImage pipeline, 1200x800 to 2400x1600, %u CPUs\n",
+           defaultThreadCount());
+    printf("%10s %16s\n", "threads", "time (ms)");
+    for (unsigned t=0; t<numThreads; ++t) {
+        pipeline.setThreads(threads[t]);
+        RayImage traced;
+        traced.image() = source;
+        double start = now();
+        auto_ptr<Image> img = pipeline.process(traced, ImageSize(2400, 1600));
+        printf("%10u %16.1f\n", threads[t], (now() - start)*1E3);
+    }
+}
+
+/* Times a whole render, tracing the image then processing it, and
+ * streaming it through the pipeline in bands as it is traced. */
+static void benchStreaming() {
+    const unsigned width = 1600, height = 1200;
+    const unsigned bandRows = 64;
+    srand(1);
+    Render render;
+    render.m_world = tr1::shared_ptr<World>(new World());
+    fillWorld(*render.m_world, 1000);
+    double side = 4.0 * pow(1000.0, 1.0/3.0);
+    ParallelView *view = new ParallelView();
+    view->m_origin = Coord(side + 1.0, 0, side);
+    view->m_xVec = RayVector(0, side, 0);
+    view->m_yVec = RayVector(0, 0, -side);
+    render.m_view = tr1::shared_ptr<RayView>(view);
+    ImagePipeline *pipeline = new ImagePipeline();
+    pipeline->push(auto_ptr<ImageTransform>(new LogHDRToDisplay(0.0, 1.0)));
+    pipeline->setResampler(auto_ptr<Resampler>(new MitchellResampler()));
+    render.m_pipeline = tr1::shared_ptr<ImagePipeline>(pipeline);
+    render.m_renderSize = ImageSize(width, height);
+    render.m_processedSize = ImageSize(width/2, height/2);
+    render.m_threads = 1;
+
+    printf("\nRender %ux%u, processed to %ux%u, 1 tracing thread\n",
+           width, height, width/2, height/2);
+    printf("%10s %16s %20s\n", "band rows", "time (ms)", "traced held (MB)");
+    for (int stream=0; stream<2; ++stream) {
+        render.m_bandRows = stream ? bandRows : 0;
+        render.dropTraced();
+        double start = now();
+        auto_ptr<Image> img = render.execute();
+        double elapsed = now() - start;
+        // Banded, up to one band queued besides those traced and processed
+        unsigned held = stream ? 3*bandRows : height;
+        printf("%10u %16.1f %20.1f\n", render.m_bandRows, elapsed*1E3,
+               (double)(width) * held * 3 * sizeof(double) / (1 << 20));
+    }
+}
+
+/* Times shading a lit sphere field again from its primary hits, after a
+ * change to a light, against tracing it again.  Spheres in the field are
+ * matt, so the difference is the primary intersection work. */
+static void benchRelight() {
+    const unsigned sizes[] = { 1000, 100000 };
+    const unsigned numSizes = sizeof(sizes)/sizeof(sizes[0]);
+    const unsigned dim = 256;
+
+    printf("\nRelighting %ux%u ParallelView, 1 light, 1 thread\n", dim, dim);
+    printf("%10s %16s %16s\n", "objects", "trace (ms)", "relight (ms)");
+
+    for (unsigned s=0; s<numSizes; ++s) {
+        srand(s+1);
+        World world;
+        fillWorld(world, sizes[s], RayColour(0.5, 0.5, 0.5));
+        double side = 4.0 * pow((double)sizes[s], 1.0/3.0);
+        PointSource *light = new PointSource(
+            RayVector(side + 2.0, side/2, side + 2.0), RayColour(1E3,1E3,1E3));
+        auto_ptr<RayObject> owned (light);
+        world.addObject(owned);
+        world.finalize();
+
+        ParallelView view;
+        view.m_origin = Coord(side + 1.0, 0, side);
+        view.m_xVec = RayVector(0, side, 0);
+        view.m_yVec = RayVector(0, 0, -side);
+
+        GBuffer gbuffer;
+        RayImage image (dim, dim);
+        view.render(image, world, 0, 1, 32, &gbuffer);
+
+        light->setIntensity(RayColour(2E3, 1E3, 5E2));
+        double start = now();
+        view.render(image, world, 0, 1);
+        double traced = now() - start;
+        start = now();
+        gbuffer.relight(image, world, 1);
+        double relit = now() - start;
+
+        printf("%10u %16.1f %16.1f\n", sizes[s], traced*1E3, relit*1E3);
+    }
+}
+
+//! Number of rays which have hit a CountedSphere
+static unsigned long sphereHits = 0;
+
+//! A sphere which counts the rays it shades
+class CountedSphere : public Sphere {
+public:
+    CountedSphere(const Coord &origin, double radius,
+                  const RayColour &diffusivity,
+                  const RayColour &reflectivity) :
+        Sphere(origin, radius, diffusivity, reflectivity)
+        {}
+    virtual bool colour(Ray &inbound, const World &world) const {
+        ++sphereHits;
+        return Sphere::colour(inbound, world);
+    }
+};
+
+//! The scene rendered by trace-ui
+static void exampleWorld(World &world) {
+    world.m_defaultColour.set(0,1.0,0);
+    world.m_globalDiffuse.set(0.05, 0.05, 0.15);
+    // Origin, radius, diffusivity, reflectivity
+    const double spheres[][10] = {
+        { 0,0,0,       1.0,  0.1,0.25,1.0, 0.1,0.25,1.0 },
+        { 0.5,1.5,1.5, 1.5,  1.0,1.0,0.1,  1.0,1.0,0.2 },
+        { 0,-1.25,0,   0.5,  0.1,1.0,0.1,  0.2,1.0,0.2 },
+        { 1.2,0.3,0.1, 0.75, 1.0,0.1,0.1,  1.0,0.2,0.2 },
+        { -3.5,-2,2,   3,    0,0,0.4,      1,1,1 }
+    };
+    for (unsigned i=0; i<5; ++i) {
+        const double *s = spheres[i];
+        auto_ptr<RayObject> sph (new CountedSphere(Coord(s[0],s[1],s[2]),
+            s[3], RayColour(s[4],s[5],s[6]), RayColour(s[7],s[8],s[9])));
+        world.addObject(sph);
+    }
+    auto_ptr<RayObject> light1 (new SphereSource(RayVector(1.5,-2.5,1.5),
+        0.125, RayColour(90.0,90.0,90.0)));
+    world.addObject(light1);
+    auto_ptr<RayObject> light2 (new SphereSource(RayVector(5,-1,-1),
+        0.125, RayColour(100,100,100)));
+    world.addObject(light2);
+    world.finalize();
+}
+
+/* Counts the rays shaded by a view traced to depth 20, as reflections
+ * are cut off by their throughput, and the mean error that makes to the
+ * traced colours. */
+static void benchCutoffs(World &world, RayView &view,
+                         unsigned width, unsigned height) {
+    const double cutoffs[] = { 0.0, 1E-3, 1E-2, 1E-2, 1E-1 };
+    const bool roulette[] = { false, false, false, true, true };
+    const unsigned settings = sizeof(cutoffs)/sizeof(cutoffs[0]);
+
+    printf("%10s %9s %14s %12s %14s\n", "cutoff", "roulette",
+           "rays shaded", "time (ms)", "mean rel err");
+    RayImage reference (width, height);
+    for (unsigned s=0; s<settings; ++s) {
+        world.m_minThroughput = cutoffs[s];
+        world.m_roulette = roulette[s];
+        RayImage image (width, height);
+        sphereHits = 0;
+        double start = now();
+        view.render(s ? image : reference, world, 20, 1);
+        double elapsed = now() - start;
+
+        double error = 0.0;
+        for (unsigned i=0; s && i<height; ++i) {
+            for (unsigned j=0; j<width; ++j) {
+                RayColour ref = reference.at(i, j);
+                RayColour diff = image.at(i, j) - ref;
+                error += diff.magnitude() / (ref.magnitude() + 1E-9);
+            }
+        }
+        printf("%10g %9s %14lu %12.1f %14.2e\n", cutoffs[s],
+               roulette[s] ? "yes" : "no", sphereHits, elapsed*1E3,
+               error / (width*height));
+    }
+}
+
+static void benchTermination() {
+    World example;
+    exampleWorld(example);
+    ParallelView view;
+    view.m_origin = Coord(2.0,-2,2);
+    view.m_xVec = RayVector(0,4.5,0);
+    view.m_yVec = RayVector(0,0,-3);
+    printf("\nExample scene 300x200, depth 20, 1 thread\n");
+    benchCutoffs(example, view, 300, 200);
+
+    // A dense field of dull mirrors, lit from inside
+    srand(1);
+    const unsigned count = 1000;
+    double side = 4.0 * pow((double)count, 1.0/3.0);
+    World field;
+    for (unsigned i=0; i<count; ++i) {
+        auto_ptr<RayObject> sph (new CountedSphere(
+            Coord(uniform(0, side), uniform(0, side), uniform(0, side)),
+            uniform(0.5, 1.5), RayColour(0.3, 0.3, 0.3),
+            RayColour(0.6, 0.5, 0.4)));
+        field.addObject(sph);
+    }
+    auto_ptr<RayObject> light (new PointSource(
+        RayVector(side/2, side/2, side/2), RayColour(1E4, 1E4, 1E4)));
+    field.addObject(light);
+    field.finalize();
+    view.m_origin = Coord(side/2, side/4, 3*side/4);
+    view.m_xVec = RayVector(0, side/2, 0);
+    view.m_yVec = RayVector(0, 0, -side/2);
+    printf("\n%u dull mirrors 256x256, depth 20, 1 thread\n", count);
+    benchCutoffs(field, view, 256, 256);
+}
+
+/* Renders the example scene against a range of time budgets, and shows
+ * how far each got and how long it actually took. */
+static void benchDeadline() {
+    const double budgets[] = { 0.01, 0.03, 0.1, 0.3, 1.0 };
+    const unsigned numBudgets = sizeof(budgets)/sizeof(budgets[0]);
+    const unsigned width = 1200, height = 800;
+
+    Render render;
+    render.m_world = tr1::shared_ptr<World>(new World());
+    exampleWorld(*render.m_world);
+    ParallelView *view = new ParallelView();
+    view->m_origin = Coord(2.0,-2,2);
+    view->m_xVec = RayVector(0,4.5,0);
+    view->m_yVec = RayVector(0,0,-3);
+    render.m_view = tr1::shared_ptr<RayView>(view);
+    ImagePipeline *pipeline = new ImagePipeline();
+    pipeline->push(auto_ptr<ImageTransform>(new LogHDRToDisplay(0.0, 0.5)));
+    pipeline->setResampler(auto_ptr<Resampler>(new BilinearInterpolator()));
+    render.m_pipeline = tr1::shared_ptr<ImagePipeline>(pipeline);
+    render.m_maxDepth = 20;
+    render.m_renderSize = ImageSize(width, height);
+    render.m_processedSize = ImageSize(width, height);
+    render.m_threads = 1;
+
+    printf("\nExample scene against a deadline, %ux%u, 1 thread\n",
+           width, height);
+    printf("%12s %10s %6s %12s %10s %10s\n", "budget (ms)", "taken (ms)",
+           "level", "traced", "coverage", "complete");
+    for (unsigned b=0; b<numBudgets; ++b) {
+        render.dropTraced();
+        RenderQuality quality;
+        auto_ptr<Image> img = render.executeWithin(budgets[b], &quality);
+        char traced[24];
+        snprintf(traced, sizeof(traced), "%ux%u",
+                 quality.m_tracedSize.m_width, quality.m_tracedSize.m_height);
+        printf("%12.0f %10.1f %4u/%u %12s %9.1f%% %10s\n", budgets[b]*1E3,
+               quality.m_seconds*1E3, quality.m_level, quality.m_levels - 1,
+               traced, quality.m_coverage*100,
+               quality.m_complete ? "yes" : "no");
+    }
+}
+
+//! Trace output function which throws the message away
+static void discard(const char *msg) {}
+
+/* Times a typical TRC_INFO message, formatted and written straight away,
+ * and recorded into a trace ring to be formatted by a later flush */
+static void benchTraceRing() {
+    const unsigned batches = 200;
+    const unsigned batch = TRC_RING_RECORDS;
+    trc_ctl_t ctl = { TRC_INFO, "BENCH", discard };
+    char name[] = "pixel";
+
+    double start = now();
+    for (unsigned b=0; b<batches; ++b) {
+        for (unsigned i=0; i<batch; ++i) {
+            trc_printf(&ctl,TRC_INFO,1,"Render [%d,%d]: %s %.03f\n",
+                       b,i,name,i*0.5);
+        }
+    }
+    double direct = now() - start;
+
+    double record = 0.0;
+    double flush = 0.0;
+    trc_ring_start();
+    for (unsigned b=0; b<batches; ++b) {
+        start = now();
+        for (unsigned i=0; i<batch; ++i) {
+            trc_printf(&ctl,TRC_INFO,1,"Render [%d,%d]: %s %.03f\n",
+                       b,i,name,i*0.5);
+        }
+        record += now() - start;
+        start = now();
+        trc_ring_flush();
+        flush += now() - start;
+    }
+    trc_ring_stop();
+
+    double count = batches*batch;
+    printf("\nTRC_INFO trace, tagged (%u messages)\n", batches*batch);
+    printf("%16s %16s %16s\n", "direct (ns/msg)", "ring (ns/msg)",
+           "flush (ns/msg)");
+    printf("%16.1f %16.1f %16.1f\n", direct*1E9/count, record*1E9/count,
+           flush*1E9/count);
+}
+
+/* The benchmark suite: a fixed matrix of generated scenes and image sizes,
+ * timing each phase of a render on its own.  Every measurement is repeated,
+ * and printed as one tab-separated line, so that the output of two builds
+ * can be compared line by line (e.g. with diff, or a spreadsheet).  Rates
+ * are at the median time. */
+
+//! Times each measurement is repeated
+#define SUITE_REPS 5
+//! Primary rays traced through World::trace, per repeat
+#define SUITE_RAYS 4096
+//! Depth of reflections traced
+#define SUITE_DEPTH 10
+
+struct SuiteScene {
+    SceneGenerator::Kind m_kind;
+    unsigned             m_objects;
+    //! Whether the scene is run with --quick
+    bool                 m_quick;
+};
+
+static const SuiteScene suiteScenes[] = {
+    { SceneGenerator::FIELD,    100,     true },
+    { SceneGenerator::FIELD,    10000,   true },
+    { SceneGenerator::FIELD,    1000000, false },
+    { SceneGenerator::CLUSTERS, 10000,   true },
+    { SceneGenerator::CLUSTERS, 1000000, false },
+    { SceneGenerator::MIRRORS,  10000,   true },
+    { SceneGenerator::LIGHTS,   1000,    true }
+};
+
+//! Image sizes rendered.  Only the first is run with --quick.
+static const unsigned suiteSizes[][2] = { { 160, 120 }, { 640, 480 } };
+
+//! Nearest-rank percentile of some timings
+static double percentile(vector<double> times, double p) {
+    sort(times.begin(), times.end());
+    unsigned rank = (unsigned)(ceil(p/100.0 * times.size()));
+    return times[rank ? rank-1 : 0];
+}
+
+/* Print one result.
+ * @param work  Units of work done per repeat, e.g. rays */
+static void suiteLine(const char *phase, const char *scene, unsigned objects,
+                      unsigned width, unsigned height,
+                      const vector<double> &times, double work,
+                      const char *unit) {
+    double median = percentile(times, 50);
+    printf("%s\t%s\t%u\t%u\t%u\t%u\t%.3f\t%.3f\t%.3f\t%.4g\t%s\n",
+           phase, scene, objects, width, height, (unsigned)(times.size()),
+           percentile(times, 10)*1E3, median*1E3, percentile(times, 90)*1E3,
+           work / median, unit);
+    fflush(stdout);
+}
+
+/* Primary rays from the view, through random points of its image.  These
+ * go through World::trace, with no view or pipeline around it. */
+static void suiteRays(const AngleView &view, vector<Ray> &rays) {
+    RayVector look = view.m_xvec.cross(view.m_yvec).unitify();
+    RayVector right = RayVector(view.m_xvec).unitify();
+    RayVector down = RayVector(view.m_yvec).unitify();
+    srand(1);
+    rays.assign(SUITE_RAYS, Ray(SUITE_DEPTH));
+    for (unsigned i=0; i<SUITE_RAYS; ++i) {
+        double x = tan(uniform(-0.5, 0.5) * view.m_xFov);
+        double y = tan(uniform(-0.5, 0.5) * view.m_yFov);
+        rays[i].m_endpoint = view.m_origin;
+        rays[i].m_dir = (look + right*x + down*y).unitify();
+    }
+}
+
+static void suiteScene(const SuiteScene &scene, bool quick) {
+    SceneGenerator generator (scene.m_kind, scene.m_objects);
+    const char *name = SceneGenerator::kindName(scene.m_kind);
+
+    // Generating the objects, then building the hierarchy over them
+    vector<double> generated, finalized;
+    tr1::shared_ptr<World> world;
+    for (unsigned r=0; r<SUITE_REPS; ++r) {
+        world = tr1::shared_ptr<World>(new World());
+        WorldBuilder builder (*world);
+        double start = monotonicSeconds();
+        generator.generate(builder);
+        generated.push_back(monotonicSeconds() - start);
+        start = monotonicSeconds();
+        world->finalize();
+        finalized.push_back(monotonicSeconds() - start);
+    }
+    suiteLine("generate", name, scene.m_objects, 0, 0, generated,
+              scene.m_objects, "objects/s");
+    suiteLine("finalize", name, scene.m_objects, 0, 0, finalized,
+              scene.m_objects, "objects/s");
+
+    // World::trace alone, one thread
+    AngleView *view = new AngleView();
+    generator.view(*view);
+    vector<Ray> rays;
+    suiteRays(*view, rays);
+    vector<double> traced;
+    for (unsigned r=0; r<SUITE_REPS; ++r) {
+        double start = monotonicSeconds();
+        for (unsigned i=0; i<rays.size(); ++i) {
+            Ray ray (rays[i]);
+            world->trace(ray);
+        }
+        traced.push_back(monotonicSeconds() - start);
+    }
+    suiteLine("trace", name, scene.m_objects, 0, 0, traced,
+              rays.size(), "rays/s");
+
+    // The whole render, on every CPU
+    Render render;
+    render.m_world = world;
+    render.m_view = tr1::shared_ptr<RayView>(view);
+    render.m_pipeline = tr1::shared_ptr<ImagePipeline>(new ImagePipeline());
+    render.m_pipeline->push(auto_ptr<ImageTransform>
+        (new LogHDRToDisplay(0.0, 1.0)));
+    render.m_maxDepth = SUITE_DEPTH;
+    render.m_threads = 0;
+    unsigned sizes = quick ? 1 : sizeof(suiteSizes)/sizeof(suiteSizes[0]);
+    for (unsigned s=0; s<sizes; ++s) {
+        unsigned width = suiteSizes[s][0], height = suiteSizes[s][1];
+        render.m_renderSize = ImageSize(width, height);
+        render.m_processedSize = render.m_renderSize;
+        vector<double> rendered;
+        for (unsigned r=0; r<SUITE_REPS; ++r) {
+            // Or the image traced last time would just be processed again
+            render.dropTraced();
+            double start = monotonicSeconds();
+            render.execute();
+            rendered.push_back(monotonicSeconds() - start);
+        }
+        suiteLine("render", name, scene.m_objects, width, height, rendered,
+                  (double)(width)*height, "pixels/s");
+    }
+}
+
+/* ImagePipeline::process alone: a log tone map of a traced image, then
+ * resampled to twice its size. */
+static void suitePipeline(bool quick) {
+    unsigned sizes = quick ? 1 : sizeof(suiteSizes)/sizeof(suiteSizes[0]);
+    for (unsigned s=0; s<sizes; ++s) {
+        unsigned width = suiteSizes[s][0], height = suiteSizes[s][1];
+        Image source (width, height);
+        srand(1);
+        for (unsigned c=0; c<3; ++c) {
+            double *plane = source.doublePlane(c);
+            for (unsigned i=0; i<width*height; ++i) {
+                plane[i] = uniform(0.0, 2.0);
+            }
+        }
+        ImagePipeline pipeline;
+        pipeline.push(auto_ptr<ImageTransform>(new LogHDRToDisplay(0.0, 1.0)));
+        pipeline.setResampler(auto_ptr<Resampler>(new BilinearInterpolator()));
+        vector<double> processed;
+        for (unsigned r=0; r<SUITE_REPS; ++r) {
+            double start = monotonicSeconds();
+            pipeline.process(source, ImageSize(2*width, 2*height));
+            processed.push_back(monotonicSeconds() - start);
+        }
+        suiteLine("pipeline", "-", 0, width, height, processed,
+                  3.0*width*height, "samples/s");
+    }
+}
+
+static void benchSuite(bool quick) {
+#ifdef __OPTIMIZE__
+    const char *optimized = "yes";
+#else
+    const char *optimized = "no";
+#endif
+    printf("# bench suite 1, optimized %s, %u cpus, TRC_MAX_LEVEL %d, "
+           "%d repeats%s\n", optimized, defaultThreadCount(), TRC_MAX_LEVEL,
+           SUITE_REPS, quick ? ", quick" : "");
+    printf("phase\tscene\tobjects\twidth\theight\treps\t"
+           "p10_ms\tp50_ms\tp90_ms\trate\tunit\n");
+    for (unsigned i=0; i < sizeof(suiteScenes)/sizeof(suiteScenes[0]); ++i) {
+        if (quick && !suiteScenes[i].m_quick) continue;
+        suiteScene(suiteScenes[i], quick);
+    }
+    suitePipeline(quick);
+}
+
+static void benchMicro() {
+    printf("Detail tracing %s (TRC_MAX_LEVEL %d)\n\n",
+           (TRC_MAX_LEVEL >= TRC_DTL) ? "compiled in" : "compiled out",
+           TRC_MAX_LEVEL);
+    benchLoad();
+    benchSceneRead();
+    benchCompiledLoad();
+    benchIntersect();
+    benchOcclusion();
+    benchPackets();
+    benchAngleView();
+    benchToneMap();
+    benchResample();
+    benchPipeline();
+    benchPipelineThreads();
+    benchStreaming();
+    benchRelight();
+    benchTermination();
+    benchDeadline();
+    benchTraceRing();
+}
+
+/* Usage: bench [--quick | --micro]
+ * By default, runs the suite; --quick runs just its smaller scenes and
+ * images.  --micro runs the micro-benchmarks of individual techniques,
+ * printing a table for each. */
+int main(int argc, char *argv[]) {
+    bool quick = false, micro = false;
+    for (int i=1; i<argc; ++i) {
+        if (!strcmp(argv[i], "--quick")) {
+            quick = true;
+        } else if (!strcmp(argv[i], "--micro")) {
+            micro = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--quick | --micro]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (micro) {
+        benchMicro();
+    } else {
+        benchSuite(quick);
+    }
+    return 0;
+}
@@ -0,0 +1,586 @@
+/******************************************************************************
+ * compiledScene.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * A binary form of a scene, which loads much faster than the JSON it was
+ * compiled from, and a cache of compiled scenes keyed by their source.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tr1/memory>
+#include <gtest/gtest.h>
+#include <json/writer.h>
+
+#include "compiledScene.h"
+#include "reader.h"
+
+#include "image/image.h"
+#include "trace/light_sources.h"
+#include "trace/sphere.h"
+#include "trace/world.h"
+#include "util/hash.h"
+#include "util/trace.h"
+
+using namespace std;
+using namespace std::tr1;
+
+static trc_ctl_t compiledTrace = {
+	TRC_DFL_LVL,
+	"COMPILED_SCENE",
+	TRC_STDOUT
+};
+#define TRACE(level, args...) \
+	TRC_PRINTF(&compiledTrace,level,1,args)
+
+//! First bytes of every compiled scene
+static const char COMPILED_MAGIC[8] = {'T','R','C','S','C','E','N','E'};
+//! Changed whenever the layout of the file changes
+#define COMPILED_VERSION    2
+//! Written as is, so that files from a machine of other byte order are refused
+#define COMPILED_BYTE_ORDER 0x01020304
+
+/* Start of the file.  Each section follows it, at the given offset, which
+ * is a multiple of 8 so that its records can be read straight from the
+ * mapped file. */
+struct CompiledHeader {
+	char     m_magic[8];
+	uint32_t m_version;
+	uint32_t m_byteOrder;
+	// Sizes of the records, which must match the reader's
+	uint32_t m_objectSize;
+	uint32_t m_nodeSize;
+	// Hash of the scene file compiled
+	uint64_t m_sourceHash;
+	uint64_t m_fileSize;
+
+	double   m_defaultColour[3];
+	double   m_globalDiffuse[3];
+	double   m_minThroughput;
+	uint32_t m_roulette;
+
+	uint32_t m_objectCount;
+	uint32_t m_nodeCount;
+	// Entries of the order section, each a uint32_t
+	uint32_t m_orderCount;
+	uint64_t m_objectOffset;
+	uint64_t m_nodeOffset;
+	uint64_t m_orderOffset;
+	// The scene's other members, as JSON text
+	uint64_t m_settingsOffset;
+	uint64_t m_settingsSize;
+};
+
+//! Kinds of world object
+enum CompiledType {
+	COMPILED_SPHERE = 1,
+	COMPILED_POINT_SOURCE,
+	COMPILED_SPHERE_SOURCE
+};
+
+//! A world object
+struct CompiledObject {
+	uint32_t m_type;
+	uint32_t m_pad;
+	// Centre of a sphere, or the point of a point source
+	double   m_origin[3];
+	double   m_radius;
+	// Diffusivity of a sphere, or intensity of a light
+	double   m_colour[3];
+	double   m_reflectivity[3];
+	// Where a sphere source's light comes from
+	double   m_lightPoint[3];
+};
+
+//! A node of the search hierarchy, as BoundingVolumeHierarchy::Node
+struct CompiledNode {
+	double   m_min[3];
+	double   m_max[3];
+	uint32_t m_first;
+	uint32_t m_count;
+	uint32_t m_spheres;
+	uint32_t m_pad;
+};
+
+static void toArray(const RayVector &v, double out[3]) {
+	out[0] = v.x();
+	out[1] = v.y();
+	out[2] = v.z();
+}
+
+static void toArray(const RayColour &c, double out[3]) {
+	out[0] = c.r;
+	out[1] = c.g;
+	out[2] = c.b;
+}
+
+/* Fill in the record of a world object.
+ * @return false if the object is of a kind which can't be compiled */
+static bool compileObject(const RayObject &obj, CompiledObject &rec) {
+	memset(&rec, 0, sizeof(rec));
+	Coord centre;
+	double radius = 0.0;
+	if (const SphereSource *source = dynamic_cast<const SphereSource*>(&obj)) {
+		rec.m_type = COMPILED_SPHERE_SOURCE;
+		source->sphere(centre, radius);
+		toArray(source->intensity(), rec.m_colour);
+		toArray(source->position(), rec.m_lightPoint);
+	} else if (const PointSource *point = dynamic_cast<const PointSource*>(&obj)) {
+		rec.m_type = COMPILED_POINT_SOURCE;
+		centre = point->position();
+		toArray(point->intensity(), rec.m_colour);
+	} else if (const Sphere *sphere = dynamic_cast<const Sphere*>(&obj)) {
+		rec.m_type = COMPILED_SPHERE;
+		sphere->sphere(centre, radius);
+		toArray(sphere->m_diffusivity, rec.m_colour);
+		toArray(sphere->m_reflectivity, rec.m_reflectivity);
+	} else {
+		return false;
+	}
+	toArray(centre, rec.m_origin);
+	rec.m_radius = radius;
+	return true;
+}
+
+/* Write a section, and zeros after it up to the next multiple of 8.
+ * @param offset Advanced past the section and padding */
+static void writeSection(ostream &out, const void *data, size_t size,
+                         uint64_t &offset) {
+	static const char zeros[8] = {0};
+	if (size) out.write(static_cast<const char*>(data), size);
+	offset += size;
+	if (offset % 8) {
+		out.write(zeros, 8 - offset % 8);
+		offset += 8 - offset % 8;
+	}
+}
+
+bool CompiledScene::write(const char *path, const World &world,
+                          const Json::Value &settings, uint64_t sourceHash,
+                          ostream &errors) {
+	const vector<RayObject*> &objects = world.objects();
+	vector<CompiledObject> records (objects.size());
+	for (unsigned i=0; i < objects.size(); ++i) {
+		if (!compileObject(*objects[i], records[i])) {
+			errors << "Object " << i << " is of a kind which can't be compiled";
+			return false;
+		}
+	}
+
+	vector<CompiledNode> nodes;
+	vector<uint32_t> order;
+	if (world.isFinalized()) {
+		const vector<BoundingVolumeHierarchy::Node> &built =
+			world.hierarchy().nodes();
+		nodes.resize(built.size());
+		for (unsigned i=0; i < built.size(); ++i) {
+			memset(&nodes[i], 0, sizeof(nodes[i]));
+			memcpy(nodes[i].m_min, built[i].m_box.m_min, sizeof(nodes[i].m_min));
+			memcpy(nodes[i].m_max, built[i].m_box.m_max, sizeof(nodes[i].m_max));
+			nodes[i].m_first = built[i].m_first;
+			nodes[i].m_count = built[i].m_count;
+			nodes[i].m_spheres = built[i].m_spheres;
+		}
+		const vector<unsigned> &builtOrder = world.hierarchy().order();
+		order.assign(builtOrder.begin(), builtOrder.end());
+	}
+
+	/* The loader hands this straight to SceneReader, so it needs a world,
+	 * even though the real one comes from the records. */
+	Json::Value scene = settings;
+	scene["world"] = Json::Value(Json::objectValue);
+	Json::FastWriter writer;
+	string text = writer.write(scene);
+
+	CompiledHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.m_magic, COMPILED_MAGIC, sizeof(header.m_magic));
+	header.m_version = COMPILED_VERSION;
+	header.m_byteOrder = COMPILED_BYTE_ORDER;
+	header.m_objectSize = sizeof(CompiledObject);
+	header.m_nodeSize = sizeof(CompiledNode);
+	header.m_sourceHash = sourceHash;
+	toArray(world.m_defaultColour, header.m_defaultColour);
+	toArray(world.m_globalDiffuse, header.m_globalDiffuse);
+	header.m_minThroughput = world.m_minThroughput;
+	header.m_roulette = world.m_roulette ? 1 : 0;
+	header.m_objectCount = records.size();
+	header.m_nodeCount = nodes.size();
+	header.m_orderCount = order.size();
+
+	ostringstream temp;
+	temp << path << ".tmp" << getpid();
+	ofstream out (temp.str().c_str(), ios_base::out | ios_base::binary);
+	if (out.fail()) {
+		errors << "Failed to create " << temp.str() << ": " << strerror(errno);
+		return false;
+	}
+
+	// The header is written again at the end, once the offsets are known
+	uint64_t offset = 0;
+	writeSection(out, &header, sizeof(header), offset);
+	header.m_objectOffset = offset;
+	writeSection(out, records.empty() ? 0 : &records[0],
+	             records.size() * sizeof(CompiledObject), offset);
+	header.m_nodeOffset = offset;
+	writeSection(out, nodes.empty() ? 0 : &nodes[0],
+	             nodes.size() * sizeof(CompiledNode), offset);
+	header.m_orderOffset = offset;
+	writeSection(out, order.empty() ? 0 : &order[0],
+	             order.size() * sizeof(uint32_t), offset);
+	header.m_settingsOffset = offset;
+	header.m_settingsSize = text.size();
+	writeSection(out, text.data(), text.size(), offset);
+	header.m_fileSize = offset;
+	out.seekp(0);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.close();
+
+	if (out.fail() || rename(temp.str().c_str(), path)) {
+		errors << "Failed to write " << path << ": " << strerror(errno);
+		unlink(temp.str().c_str());
+		return false;
+	}
+	return true;
+}
+
+bool CompiledScene::hashFile(const char *path, uint64_t &hash) {
+	ifstream in (path, ios_base::in | ios_base::binary);
+	if (in.fail()) return false;
+
+	Hasher hasher;
+	vector<char> buf (65536);
+	uint64_t total = 0;
+	while (in.good()) {
+		in.read(&buf[0], buf.size());
+		// Whole buffers are a multiple of 8, so only the last is padded
+		hasher.addBytes(&buf[0], in.gcount());
+		total += in.gcount();
+	}
+	if (in.bad()) return false;
+	hasher.add(total);
+	hash = hasher.value();
+	return true;
+}
+
+bool CompiledScene::load(uint64_t sourceHash) {
+	m_valid = false;
+	m_restored = false;
+
+	int fd = open(m_path, O_RDONLY);
+	if (fd < 0) {
+		m_errStream << "Failed to open file: " << strerror(errno);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || (st.st_size < (off_t)(sizeof(CompiledHeader)))) {
+		m_errStream << "Not a compiled scene";
+		close(fd);
+		return false;
+	}
+	void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		m_errStream << "Failed to map file: " << strerror(errno);
+		return false;
+	}
+
+	m_valid = loadMapped(static_cast<const char*>(map), st.st_size, sourceHash);
+	munmap(map, st.st_size);
+	return m_valid;
+}
+
+//! Whether count records of the given size fit in the file at offset
+static bool sectionFits(uint64_t offset, uint64_t count, uint64_t size,
+                        uint64_t fileSize) {
+	if ((offset % 8) || (offset > fileSize)) return false;
+	return count <= (fileSize - offset) / size;
+}
+
+bool CompiledScene::loadMapped(const char *data, size_t size,
+                               uint64_t sourceHash) {
+	CompiledHeader header;
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.m_magic, COMPILED_MAGIC, sizeof(header.m_magic)) ||
+	    (header.m_version != COMPILED_VERSION) ||
+	    (header.m_byteOrder != COMPILED_BYTE_ORDER) ||
+	    (header.m_objectSize != sizeof(CompiledObject)) ||
+	    (header.m_nodeSize != sizeof(CompiledNode))) {
+		m_errStream << "Not a compiled scene, or compiled by another version "
+		            << "or kind of machine";
+		return false;
+	}
+	if ((header.m_fileSize != size) ||
+	    !sectionFits(header.m_objectOffset, header.m_objectCount,
+	                 sizeof(CompiledObject), size) ||
+	    !sectionFits(header.m_nodeOffset, header.m_nodeCount,
+	                 sizeof(CompiledNode), size) ||
+	    !sectionFits(header.m_orderOffset, header.m_orderCount,
+	                 sizeof(uint32_t), size) ||
+	    !sectionFits(header.m_settingsOffset, header.m_settingsSize, 1, size)) {
+		m_errStream << "Compiled scene is truncated or corrupt";
+		return false;
+	}
+	if (sourceHash && (header.m_sourceHash != sourceHash)) {
+		m_errStream << "Compiled from a different scene";
+		return false;
+	}
+	m_sourceHash = header.m_sourceHash;
+
+	// The view, image and render settings are read as for a scene file
+	istringstream settings (string(data + header.m_settingsOffset,
+	                               header.m_settingsSize));
+	SceneReader reader ("");
+	if (!reader.parse(settings)) {
+		m_errStream << "Bad scene settings: " << reader.getErrors();
+		return false;
+	}
+	m_render = reader.getRender();
+
+	World &world = *m_render.m_world;
+	const double *c = header.m_defaultColour;
+	world.m_defaultColour.set(c[0], c[1], c[2]);
+	c = header.m_globalDiffuse;
+	world.m_globalDiffuse.set(c[0], c[1], c[2]);
+	world.m_minThroughput = header.m_minThroughput;
+	world.m_roulette = header.m_roulette != 0;
+
+	const CompiledObject *objects = reinterpret_cast<const CompiledObject*>
+		(data + header.m_objectOffset);
+	for (unsigned i=0; i < header.m_objectCount; ++i) {
+		const CompiledObject &rec = objects[i];
+		Coord origin (rec.m_origin[0], rec.m_origin[1], rec.m_origin[2]);
+		RayColour colour (rec.m_colour[0], rec.m_colour[1], rec.m_colour[2]);
+		auto_ptr<RayObject> added;
+		switch (rec.m_type) {
+		case COMPILED_SPHERE:
+			world.addSphere(origin, rec.m_radius, colour,
+				RayColour(rec.m_reflectivity[0], rec.m_reflectivity[1],
+				          rec.m_reflectivity[2]));
+			break;
+		case COMPILED_POINT_SOURCE:
+			added.reset(new PointSource(origin, colour));
+			world.addObject(added);
+			break;
+		case COMPILED_SPHERE_SOURCE: {
+			SphereSource *source = new SphereSource(origin, rec.m_radius, colour);
+			source->setPosition(RayVector(rec.m_lightPoint[0],
+				rec.m_lightPoint[1], rec.m_lightPoint[2]));
+			added.reset(source);
+			world.addObject(added);
+			break;
+		}
+		default:
+			m_errStream << "Object " << i << ": unknown type " << rec.m_type;
+			return false;
+		}
+	}
+
+	if (header.m_nodeCount) {
+		const CompiledNode *saved = reinterpret_cast<const CompiledNode*>
+			(data + header.m_nodeOffset);
+		vector<BoundingVolumeHierarchy::Node> nodes (header.m_nodeCount);
+		for (unsigned i=0; i < header.m_nodeCount; ++i) {
+			memcpy(nodes[i].m_box.m_min, saved[i].m_min, sizeof(saved[i].m_min));
+			memcpy(nodes[i].m_box.m_max, saved[i].m_max, sizeof(saved[i].m_max));
+			nodes[i].m_first = saved[i].m_first;
+			nodes[i].m_count = saved[i].m_count;
+			nodes[i].m_spheres = saved[i].m_spheres;
+		}
+		const uint32_t *savedOrder = reinterpret_cast<const uint32_t*>
+			(data + header.m_orderOffset);
+		vector<unsigned> order (savedOrder,
+		                        savedOrder + header.m_orderCount);
+		m_restored = world.finalize(&nodes[0], nodes.size(),
+		                            order.empty() ? 0 : &order[0],
+		                            order.size());
+	} else {
+		world.finalize();
+	}
+
+	TRACE(TRC_STAT, "Loaded %s: %u objects, hierarchy %s.\n", m_path,
+	      header.m_objectCount, m_restored ? "restored" : "built");
+	return true;
+}
+
+bool SceneCache::load(const char *scenePath) {
+	m_hit = false;
+	m_cachePath.clear();
+
+	uint64_t hash;
+	if (!CompiledScene::hashFile(scenePath, hash)) {
+		m_errStream << "Failed to read " << scenePath;
+		return false;
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.scene", (unsigned long long)(hash));
+	m_cachePath = m_dir + "/" + name;
+
+	CompiledScene compiled (m_cachePath.c_str());
+	if (compiled.load(hash)) {
+		m_render = compiled.getRender();
+		m_hit = true;
+		return true;
+	}
+
+	SceneReader reader (scenePath);
+	if (!reader.parse()) {
+		m_errStream << scenePath << ": " << reader.getErrors();
+		return false;
+	}
+	m_render = reader.getRender();
+	m_render.m_world->finalize();
+
+	/* Don't cache what was read under the hash, if the file changed while
+	 * it was being read. */
+	uint64_t after;
+	stringstream errors;
+	if (!CompiledScene::hashFile(scenePath, after) || (after != hash)) {
+		TRACE(TRC_WARN, "%s changed while being read; not cached.\n",
+		      scenePath);
+	} else if (!CompiledScene::write(m_cachePath.c_str(), *m_render.m_world,
+	                                 reader.settings(), hash, errors)) {
+		TRACE(TRC_WARN, "Failed to cache %s: %s\n", scenePath,
+		      errors.str().c_str());
+	}
+	return true;
+}
+
+//! A small scene with every kind of object, for the tests below.
+static const char *testScene =
+	"{ \"world\": { \"defaultColour\": [0, 1, 0],\n"
+	"    \"globalDiffuse\": [0.05, 0.05, 0.15], \"minThroughput\": 0.001,\n"
+	"    \"objects\": [\n"
+	"      { \"type\": \"sphere\", \"origin\": [0, 0, 0], \"radius\": 1,\n"
+	"        \"diffusivity\": [0.1, 0.25, 1], \"reflectivity\": [1, 1, 1] },\n"
+	"      { \"type\": \"sphere\", \"origin\": [0.5, 1.5, 1.5], \"radius\": 1.5,\n"
+	"        \"diffusivity\": [1, 1, 0.1], \"reflectivity\": [1, 1, 0.2] },\n"
+	"      { \"type\": \"sphereSource\", \"origin\": [1.5, -2.5, 1.5],\n"
+	"        \"radius\": 0.125, \"intensity\": [90, 90, 90] },\n"
+	"      { \"type\": \"pointSource\", \"origin\": [5, -1, -1],\n"
+	"        \"intensity\": [100, 100, 100] } ] },\n"
+	"  \"view\": { \"type\": \"parallel\", \"origin\": [2, -2, 2],\n"
+	"    \"xVec\": [0, 4.5, 0], \"yVec\": [0, 0, -3] },\n"
+	"  \"image\": [ { \"type\": \"logHDR\", \"min\": 0, \"max\": 0.5 } ],\n"
+	"  \"resampler\": \"bilinear\",\n"
+	"  \"render\": { \"size\": [30, 20], \"processedSize\": [45, 30],\n"
+	"              \"maxDepth\": 10 } }";
+
+//! Whether two renders give exactly the same image
+static bool sameImage(Render &a, Render &b) {
+	auto_ptr<Image> imgA = a.execute();
+	auto_ptr<Image> imgB = b.execute();
+	if ((imgA->width() != imgB->width()) ||
+	    (imgA->height() != imgB->height())) return false;
+	for (unsigned i=0; i < imgA->height(); ++i) {
+		for (unsigned j=0; j < imgA->width(); ++j) {
+			for (unsigned c=0; c < imgA->colours(); ++c) {
+				if (imgA->at(i, j, c) != imgB->at(i, j, c)) return false;
+			}
+		}
+	}
+	return true;
+}
+
+/* A compiled scene renders just as the scene it was compiled from, and is
+ * refused if it's from another scene, or damaged. */
+TEST(CompiledSceneTest, RoundTrip) {
+	istringstream in (testScene);
+	SceneReader reader ("");
+	ASSERT_TRUE(reader.parse(in)) << reader.getErrors();
+	Render &source = reader.getRender();
+	source.m_world->finalize();
+
+	char path[] = "/tmp/compiledSceneXXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	close(fd);
+	stringstream errors;
+	ASSERT_TRUE(CompiledScene::write(path, *source.m_world, reader.settings(),
+	                                 1234, errors)) << errors.str();
+
+	CompiledScene compiled (path);
+	ASSERT_TRUE(compiled.load(1234)) << compiled.getErrors();
+	ASSERT_TRUE(compiled.restoredHierarchy());
+	ASSERT_EQ(source.traceKey(), compiled.getRender().traceKey());
+	ASSERT_TRUE(sameImage(source, compiled.getRender()));
+	// Rendering keeps the restored hierarchy, rather than building it again
+	World &world = *compiled.getRender().m_world;
+	ASSERT_TRUE(world.isRestored());
+	// ...until the world changes
+	Sphere *sph = dynamic_cast<Sphere*>(world.objects()[0]);
+	ASSERT_TRUE(sph != 0);
+	sph->setRadius(0.5);
+	compiled.getRender().execute();
+	ASSERT_FALSE(world.isRestored());
+
+	CompiledScene other (path);
+	ASSERT_FALSE(other.load(4321));
+
+	struct stat st;
+	ASSERT_EQ(0, stat(path, &st));
+	ASSERT_EQ(0, truncate(path, st.st_size - 8));
+	CompiledScene truncated (path);
+	ASSERT_FALSE(truncated.load());
+	ASSERT_FALSE(truncated.getErrors().empty());
+	unlink(path);
+}
+
+//! The second load of a scene comes from the cache, and matches the first.
+TEST(CompiledSceneTest, Cache) {
+	char dir[] = "/tmp/sceneCacheXXXXXX";
+	ASSERT_TRUE(mkdtemp(dir));
+	string scenePath = string(dir) + "/scene.json";
+	{
+		ofstream out (scenePath.c_str());
+		out << testScene;
+	}
+
+	SceneCache cache (dir);
+	ASSERT_TRUE(cache.load(scenePath.c_str())) << cache.getErrors();
+	ASSERT_FALSE(cache.hit());
+	Render first = cache.getRender();
+	ASSERT_TRUE(cache.load(scenePath.c_str())) << cache.getErrors();
+	ASSERT_TRUE(cache.hit());
+	ASSERT_EQ(first.traceKey(), cache.getRender().traceKey());
+	ASSERT_TRUE(sameImage(first, cache.getRender()));
+
+	// An edited scene isn't found
+	{
+		ofstream out (scenePath.c_str(), ios_base::app);
+		out << "\n";
+	}
+	string oldPath = cache.cachePath();
+	ASSERT_TRUE(cache.load(scenePath.c_str()));
+	ASSERT_FALSE(cache.hit());
+	ASSERT_NE(oldPath, cache.cachePath());
+
+	unlink(oldPath.c_str());
+	unlink(cache.cachePath().c_str());
+	unlink(scenePath.c_str());
+	rmdir(dir);
+}
@@ -0,0 +1,155 @@
+/******************************************************************************
+ * compiledScene.h
+ * Copyright 2011 Iain Peet
+ *
+ * A binary form of a scene, which loads much faster than the JSON it was
+ * compiled from, and a cache of compiled scenes keyed by their source.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef COMPILED_SCENE_H_
+#define COMPILED_SCENE_H_
+
+#include <cstddef>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <stdint.h>
+#include <json/value.h>
+
+#include "trace/render.h"
+
+/** A scene compiled to a flat binary file.  The file holds a header with
+ *  the world's settings, then one fixed-size record per world object, in
+ *  world order, the world's search hierarchy as built, and the scene's
+ *  other members (view, image, resampler, render) as JSON text, since
+ *  those are small.
+ *
+ *  The file is loaded with mmap.  Objects are copied straight from their
+ *  records into the world's sphere pool, and the hierarchy is restored
+ *  rather than built again, so there is no parsing and no sorting.
+ *
+ *  Files are only meant to be read on the machine which wrote them; the
+ *  byte order and record sizes are checked, and the file is refused if
+ *  they differ. */
+class CompiledScene {
+private:
+  const char*       m_path;
+  bool              m_valid;
+  std::stringstream m_errStream;
+  Render            m_render;
+  // Hash of the scene the file was compiled from
+  uint64_t          m_sourceHash;
+  // Whether the saved hierarchy was used, rather than built again
+  bool              m_restored;
+
+private:
+  // Not copyable, as for SceneReader
+  CompiledScene(const CompiledScene &other);
+  CompiledScene& operator=(const CompiledScene &other);
+
+  // load(), once the file is mapped
+  bool loadMapped(const char *data, size_t size, uint64_t sourceHash);
+
+public:
+  CompiledScene(const char *path) :
+    m_path(path),
+    m_valid(false),
+    m_errStream(),
+    m_render(),
+    m_sourceHash(0),
+    m_restored(false)
+    { /* n/a */ }
+
+  /* Compile a scene to a file.  If the world is finalized, its hierarchy
+   * is saved too.  The file is written beside path and renamed into
+   * place, so readers never see part of it.
+   * @param settings   The scene's members other than its world, as from
+   *                   SceneReader::settings().
+   * @param sourceHash Hash of the scene file, see hashFile().
+   * @return true on success.  Otherwise, a reason is written to errors. */
+  static bool write(const char *path, const World &world,
+                    const Json::Value &settings, uint64_t sourceHash,
+                    std::ostream &errors);
+
+  /* Hash the contents of a file.
+   * @return false if the file couldn't be read */
+  static bool hashFile(const char *path, uint64_t &hash);
+
+  /* Load the file.
+   * @param sourceHash If not 0, the file is refused unless it was compiled
+   *                   from a scene with this hash.
+   * @return true if loaded successfully, false otherwise */
+  bool load(uint64_t sourceHash = 0);
+  bool isValid() const {return m_valid;}
+
+  uint64_t sourceHash() const { return m_sourceHash; }
+  bool restoredHierarchy() const { return m_restored; }
+
+  /* Get the loaded render.  The world is finalized.  The internal state
+   * of the render is undefined if this file is not valid. */
+  Render& getRender() { return m_render; }
+
+  /* Get a string recording all errors that have occurred */
+  std::string getErrors() const { return m_errStream.str(); }
+};
+
+/** Loads JSON scene files through a directory of compiled scenes, named
+ *  by the hash of their JSON.  The first load of a scene parses it and
+ *  compiles it into the cache; later loads of the same content just load
+ *  the compiled file.  Editing the scene changes its hash, so stale
+ *  entries are never used; they are left for the user to clear out. */
+class SceneCache {
+private:
+  std::string       m_dir;
+  std::stringstream m_errStream;
+  Render            m_render;
+  // Compiled file for the last scene loaded
+  std::string       m_cachePath;
+  // Whether the last scene was found in the cache
+  bool              m_hit;
+
+private:
+  SceneCache(const SceneCache &other);
+  SceneCache& operator=(const SceneCache &other);
+
+public:
+  /* @param dir Directory of compiled scenes.  This must exist. */
+  SceneCache(const char *dir) :
+    m_dir(dir),
+    m_errStream(),
+    m_render(),
+    m_cachePath(),
+    m_hit(false)
+    { /* n/a */ }
+
+  /* Load a JSON scene file, from the cache if it's there.  If not, it is
+   * compiled into the cache.  Failing to write the cache is not an error,
+   * since the scene has still been loaded.
+   * @return true if the scene was loaded */
+  bool load(const char *scenePath);
+
+  //! Whether the last scene loaded came from the cache.
+  bool hit() const { return m_hit; }
+  //! The compiled file of the last scene loaded.
+  const std::string& cachePath() const { return m_cachePath; }
+
+  Render& getRender() { return m_render; }
+  std::string getErrors() const { return m_errStream.str(); }
+};
+
+#endif //COMPILED_SCENE_H_
@@ -0,0 +1,397 @@
+/******************************************************************************
+ * jsonStream.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Provides JsonStream, which reads a JSON document a piece at a time.
+ ******************************************************************************
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License. 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <clocale>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <gtest/gtest.h>
+#include <json/reader.h>
+
+#include "jsonStream.h"
+
+using namespace std;
+
+//! Deepest nesting of objects and arrays allowed
+#define JSON_MAX_DEPTH 256
+
+bool JsonStream::fill() {
+	if (!m_in.good()) return false;
+	m_in.read(m_buf, sizeof(m_buf));
+	m_len = m_in.gcount();
+	m_pos = 0;
+	return m_len > 0;
+}
+
+int JsonStream::skipSpace() {
+	for (;;) {
+		int c = peek();
+		if (c == '\n') ++m_line;
+		if ((c != ' ') && (c != '\t') && (c != '\n') && (c != '\r')) {
+			return c;
+		}
+		++m_pos;
+	}
+}
+
+bool JsonStream::fail(const char *message) {
+	m_error = message;
+	return false;
+}
+
+//! Consume a literal word, e.g. 'true'
+bool JsonStream::expect(const char *word) {
+	for (const char *w = word; *w; ++w) {
+		if (next() != *w) return fail("Unknown literal");
+	}
+	return true;
+}
+
+bool JsonStream::parse(JsonEvents &events) {
+	m_error.clear();
+	if (!parseValue(events)) return false;
+	if (skipSpace() != -1) return fail("Unexpected text after document");
+	return true;
+}
+
+bool JsonStream::parseValue(JsonEvents &events) {
+	int c = skipSpace();
+	switch (c) {
+	case '{':
+		return parseObject(events);
+	case '[':
+		return parseArray(events);
+	case '"':
+		if (!parseString(m_token)) return false;
+		return events.string(m_token);
+	case 't':
+		return expect("true") && events.boolean(true);
+	case 'f':
+		return expect("false") && events.boolean(false);
+	case 'n':
+		return expect("null") && events.null();
+	case -1:
+		return fail("Unexpected end of document");
+	default:
+		if ((c == '-') || ((c >= '0') && (c <= '9'))) {
+			return parseNumber(events);
+		}
+		return fail("Unexpected character");
+	}
+}
+
+bool JsonStream::parseObject(JsonEvents &events) {
+	if (++m_depth > JSON_MAX_DEPTH) return fail("Nested too deeply");
+	next(); // {
+	if (!events.startObject()) return false;
+
+	if (skipSpace() == '}') {
+		next();
+	} else {
+		for (;;) {
+			if (skipSpace() != '"') return fail("Expected member name");
+			if (!parseString(m_token)) return false;
+			if (!events.key(m_token)) return false;
+			if (skipSpace() != ':') return fail("Expected ':'");
+			next();
+			if (!parseValue(events)) return false;
+
+			int c = skipSpace();
+			next();
+			if (c == '}') break;
+			if (c != ',') return fail("Expected ',' or '}'");
+		}
+	}
+	--m_depth;
+	return events.endObject();
+}
+
+bool JsonStream::parseArray(JsonEvents &events) {
+	if (++m_depth > JSON_MAX_DEPTH) return fail("Nested too deeply");
+	next(); // [
+	if (!events.startArray()) return false;
+
+	if (skipSpace() == ']') {
+		next();
+	} else {
+		for (;;) {
+			if (!parseValue(events)) return false;
+
+			int c = skipSpace();
+			next();
+			if (c == ']') break;
+			if (c != ',') return fail("Expected ',' or ']'");
+		}
+	}
+	--m_depth;
+	return events.endArray();
+}
+
+//! Append a code point to a string, as UTF-8
+static void appendUtf8(string &out, unsigned code) {
+	if (code < 0x80) {
+		out += (char)(code);
+	} else if (code < 0x800) {
+		out += (char)(0xC0 | (code >> 6));
+		out += (char)(0x80 | (code & 0x3F));
+	} else if (code < 0x10000) {
+		out += (char)(0xE0 | (code >> 12));
+		out += (char)(0x80 | ((code >> 6) & 0x3F));
+		out += (char)(0x80 | (code & 0x3F));
+	} else {
+		out += (char)(0xF0 | (code >> 18));
+		out += (char)(0x80 | ((code >> 12) & 0x3F));
+		out += (char)(0x80 | ((code >> 6) & 0x3F));
+		out += (char)(0x80 | (code & 0x3F));
+	}
+}
+
+bool JsonStream::parseHex(unsigned &code) {
+	code = 0;
+	for (int i=0; i<4; ++i) {
+		int h = next();
+		code <<= 4;
+		if ((h >= '0') && (h <= '9')) code |= h - '0';
+		else if ((h >= 'a') && (h <= 'f')) code |= h - 'a' + 10;
+		else if ((h >= 'A') && (h <= 'F')) code |= h - 'A' + 10;
+		else return fail("Bad \\u escape");
+	}
+	return true;
+}
+
+bool JsonStream::parseString(string &out) {
+	out.clear();
+	next(); // "
+	for (;;) {
+		int c = next();
+		if (c == '"') return true;
+		if ((c < 0) || (c == '\n')) return fail("Unterminated string");
+		if (c != '\\') {
+			out += (char)(c);
+			continue;
+		}
+
+		c = next();
+		switch (c) {
+		case '"':  out += '"';  break;
+		case '\\': out += '\\'; break;
+		case '/':  out += '/';  break;
+		case 'b':  out += '\b'; break;
+		case 'f':  out += '\f'; break;
+		case 'n':  out += '\n'; break;
+		case 'r':  out += '\r'; break;
+		case 't':  out += '\t'; break;
+		case 'u': {
+			unsigned code;
+			if (!parseHex(code)) return false;
+			// A high surrogate must be followed by a low one; combine them.
+			if ((code >= 0xDC00) && (code < 0xE000)) {
+				return fail("Unpaired surrogate");
+			}
+			if ((code >= 0xD800) && (code < 0xDC00)) {
+				unsigned low;
+				if ((next() != '\\') || (next() != 'u')) {
+					return fail("Unpaired surrogate");
+				}
+				if (!parseHex(low)) return false;
+				if ((low < 0xDC00) || (low >= 0xE000)) {
+					return fail("Unpaired surrogate");
+				}
+				code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+			}
+			appendUtf8(out, code);
+			break;
+		}
+		default:
+			return fail("Bad escape");
+		}
+	}
+}
+
+bool JsonStream::parseNumber(JsonEvents &events) {
+	m_token.clear();
+	for (;;) {
+		int c = peek();
+		if (((c >= '0') && (c <= '9')) || (c == '-') || (c == '+') ||
+		    (c == '.') || (c == 'e') || (c == 'E')) {
+			m_token += (char)(c);
+			++m_pos;
+		} else {
+			break;
+		}
+	}
+
+	/* strtod() expects the decimal point of the C library's locale, which
+	 * Qt sets from the environment, so it may not be JSON's '.'. */
+	const char *point = localeconv()->decimal_point;
+	if (strcmp(point, ".")) {
+		size_t dot = m_token.find('.');
+		if (dot != string::npos) m_token.replace(dot, 1, point);
+	}
+
+	char *end = 0;
+	double value = strtod(m_token.c_str(), &end);
+	if (*end) return fail("Bad number");
+	return events.number(value);
+}
+
+Json::Value* JsonValueBuilder::add(const Json::Value &value) {
+	if (m_open.empty()) {
+		m_value = value;
+		return &m_value;
+	}
+	Json::Value &parent = *m_open.back();
+	if (parent.isArray()) return &parent.append(value);
+	return &(parent[m_key] = value);
+}
+
+bool JsonValueBuilder::startObject() {
+	m_open.push_back(add(Json::Value(Json::objectValue)));
+	return true;
+}
+
+bool JsonValueBuilder::startArray() {
+	m_open.push_back(add(Json::Value(Json::arrayValue)));
+	return true;
+}
+
+bool JsonValueBuilder::endObject() {
+	m_open.pop_back();
+	m_done = m_open.empty();
+	return true;
+}
+
+bool JsonValueBuilder::endArray() {
+	return endObject();
+}
+
+bool JsonValueBuilder::key(const std::string &name) {
+	m_key = name;
+	return true;
+}
+
+bool JsonValueBuilder::number(double value) {
+	add(Json::Value(value));
+	m_done = m_open.empty();
+	return true;
+}
+
+bool JsonValueBuilder::string(const std::string &value) {
+	add(Json::Value(value));
+	m_done = m_open.empty();
+	return true;
+}
+
+bool JsonValueBuilder::boolean(bool value) {
+	add(Json::Value(value));
+	m_done = m_open.empty();
+	return true;
+}
+
+bool JsonValueBuilder::null() {
+	add(Json::Value());
+	m_done = m_open.empty();
+	return true;
+}
+
+/* Streaming a document into a JsonValueBuilder gives the same value as
+ * jsoncpp's own reader.  (Which keeps integers as ints, where the stream
+ * gives every number as a double, so there are none here.) */
+TEST(JsonStreamTest, MatchesReader) {
+	const char *doc =
+		"{ \"a\": [1.5, -2.5e3, 0.125, true, false, null],\n"
+		"  \"b\": { \"c\": \"q\\\"\\\\\\/\\n\\u00e9\\ud83d\\ude00\", \"d\": {} },\n"
+		"  \"e\": [[], [{}], \"\"], \"f\": -0.0 }";
+	istringstream in (doc);
+	JsonStream stream (in);
+	JsonValueBuilder builder;
+	ASSERT_TRUE(stream.parse(builder)) << stream.error();
+	ASSERT_TRUE(builder.done());
+
+	Json::Value expected;
+	Json::Reader reader;
+	ASSERT_TRUE(reader.parse(doc, expected));
+	ASSERT_TRUE(expected == builder.value());
+	ASSERT_EQ(3u, stream.line());
+}
+
+/* Numbers are read the same whatever the locale's decimal point.  This
+ * tries the environment's locale first, then some which use a comma. */
+TEST(JsonStreamTest, LocaleIndependent) {
+	const char *doc = "[ 0.125, -2.5e3, 1e-2, 7 ]";
+	const double expected[] = { 0.125, -2.5e3, 1e-2, 7 };
+	const char *locales[] = { "", "de_DE.UTF-8", "de_DE.utf8", "de_DE",
+	                          "fr_FR.UTF-8", "fr_FR.utf8", "fr_FR" };
+
+	string saved = setlocale(LC_NUMERIC, 0);
+	bool tried = false;
+	for (unsigned i=0; i < sizeof(locales)/sizeof(locales[0]); ++i) {
+		if (!setlocale(LC_NUMERIC, locales[i])) continue;
+		if (!strcmp(localeconv()->decimal_point, ".")) continue;
+		tried = true;
+
+		istringstream in (doc);
+		JsonStream stream (in);
+		JsonValueBuilder builder;
+		bool parsed = stream.parse(builder);
+		const Json::Value value = builder.value();
+		setlocale(LC_NUMERIC, saved.c_str());
+		ASSERT_TRUE(parsed) << stream.error();
+		ASSERT_EQ(4u, value.size());
+		for (unsigned j=0; j < 4; ++j) {
+			ASSERT_EQ(expected[j], value[j].asDouble()) << locales[i];
+		}
+		break;
+	}
+	setlocale(LC_NUMERIC, saved.c_str());
+	if (!tried) {
+		cout << "No locale with another decimal point; not checked." << endl;
+	}
+}
+
+//! Malformed documents are refused, with the line of the problem.
+TEST(JsonStreamTest, Errors) {
+	const char *bad[] = {
+		"{ \"a\": 1,\n \"b\" 2 }",
+		"{ \"a\": [1, 2\n\n }",
+		"{ \"a\": tru }",
+		"{ \"a\": \"x }",
+		"{ } x",
+		"[ 1, 2",
+		"[ \"\\ud83d\" ]",
+		"[ \"\\ud83dx\" ]",
+		"[ \"\\ud83d\\u0041\" ]",
+		"[ \"\\ud83d\\ud83d\" ]",
+		"[ \"\\ude00\" ]",
+		"[ \"\\u12g4\" ]"
+	};
+	const unsigned lines[] = { 2, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+	for (unsigned i=0; i < sizeof(bad)/sizeof(bad[0]); ++i) {
+		istringstream in (bad[i]);
+		JsonStream stream (in);
+		JsonValueBuilder builder;
+		ASSERT_FALSE(stream.parse(builder)) << bad[i];
+		ASSERT_FALSE(stream.error().empty());
+		ASSERT_EQ(lines[i], stream.line()) << bad[i];
+	}
+}
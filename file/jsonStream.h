@@ -0,0 +1,154 @@
+/******************************************************************************
+ * jsonStream.h
+ * Copyright 2011 Iain Peet
+ *
+ * Provides JsonStream, which reads a JSON document a piece at a time and
+ * reports each piece as it is read, rather than building the document in
+ * memory.
+ ******************************************************************************
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License. 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef JSON_STREAM_H_
+#define JSON_STREAM_H_
+
+#include <istream>
+#include <string>
+#include <vector>
+#include <json/value.h>
+
+/** Receives the pieces of a JSON document from JsonStream, in the order
+ *  they appear.  Each returns false to stop the parse, e.g. when the
+ *  document makes no sense to the receiver. */
+class JsonEvents {
+public:
+  virtual ~JsonEvents() {}
+
+  virtual bool startObject() = 0;
+  virtual bool endObject() = 0;
+  virtual bool startArray() = 0;
+  virtual bool endArray() = 0;
+  // The name of the member whose value comes next
+  virtual bool key(const std::string &name) = 0;
+  virtual bool number(double value) = 0;
+  virtual bool string(const std::string &value) = 0;
+  virtual bool boolean(bool value) = 0;
+  virtual bool null() = 0;
+};
+
+/** Reads a JSON document from a stream, a buffer at a time, passing each
+ *  piece to a JsonEvents as soon as it is read.  Only the buffer and the
+ *  nesting of the document are held in memory, however big it is. */
+class JsonStream {
+private:
+  std::istream &m_in;
+  char          m_buf[65536];
+  size_t        m_pos;
+  size_t        m_len;
+  unsigned      m_line;
+  unsigned      m_depth;
+  std::string   m_error;
+  // Scratch for strings and numbers, kept to save reallocating
+  std::string   m_token;
+
+private:
+  JsonStream(const JsonStream &other);
+  JsonStream& operator=(const JsonStream &other);
+
+  /* Next character, without consuming it.  -1 at the end. */
+  int peek() {
+    if ((m_pos == m_len) && !fill()) return -1;
+    return (unsigned char)(m_buf[m_pos]);
+  }
+  int next() {
+    int c = peek();
+    if (c >= 0) ++m_pos;
+    return c;
+  }
+  bool fill();
+  // Skip whitespace, and get the next character without consuming it
+  int skipSpace();
+  bool fail(const char *message);
+  bool expect(const char *word);
+
+  bool parseValue(JsonEvents &events);
+  bool parseObject(JsonEvents &events);
+  bool parseArray(JsonEvents &events);
+  bool parseString(std::string &out);
+  // Read the four hex digits of a \u escape
+  bool parseHex(unsigned &code);
+  bool parseNumber(JsonEvents &events);
+
+public:
+  JsonStream(std::istream &in) :
+    m_in(in), m_pos(0), m_len(0), m_line(1), m_depth(0), m_error(),
+    m_token()
+    { /* n/a */ }
+
+  /* Read one JSON value (normally an object) from the stream, which must
+   * be followed by nothing but whitespace.
+   * @return false if the document is malformed, or events stopped it */
+  bool parse(JsonEvents &events);
+
+  /* What went wrong, if parse() returned false because the document
+   * is malformed.  Empty if events stopped it. */
+  const std::string& error() const { return m_error; }
+  //! Line reached, from 1
+  unsigned line() const { return m_line; }
+};
+
+/** Builds a Json::Value from the events for one value (and any values
+ *  in it), so that small parts of a large document can be looked at as
+ *  a whole. */
+class JsonValueBuilder : public JsonEvents {
+private:
+  Json::Value               m_value;
+  // Objects and arrays still being filled, innermost last
+  std::vector<Json::Value*> m_open;
+  std::string               m_key;
+  bool                      m_done;
+
+  // Put a value where the next one goes
+  Json::Value* add(const Json::Value &value);
+
+public:
+  JsonValueBuilder() : m_value(), m_open(), m_key(), m_done(false) {}
+
+  //! Whether part of a value has been given, but not all of it
+  bool active() const { return !m_open.empty(); }
+  //! Whether a whole value has been built
+  bool done() const { return m_done; }
+  const Json::Value& value() const { return m_value; }
+  //! Forget the value, ready to build another
+  void reset() {
+    m_value = Json::Value();
+    m_open.clear();
+    m_done = false;
+  }
+
+  virtual bool startObject();
+  virtual bool endObject();
+  virtual bool startArray();
+  virtual bool endArray();
+  virtual bool key(const std::string &name);
+  virtual bool number(double value);
+  virtual bool string(const std::string &value);
+  virtual bool boolean(bool value);
+  virtual bool null();
+};
+
+#endif //JSON_STREAM_H_
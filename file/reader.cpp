@@ -21,13 +21,26 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  *****************************************************************************/
 
+#include <cfloat>
+#include <cmath>
 #include <iostream>
 #include <fstream>
-#include <json/reader.h>
+#include <memory>
+#include <tr1/memory>
+#include <gtest/gtest.h>
 
 #include "reader.h"
 
+#include "image/colour.h"
+#include "image/pipeline.h"
+#include "image/resample.h"
+#include "trace/light_sources.h"
+#include "trace/sphere.h"
+#include "trace/view.h"
+#include "trace/world.h"
+
 using namespace std;
+using namespace std::tr1;
 
 bool SceneReader::parse() {
 	ifstream f (m_path, ios_base::in);
@@ -35,23 +48,588 @@ bool SceneReader::parse() {
 		m_errStream << "Failed to open file";
 		return false;
 	}
+	return parse(f);
+}
 
-	if (!m_reader.parse(f, m_root)) {
-		m_errStream << "Failed to parse JSON:\n";
-		m_errStream << m_reader.getFormattedErrorMessages();
+bool SceneReader::parse(istream &in) {
+	m_valid = false;
+	m_render.m_view.reset();
+	m_render.m_world = shared_ptr<World>(new World());
+	m_render.m_pipeline = shared_ptr<ImagePipeline>(new ImagePipeline());
+	m_levels.assign(1, DOCUMENT);
+	m_builder.reset();
+	m_objects = 0;
+	m_haveWorld = false;
+	m_haveView = false;
+	m_settings = Json::Value(Json::objectValue);
+
+	JsonStream stream (in);
+	if (!stream.parse(*this)) {
+		if (!stream.error().empty()) {
+			m_errStream << "Failed to parse JSON, line " << stream.line()
+			            << ": " << stream.error() << "\n";
+		}
 		return false;
 	}
 
 	/* Check that required world and view objects exist */
-	if (!m_root.isMember("world")) {
+	if (!m_haveWorld) {
 		m_errStream << "Missing required 'world' member";
 		return false;
 	}
-	if (!m_root.isMember("view")) {
+	if (!m_haveView) {
 		m_errStream << "Missing required 'view' member";
 		return false;
 	}
 
+	m_valid = true;
+	return true;
+}
+
+/* The scene, the world and its list of objects are read a piece at a time.
+ * Anything else (each object in the list, the view, etc) is small, and is
+ * built up whole by m_builder, then read. */
+
+bool SceneReader::startObject() {
+	if (!m_builder.active()) {
+		switch (m_levels.back()) {
+		case DOCUMENT:
+			m_levels.push_back(SCENE);
+			return true;
+		case SCENE:
+			if (m_key != "world") break;
+			if (m_haveWorld) {
+				m_errStream << "More than one 'world'";
+				return false;
+			}
+			m_haveWorld = true;
+			m_levels.push_back(WORLD);
+			return true;
+		default:
+			break;
+		}
+	}
+	return m_builder.startObject() && built();
+}
+
+bool SceneReader::endObject() {
+	if (m_builder.active()) return m_builder.endObject() && built();
+	m_levels.pop_back();
+	return true;
+}
+
+bool SceneReader::startArray() {
+	if (!m_builder.active()) {
+		if (m_levels.back() == DOCUMENT) {
+			m_errStream << "A scene must be an object";
+			return false;
+		}
+		if ((m_levels.back() == WORLD) && (m_key == "objects")) {
+			m_levels.push_back(OBJECTS);
+			return true;
+		}
+	}
+	return m_builder.startArray() && built();
+}
+
+bool SceneReader::endArray() {
+	if (m_builder.active()) return m_builder.endArray() && built();
+	m_levels.pop_back();
+	return true;
+}
+
+bool SceneReader::key(const std::string &name) {
+	if (m_builder.active()) return m_builder.key(name);
+	m_key = name;
+	return true;
+}
+
+bool SceneReader::number(double value) {
+	return m_builder.number(value) && built();
+}
+
+bool SceneReader::string(const std::string &value) {
+	return m_builder.string(value) && built();
+}
+
+bool SceneReader::boolean(bool value) {
+	return m_builder.boolean(value) && built();
+}
+
+bool SceneReader::null() {
+	return m_builder.null() && built();
+}
+
+bool SceneReader::built() {
+	if (!m_builder.done()) return true;
+
+	bool ok = false;
+	switch (m_levels.back()) {
+	case DOCUMENT:
+		m_errStream << "A scene must be an object";
+		break;
+	case SCENE:
+		ok = readSceneMember(m_key, m_builder.value());
+		m_settings[m_key] = m_builder.value();
+		break;
+	case WORLD:
+		ok = readWorldMember(m_key, m_builder.value());
+		break;
+	case OBJECTS:
+		ok = readObject(m_builder.value());
+		++m_objects;
+		break;
+	}
+	m_builder.reset();
+	return ok;
+}
+
+/* Read a list of numbers.
+ * @return false if it isn't a list of count numbers */
+static bool readList(const Json::Value &list, double out[], unsigned count) {
+	if (!list.isArray() || (list.size() != count)) return false;
+	for (unsigned i=0; i < count; ++i) {
+		if (!list[i].isNumeric()) return false;
+		out[i] = list[i].asDouble();
+	}
+	return true;
+}
+
+//! As readList(), for a member which may be missing
+static bool readNumbers(const Json::Value &obj, const char *name,
+                        double out[], unsigned count) {
+	if (!obj.isObject() || !obj.isMember(name)) return false;
+	return readList(obj[name], out, count);
+}
+
+//! Read a member which is a single number
+static bool readNumber(const Json::Value &obj, const char *name,
+                       double &out) {
+	if (!obj.isObject() || !obj.isMember(name)) return false;
+	if (!obj[name].isNumeric()) return false;
+	out = obj[name].asDouble();
+	return true;
+}
+
+//! Largest width or height of an image which may be traced or processed
+static const double maxImageSide = 16384;
+
+//! Read a member which is a whole number in [min, max]
+static bool readCount(const Json::Value &obj, const char *name,
+                      double min, double max, double &out) {
+	if (!readNumber(obj, name, out)) return false;
+	return (out == floor(out)) && (out >= min) && (out <= max);
+}
+
+//! Read a member which is the width and height of an image
+static bool readSize(const Json::Value &obj, const char *name,
+                     ImageSize &size) {
+	double dims[2];
+	if (!readNumbers(obj, name, dims, 2)) return false;
+	for (unsigned i=0; i < 2; ++i) {
+		if ((dims[i] != floor(dims[i])) || (dims[i] < 1) ||
+		    (dims[i] > maxImageSide)) {
+			return false;
+		}
+	}
+	size = ImageSize((unsigned)(dims[0]), (unsigned)(dims[1]));
+	return true;
+}
+
+bool SceneReader::readSceneMember(const std::string &name,
+                                  const Json::Value &value) {
+	if (name == "view") return readView(value);
+	if (name == "image") return readTransforms(value);
+	if (name == "resampler") return readResampler(value);
+	if (name == "render") return readRenderSettings(value);
+	if (name == "world") {
+		m_errStream << "'world' must be an object";
+		return false;
+	}
+	m_errStream << "Unknown scene member '" << name << "'";
+	return false;
+}
+
+bool SceneReader::readWorldMember(const std::string &name,
+                                  const Json::Value &value) {
+	World &world = *m_render.m_world;
+	double c[3];
+	if ((name == "defaultColour") && readList(value, c, 3)) {
+		world.m_defaultColour.set(c[0], c[1], c[2]);
+		return true;
+	}
+	if ((name == "globalDiffuse") && readList(value, c, 3)) {
+		world.m_globalDiffuse.set(c[0], c[1], c[2]);
+		return true;
+	}
+	if ((name == "minThroughput") && value.isNumeric()) {
+		world.m_minThroughput = value.asDouble();
+		return true;
+	}
+	if ((name == "roulette") && value.isBool()) {
+		world.m_roulette = value.asBool();
+		return true;
+	}
+	m_errStream << "Bad or unknown world member '" << name << "'";
+	return false;
+}
+
+bool SceneReader::readObject(const Json::Value &obj) {
+	World &world = *m_render.m_world;
+	std::string type = (obj.isObject() && obj["type"].isString()) ?
+	              obj["type"].asString() : "";
+	double origin[3], radius = 0.0;
+	double diffusivity[3] = {0, 0, 0};
+	double reflectivity[3] = {0, 0, 0};
+	double intensity[3];
+
+	if (!readNumbers(obj, "origin", origin, 3)) {
+		m_errStream << "Object " << m_objects << ": bad or missing 'origin'";
+		return false;
+	}
+	Coord centre (origin[0], origin[1], origin[2]);
+	bool needRadius = (type == "sphere") || (type == "sphereSource");
+	// Also refuses infinity, from a number too large for a double
+	if (needRadius && (!readNumber(obj, "radius", radius) ||
+	                   !(radius > 0) || (radius > DBL_MAX))) {
+		m_errStream << "Object " << m_objects << ": bad or missing 'radius'";
+		return false;
+	}
+	bool needIntensity = (type == "pointSource") || (type == "sphereSource");
+	if (needIntensity && !readNumbers(obj, "intensity", intensity, 3)) {
+		m_errStream << "Object " << m_objects
+		            << ": bad or missing 'intensity'";
+		return false;
+	}
+
+	if (type == "sphere") {
+		if ((obj.isMember("diffusivity") &&
+		     !readNumbers(obj, "diffusivity", diffusivity, 3)) ||
+		    (obj.isMember("reflectivity") &&
+		     !readNumbers(obj, "reflectivity", reflectivity, 3))) {
+			m_errStream << "Object " << m_objects << ": bad sphere colour";
+			return false;
+		}
+		world.addSphere(centre, radius,
+			RayColour(diffusivity[0], diffusivity[1], diffusivity[2]),
+			RayColour(reflectivity[0], reflectivity[1], reflectivity[2]));
+		return true;
+	}
+
+	RayColour light (intensity[0], intensity[1], intensity[2]);
+	auto_ptr<RayObject> added;
+	if (type == "pointSource") {
+		added.reset(new PointSource(centre, light));
+	} else if (type == "sphereSource") {
+		added.reset(new SphereSource(centre, radius, light));
+	} else {
+		m_errStream << "Object " << m_objects << ": unknown type '"
+		            << type << "'";
+		return false;
+	}
+	world.addObject(added);
+	return true;
+}
+
+bool SceneReader::readView(const Json::Value &view) {
+	std::string type = (view.isObject() && view["type"].isString()) ?
+	              view["type"].asString() : "";
+	double origin[3], xVec[3], yVec[3];
+	if (!readNumbers(view, "origin", origin, 3) ||
+	    !readNumbers(view, "xVec", xVec, 3) ||
+	    !readNumbers(view, "yVec", yVec, 3)) {
+		m_errStream << "View: bad or missing 'origin', 'xVec' or 'yVec'";
+		return false;
+	}
+
+	if (type == "parallel") {
+		ParallelView *parallel = new ParallelView();
+		parallel->m_origin = Coord(origin[0], origin[1], origin[2]);
+		parallel->m_xVec = RayVector(xVec[0], xVec[1], xVec[2]);
+		parallel->m_yVec = RayVector(yVec[0], yVec[1], yVec[2]);
+		m_render.m_view = shared_ptr<RayView>(parallel);
+	} else if (type == "angle") {
+		double xFov, yFov;
+		if (!readNumber(view, "xFov", xFov) ||
+		    !readNumber(view, "yFov", yFov)) {
+			m_errStream << "View: bad or missing 'xFov' or 'yFov'";
+			return false;
+		}
+		AngleView *angle = new AngleView();
+		angle->m_origin = Coord(origin[0], origin[1], origin[2]);
+		angle->m_xvec = RayVector(xVec[0], xVec[1], xVec[2]);
+		angle->m_yvec = RayVector(yVec[0], yVec[1], yVec[2]);
+		angle->m_xFov = xFov;
+		angle->m_yFov = yFov;
+		m_render.m_view = shared_ptr<RayView>(angle);
+	} else {
+		m_errStream << "View: unknown type '" << type << "'";
+		return false;
+	}
+	m_haveView = true;
+	return true;
+}
+
+bool SceneReader::readTransforms(const Json::Value &transforms) {
+	if (!transforms.isArray()) {
+		m_errStream << "'image' must be a list of transforms";
+		return false;
+	}
+	for (unsigned i=0; i < transforms.size(); ++i) {
+		const Json::Value &transform = transforms[i];
+		std::string type = (transform.isObject() && transform["type"].isString())
+		              ? transform["type"].asString() : "";
+		double min, max;
+		if (!readNumber(transform, "min", min) ||
+		    !readNumber(transform, "max", max)) {
+			m_errStream << "Transform " << i << ": bad or missing 'min' or 'max'";
+			return false;
+		}
+
+		if (type == "linearHDR") {
+			m_render.m_pipeline->push(auto_ptr<ImageTransform>(
+				new LinearHDRToDisplay(min, max)));
+		} else if (type == "logHDR") {
+			LogHDRToDisplay::LogMode mode = LogHDRToDisplay::EXACT_LOG;
+			std::string name = "exact";
+			if (transform.isMember("mode")) {
+				if (!transform["mode"].isString()) {
+					m_errStream << "Transform " << i << ": bad 'mode'";
+					return false;
+				}
+				name = transform["mode"].asString();
+			}
+			if (name == "fast") {
+				mode = LogHDRToDisplay::FAST_LOG;
+			} else if (name == "table") {
+				mode = LogHDRToDisplay::TABLE_LOG;
+			} else if (name != "exact") {
+				m_errStream << "Transform " << i << ": unknown mode '"
+				            << name << "'";
+				return false;
+			}
+			m_render.m_pipeline->push(auto_ptr<ImageTransform>(
+				new LogHDRToDisplay(min, max, mode)));
+		} else {
+			m_errStream << "Transform " << i << ": unknown type '"
+			            << type << "'";
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SceneReader::readResampler(const Json::Value &resampler) {
+	std::string type = resampler.isString() ? resampler.asString() : "";
+	Resampler *chosen = 0;
+	if (type == "nearest") {
+		chosen = new NearestNeighbor();
+	} else if (type == "bilinear") {
+		chosen = new BilinearInterpolator();
+	} else if (type == "box") {
+		chosen = new BoxResampler();
+	} else if (type == "mitchell") {
+		chosen = new MitchellResampler();
+	} else if (type == "lanczos") {
+		chosen = new LanczosResampler();
+	} else {
+		m_errStream << "Unknown resampler '" << type << "'";
+		return false;
+	}
+	m_render.m_pipeline->setResampler(auto_ptr<Resampler>(chosen));
+	return true;
+}
+
+bool SceneReader::readRenderSettings(const Json::Value &settings) {
+	if (!readSize(settings, "size", m_render.m_renderSize)) {
+		m_errStream << "Render: bad or missing 'size'";
+		return false;
+	}
+	m_render.m_processedSize = m_render.m_renderSize;
+	if (settings.isMember("processedSize") &&
+	    !readSize(settings, "processedSize", m_render.m_processedSize)) {
+		m_errStream << "Render: bad 'processedSize'";
+		return false;
+	}
+
+	/* threads may be 0, for one per CPU.  Tiles and bands of no rows
+	 * would never finish the image. */
+	const char *counts[] = { "maxDepth", "threads", "tileSize", "bandRows" };
+	const double least[] = { 0, 0, 1, 1 };
+	for (unsigned i=0; i < sizeof(counts)/sizeof(counts[0]); ++i) {
+		double count;
+		if (!settings.isMember(counts[i])) continue;
+		if (!readCount(settings, counts[i], least[i], maxImageSide, count)) {
+			m_errStream << "Render: bad '" << counts[i] << "'";
+			return false;
+		}
+		switch (i) {
+		case 0: m_render.m_maxDepth = (int)(count); break;
+		case 1: m_render.m_threads = (unsigned)(count); break;
+		case 2: m_render.m_tileSize = (unsigned)(count); break;
+		case 3: m_render.m_bandRows = (unsigned)(count); break;
+		}
+	}
+
+	if (settings.isMember("precision")) {
+		if (!settings["precision"].isString()) {
+			m_errStream << "Render: bad 'precision'";
+			return false;
+		}
+		std::string precision = settings["precision"].asString();
+		if (precision == "float") {
+			m_render.m_pipeline->setPrecision(Image::FLOAT_SAMPLES);
+		} else if (precision == "double") {
+			m_render.m_pipeline->setPrecision(Image::DOUBLE_SAMPLES);
+		} else {
+			m_errStream << "Render: unknown precision '" << precision << "'";
+			return false;
+		}
+	}
 	return true;
 }
 
+/* The scene read matches the same scene built by hand, down to the hash
+ * of everything which is traced. */
+TEST(SceneReaderTest, ReadsScene) {
+	const char *doc =
+		"{ \"world\": { \"defaultColour\": [0, 1, 0],\n"
+		"    \"globalDiffuse\": [0.05, 0.05, 0.15],\n"
+		"    \"objects\": [\n"
+		"      { \"type\": \"sphere\", \"origin\": [0, 0, 0], \"radius\": 1,\n"
+		"        \"diffusivity\": [0.1, 0.25, 1], \"reflectivity\": [1, 1, 1] },\n"
+		"      { \"type\": \"sphereSource\", \"origin\": [1.5, -2.5, 1.5],\n"
+		"        \"radius\": 0.125, \"intensity\": [90, 90, 90] },\n"
+		"      { \"type\": \"pointSource\", \"origin\": [5, -1, -1],\n"
+		"        \"intensity\": [100, 100, 100] } ] },\n"
+		"  \"view\": { \"type\": \"parallel\", \"origin\": [2, -2, 2],\n"
+		"    \"xVec\": [0, 4.5, 0], \"yVec\": [0, 0, -3] },\n"
+		"  \"image\": [ { \"type\": \"linearHDR\", \"min\": 0, \"max\": 4 },\n"
+		"             { \"type\": \"logHDR\", \"min\": 0, \"max\": 0.5,\n"
+		"               \"mode\": \"table\" } ],\n"
+		"  \"resampler\": \"lanczos\",\n"
+		"  \"render\": { \"size\": [30, 20], \"processedSize\": [60, 40],\n"
+		"              \"maxDepth\": 5, \"precision\": \"float\" } }";
+	istringstream in (doc);
+	SceneReader reader ("");
+	ASSERT_TRUE(reader.parse(in)) << reader.getErrors();
+	ASSERT_TRUE(reader.isValid());
+	Render &read = reader.getRender();
+	read.m_world->finalize();
+	ASSERT_EQ(3u, read.m_world->objects().size());
+	ASSERT_EQ(2u, read.m_world->lights().size());
+	ASSERT_EQ(60u, read.m_processedSize.m_width);
+	ASSERT_EQ(40u, read.m_processedSize.m_height);
+
+	Render built;
+	built.m_world = shared_ptr<World>(new World());
+	built.m_world->m_defaultColour.set(0, 1, 0);
+	built.m_world->m_globalDiffuse.set(0.05, 0.05, 0.15);
+	built.m_world->addSphere(Coord(0,0,0), 1, RayColour(0.1,0.25,1),
+	                         RayColour(1,1,1));
+	auto_ptr<RayObject> light1 (new SphereSource(Coord(1.5,-2.5,1.5),
+		0.125, RayColour(90,90,90)));
+	built.m_world->addObject(light1);
+	auto_ptr<RayObject> light2 (new PointSource(Coord(5,-1,-1),
+		RayColour(100,100,100)));
+	built.m_world->addObject(light2);
+	built.m_world->finalize();
+	ParallelView *view = new ParallelView();
+	view->m_origin = Coord(2,-2,2);
+	view->m_xVec = RayVector(0,4.5,0);
+	view->m_yVec = RayVector(0,0,-3);
+	built.m_view = shared_ptr<RayView>(view);
+	built.m_pipeline = shared_ptr<ImagePipeline>(new ImagePipeline());
+	built.m_pipeline->setPrecision(Image::FLOAT_SAMPLES);
+	built.m_maxDepth = 5;
+	built.m_renderSize = ImageSize(30, 20);
+	ASSERT_EQ(built.traceKey(), read.traceKey());
+
+	/* The pipeline has the same stages, in the same order: it processes
+	 * an image just as one built by hand does. */
+	built.m_pipeline->push(auto_ptr<ImageTransform>(
+		new LinearHDRToDisplay(0, 4)));
+	built.m_pipeline->push(auto_ptr<ImageTransform>(
+		new LogHDRToDisplay(0, 0.5, LogHDRToDisplay::TABLE_LOG)));
+	built.m_pipeline->setResampler(auto_ptr<Resampler>(
+		new LanczosResampler()));
+	Image traced (30, 20);
+	srand(4);
+	for (unsigned i=0; i < traced.height(); ++i) {
+		for (unsigned j=0; j < traced.width(); ++j) {
+			for (unsigned k=0; k < traced.colours(); ++k) {
+				traced.set(i, j, k, rand() % 1000 / 100.0);
+			}
+		}
+	}
+	auto_ptr<Image> expected = built.m_pipeline->process(traced,
+		ImageSize(60, 40));
+	auto_ptr<Image> actual = read.m_pipeline->process(traced,
+		read.m_processedSize);
+	ASSERT_EQ(60u, actual->width());
+	ASSERT_EQ(40u, actual->height());
+	for (unsigned i=0; i < expected->height(); ++i) {
+		for (unsigned j=0; j < expected->width(); ++j) {
+			for (unsigned k=0; k < expected->colours(); ++k) {
+				ASSERT_EQ(expected->at(i,j,k), actual->at(i,j,k));
+			}
+		}
+	}
+}
+
+//! A valid scene, missing the closing brace, for more members to follow
+#define MINIMAL_SCENE "{ \"world\": { \"objects\": [] }," \
+	" \"view\": { \"type\": \"parallel\", \"origin\": [0,0,0]," \
+	" \"xVec\": [1,0,0], \"yVec\": [0,1,0] }, "
+
+//! Bad scenes are refused, with a reason.
+TEST(SceneReaderTest, Errors) {
+	const char *bad[] = {
+		"{ \"world\": { \"objects\": [] } }",
+		"{ \"world\": { \"objects\": [ { \"type\": \"cube\","
+			" \"origin\": [0,0,0] } ] },"
+			" \"view\": { \"type\": \"parallel\", \"origin\": [0,0,0],"
+			" \"xVec\": [1,0,0], \"yVec\": [0,1,0] } }",
+		"{ \"world\": { \"objects\": [ { \"type\": \"sphere\","
+			" \"origin\": [0,0] } ] } }",
+		"{ \"world\": {},\n \"view\": { \"type\": \"angle\" ",
+		"[ 1 ]",
+		// Values of the wrong kind, or out of range
+		MINIMAL_SCENE "\"image\": [ { \"type\": \"logHDR\", \"min\": 0,"
+			" \"max\": 1, \"mode\": 2 } ] }",
+		MINIMAL_SCENE "\"render\": { \"size\": [4,4], \"precision\": [] } }",
+		MINIMAL_SCENE "\"render\": { \"size\": [4,4], \"tileSize\": 0 } }",
+		MINIMAL_SCENE "\"render\": { \"size\": [4,4], \"bandRows\": 0 } }",
+		MINIMAL_SCENE "\"render\": { \"size\": [4,4], \"threads\": 1.5 } }",
+		MINIMAL_SCENE "\"render\": { \"size\": [-4,4] } }",
+		MINIMAL_SCENE "\"render\": { \"size\": [4.5,4] } }",
+		MINIMAL_SCENE "\"render\": { \"size\": [4,1e10] } }",
+		MINIMAL_SCENE "\"render\": { \"size\": [4,4],"
+			" \"processedSize\": [0,4] } }",
+		"{ \"world\": { \"objects\": [ { \"type\": \"sphere\","
+			" \"origin\": [0,0,0], \"radius\": -1 } ] } }",
+		"{ \"world\": { \"objects\": [ { \"type\": \"sphereSource\","
+			" \"origin\": [0,0,0], \"radius\": 0,"
+			" \"intensity\": [1,1,1] } ] } }",
+		"{ \"world\": { \"objects\": [ { \"type\": \"sphere\","
+			" \"origin\": [0,0,0], \"radius\": 1e999 } ] } }"
+	};
+	const char *reasons[] = {
+		"'view'", "Object 0: unknown type 'cube'", "Object 0: bad",
+		"line 2", "must be an object",
+		"Transform 0: bad 'mode'", "bad 'precision'", "bad 'tileSize'",
+		"bad 'bandRows'", "bad 'threads'", "bad or missing 'size'",
+		"bad or missing 'size'", "bad or missing 'size'",
+		"bad 'processedSize'",
+		"Object 0: bad or missing 'radius'", "Object 0: bad or missing 'radius'",
+		"Object 0: bad or missing 'radius'"
+	};
+	for (unsigned i=0; i < sizeof(bad)/sizeof(bad[0]); ++i) {
+		istringstream in (bad[i]);
+		SceneReader reader ("");
+		ASSERT_FALSE(reader.parse(in)) << bad[i];
+		ASSERT_FALSE(reader.isValid());
+		ASSERT_NE(std::string::npos, reader.getErrors().find(reasons[i]))
+			<< reader.getErrors();
+	}
+}
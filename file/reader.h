@@ -24,48 +24,133 @@
 #ifndef SCENE_READER_H_
 #define SCENE_READER_H_
 
-#include <json/reader.h>
+#include <istream>
 #include <string>
 #include <sstream>
+#include <vector>
 
+#include "file/jsonStream.h"
 #include "trace/render.h"
 
-class SceneReader {
+/** Reads a scene, and builds a Render from it.  A scene is a JSON object:
+ *
+ *  { "world": { "defaultColour": [r,g,b], "globalDiffuse": [r,g,b],
+ *               "minThroughput": 0.0, "roulette": false,
+ *               "objects": [ object, ... ] },
+ *    "view": { "type": "parallel", "origin": [x,y,z],
+ *              "xVec": [x,y,z], "yVec": [x,y,z] }
+ *         or { "type": "angle", "origin": [x,y,z], "xVec": [x,y,z],
+ *              "yVec": [x,y,z], "xFov": radians, "yFov": radians },
+ *    "image": [ { "type": "linearHDR", "min": 0, "max": 1 },
+ *               { "type": "logHDR", "min": 0, "max": 1,
+ *                 "mode": "exact" | "fast" | "table" }, ... ],
+ *    "resampler": "nearest" | "bilinear" | "box" | "mitchell" | "lanczos",
+ *    "render": { "size": [w,h], "processedSize": [w,h], "maxDepth": 20,
+ *                "threads": 0, "tileSize": 32, "bandRows": 64,
+ *                "precision": "double" | "float" } }
+ *
+ *  where each object is one of
+ *    { "type": "sphere", "origin": [x,y,z], "radius": r,
+ *      "diffusivity": [r,g,b], "reflectivity": [r,g,b] }
+ *    { "type": "pointSource", "origin": [x,y,z], "intensity": [r,g,b] }
+ *    { "type": "sphereSource", "origin": [x,y,z], "radius": r,
+ *      "intensity": [r,g,b] }
+ *
+ *  "world" and "view" are required, as is "size" if "render" is given.
+ *  Sizes and counts are whole numbers.  Image sides are from 1 to 16384;
+ *  "tileSize" and "bandRows" must be at least 1, and "bandRows" is left
+ *  out to trace the whole image at once.  "threads" is 0 for one per CPU.
+ *  The file is read a piece at a time, and each object is added to the
+ *  world as soon as it has been read, so the whole document is never held
+ *  in memory; only one object at a time is. */
+class SceneReader : private JsonEvents {
 private:
-  const char*  m_path;
-  Json::Value  m_root;
-  Json::Reader m_reader;
+  //! Where in the scene the reader is
+  enum Level {
+    DOCUMENT,
+    SCENE,
+    WORLD,
+    OBJECTS
+  };
 
+  const char*  m_path;
   bool m_valid;
 
   std::stringstream m_errStream;
 
   Render m_render;
 
+  // Enclosing levels of the document, innermost last
+  std::vector<Level> m_levels;
+  // Name of the member being read
+  std::string        m_key;
+  // Builds members which are read whole
+  JsonValueBuilder   m_builder;
+  // Number of world objects read
+  unsigned           m_objects;
+  bool               m_haveWorld;
+  bool               m_haveView;
+  // Members of the scene other than the world, as read
+  Json::Value        m_settings;
+
 private:
   /* Json::Value and Reader copy behaviour undocumented - disallow
    * for now, investigate if copying turns out to be necessary */
   SceneReader(const SceneReader& other);
   SceneReader& operator=(const SceneReader& other);
 
+  // JsonEvents
+  virtual bool startObject();
+  virtual bool endObject();
+  virtual bool startArray();
+  virtual bool endArray();
+  virtual bool key(const std::string &name);
+  virtual bool number(double value);
+  virtual bool string(const std::string &value);
+  virtual bool boolean(bool value);
+  virtual bool null();
+
+  /* Called after each event passed to m_builder.  Once it has a whole
+   * value, that's applied to the scene. */
+  bool built();
+  // Apply a member of the scene, the world, or an object of the world
+  bool readSceneMember(const std::string &name, const Json::Value &value);
+  bool readWorldMember(const std::string &name, const Json::Value &value);
+  bool readObject(const Json::Value &obj);
+  bool readView(const Json::Value &view);
+  bool readTransforms(const Json::Value &transforms);
+  bool readResampler(const Json::Value &resampler);
+  bool readRenderSettings(const Json::Value &settings);
+
 public:
   SceneReader(const char* path) :
     m_path(path), 
-    m_root(), 
-    m_reader(), 
     m_valid(false),
     m_errStream(),
-    m_render()
+    m_render(),
+    m_levels(),
+    m_key(),
+    m_builder(),
+    m_objects(0),
+    m_haveWorld(false),
+    m_haveView(false),
+    m_settings(Json::objectValue)
     { /* n/a */ }
 
   /* Parse the file.
    * @return true if parsed successfully, false otherwise */
   bool parse();
+  /* Parse a scene from a stream, rather than the file. */
+  bool parse(std::istream &in);
   bool isValid() const {return m_valid;}
 
   /* Get the parsed render.  The internal state of the render
    * is undefined if this file is not valid. */
-  Render& getRender();
+  Render& getRender() { return m_render; }
+
+  /* The members of the scene other than its world, i.e. the view, image,
+   * resampler and render settings, as read.  These are small. */
+  const Json::Value& settings() const { return m_settings; }
 
   /* Get a string recording all errors that have occurred */
   std::string getErrors() const { return m_errStream.str(); }
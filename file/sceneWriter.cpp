@@ -0,0 +1,124 @@
+/******************************************************************************
+ * sceneWriter.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Writes scene files, in the format read by SceneReader, an object at a
+ * time.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <sstream>
+#include <tr1/memory>
+#include <gtest/gtest.h>
+
+#include "sceneWriter.h"
+#include "reader.h"
+
+#include "image/pipeline.h"
+#include "trace/view.h"
+#include "trace/world.h"
+
+using namespace std;
+using namespace std::tr1;
+
+//! Enough digits that every double reads back exactly
+#define SCENE_PRECISION 17
+
+//! Writes a list of three numbers
+struct Triple {
+	double a, b, c;
+	Triple(const RayVector &v) : a(v.x()), b(v.y()), c(v.z()) {}
+	Triple(const RayColour &col) : a(col.r), b(col.g), c(col.b) {}
+};
+
+static ostream& operator<<(ostream &out, const Triple &t) {
+	return out << "[" << t.a << ", " << t.b << ", " << t.c << "]";
+}
+
+void SceneWriter::colours(const RayColour &defaultColour,
+                          const RayColour &globalDiffuse) {
+	m_out.precision(SCENE_PRECISION);
+	m_out << "{ \"world\": {\n"
+	      << "  \"defaultColour\": " << Triple(defaultColour) << ",\n"
+	      << "  \"globalDiffuse\": " << Triple(globalDiffuse) << ",\n"
+	      << "  \"objects\": [";
+}
+
+void SceneWriter::sphere(const Coord &origin, double radius,
+                         const RayColour &diffusivity,
+                         const RayColour &reflectivity) {
+	m_out << (m_objects++ ? ",\n" : "\n")
+	      << "    { \"type\": \"sphere\", \"origin\": " << Triple(origin)
+	      << ", \"radius\": " << radius
+	      << ", \"diffusivity\": " << Triple(diffusivity)
+	      << ", \"reflectivity\": " << Triple(reflectivity) << " }";
+}
+
+void SceneWriter::light(const Coord &origin, double radius,
+                        const RayColour &intensity) {
+	m_out << (m_objects++ ? ",\n" : "\n");
+	if (radius > 0.0) {
+		m_out << "    { \"type\": \"sphereSource\", \"origin\": "
+		      << Triple(origin) << ", \"radius\": " << radius;
+	} else {
+		m_out << "    { \"type\": \"pointSource\", \"origin\": "
+		      << Triple(origin);
+	}
+	m_out << ", \"intensity\": " << Triple(intensity) << " }";
+}
+
+bool SceneWriter::finish(const AngleView &view, const ImageSize &size,
+                         int maxDepth) {
+	m_out << " ] },\n"
+	      << "  \"view\": { \"type\": \"angle\", \"origin\": "
+	      << Triple(view.m_origin) << ",\n"
+	      << "    \"xVec\": " << Triple(view.m_xvec)
+	      << ", \"yVec\": " << Triple(view.m_yvec) << ",\n"
+	      << "    \"xFov\": " << view.m_xFov
+	      << ", \"yFov\": " << view.m_yFov << " },\n"
+	      << "  \"image\": [ { \"type\": \"logHDR\", \"min\": 0, \"max\": 1 } ],\n"
+	      << "  \"render\": { \"size\": [" << size.m_width << ", "
+	      << size.m_height << "], \"maxDepth\": " << maxDepth << " } }\n";
+	return !m_out.fail();
+}
+
+/* A generated scene written out and read back is exactly the one
+ * generated straight into a world. */
+TEST(SceneWriterTest, MatchesGenerated) {
+	for (unsigned k=0; k < 4; ++k) {
+		SceneGenerator generator ((SceneGenerator::Kind)(k), 200, 3);
+		Render direct;
+		direct.m_world = shared_ptr<World>(new World());
+		generator.generate(*direct.m_world);
+		AngleView *view = new AngleView();
+		generator.view(*view);
+		direct.m_view = shared_ptr<RayView>(view);
+		direct.m_pipeline = shared_ptr<ImagePipeline>(new ImagePipeline());
+		direct.m_renderSize = ImageSize(64, 48);
+		direct.m_maxDepth = 6;
+
+		stringstream file;
+		SceneWriter writer (file);
+		generator.generate(writer);
+		ASSERT_TRUE(writer.finish(*view, direct.m_renderSize,
+		                          direct.m_maxDepth));
+
+		SceneReader reader ("");
+		ASSERT_TRUE(reader.parse(file)) << reader.getErrors();
+		ASSERT_EQ(direct.traceKey(), reader.getRender().traceKey());
+	}
+}
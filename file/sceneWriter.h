@@ -0,0 +1,61 @@
+/******************************************************************************
+ * sceneWriter.h
+ * Copyright 2011 Iain Peet
+ *
+ * Writes scene files, in the format read by SceneReader, an object at a
+ * time.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef SCENE_WRITER_H_
+#define SCENE_WRITER_H_
+
+#include <ostream>
+
+#include "image/imageSize.h"
+#include "trace/generator.h"
+
+class AngleView;
+
+/** Writes a scene file as its objects are given, so that scenes far too
+ *  big to hold in memory can be written.  Numbers are written with all
+ *  of their precision, so the scene read back is exactly the one given.
+ *  Objects must be given between the world's colours and finish(). */
+class SceneWriter : public SceneBuilder {
+private:
+  std::ostream &m_out;
+  // Number of objects written
+  unsigned      m_objects;
+
+public:
+  SceneWriter(std::ostream &out) : m_out(out), m_objects(0) {}
+
+  virtual void colours(const RayColour &defaultColour,
+                       const RayColour &globalDiffuse);
+  virtual void sphere(const Coord &origin, double radius,
+                      const RayColour &diffusivity,
+                      const RayColour &reflectivity);
+  virtual void light(const Coord &origin, double radius,
+                     const RayColour &intensity);
+
+  /* End the world, and write the rest of the scene: the view, a log tone
+   * map, and the render size.
+   * @return false if the stream failed at any point */
+  bool finish(const AngleView &view, const ImageSize &size, int maxDepth);
+};
+
+#endif //SCENE_WRITER_H_
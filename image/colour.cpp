@@ -20,9 +20,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  *****************************************************************************/
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <gtest/gtest.h>
 
 #include "colour.h"
 
@@ -39,7 +47,7 @@ void RayColour::set(double r, double g, double b)
 }
 
 //! Magnitude of this colour
-double RayColour::magnitude()
+double RayColour::magnitude() const
 {
     return sqrt(r*r + g*g + b*b);
 }
@@ -54,11 +62,11 @@ RayColour& RayColour::operator=(double other)
     set(other, other, other);
     return *this;
 }
-RayColour RayColour::operator*(const RayColour& other)
+RayColour RayColour::operator*(const RayColour& other) const
 {
     return RayColour(r*other.r, g*other.g, b*other.b);
 }
-RayColour RayColour::operator*(double other)
+RayColour RayColour::operator*(double other) const
 {
     return RayColour(r*other, g*other, b*other);
 }
@@ -66,11 +74,11 @@ RayColour operator*(double left, const RayColour & other)
 {
     return RayColour(left*other.r, left*other.g, left*other.b);
 }
-RayColour RayColour::operator+(const RayColour& other)
+RayColour RayColour::operator+(const RayColour& other) const
 {
     return RayColour(r+other.r, g+other.g, b+other.b);
 }
-RayColour RayColour::operator-(const RayColour& other)
+RayColour RayColour::operator-(const RayColour& other) const
 {
     return RayColour(r-other.r, g-other.g, b-other.b);
 }
@@ -93,49 +101,179 @@ char* RayColour::snprint(char *buf, int maxLen) const
 
 
 //! Straightforward linear colour conversion
-Image& LinearHDRToDisplay::apply(Image &img) {
-    for (unsigned i=0; i < img.height(); ++i) {
-        for (unsigned j=0; j < img.width(); ++j) {
-            for (unsigned k=0; k < img.colours(); ++k) {
-                img.at(i,j,k) = (img.at(i,j,k)-m_min) / (m_max - m_min);
-                if (img.at(i,j,k) > 1.0) img.at(i,j,k) = 1.0;
-                if (img.at(i,j,k) < 0.0) img.at(i,j,k) = 0;
-            }
+void LinearHDRToDisplay::mapSamples(double samples[], unsigned count) const {
+    unsigned i = 0;
+#ifdef __SSE2__
+    /* Same operations, in the same order, two at a time.  min/max return
+     * their second operand for NaN, which keeps NaNs as the scalar
+     * clamps do. */
+    const __m128d min = _mm_set1_pd(m_min);
+    const __m128d range = _mm_set1_pd(m_max - m_min);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d one = _mm_set1_pd(1.0);
+    for (; i+2 <= count; i+=2) {
+        __m128d val = _mm_div_pd(
+            _mm_sub_pd(_mm_loadu_pd(samples + i), min), range);
+        val = _mm_max_pd(zero, _mm_min_pd(one, val));
+        _mm_storeu_pd(samples + i, val);
+    }
+#endif
+    for (; i < count; ++i) {
+        double val = (samples[i]-m_min) / (m_max - m_min);
+        if (val > 1.0) val = 1.0;
+        if (val < 0.0) val = 0;
+        samples[i] = val;
+    }
+}
+
+//! Bits of the mantissa which index the log table
+#define LOG_TABLE_BITS 10
+
+/* log(m) for m in [1,2], at 2^LOG_TABLE_BITS even steps.  There is an
+ * extra entry at the end for interpolating in the last step.  Filled
+ * before main, so it needn't be thread-safe. */
+static struct LogTable {
+    double m_logs[(1 << LOG_TABLE_BITS) + 1];
+
+    LogTable() {
+        const unsigned steps = 1 << LOG_TABLE_BITS;
+        for (unsigned i=0; i <= steps; ++i) {
+            m_logs[i] = log(1.0 + (double)(i) / steps);
         }
     }
+} logTable;
+
+#ifdef __SSE2__
+/* Natural log of two samples, each >= 1.  y = m * 2^e, where
+ * m is in [sqrt(1/2), sqrt(2)), so that
+ * log(y) = e*log(2) + log(m), and with f = (m-1)/(m+1),
+ * log(m) = 2(f + f^3/3 + f^5/5 + ...).  |f| < 0.172, so the terms up to
+ * f^11 leave an error below 2E-11. */
+static inline __m128d fastLog2(__m128d y)
+{
+    const __m128i mantissa = _mm_set1_epi64x(0x000FFFFFFFFFFFFFLL);
+    const __m128i oneBits = _mm_set1_epi64x(0x3FF0000000000000LL);
+    const __m128d one = _mm_set1_pd(1.0);
+
+    __m128i bits = _mm_castpd_si128(y);
+    // y is positive, so the exponent is all of the top 12 bits.
+    __m128i exp = _mm_srli_epi64(bits, 52);
+    exp = _mm_shuffle_epi32(exp, _MM_SHUFFLE(3,1,2,0));
+    __m128d e = _mm_sub_pd(_mm_cvtepi32_pd(exp), _mm_set1_pd(1023.0));
+
+    // Mantissa in [1,2), folded into [sqrt(1/2), sqrt(2))
+    __m128d m = _mm_castsi128_pd(
+        _mm_or_si128(_mm_and_si128(bits, mantissa), oneBits));
+    __m128d big = _mm_cmpgt_pd(m, _mm_set1_pd(M_SQRT2));
+    m = _mm_sub_pd(m, _mm_and_pd(big, _mm_mul_pd(m, _mm_set1_pd(0.5))));
+    e = _mm_add_pd(e, _mm_and_pd(big, one));
+
+    __m128d f = _mm_div_pd(_mm_sub_pd(m, one), _mm_add_pd(m, one));
+    __m128d f2 = _mm_mul_pd(f, f);
+    __m128d poly = _mm_set1_pd(1.0/11);
+    poly = _mm_add_pd(_mm_mul_pd(poly, f2), _mm_set1_pd(1.0/9));
+    poly = _mm_add_pd(_mm_mul_pd(poly, f2), _mm_set1_pd(1.0/7));
+    poly = _mm_add_pd(_mm_mul_pd(poly, f2), _mm_set1_pd(1.0/5));
+    poly = _mm_add_pd(_mm_mul_pd(poly, f2), _mm_set1_pd(1.0/3));
+    poly = _mm_add_pd(_mm_mul_pd(poly, f2), one);
+    poly = _mm_mul_pd(_mm_add_pd(f, f), poly);
+
+    return _mm_add_pd(_mm_mul_pd(e, _mm_set1_pd(M_LN2)), poly);
+}
+#endif
+
+double LogHDRToDisplay::fastLog(double y) {
+#ifdef __SSE2__
+    double ret[2];
+    _mm_storeu_pd(ret, fastLog2(_mm_set1_pd(y)));
+    return ret[0];
+#else
+    return log(y);
+#endif
+}
 
-    return img;
+double LogHDRToDisplay::tableLog(double y) {
+    const unsigned fracBits = 52 - LOG_TABLE_BITS;
+    uint64_t bits;
+    memcpy(&bits, &y, sizeof(bits));
+
+    int e = (int)(bits >> 52) - 1023;
+    uint64_t mant = bits & 0x000FFFFFFFFFFFFFULL;
+    unsigned inx = mant >> fracBits;
+    double frac = (double)(mant & ((1ULL << fracBits) - 1))
+        * (1.0 / (1ULL << fracBits));
+
+    const double *logs = logTable.m_logs;
+    return e*M_LN2 + logs[inx] + frac*(logs[inx+1] - logs[inx]);
 }
 
 //! Logarithmic colour mapper
-Image& LogHDRToDisplay::apply(Image &img) {
-	if (m_min < 0) return img;
-	if (m_max < 0) return img;
+void LogHDRToDisplay::mapSamples(double samples[], unsigned count) const {
+	if (m_min < 0) return;
+	if (m_max < 0) return;
 	double logMin = log(m_min+1.0);
 	double logMax = log(m_max+1.0);
 
-	for (unsigned i=0; i<img.height(); ++i) {
-		for (unsigned j=0; j<img.width(); ++j) {
-			for (unsigned k=0; k < img.colours(); ++k) {
-				if (img.at(i,j,k) < 0.0) {
-					img.at(i,j,k) = 0;
-					continue;
-				}
-
-				// This gets us into the range [logMin, logMax]
-				double val = log(img.at(i,j,k) + 1.0);
+	/* The approximate modes multiply by the reciprocal of the range.
+	 * Negative samples are taken as 0, which maps to 0 anyway, since
+	 * logMin >= 0. */
+	double scale = 1.0/(logMax-logMin);
+	unsigned i = 0;
+	switch (m_mode) {
+	case FAST_LOG:
+#ifdef __SSE2__
+	{
+		const __m128d zero = _mm_setzero_pd();
+		const __m128d one = _mm_set1_pd(1.0);
+		const __m128d min = _mm_set1_pd(logMin);
+		const __m128d scale2 = _mm_set1_pd(scale);
+		for (; i+2 <= count; i+=2) {
+			__m128d val = _mm_max_pd(_mm_loadu_pd(samples + i), zero);
+			val = fastLog2(_mm_add_pd(val, one));
+			val = _mm_mul_pd(_mm_sub_pd(val, min), scale2);
+			val = _mm_max_pd(zero, _mm_min_pd(one, val));
+			_mm_storeu_pd(samples + i, val);
+		}
+	}
+#endif
+		for (; i < count; ++i) {
+			double val = samples[i] < 0.0 ? 0.0 : samples[i];
+			val = (fastLog(val + 1.0)-logMin) * scale;
+			if (val < 0.0) val = 0;
+			if (val > 1.0) val = 1.0;
+			samples[i] = val;
+		}
+		break;
 
-				/* Convert [logMin, logMax] -> [0, 1]  */
-				val = (val-logMin) / (logMax-logMin);
-				if (val < 0.0) val = 0;
-				if (val > 1.0) val = 1.0;
+	case TABLE_LOG:
+		for (; i < count; ++i) {
+			double val = samples[i] < 0.0 ? 0.0 : samples[i];
+			val = (tableLog(val + 1.0)-logMin) * scale;
+			if (val < 0.0) val = 0;
+			if (val > 1.0) val = 1.0;
+			samples[i] = val;
+		}
+		break;
 
-				img.at(i,j,k) = val;
+	default:
+		for (; i < count; ++i) {
+			if (samples[i] < 0.0) {
+				samples[i] = 0;
+				continue;
 			}
+
+			// This gets us into the range [logMin, logMax]
+			double val = log(samples[i] + 1.0);
+
+			/* Convert [logMin, logMax] -> [0, 1]  */
+			val = (val-logMin) / (logMax-logMin);
+			if (val < 0.0) val = 0;
+			if (val > 1.0) val = 1.0;
+
+			samples[i] = val;
 		}
+		break;
 	}
-
-	return img;
 }
 
 // Converts double colour to int colour
@@ -144,3 +282,37 @@ unsigned long intColour(double value, unsigned bits) {
     return ret % (1<<bits);
 }
 
+
+/* The approximate logs must stay within their documented errors, from
+ * 1 up to very large intensities. */
+TEST(ColourTest, LogModeErrors) {
+    double worstFast = 0.0;
+    double worstTable = 0.0;
+    for (double y=1.0; y < 1E300; y *= 1.0137) {
+        double exact = log(y);
+        worstFast = std::max(worstFast,
+                             fabs(LogHDRToDisplay::fastLog(y) - exact));
+        worstTable = std::max(worstTable,
+                              fabs(LogHDRToDisplay::tableLog(y) - exact));
+    }
+    EXPECT_LT(worstFast, 1E-10);
+    EXPECT_LT(worstTable, 1.2E-7);
+
+    // Every mode maps the same way, near enough, including the clamps
+    double samples[3][7] = { { -1.0, 0.0, 0.5, 3.0, 17.0, 99.0, 1E6 } };
+    memcpy(samples[1], samples[0], sizeof(samples[0]));
+    memcpy(samples[2], samples[0], sizeof(samples[0]));
+    LogHDRToDisplay(0.25, 99.0).mapSamples(samples[0], 7);
+    LogHDRToDisplay(0.25, 99.0, LogHDRToDisplay::FAST_LOG)
+        .mapSamples(samples[1], 7);
+    LogHDRToDisplay(0.25, 99.0, LogHDRToDisplay::TABLE_LOG)
+        .mapSamples(samples[2], 7);
+    for (unsigned i=0; i<7; ++i) {
+        EXPECT_NEAR(samples[0][i], samples[1][i], 1E-10);
+        EXPECT_NEAR(samples[0][i], samples[2][i], 1E-7);
+    }
+    EXPECT_EQ(0.0, samples[1][0]);
+    EXPECT_EQ(1.0, samples[1][6]);
+    EXPECT_EQ(0.0, samples[2][0]);
+    EXPECT_EQ(1.0, samples[2][6]);
+}
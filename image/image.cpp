@@ -21,7 +21,10 @@
 * along with this program.  If not, see <http://www.gnu.org/licenses/>
 *****************************************************************************/
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <QPaintEvent>
 #include <QPainter>
 
@@ -37,82 +40,70 @@ static trc_ctl_t imgTrace = {
     TRC_STDOUT
 };
 #define TRACE(level, args...) \
-    trc_printf(&imgTrace,level,1,args)
+    TRC_PRINTF(&imgTrace,level,1,args)
 
-Image::Image(unsigned width, unsigned height, unsigned colours) :
-    m_pixels(0), m_width(0), m_height(0), m_colours(0)
+Image::Image(unsigned width, unsigned height, unsigned colours,
+             Precision precision) :
+    m_data(0), m_width(0), m_height(0), m_colours(0),
+    m_precision(precision), m_planeStride(0)
 {
     resize(width, height, colours);
 }
 
 Image::Image(const Image &other) :
-	m_pixels(0), m_width(0), m_height(0), m_colours(0)
+	m_data(0), m_width(0), m_height(0), m_colours(0),
+	m_precision(other.m_precision), m_planeStride(0)
 {
 		resize(other.width(), other.height(), other.colours());
-		if (!m_pixels) {
+		if (!m_data) {
 			// alloc failed
 			return;
 		}
 
-		other.copyPix(m_pixels);
+		other.copyPix(m_data);
 }
 
 Image::~Image() {
-    resize(0, 0, 0);
+    free(m_data);
 }
 
 Image& Image::operator=(const Image& other) {
+		if (&other == this) return *this;
+		if (other.m_precision != m_precision) {
+			resize(0, 0, 0);
+			m_precision = other.m_precision;
+		}
 		resize(other.width(), other.height(), other.colours());
-		if (!m_pixels) {
+		if (!m_data) {
 			// alloc failed
 			return *this;
 		}
 
-		other.copyPix(m_pixels);
+		other.copyPix(m_data);
 		return *this;
 }
 
-double** Image::allocPix(unsigned width, unsigned height, unsigned colours) {
+void* Image::allocPix(unsigned width, unsigned height, unsigned colours,
+                      Precision precision, size_t &stride) {
     if(!(width && height && colours)) return 0;
 
-    // Alloc array of pointers to images for each colour
-    double **pix = new double* [colours];
-    if (!pix) return 0;
-
-    // Alloc image for each colour
-    int i;
-    bool failed=false;
-    for(i=0; i<(int)(colours); ++i) {
-        pix[i] = new double[width * height];
-        if (!pix[i]) {
-            failed = true;
-            break;
-        }
-    }
-
-    if (!failed) return pix;
+    /* Round each plane up to the alignment, so they all start aligned */
+    size_t sample = (precision == FLOAT_SAMPLES) ?
+        sizeof(float) : sizeof(double);
+    size_t perAlign = IMAGE_ALIGN / sample;
+    stride = ((size_t)(width) * height + perAlign - 1) / perAlign * perAlign;
 
-    // Unwind on partial alloc fail.
-    for(i=0; --i >= 0;) {
-        delete [] pix[i];
-    }
-    delete pix;
-    return 0;
-}
-
-void Image::freePix(double **pix, unsigned colours) {
-    if (!pix) return;
-
-    for(unsigned i=0; i<colours; ++i) {
-        delete [] pix[i];
+    void *pix = 0;
+    if (posix_memalign(&pix, IMAGE_ALIGN, stride * colours * sample)) {
+        return 0;
     }
-    delete [] pix;
+    return pix;
 }
 
-void Image::copyPix(double **dst) const {
-	for (unsigned k=0; k < m_colours; ++k) {
-		memcpy(dst[k], m_pixels[k], m_width * m_height * sizeof(double));
-	}
+void Image::copyPix(void *dst) const {
+	size_t sample = (m_precision == FLOAT_SAMPLES) ?
+		sizeof(float) : sizeof(double);
+	memcpy(dst, m_data, m_planeStride * m_colours * sample);
 }
 
 int Image::resize(unsigned width, unsigned height, unsigned colours) {
@@ -120,9 +111,10 @@ int Image::resize(unsigned width, unsigned height, unsigned colours) {
         return 0;
     }
 
-    double **newPix = 0;
+    void *newPix = 0;
+    size_t newStride = 0;
     if (width && height && colours) {
-        newPix = allocPix(width, height, colours);
+        newPix = allocPix(width, height, colours, m_precision, newStride);
     }
 
     if (width && height && colours && (!newPix)) {
@@ -130,47 +122,65 @@ int Image::resize(unsigned width, unsigned height, unsigned colours) {
         return -1;
     }
 
-    freePix(m_pixels, m_colours);
+    free(m_data);
 
-    m_pixels = newPix;
+    m_data = newPix;
     m_width = width;
     m_height = height;
     m_colours = colours;
+    m_planeStride = newStride;
     return 0;
 }
 
-Image& Image::swap(Image& other) {
-    double **myPix = m_pixels;
-    double myW = m_width;
-    double myH = m_height;
-    double myC = m_colours;
-
-    m_pixels = other.m_pixels;
-    m_width = other.m_width;
-    m_height = other.m_height;
-    m_colours = other.m_colours;
+int Image::setPrecision(Precision precision) {
+    if (precision == m_precision) return 0;
 
-    other.m_pixels = myPix;
-    other.m_width = myW;
-    other.m_height = myH;
-    other.m_colours = myC;
+    Image converted (m_width, m_height, m_colours, precision);
+    if (m_data && !converted.m_data) {
+        // Alloc failed
+        return -1;
+    }
+    for (unsigned k=0; k < m_colours; ++k) {
+        for (unsigned i=0; i < m_height; ++i) {
+            for (unsigned j=0; j < m_width; ++j) {
+                converted.set(i, j, k, at(i, j, k));
+            }
+        }
+    }
+    swap(converted);
+    return 0;
+}
 
+Image& Image::swap(Image& other) {
+    std::swap(m_data, other.m_data);
+    std::swap(m_width, other.m_width);
+    std::swap(m_height, other.m_height);
+    std::swap(m_colours, other.m_colours);
+    std::swap(m_precision, other.m_precision);
+    std::swap(m_planeStride, other.m_planeStride);
     return *this;
 }
 
 int Image::fromRay(const RayImage& ray) {
-    if (resize(ray.width(), ray.height(), 3)) {
-        return -1;
-    }
+    *this = ray.image();
+    return (m_data || !ray.width()) ? 0 : -1;
+}
 
-    for(unsigned i=0; i<ray.height(); ++i) {
-        for(unsigned j=0; j<ray.width(); ++j) {
-            m_pixels[RED][i*m_width + j] = ray.at(i,j).m_colour.r;
-            m_pixels[GREEN][i*m_width + j] = ray.at(i,j).m_colour.g;
-            m_pixels[BLUE][i*m_width + j] = ray.at(i,j).m_colour.b;
-        }
+void Image::copyRows(const Image &rows, unsigned top) {
+    size_t sample = (m_precision == FLOAT_SAMPLES) ?
+        sizeof(float) : sizeof(double);
+    size_t offset = (size_t)(top) * m_width * sample;
+    size_t bytes = (size_t)(rows.m_width) * rows.m_height * sample;
+    for (unsigned k=0; k < m_colours; ++k) {
+        memcpy(static_cast<char*>(m_data) + k*m_planeStride*sample + offset,
+               static_cast<const char*>(rows.m_data)
+                   + k*rows.m_planeStride*sample,
+               bytes);
     }
+}
 
-    return 0;
+void Image::adopt(RayImage& ray) {
+    swap(ray.image());
+    ray.setSize(0, 0);
 }
 
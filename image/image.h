@@ -24,6 +24,7 @@
 #ifndef image_h_
 #define image_h_
 
+#include <cstddef>
 #include <cstdio>
 #include <vector>
 #include <QColor>
@@ -36,20 +37,43 @@
 
 class RayImage;
 
+//! Alignment of each colour plane of an Image, in bytes.
+#define IMAGE_ALIGN 64
+
+/** A rectangular image, with any number of colour planes.  All of the
+ *  planes are kept in one allocation, one after another, and each starts
+ *  on an IMAGE_ALIGN boundary so that it can be loaded with aligned SIMD
+ *  instructions.  Samples are stored as doubles, or as floats to halve
+ *  the memory used; at() and set() work the same either way. */
 class Image {
+public:
+    //! How each sample is stored
+    enum Precision {
+        DOUBLE_SAMPLES,
+        FLOAT_SAMPLES
+    };
+
 private:
-    double **m_pixels;
+    // All colour planes, one after another.
+    void     *m_data;
     unsigned m_width;
     unsigned m_height;
     unsigned m_colours;
+    Precision m_precision;
+    // Number of samples from the start of one plane to the next
+    size_t   m_planeStride;
 
 private:
-    double** allocPix(unsigned width, unsigned height, unsigned colours);
-    void freePix(double **pix, unsigned colours);
-    void copyPix(double **dst) const;
+    /* Allocate storage for an image.
+     * @param stride Set to the plane stride of the new storage
+     * @return the storage, or 0 on failure */
+    static void* allocPix(unsigned width, unsigned height, unsigned colours,
+                          Precision precision, size_t &stride);
+    void copyPix(void *dst) const;
 
 public:
-    Image(unsigned width=0, unsigned height=0, unsigned colours=3);
+    Image(unsigned width=0, unsigned height=0, unsigned colours=3,
+          Precision precision=DOUBLE_SAMPLES);
     Image(const Image& other);
     Image& operator=(const Image& other);
     virtual ~Image();
@@ -60,6 +84,10 @@ public:
      * @return 0 on success, -1 on failure (allocation failure) */
     int fromRay(const RayImage& ray);
 
+    /* Takes the traced colours of the given RayImage, without copying
+     * them.  The RayImage is left empty. */
+    void adopt(RayImage& ray);
+
     /* Swap the contents of this image with another.
      * (Useful for not-in-place transforms, etc) 
      * @return a reference to this */
@@ -68,15 +96,57 @@ public:
     unsigned width() const {return m_width;}
     unsigned height() const {return m_height;}
     unsigned colours() const {return m_colours;}
+    Precision precision() const {return m_precision;}
+
+    double at(unsigned row, unsigned col, unsigned colour) const {
+        size_t inx = colour*m_planeStride + row*m_width + col;
+        if (m_precision == FLOAT_SAMPLES) {
+            return static_cast<const float*>(m_data)[inx];
+        }
+        return static_cast<const double*>(m_data)[inx];
+    }
+    void set(unsigned row, unsigned col, unsigned colour, double value) {
+        size_t inx = colour*m_planeStride + row*m_width + col;
+        if (m_precision == FLOAT_SAMPLES) {
+            static_cast<float*>(m_data)[inx] = value;
+        } else {
+            static_cast<double*>(m_data)[inx] = value;
+        }
+    }
 
-    double& at(unsigned row, unsigned col, unsigned colour)
-        {return m_pixels[colour][row*m_width + col];}
-    double at(unsigned row, unsigned col, unsigned colour) const
-        {return m_pixels[colour][row*m_width + col];}
+    /* Direct access to a colour plane, for loops over many pixels.  Rows
+     * are concatenated.  Each returns 0 if the samples aren't stored with
+     * that precision. */
+    double* doublePlane(unsigned colour) {
+        if (m_precision != DOUBLE_SAMPLES) return 0;
+        return static_cast<double*>(m_data) + colour*m_planeStride;
+    }
+    const double* doublePlane(unsigned colour) const {
+        if (m_precision != DOUBLE_SAMPLES) return 0;
+        return static_cast<const double*>(m_data) + colour*m_planeStride;
+    }
+    float* floatPlane(unsigned colour) {
+        if (m_precision != FLOAT_SAMPLES) return 0;
+        return static_cast<float*>(m_data) + colour*m_planeStride;
+    }
+    const float* floatPlane(unsigned colour) const {
+        if (m_precision != FLOAT_SAMPLES) return 0;
+        return static_cast<const float*>(m_data) + colour*m_planeStride;
+    }
 
-    /* Resizes image.  If new alloc fails, size doesn't change.
+    /* Copies all of rows into this image, from row top down.  rows must
+     * have the same width, colours and precision as this image. */
+    void copyRows(const Image &rows, unsigned top);
+
+    /* Resizes image.  Precision is unchanged.  If new alloc fails, size
+     * doesn't change.
      * @returns 0 on success, -1 on failed alloc */
     int resize(unsigned width, unsigned height, unsigned colours);
+
+    /* Changes the precision of the samples, converting any existing
+     * pixels.
+     * @returns 0 on success, -1 on failed alloc */
+    int setPrecision(Precision precision);
 };
 
 #endif //image_h_
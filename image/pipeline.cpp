@@ -22,8 +22,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  *****************************************************************************/
 
+#include <algorithm>
+#include <gtest/gtest.h>
+
 #include "pipeline.h"
 
+#include "image/colour.h"
 #include "image/image.h"
 #include "image/imageSize.h"
 #include "image/transform.h"
@@ -39,7 +43,7 @@ static trc_ctl_t pipeTrace = {
     TRC_STDOUT
 };
 #define TRACE(level, args...) \
-    trc_printf(&pipeTrace,level,1,args)
+    TRC_PRINTF(&pipeTrace,level,1,args)
 
 ImagePipeline::~ImagePipeline() {
 	for (unsigned i=0; i<m_transforms.size(); ++i) {
@@ -59,32 +63,298 @@ void ImagePipeline::setResampler(auto_ptr<Resampler> resampler) {
 	m_resampler = resampler;
 }
 
-auto_ptr<Image> ImagePipeline::process(const RayImage &img) {
-	auto_ptr<Image> ret (new Image());
-	ret->fromRay(img);
+void ImagePipeline::applyTransforms(Image &img, unsigned begin, unsigned end)
+{
+	unsigned i = begin;
+	while (i < end) {
+		if (!m_transforms[i]->pointwise()) {
+			m_transforms[i++]->applyParallel(img, m_threads);
+			continue;
+		}
 
-	for (unsigned i=0; i < m_transforms.size(); ++i) {
-		m_transforms[i]->apply(*ret);
+		unsigned run = i;
+		while ((run < end) && m_transforms[run]->pointwise()) ++run;
+		TRACE(TRC_DTL, "Fusing point-wise transforms %u to %u\n", i, run-1);
+		ImageTransform::applyPointwise(img, &m_transforms[i], run - i,
+		                               m_threads);
+		i = run;
 	}
+}
+
+auto_ptr<Image> ImagePipeline::process(RayImage &img) {
+	auto_ptr<Image> ret (new Image());
+	ret->adopt(img);
+	ret->setPrecision(m_precision);
+
+	applyTransforms(*ret, 0, m_transforms.size());
 
 	return ret;
 }
 
-auto_ptr<Image> ImagePipeline::process(const RayImage& img, const ImageSize &size) 
+auto_ptr<Image> ImagePipeline::process(RayImage& img, const ImageSize &size) 
 {
-	auto_ptr<Image> ret = process(img);
+	auto_ptr<Image> ret (new Image());
+	ret->adopt(img);
+	ret->setPrecision(m_precision);
+	return processImage(ret, size);
+}
 
-	if (!m_resampler.get()) {
-		// No resampler set, can't resize.
+auto_ptr<Image> ImagePipeline::process(const Image& img, const ImageSize &size)
+{
+	auto_ptr<Image> ret (new Image(img));
+	ret->setPrecision(m_precision);
+	return processImage(ret, size);
+}
+
+auto_ptr<Image> ImagePipeline::processImage
+	(auto_ptr<Image> ret, const ImageSize &size)
+{
+	/* Point-wise transforms at the end of the pipeline don't change the
+	 * size, so we know now whether we'll need to resample after them,
+	 * and may be able to do it in the same pass. */
+	unsigned end = m_transforms.size();
+	unsigned tail = end;
+	while ((tail > 0) && m_transforms[tail-1]->pointwise()) --tail;
+
+	applyTransforms(*ret, 0, tail);
+
+	bool resample = m_resampler.get() &&
+		((size.m_width != ret->width()) || (size.m_height != ret->height()));
+	if (!resample) {
+		// No resampler set, can't resize.  Or no need.
+		applyTransforms(*ret, tail, end);
 		return ret;
 	}
 
-	if ((size.m_width != ret->width()) || (size.m_height != ret->height())) {
-		// Need to resample the output image
-		m_resampler->setResolution(size.m_width, size.m_height);
-		m_resampler->apply(*ret);
+	m_resampler->setResolution(size.m_width, size.m_height);
+	if ((tail < end) &&
+	    m_resampler->applyMapped(*ret, &m_transforms[tail], end - tail,
+	                             m_threads)) {
+		return ret;
 	}
 
+	applyTransforms(*ret, tail, end);
+	m_resampler->applyParallel(*ret, m_threads);
 	return ret;
 }
 
+void ImagePipeline::beginStream(const ImageSize &traced, const ImageSize &size)
+{
+	m_streamSize = size;
+
+	bool pointwise = true;
+	for (unsigned i=0; i < m_transforms.size(); ++i) {
+		pointwise = pointwise && m_transforms[i]->pointwise();
+	}
+	bool resample = m_resampler.get() &&
+		((size.m_width != traced.m_width) ||
+		 (size.m_height != traced.m_height));
+
+	if (pointwise && !resample) {
+		m_streamMode = STREAM_ROWS;
+		m_streamOut.reset(new Image(traced.m_width, traced.m_height, 3,
+		                            m_precision));
+		return;
+	}
+	if (pointwise) {
+		m_resampler->setResolution(size.m_width, size.m_height);
+		m_streamOut.reset(new Image(size.m_width, size.m_height, 3,
+		                            m_precision));
+		if (m_resampler->beginStream(traced.m_width, traced.m_height,
+		                             *m_streamOut)) {
+			m_streamMode = STREAM_RESAMPLE;
+			return;
+		}
+	}
+
+	TRACE(TRC_INFO, "Pipeline can't stream, gathering whole image.\n");
+	m_streamMode = STREAM_WHOLE;
+	m_streamOut.reset(new Image(traced.m_width, traced.m_height, 3,
+	                            m_precision));
+}
+
+void ImagePipeline::streamBand(RayImage &band)
+{
+	unsigned top = band.top();
+	Image rows;
+	rows.adopt(band);
+	rows.setPrecision(m_precision);
+
+	switch (m_streamMode) {
+	case STREAM_RESAMPLE:
+		applyTransforms(rows, 0, m_transforms.size());
+		m_resampler->streamRows(rows, top, m_threads);
+		break;
+	case STREAM_ROWS:
+		applyTransforms(rows, 0, m_transforms.size());
+		m_streamOut->copyRows(rows, top);
+		break;
+	default:
+		m_streamOut->copyRows(rows, top);
+		break;
+	}
+}
+
+auto_ptr<Image> ImagePipeline::endStream()
+{
+	if (m_streamMode == STREAM_WHOLE) {
+		return processImage(m_streamOut, m_streamSize);
+	}
+	return m_streamOut;
+}
+
+/* Fused point-wise passes, with and without a fused resample, and with
+ * any number of threads, must give what applying each stage in turn
+ * gives: exactly, for doubles.  Floats are only rounded at the end of a
+ * fused pass, rather than after every stage, so they may differ by a
+ * rounding. */
+TEST(PipelineTest, FusedMatchesSeparate) {
+	const unsigned width = 67;
+	const unsigned height = 41;
+	const ImageSize sizes[] = { ImageSize(width, height), ImageSize(30, 50) };
+	const unsigned threads[] = { 1, 3 };
+
+	for (int p=0; p<2; ++p) {
+		Image::Precision precision = p ? Image::FLOAT_SAMPLES :
+		                                 Image::DOUBLE_SAMPLES;
+		for (unsigned c=0; c<4; ++c) {
+			const ImageSize &size = sizes[c % 2];
+			bool mitchell = c / 2;
+
+			RayImage traced (width, height, precision);
+			for (unsigned i=0; i<height; ++i) {
+				for (unsigned j=0; j<width; ++j) {
+					traced.set(i, j, RayColour(i*0.37, j*1.3 - 20.0, i*j*0.01));
+				}
+			}
+			Image expected (traced.image());
+			Image tracedCopy (traced.image());
+
+			LinearHDRToDisplay(-5.0, 60.0).apply(expected);
+			LogHDRToDisplay(0.0, 0.8).apply(expected);
+			if (mitchell && (size.m_width != width)) {
+				// (Mitchell blurs a little, even at the same size)
+				MitchellResampler(size.m_width, size.m_height).apply(expected);
+			} else if (!mitchell) {
+				NearestNeighbor(size.m_width, size.m_height).apply(expected);
+			}
+
+			for (unsigned t=0; t<2; ++t) {
+				ImagePipeline pipeline;
+				pipeline.setPrecision(precision);
+				pipeline.setThreads(threads[t]);
+				pipeline.push(auto_ptr<ImageTransform>(
+					new LinearHDRToDisplay(-5.0, 60.0)));
+				pipeline.push(auto_ptr<ImageTransform>(
+					new LogHDRToDisplay(0.0, 0.8)));
+				if (mitchell) {
+					pipeline.setResampler(
+						auto_ptr<Resampler>(new MitchellResampler()));
+				} else {
+					pipeline.setResampler(
+						auto_ptr<Resampler>(new NearestNeighbor()));
+				}
+				traced.image() = tracedCopy;
+				auto_ptr<Image> fused = pipeline.process(traced, size);
+
+				ASSERT_EQ(expected.width(), fused->width());
+				ASSERT_EQ(expected.height(), fused->height());
+				ASSERT_EQ(precision, fused->precision());
+				for (unsigned i=0; i<expected.height(); ++i) {
+					for (unsigned j=0; j<expected.width(); ++j) {
+						for (unsigned k=0; k<expected.colours(); ++k) {
+							if (p) {
+								ASSERT_NEAR(expected.at(i,j,k),
+								            fused->at(i,j,k), 1E-6);
+							} else {
+								ASSERT_EQ(expected.at(i,j,k), fused->at(i,j,k))
+									<< "case " << c << ", threads " << threads[t];
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+/* Streaming an image through in bands gives what processing it whole
+ * gives, whether or not the pipeline can really stream it. */
+TEST(PipelineTest, StreamMatchesWhole) {
+	const unsigned width = 53;
+	const unsigned height = 38;
+	const unsigned band = 7;
+	const ImageSize traced (width, height);
+	const ImageSize sizes[] = { ImageSize(width, height), ImageSize(90, 71),
+	                            ImageSize(20, 13) };
+
+	Image source (width, height);
+	for (unsigned i=0; i<height; ++i) {
+		for (unsigned j=0; j<width; ++j) {
+			source.set(i, j, RED, i*0.37);
+			source.set(i, j, GREEN, j*1.3 - 20.0);
+			source.set(i, j, BLUE, i*j*0.01);
+		}
+	}
+
+	for (unsigned r=0; r<3; ++r) {
+		for (unsigned s=0; s<3; ++s) {
+			auto_ptr<Image> whole;
+			auto_ptr<Image> streamed;
+			for (int stream=0; stream<2; ++stream) {
+				ImagePipeline pipeline;
+				pipeline.setThreads(2);
+				pipeline.push(auto_ptr<ImageTransform>(
+					new LogHDRToDisplay(0.0, 0.8)));
+				switch (r) {
+				case 0:
+					pipeline.setResampler(
+						auto_ptr<Resampler>(new NearestNeighbor()));
+					break;
+				case 1:
+					pipeline.setResampler(
+						auto_ptr<Resampler>(new LanczosResampler()));
+					break;
+				default:
+					// Can't stream
+					pipeline.setResampler(
+						auto_ptr<Resampler>(new BilinearInterpolator()));
+					break;
+				}
+
+				if (!stream) {
+					RayImage img (width, height);
+					img.image() = source;
+					whole = pipeline.process(img, sizes[s]);
+					continue;
+				}
+
+				pipeline.beginStream(traced, sizes[s]);
+				for (unsigned top=0; top<height; top+=band) {
+					unsigned rows = std::min(band, height - top);
+					RayImage img;
+					img.setBand(width, height, top, rows);
+					for (unsigned i=top; i<top+rows; ++i) {
+						for (unsigned j=0; j<width; ++j) {
+							img.set(i, j, RayColour(source.at(i,j,RED),
+								source.at(i,j,GREEN), source.at(i,j,BLUE)));
+						}
+					}
+					pipeline.streamBand(img);
+				}
+				streamed = pipeline.endStream();
+			}
+
+			ASSERT_EQ(whole->width(), streamed->width());
+			ASSERT_EQ(whole->height(), streamed->height());
+			for (unsigned i=0; i<whole->height(); ++i) {
+				for (unsigned j=0; j<whole->width(); ++j) {
+					for (unsigned k=0; k<whole->colours(); ++k) {
+						ASSERT_EQ(whole->at(i,j,k), streamed->at(i,j,k))
+							<< "resampler " << r << ", size " << s;
+					}
+				}
+			}
+		}
+	}
+}
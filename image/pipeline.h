@@ -28,8 +28,9 @@
 #include <vector>
 #include <memory>
 
-class Image;
-class ImageSize;
+#include "image/image.h"
+#include "image/imageSize.h"
+
 class ImageTransform;
 class RayImage;
 class Resampler;
@@ -42,9 +43,38 @@ private:
   // Used to resize the final image, if requested.
   std::auto_ptr<Resampler>     m_resampler;
 
+  // Precision of the images processed
+  Image::Precision             m_precision;
+
+  // Number of threads to process with.  0 for one per CPU.
+  unsigned                     m_threads;
+
+  // While streaming: how the bands are handled
+  enum StreamMode {
+    // Mapped, and copied into m_streamOut
+    STREAM_ROWS,
+    // Mapped, and streamed through the resampler into m_streamOut
+    STREAM_RESAMPLE,
+    // Gathered into m_streamOut, to be processed once all have arrived
+    STREAM_WHOLE
+  };
+  StreamMode                   m_streamMode;
+  std::auto_ptr<Image>         m_streamOut;
+  // Size requested for the streamed image
+  ImageSize                    m_streamSize;
+
+  /* Applies transforms [begin,end) to the image.  Consecutive point-wise
+   * transforms are fused into a single pass. */
+  void applyTransforms(Image &img, unsigned begin, unsigned end);
+
+  // As process(), for an image adopted already
+  std::auto_ptr<Image> processImage
+      (std::auto_ptr<Image> img, const ImageSize &size);
+
 public:
   ImagePipeline() :
-    m_transforms(), m_resampler(0)
+    m_transforms(), m_resampler(0), m_precision(Image::DOUBLE_SAMPLES),
+    m_threads(1), m_streamMode(STREAM_WHOLE), m_streamOut(0), m_streamSize()
     { /* n/a */ }
   ~ImagePipeline();
 
@@ -54,17 +84,51 @@ public:
   // Set the resampler used to resize the final image, if requested.
   void setResampler(std::auto_ptr<Resampler> resampler);
 
+  /* Set the precision of the images processed.  Single precision halves
+   * the memory used.  Traced images are converted if need be, but it's
+   * cheaper to trace them with this precision in the first place. */
+  void setPrecision(Image::Precision precision) { m_precision = precision; }
+  Image::Precision precision() const { return m_precision; }
+
+  /* Set the number of threads to process with (0 for one per CPU).
+   * Each stage is split into bands of rows.  Threads only wait for each
+   * other where a stage needs the results of the one before it all
+   * done; runs of point-wise stages, and the first pass of a
+   * resample after them, are a single parallel pass. */
+  void setThreads(unsigned threads) { m_threads = threads; }
+
   /* Processes the given traced RayImage through the image pipeline.
+   * The pipeline takes the traced pixels without copying them, so img
+   * is left empty.
    * Returned Image will have whatever resolution the pipeline produces
    * for the resolution of the given RayImage */
-  std::auto_ptr<Image> process(const RayImage& img);
+  std::auto_ptr<Image> process(RayImage& img);
 
   /* Processes the given traced RayImage through the image pipeline.
    * If the result of the pipeline does not have the given width
    * and height, the resampler set with setResampler will be used
    * to resample to the desired resolution. */
   std::auto_ptr<Image> process
-      (const RayImage& img, const ImageSize &size);
+      (RayImage& img, const ImageSize &size);
+
+  /* As above, for an image traced earlier, which is left as it was. */
+  std::auto_ptr<Image> process(const Image& img, const ImageSize &size);
+
+  /* Streaming.  Rather than waiting for the whole traced image, the
+   * pipeline can take it a band of rows at a time, top to bottom, as
+   * the bands are traced.  Each band is processed as it arrives, and
+   * only the processed image, plus any rows the resampler still needs,
+   * are kept.  That needs every transform to be point-wise, and a
+   * resampler which can stream (if one is needed); otherwise the bands
+   * are just gathered and processed at the end.  The result is the
+   * same as process(img, size) on the whole image. */
+  void beginStream(const ImageSize &traced, const ImageSize &size);
+
+  /* Processes the next band of the image, which is left empty. */
+  void streamBand(RayImage &band);
+
+  /* @return the processed image, once every band has been streamed */
+  std::auto_ptr<Image> endStream();
 };
 
 #endif //IMAGE_PIPELINE_H_
@@ -24,40 +24,43 @@
 
 #include "image/imageSize.h"
 
-RayImage::RayImage(unsigned width, unsigned height) :
-    m_rays(0), m_width(0), m_height(0)
+RayImage::RayImage(unsigned width, unsigned height,
+                   Image::Precision precision) :
+    m_pixels(0, 0, 3, precision), m_height(0), m_top(0)
 {
     setSize(width, height);
 }
 
-RayImage::RayImage(const ImageSize &size) :
-    m_rays(0), m_width(0), m_height(0)
+RayImage::RayImage(const ImageSize &size, Image::Precision precision) :
+    m_pixels(0, 0, 3, precision), m_height(0), m_top(0)
 {
     setSize(size.m_width, size.m_height);
 }
 
-RayImage::~RayImage() {
-    setSize(0, 0);
+int RayImage::setSize(unsigned width, unsigned height) {
+    return setBand(width, height, 0, height);
 }
 
-int RayImage::setSize(unsigned width, unsigned height) {
-    /* Alloc new */
-    Ray *newRays = 0;
-    if (width && height) {
-        newRays = new Ray[width*height];
+int RayImage::setBand(unsigned width, unsigned height,
+                      unsigned top, unsigned rows) {
+    if (!(width && height && rows)) {
+        m_height = 0;
+        m_top = 0;
+        return m_pixels.resize(0, 0, 0);
     }
-
-    /* Check alloc */
-    if (width && height && (!newRays)) {
-        // Failed to alloc
+    if (m_pixels.resize(width, rows, 3)) {
         return -1;
     }
-
-    /* Replace old */
-    delete [] m_rays;
-    m_rays = newRays;
-    m_width = width;
     m_height = height;
+    m_top = top;
+
+    /* Untraced pixels are black */
+    for (unsigned k=0; k<3; ++k) {
+        for (unsigned i=0; i<rows; ++i) {
+            for (unsigned j=0; j<width; ++j) {
+                m_pixels.set(i, j, k, 0.0);
+            }
+        }
+    }
     return 0;
 }
-
@@ -24,39 +24,71 @@
 #ifndef RAY_IMAGE_H_
 #define RAY_IMAGE_H_ 
 
-#include "trace/ray.h"
+#include "image/colour.h"
+#include "image/image.h"
 
 class ImageSize;
 
+/** The colours traced for each pixel of a view.  Rays only exist while
+ *  a pixel is being traced; this just keeps the colour they end up with,
+ *  in a plain 3-colour Image which the image pipeline can adopt.
+ *  A RayImage may hold just a band of the rows of the view's image, so
+ *  that a large image can be traced and processed a band at a time.
+ *  Rows are always numbered as in the whole image. */
 class RayImage {
 private:
-    // Rays.  All rows are concatenated into one array.
-    Ray*     m_rays;
-    unsigned m_width;
+    // Traced colours of the rows held, one plane per colour component.
+    Image    m_pixels;
+    // Height of the whole image
     unsigned m_height;
+    // First row held
+    unsigned m_top;
 
 private:
-    /* Disable, because Ray isn't copyable */
+    /* Disable, since images can be large; use Image::adopt to move */
     RayImage(const RayImage &other);
     RayImage& operator=(const RayImage &other);
 
 public:
-    RayImage(unsigned width=0, unsigned height=0);
-    RayImage(const ImageSize &size);
-    virtual ~RayImage();
+    RayImage(unsigned width=0, unsigned height=0,
+             Image::Precision precision=Image::DOUBLE_SAMPLES);
+    RayImage(const ImageSize &size,
+             Image::Precision precision=Image::DOUBLE_SAMPLES);
 
-    unsigned width() const {return m_width;}
+    unsigned width() const {return m_pixels.width();}
     unsigned height() const {return m_height;}
+    //! The rows held are [top(), top() + rows())
+    unsigned top() const {return m_top;}
+    unsigned rows() const {return m_pixels.height();}
 
-    Ray& at(unsigned row, unsigned col) 
-        {return m_rays[row*m_width + col];}
-    const Ray& at(unsigned row, unsigned col) const
-        {return m_rays[row*m_width + col];}
+    //! Get the colour traced for a pixel.
+    RayColour at(unsigned row, unsigned col) const {
+        row -= m_top;
+        return RayColour(m_pixels.at(row, col, RED),
+                         m_pixels.at(row, col, GREEN),
+                         m_pixels.at(row, col, BLUE));
+    }
+    //! Set the colour traced for a pixel.
+    void set(unsigned row, unsigned col, const RayColour &colour) {
+        row -= m_top;
+        m_pixels.set(row, col, RED, colour.r);
+        m_pixels.set(row, col, GREEN, colour.g);
+        m_pixels.set(row, col, BLUE, colour.b);
+    }
+
+    //! The traced colours of the rows held, as an image.
+    Image& image() {return m_pixels;}
+    const Image& image() const {return m_pixels;}
 
     /* Resize.  This destroys preexisting data.
      * If new alloc fails, size doesn't change
      * @return 0 on success, -1 on fail */
     int setSize(unsigned width, unsigned height);
+
+    /* Hold only rows [top, top+rows) of a width x height image.  This
+     * destroys preexisting data.
+     * @return 0 on success, -1 on fail */
+    int setBand(unsigned width, unsigned height, unsigned top, unsigned rows);
 };
 
 #endif //RAY_IMAGE_H_
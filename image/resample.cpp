@@ -21,16 +21,23 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  *****************************************************************************/
 
+#include <algorithm>
 #include <cmath>
+#include <vector>
+#include <gtest/gtest.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "resample.h"
 
 #include "image.h"
+#include "util/parallel.h"
 
 // Resample according to nearest neighbor
 Image& NearestNeighbor::apply(Image &img) {
   // Allocate new image for resampled data
-  Image resampled (m_xPix, m_yPix, img.colours());
+  Image resampled (m_xPix, m_yPix, img.colours(), img.precision());
 
   if ((resampled.width() != m_xPix) || (resampled.height() != m_yPix)) {
     // Alloc failure!
@@ -45,7 +52,7 @@ Image& NearestNeighbor::apply(Image &img) {
       double srcI = yScale * i;
       double srcJ = xScale * j;
       for (unsigned k=0; k < resampled.colours(); ++k) {
-        resampled.at(i, j, k) = img.at(srcI, srcJ, k);
+        resampled.set(i, j, k, img.at(srcI, srcJ, k));
       }
     }
   }
@@ -54,10 +61,112 @@ Image& NearestNeighbor::apply(Image &img) {
   return img.swap(resampled);
 }
 
+//! Rows of the destination in each band handed to a thread
+#define RESAMPLE_BAND_ROWS 16
+
+/** Resamples bands of rows to the nearest neighbour, and maps them */
+class NearestBands : public ParallelTasks {
+private:
+  const Image           &m_src;
+  Image                 &m_dst;
+  ImageTransform *const *m_stages;
+  unsigned               m_count;
+
+public:
+  NearestBands(const Image &src, Image &dst,
+               ImageTransform *const stages[], unsigned count) :
+    m_src(src), m_dst(dst), m_stages(stages), m_count(count)
+    { /* n/a */ }
+
+  virtual void run(unsigned task, unsigned thread) {
+    unsigned width = m_dst.width();
+    double xScale = (double)(m_src.width()) / width;
+    double yScale = (double)(m_src.height()) / m_dst.height();
+    unsigned begin = task * RESAMPLE_BAND_ROWS;
+    unsigned end = std::min(begin + RESAMPLE_BAND_ROWS, m_dst.height());
+
+    // Each resampled row is gathered, mapped while in cache, and stored
+    std::vector<double> row (width);
+    for (unsigned i=begin; i < end; ++i) {
+      double srcI = yScale * i;
+      for (unsigned k=0; k < m_dst.colours(); ++k) {
+        for (unsigned j=0; j < width; ++j) {
+          double srcJ = xScale * j;
+          row[j] = m_src.at(srcI, srcJ, k);
+        }
+        for (unsigned s=0; s < m_count; ++s) {
+          m_stages[s]->mapSamples(&row[0], width);
+        }
+        for (unsigned j=0; j < width; ++j) {
+          m_dst.set(i, j, k, row[j]);
+        }
+      }
+    }
+  }
+};
+
+// Resample according to nearest neighbor, mapping as we go
+bool NearestNeighbor::applyMapped(Image &img, ImageTransform *const stages[],
+                                  unsigned count, unsigned threads)
+{
+  if (!(m_xPix && m_yPix)) return false;
+
+  Image resampled (m_xPix, m_yPix, img.colours(), img.precision());
+
+  if ((resampled.width() != m_xPix) || (resampled.height() != m_yPix)) {
+    // Alloc failure!
+    return false;
+  }
+
+  NearestBands bands (img, resampled, stages, count);
+  runParallel(bands, (m_yPix + RESAMPLE_BAND_ROWS - 1) / RESAMPLE_BAND_ROWS,
+              threads);
+
+  img.swap(resampled);
+  return true;
+}
+
+Image& NearestNeighbor::applyParallel(Image &img, unsigned threads) {
+  applyMapped(img, 0, 0, threads);
+  return img;
+}
+
+bool NearestNeighbor::beginStream(unsigned srcWidth, unsigned srcHeight,
+                                  Image &dst)
+{
+  if (!(m_xPix && m_yPix && srcWidth && srcHeight)) return false;
+  if ((dst.width() != m_xPix) || (dst.height() != m_yPix)) return false;
+
+  m_streamDst = &dst;
+  m_streamNext = 0;
+  m_streamSrcHeight = srcHeight;
+  return true;
+}
+
+// Only the source row nearest each destination row is needed
+void NearestNeighbor::streamRows(const Image &band, unsigned top,
+                                 unsigned threads)
+{
+  double xScale = (double)(band.width()) / m_xPix;
+  double yScale = (double)(m_streamSrcHeight) / m_yPix;
+  unsigned received = top + band.height();
+
+  for (; m_streamNext < m_yPix; ++m_streamNext) {
+    unsigned srcI = yScale * m_streamNext;
+    if (srcI >= received) break;
+    for (unsigned j=0; j < m_xPix; ++j) {
+      double srcJ = xScale * j;
+      for (unsigned k=0; k < m_streamDst->colours(); ++k) {
+        m_streamDst->set(m_streamNext, j, k, band.at(srcI - top, srcJ, k));
+      }
+    }
+  }
+}
+
 // Resample with the bilinear transform
 Image& BilinearInterpolator::apply(Image &img) {
   // Allocate new image for resampled datta
-  Image resampled (m_xPix, m_yPix, img.colours());
+  Image resampled (m_xPix, m_yPix, img.colours(), img.precision());
 
   if ((resampled.width() != m_xPix) || (resampled.height() != m_yPix)) {
     // Alloc failure!
@@ -89,7 +198,7 @@ void BilinearInterpolator::doBilinearSample(
     if ((srcI == (int)(srcI)) && (srcJ == (int)(srcJ))) {
       /* If source and dest coords are exactly the same, no need
        * to average. */
-      dst.at(dstI, dstJ, k) = src.at(srcI, srcJ, k);
+      dst.set(dstI, dstJ, k, src.at(srcI, srcJ, k));
       continue;
     }
 
@@ -103,7 +212,395 @@ void BilinearInterpolator::doBilinearSample(
     double top = ul + (ur - ul)*(srcJ - (int)(srcJ));
     double bottom = ll + (lr - ll)*(srcJ - (int)(srcJ));
 
-    dst.at(dstI, dstJ, k) = top + (bottom-top)*(srcI - (int)(srcI));
+    dst.set(dstI, dstJ, k, top + (bottom-top)*(srcI - (int)(srcI)));
   }
 }
 
+
+// Box kernel.  Half open, so a sample halfway between two is counted once.
+double BoxResampler::kernel(double x) const {
+  return ((x >= -0.5) && (x < 0.5)) ? 1.0 : 0.0;
+}
+
+// Mitchell-Netravali cubic, B = C = 1/3
+double MitchellResampler::kernel(double x) const {
+  x = fabs(x);
+  if (x < 1.0) {
+    return (7.0*x*x*x - 12.0*x*x + 16.0/3.0) / 6.0;
+  }
+  if (x < 2.0) {
+    return (-7.0/3.0*x*x*x + 12.0*x*x - 20.0*x + 32.0/3.0) / 6.0;
+  }
+  return 0.0;
+}
+
+// Lanczos, a = 3
+double LanczosResampler::kernel(double x) const {
+  if (x == 0.0) return 1.0;
+  if ((x <= -3.0) || (x >= 3.0)) return 0.0;
+  double px = M_PI * x;
+  return 3.0 * sin(px) * sin(px / 3.0) / (px * px);
+}
+
+void SeparableResampler::prepare(FilterTable &table, unsigned src, unsigned dst)
+{
+  if ((table.m_src == src) && (table.m_dst == dst)) return;
+
+  double scale = (double)(src) / dst;
+  double stretch = (scale > 1.0) ? scale : 1.0;
+  double radius = support() * stretch;
+
+  /* Every source sample within radius of the centre.  The table has an
+   * even number of taps, for SSE2, unless the source is smaller. */
+  int window = (int)(floor(2.0 * radius)) + 1;
+  unsigned taps = window + (window % 2);
+  if (taps > src) taps = src;
+
+  table.m_first.resize(dst);
+  table.m_weights.assign((size_t)(dst) * taps, 0.0);
+  for (unsigned i=0; i < dst; ++i) {
+    double centre = (i + 0.5) * scale - 0.5;
+    int start = (int)(ceil(centre - radius));
+    int first = start;
+    if (first > (int)(src - taps)) first = src - taps;
+    if (first < 0) first = 0;
+
+    /* Samples past the edges repeat the edge samples, which always lie
+     * in the window. */
+    double *weights = &table.m_weights[(size_t)(i) * taps];
+    double total = 0.0;
+    for (int t=start; t < start + window; ++t) {
+      double weight = kernel((t - centre) / stretch);
+      int inx = t;
+      if (inx < 0) inx = 0;
+      if (inx > (int)(src) - 1) inx = src - 1;
+      weights[inx - first] += weight;
+      total += weight;
+    }
+    if (total != 0.0) {
+      for (unsigned t=0; t < taps; ++t) weights[t] /= total;
+    }
+    table.m_first[i] = first;
+  }
+
+  table.m_src = src;
+  table.m_dst = dst;
+  table.m_taps = taps;
+}
+
+/* Resamples one row.  dst[i] is the dot product of taps weights from
+ * weights[i*taps] with taps samples from src[first[i]]. */
+static void filterRow(const double src[], const unsigned first[],
+                      const double weights[], unsigned taps,
+                      unsigned count, double dst[])
+{
+  for (unsigned i=0; i < count; ++i) {
+    const double *in = src + first[i];
+    const double *w = weights + (size_t)(i) * taps;
+    unsigned t = 0;
+    double sum = 0.0;
+#ifdef __SSE2__
+    __m128d acc = _mm_setzero_pd();
+    for (; t+2 <= taps; t+=2) {
+      acc = _mm_add_pd(acc,
+          _mm_mul_pd(_mm_loadu_pd(in + t), _mm_loadu_pd(w + t)));
+    }
+    double pair[2];
+    _mm_storeu_pd(pair, acc);
+    sum = pair[0] + pair[1];
+#endif
+    for (; t < taps; ++t) sum += in[t] * w[t];
+    dst[i] = sum;
+  }
+}
+
+/* Resamples down the columns, for one destination row: dst is the sum
+ * of taps rows of width samples, from row first of src, each times its
+ * weight. */
+static void filterColumns(const double src[], unsigned width, unsigned first,
+                          const double weights[], unsigned taps, double dst[])
+{
+  for (unsigned j=0; j < width; ++j) dst[j] = 0.0;
+
+  for (unsigned t=0; t < taps; ++t) {
+    const double *in = src + (size_t)(first + t) * width;
+    double w = weights[t];
+    unsigned j = 0;
+#ifdef __SSE2__
+    __m128d w2 = _mm_set1_pd(w);
+    for (; j+2 <= width; j+=2) {
+      _mm_storeu_pd(dst + j, _mm_add_pd(_mm_loadu_pd(dst + j),
+          _mm_mul_pd(w2, _mm_loadu_pd(in + j))));
+    }
+#endif
+    for (; j < width; ++j) dst[j] += w * in[j];
+  }
+}
+
+/** Resamples bands of source rows to the new width, after mapping them,
+ *  for every colour */
+class RowBands : public ParallelTasks {
+private:
+  const Image           &m_src;
+  ImageTransform *const *m_stages;
+  unsigned               m_count;
+  const unsigned        *m_first;
+  const double          *m_weights;
+  unsigned               m_taps;
+  unsigned               m_width;
+  // Where to put the resampled rows, for each colour
+  double *const         *m_across;
+
+public:
+  RowBands(const Image &src, ImageTransform *const stages[], unsigned count,
+           const unsigned first[], const double weights[], unsigned taps,
+           unsigned width, double *const across[]) :
+    m_src(src), m_stages(stages), m_count(count), m_first(first),
+    m_weights(weights), m_taps(taps), m_width(width), m_across(across)
+    { /* n/a */ }
+
+  unsigned count() const {
+    return (m_src.height() + RESAMPLE_BAND_ROWS - 1) / RESAMPLE_BAND_ROWS;
+  }
+
+  virtual void run(unsigned task, unsigned thread) {
+    unsigned srcWidth = m_src.width();
+    unsigned begin = task * RESAMPLE_BAND_ROWS;
+    unsigned end = std::min(begin + RESAMPLE_BAND_ROWS, m_src.height());
+
+    // Float or mapped samples are copied a row at a time
+    std::vector<double> row (srcWidth);
+    for (unsigned k=0; k < m_src.colours(); ++k) {
+      for (unsigned i=begin; i < end; ++i) {
+        const double *src = m_src.doublePlane(k);
+        if (src) {
+          src += (size_t)(i) * srcWidth;
+          if (m_count) {
+            std::copy(src, src + srcWidth, row.begin());
+            src = &row[0];
+          }
+        } else {
+          const float *fsrc = m_src.floatPlane(k) + (size_t)(i) * srcWidth;
+          for (unsigned j=0; j < srcWidth; ++j) row[j] = fsrc[j];
+          src = &row[0];
+        }
+        for (unsigned s=0; s < m_count; ++s) {
+          m_stages[s]->mapSamples(&row[0], srcWidth);
+        }
+        filterRow(src, m_first, m_weights, m_taps, m_width,
+                  m_across[k] + (size_t)(i) * m_width);
+      }
+    }
+  }
+};
+
+/** Resamples bands of destination rows [begin, end) down the columns */
+class ColumnBands : public ParallelTasks {
+private:
+  Image                 &m_dst;
+  const unsigned        *m_first;
+  const double          *m_weights;
+  unsigned               m_taps;
+  // Source rows resampled across, for each colour, from row m_acrossTop
+  const double *const   *m_across;
+  unsigned               m_acrossTop;
+  unsigned               m_begin;
+  unsigned               m_end;
+
+public:
+  ColumnBands(Image &dst, const unsigned first[], const double weights[],
+              unsigned taps, const double *const across[], unsigned acrossTop,
+              unsigned begin, unsigned end) :
+    m_dst(dst), m_first(first), m_weights(weights), m_taps(taps),
+    m_across(across), m_acrossTop(acrossTop), m_begin(begin), m_end(end)
+    { /* n/a */ }
+
+  unsigned count() const {
+    return (m_end - m_begin + RESAMPLE_BAND_ROWS - 1) / RESAMPLE_BAND_ROWS;
+  }
+
+  virtual void run(unsigned task, unsigned thread) {
+    unsigned width = m_dst.width();
+    unsigned begin = m_begin + task * RESAMPLE_BAND_ROWS;
+    unsigned end = std::min(begin + RESAMPLE_BAND_ROWS, m_end);
+
+    // Float samples are converted from doubles a row at a time
+    std::vector<double> row (width);
+    for (unsigned k=0; k < m_dst.colours(); ++k) {
+      for (unsigned i=begin; i < end; ++i) {
+        double *dst = m_dst.doublePlane(k);
+        dst = dst ? dst + (size_t)(i) * width : &row[0];
+        filterColumns(m_across[k], width, m_first[i] - m_acrossTop,
+                      m_weights + (size_t)(i) * m_taps, m_taps, dst);
+        if (dst == &row[0]) {
+          float *fdst = m_dst.floatPlane(k) + (size_t)(i) * width;
+          for (unsigned j=0; j < width; ++j) fdst[j] = row[j];
+        }
+      }
+    }
+  }
+};
+
+/* Resample rows, then columns.  Each pass is split into bands of rows;
+ * the columns need every row, so the second waits for the first. */
+bool SeparableResampler::resample(Image &img, ImageTransform *const stages[],
+                                  unsigned count, unsigned threads)
+{
+  if (!(m_xPix && m_yPix && img.width() && img.height())) return false;
+
+  Image resampled (m_xPix, m_yPix, img.colours(), img.precision());
+
+  if ((resampled.width() != m_xPix) || (resampled.height() != m_yPix)) {
+    // Alloc failure!
+    return false;
+  }
+
+  unsigned srcHeight = img.height();
+  prepare(m_xTable, img.width(), m_xPix);
+  prepare(m_yTable, srcHeight, m_yPix);
+
+  // Every source row, resampled to the new width
+  size_t plane = (size_t)(m_xPix) * srcHeight;
+  std::vector<double> across (plane * img.colours());
+  std::vector<double*> planes (img.colours());
+  for (unsigned k=0; k < img.colours(); ++k) planes[k] = &across[k * plane];
+
+  RowBands rows (img, stages, count, &m_xTable.m_first[0],
+                 &m_xTable.m_weights[0], m_xTable.m_taps, m_xPix, &planes[0]);
+  runParallel(rows, rows.count(), threads);
+
+  std::vector<const double*> constPlanes (planes.begin(), planes.end());
+  ColumnBands columns (resampled, &m_yTable.m_first[0],
+                       &m_yTable.m_weights[0], m_yTable.m_taps,
+                       &constPlanes[0], 0, 0, m_yPix);
+  runParallel(columns, columns.count(), threads);
+
+  // Swap resampled data for old data
+  img.swap(resampled);
+  return true;
+}
+
+bool SeparableResampler::beginStream(unsigned srcWidth, unsigned srcHeight,
+                                     Image &dst)
+{
+  if (!(m_xPix && m_yPix && srcWidth && srcHeight)) return false;
+  if ((dst.width() != m_xPix) || (dst.height() != m_yPix)) return false;
+
+  prepare(m_xTable, srcWidth, m_xPix);
+  prepare(m_yTable, srcHeight, m_yPix);
+  m_streamDst = &dst;
+  m_streamNext = 0;
+  m_windowTop = 0;
+  m_window.assign(dst.colours(), std::vector<double>());
+  return true;
+}
+
+void SeparableResampler::streamRows(const Image &band, unsigned top,
+                                    unsigned threads)
+{
+  unsigned colours = m_window.size();
+  size_t held = m_window[0].size() / m_xPix;
+  unsigned received = top + band.height();
+
+  // Rows are resampled across straight onto the end of the window
+  std::vector<double*> across (colours);
+  for (unsigned k=0; k < colours; ++k) {
+    m_window[k].resize((held + band.height()) * m_xPix);
+    across[k] = &m_window[k][held * m_xPix];
+  }
+  RowBands rows (band, 0, 0, &m_xTable.m_first[0], &m_xTable.m_weights[0],
+                 m_xTable.m_taps, m_xPix, &across[0]);
+  runParallel(rows, rows.count(), threads);
+
+  // Write every destination row whose source rows have all arrived
+  unsigned end = m_streamNext;
+  while ((end < m_yPix) &&
+         (m_yTable.m_first[end] + m_yTable.m_taps <= received)) {
+    ++end;
+  }
+  if (end > m_streamNext) {
+    std::vector<const double*> window (colours);
+    for (unsigned k=0; k < colours; ++k) window[k] = &m_window[k][0];
+    ColumnBands columns (*m_streamDst, &m_yTable.m_first[0],
+                         &m_yTable.m_weights[0], m_yTable.m_taps,
+                         &window[0], m_windowTop, m_streamNext, end);
+    runParallel(columns, columns.count(), threads);
+    m_streamNext = end;
+  }
+
+  // Forget source rows which no later destination row needs
+  unsigned keep = received;
+  if (m_streamNext < m_yPix) {
+    keep = std::min(keep, m_yTable.m_first[m_streamNext]);
+  }
+  if (keep > m_windowTop) {
+    size_t drop = (size_t)(keep - m_windowTop) * m_xPix;
+    for (unsigned k=0; k < colours; ++k) {
+      m_window[k].erase(m_window[k].begin(), m_window[k].begin() + drop);
+    }
+    m_windowTop = keep;
+  }
+}
+
+Image& SeparableResampler::apply(Image &img) {
+  resample(img, 0, 0, 1);
+  return img;
+}
+
+Image& SeparableResampler::applyParallel(Image &img, unsigned threads) {
+  resample(img, 0, 0, threads);
+  return img;
+}
+
+bool SeparableResampler::applyMapped(Image &img,
+    ImageTransform *const stages[], unsigned count, unsigned threads)
+{
+  return resample(img, stages, count, threads);
+}
+
+/* Every kernel keeps a flat image flat, and the box filter averages
+ * exactly when shrinking by a whole factor. */
+TEST(ResampleTest, Separable) {
+  Image flat (37, 23);
+  for (unsigned i=0; i < flat.height(); ++i) {
+    for (unsigned j=0; j < flat.width(); ++j) {
+      for (unsigned k=0; k < flat.colours(); ++k) flat.set(i, j, k, 0.75);
+    }
+  }
+
+  BoxResampler box;
+  MitchellResampler mitchell;
+  LanczosResampler lanczos;
+  Resampler *resamplers[] = { &box, &mitchell, &lanczos };
+  const unsigned sizes[][2] = { {80, 50}, {12, 7}, {37, 5}, {1, 1} };
+  for (unsigned r=0; r < 3; ++r) {
+    for (unsigned s=0; s < 4; ++s) {
+      Image img (flat);
+      resamplers[r]->setResolution(sizes[s][0], sizes[s][1]);
+      resamplers[r]->apply(img);
+      ASSERT_EQ(sizes[s][0], img.width());
+      ASSERT_EQ(sizes[s][1], img.height());
+      for (unsigned i=0; i < img.height(); ++i) {
+        for (unsigned j=0; j < img.width(); ++j) {
+          ASSERT_NEAR(0.75, img.at(i, j, BLUE), 1E-12)
+            << "resampler " << r << ", size " << s;
+        }
+      }
+    }
+  }
+
+  Image ramp (8, 4, 1, Image::FLOAT_SAMPLES);
+  for (unsigned i=0; i < ramp.height(); ++i) {
+    for (unsigned j=0; j < ramp.width(); ++j) ramp.set(i, j, 0, i*8 + j);
+  }
+  box.setResolution(4, 2);
+  box.apply(ramp);
+  ASSERT_EQ(Image::FLOAT_SAMPLES, ramp.precision());
+  for (unsigned i=0; i < 2; ++i) {
+    for (unsigned j=0; j < 4; ++j) {
+      double mean = (16*i + 2*j) + (16*i + 2*j + 1)
+                  + (16*i + 8 + 2*j) + (16*i + 8 + 2*j + 1);
+      EXPECT_EQ(mean / 4.0, ramp.at(i, j, 0));
+    }
+  }
+}
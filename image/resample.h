@@ -24,6 +24,8 @@
 #ifndef RESAMPLE_H_
 #define RESAMPLE_H_
 
+#include <vector>
+
 #include "image/transform.h"
 
 class Image;
@@ -35,8 +37,12 @@ protected:
   unsigned m_xPix;
   unsigned m_yPix;
 
+  // While streaming: the destination, and the next row of it to write
+  Image   *m_streamDst;
+  unsigned m_streamNext;
+
   Resampler(unsigned width=0, unsigned height=0):
-    m_xPix(width), m_yPix(height)
+    m_xPix(width), m_yPix(height), m_streamDst(0), m_streamNext(0)
     { /* n/a */ }
 
 public:
@@ -44,6 +50,30 @@ public:
     m_xPix = width;
     m_yPix = height;
   }
+
+  /* Resamples the image, applying a run of point-wise transforms to
+   * the samples in the same pass, with the given number of threads (0
+   * for one per CPU).  Only resamplers for which this gives exactly the
+   * result of transforming first do so.
+   * @return true if done, false (leaving img alone) if not supported */
+  virtual bool applyMapped(Image &img, ImageTransform *const stages[],
+                           unsigned count, unsigned threads)
+    { return false; }
+
+  /* Starts resampling an image which arrives a band of rows at a time,
+   * from top to bottom.  Each destination row is written as soon as the
+   * source rows it needs have arrived, and source rows are only kept
+   * until no later destination row needs them.
+   * @param dst  Where to write the result.  It must already have the
+   *             destination size, and the bands' colours and precision.
+   * @return false if this resampler can't stream */
+  virtual bool beginStream(unsigned srcWidth, unsigned srcHeight, Image &dst)
+    { return false; }
+
+  /* Adds the next band of the streamed image: its rows [top, top + the
+   * band's height). */
+  virtual void streamRows(const Image &band, unsigned top, unsigned threads)
+    { }
 };
 
 /* A simple nearest neighbor resampler.  Each resampled pixel takes on
@@ -52,10 +82,23 @@ public:
 class NearestNeighbor: public Resampler {
 public:
   NearestNeighbor(unsigned width=0, unsigned height=0) :
-    Resampler(width, height)
+    Resampler(width, height), m_streamSrcHeight(0)
     { /* n/a */ }
 
   virtual Image& apply(Image &img);
+
+  virtual Image& applyParallel(Image &img, unsigned threads);
+
+  /* Picking a sample commutes with mapping it, so this is supported */
+  virtual bool applyMapped(Image &img, ImageTransform *const stages[],
+                           unsigned count, unsigned threads);
+
+  virtual bool beginStream(unsigned srcWidth, unsigned srcHeight, Image &dst);
+  virtual void streamRows(const Image &band, unsigned top, unsigned threads);
+
+private:
+  // Height of the image being streamed
+  unsigned m_streamSrcHeight;
 };
 
 /* A bilinear transform resampler.  Each resampled pixel is the 
@@ -73,4 +116,102 @@ public:
   virtual Image& apply(Image &img);
 };
 
+/* Base for resamplers which filter the rows, then the columns, with a
+ * kernel.  When shrinking, the kernel is stretched to cover each
+ * destination pixel.  Samples past the edges repeat the edge samples.
+ * Weights are worked out once for each pair of source and destination
+ * sizes, and kept until the sizes change. */
+class SeparableResampler: public Resampler {
+private:
+  /* The weights for resampling one dimension.  Destination sample i is
+   * the sum, over m_taps source samples from m_first[i], of the samples
+   * times m_weights[i*m_taps ...]. */
+  struct FilterTable {
+    unsigned              m_src;
+    unsigned              m_dst;
+    unsigned              m_taps;
+    std::vector<unsigned> m_first;
+    std::vector<double>   m_weights;
+
+    FilterTable() : m_src(0), m_dst(0), m_taps(0) {}
+  };
+
+  FilterTable m_xTable;
+  FilterTable m_yTable;
+
+  /* While streaming: source rows resampled across which are still
+   * needed, for each colour, starting from source row m_windowTop. */
+  std::vector<std::vector<double> > m_window;
+  unsigned                          m_windowTop;
+
+  // Update a table for the given sizes, unless it has them already.
+  void prepare(FilterTable &table, unsigned src, unsigned dst);
+
+  /* Resample, mapping the source samples with the given point-wise
+   * transforms first.  @return false on alloc failure */
+  bool resample(Image &img, ImageTransform *const stages[], unsigned count,
+                unsigned threads);
+
+protected:
+  SeparableResampler(unsigned width, unsigned height) :
+    Resampler(width, height), m_windowTop(0)
+    { /* n/a */ }
+
+  //! The kernel's weight at x source samples from the centre
+  virtual double kernel(double x) const = 0;
+  //! Kernel is zero at and beyond this distance from the centre
+  virtual double support() const = 0;
+
+public:
+  virtual Image& apply(Image &img);
+  virtual Image& applyParallel(Image &img, unsigned threads);
+
+  /* Filtering mapped source samples is filtering the mapped image, so
+   * this is supported */
+  virtual bool applyMapped(Image &img, ImageTransform *const stages[],
+                           unsigned count, unsigned threads);
+
+  /* Only the rows each destination row's kernel covers are kept. */
+  virtual bool beginStream(unsigned srcWidth, unsigned srcHeight, Image &dst);
+  virtual void streamRows(const Image &band, unsigned top, unsigned threads);
+};
+
+/* Averages the source pixels each destination pixel covers.  When
+ * enlarging, this is the same as nearest neighbour. */
+class BoxResampler: public SeparableResampler {
+protected:
+  virtual double kernel(double x) const;
+  virtual double support() const { return 0.5; }
+
+public:
+  BoxResampler(unsigned width=0, unsigned height=0) :
+    SeparableResampler(width, height)
+    { /* n/a */ }
+};
+
+/* Mitchell-Netravali cubic, with B = C = 1/3.  A good compromise between
+ * blurring and ringing. */
+class MitchellResampler: public SeparableResampler {
+protected:
+  virtual double kernel(double x) const;
+  virtual double support() const { return 2.0; }
+
+public:
+  MitchellResampler(unsigned width=0, unsigned height=0) :
+    SeparableResampler(width, height)
+    { /* n/a */ }
+};
+
+/* Windowed sinc, with three lobes.  Sharp, with a little ringing. */
+class LanczosResampler: public SeparableResampler {
+protected:
+  virtual double kernel(double x) const;
+  virtual double support() const { return 3.0; }
+
+public:
+  LanczosResampler(unsigned width=0, unsigned height=0) :
+    SeparableResampler(width, height)
+    { /* n/a */ }
+};
+
 #endif //RESAMPLE_H_
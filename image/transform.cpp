@@ -0,0 +1,92 @@
+/******************************************************************************
+ * transform.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Common machinery for image transforms.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License. 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <algorithm>
+#include <cstddef>
+
+#include "transform.h"
+
+#include "image.h"
+#include "util/parallel.h"
+
+/* Samples mapped at a time.  A block of doubles this size sits
+ * comfortably in L1. */
+#define POINTWISE_BLOCK 1024
+//! Blocks in each band of samples handed to a thread
+#define POINTWISE_BAND_BLOCKS 16
+
+/** Maps one band of samples, in every colour plane */
+class PointwiseBands : public ParallelTasks {
+private:
+    Image                 &m_img;
+    ImageTransform *const *m_stages;
+    unsigned               m_count;
+
+public:
+    PointwiseBands(Image &img, ImageTransform *const stages[],
+                   unsigned count) :
+        m_img(img), m_stages(stages), m_count(count)
+        { /* n/a */ }
+
+    static size_t bandSize() { return POINTWISE_BLOCK*POINTWISE_BAND_BLOCKS; }
+
+    virtual void run(unsigned task, unsigned thread) {
+        size_t samples = (size_t)(m_img.width()) * m_img.height();
+        size_t begin = task * bandSize();
+        size_t end = std::min(samples, begin + bandSize());
+        double scratch[POINTWISE_BLOCK];
+
+        for (unsigned k=0; k < m_img.colours(); ++k) {
+            double *dplane = m_img.doublePlane(k);
+            float *fplane = m_img.floatPlane(k);
+
+            for (size_t start=begin; start < end; start += POINTWISE_BLOCK) {
+                unsigned len = std::min(end - start, (size_t)POINTWISE_BLOCK);
+
+                // Double samples are mapped where they are
+                double *block = dplane ? dplane + start : scratch;
+                if (fplane) {
+                    for (unsigned i=0; i<len; ++i) block[i] = fplane[start+i];
+                }
+
+                for (unsigned s=0; s<m_count; ++s) {
+                    m_stages[s]->mapSamples(block, len);
+                }
+
+                if (fplane) {
+                    for (unsigned i=0; i<len; ++i) fplane[start+i] = block[i];
+                }
+            }
+        }
+    }
+};
+
+Image& ImageTransform::applyPointwise(Image &img,
+    ImageTransform *const stages[], unsigned count, unsigned threads)
+{
+    size_t samples = (size_t)(img.width()) * img.height();
+    size_t band = PointwiseBands::bandSize();
+
+    PointwiseBands bands (img, stages, count);
+    runParallel(bands, (samples + band - 1) / band, threads);
+    return img;
+}
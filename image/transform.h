@@ -32,6 +32,43 @@ public:
     /* Applies this transform to the given image.
      * @return the given image, transformed. */
     virtual Image& apply(Image& img) = 0;
+
+    /* As apply(), but spreads the work over a number of threads (0 for
+     * one per CPU).  Transforms which can't be split just apply(). */
+    virtual Image& applyParallel(Image& img, unsigned threads)
+        { return apply(img); }
+
+    /* Point-wise transforms map each sample on its own, whatever its
+     * position, colour or neighbours.  They return true here and
+     * implement mapSamples(), so that runs of them can share one pass
+     * over the image. */
+    virtual bool pointwise() const { return false; }
+
+    /* Maps count samples in place.  Only called if pointwise(). */
+    virtual void mapSamples(double samples[], unsigned count) const { }
+
+    /* Applies a run of point-wise transforms to the image in one pass,
+     * a block of samples at a time, so that each block stays in cache
+     * from the first transform to the last.  Bands of the image are
+     * handed out to the given number of threads (0 for one per CPU).
+     * @return the given image, transformed. */
+    static Image& applyPointwise(Image &img, ImageTransform *const stages[],
+                                 unsigned count, unsigned threads=1);
+};
+
+/* Convenient base for point-wise transforms. */
+class PointTransform : public ImageTransform {
+public:
+    virtual Image& apply(Image& img) {
+        return applyParallel(img, 1);
+    }
+
+    virtual Image& applyParallel(Image& img, unsigned threads) {
+        ImageTransform *self = this;
+        return applyPointwise(img, &self, 1, threads);
+    }
+
+    virtual bool pointwise() const { return true; }
 };
 
 #endif //TRAMSFORM_H_
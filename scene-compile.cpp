@@ -0,0 +1,61 @@
+/******************************************************************************
+ * scene-compile.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Compiles a JSON scene file into the binary form loaded by CompiledScene.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License. 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <stdint.h>
+
+#include "file/compiledScene.h"
+#include "file/reader.h"
+#include "trace/world.h"
+
+using namespace std;
+
+/* Usage: scene-compile scene.json out.scene
+ * The scene's search hierarchy is built and saved with it. */
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        cerr << "Usage: " << argv[0] << " scene.json out.scene" << endl;
+        return 2;
+    }
+
+    uint64_t hash;
+    if (!CompiledScene::hashFile(argv[1], hash)) {
+        cerr << argv[1] << ": failed to read" << endl;
+        return 1;
+    }
+    SceneReader reader (argv[1]);
+    if (!reader.parse()) {
+        cerr << argv[1] << ": " << reader.getErrors() << endl;
+        return 1;
+    }
+    World &world = *reader.getRender().m_world;
+    world.finalize();
+
+    stringstream errors;
+    if (!CompiledScene::write(argv[2], world, reader.settings(), hash,
+                              errors)) {
+        cerr << argv[2] << ": " << errors.str() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+/******************************************************************************
+ * scene-gen.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Writes procedurally generated scene files, for benchmarks.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License. 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "file/sceneWriter.h"
+#include "image/imageSize.h"
+#include "trace/generator.h"
+#include "trace/view.h"
+
+using namespace std;
+
+static int usage(const char *name) {
+    cerr << "Usage: " << name << " kind objects [seed [out.json]]\n"
+         << "  kind is field, clusters, mirrors or lights.\n"
+         << "  The scene is written to stdout if no file is given." << endl;
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    if ((argc < 3) || (argc > 5)) return usage(argv[0]);
+
+    SceneGenerator generator;
+    char *end;
+    if (!SceneGenerator::kindFromName(argv[1], generator.m_kind)) {
+        return usage(argv[0]);
+    }
+    generator.m_objects = strtoul(argv[2], &end, 10);
+    if (*end || !generator.m_objects) return usage(argv[0]);
+    if (argc > 3) {
+        generator.m_seed = strtoull(argv[3], &end, 10);
+        if (*end) return usage(argv[0]);
+    }
+
+    ofstream file;
+    if (argc > 4) {
+        file.open(argv[4]);
+        if (file.fail()) {
+            cerr << argv[4] << ": failed to create" << endl;
+            return 1;
+        }
+    }
+    ostream &out = (argc > 4) ? file : cout;
+
+    SceneWriter writer (out);
+    generator.generate(writer);
+    AngleView view;
+    generator.view(view);
+    if (!writer.finish(view, ImageSize(640, 480), 10)) {
+        cerr << "Failed to write scene" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -21,22 +21,22 @@
  *****************************************************************************/
 
 #include <QtGui>
+#include <cstdlib>
 #include <memory>
 #include <tr1/memory>
 #include <iostream>
+#include <sys/stat.h>
+#include <sys/types.h>
 
+#include "file/compiledScene.h"
 #include "file/reader.h"
-#include "image/colour.h"
 #include "image/image.h"
 #include "image/imageSize.h"
 #include "image/pipeline.h"
 #include "image/rayImage.h"
-#include "image/resample.h"
 #include "trace/lighting.h"
-#include "trace/light_sources.h"
 #include "trace/object.h"
 #include "trace/render.h"
-#include "trace/sphere.h"
 #include "trace/view.h"
 #include "trace/world.h"
 #include "ui/imageWidget.h"
@@ -44,20 +44,62 @@
 using namespace std;
 using namespace std::tr1;
 
-void qtTest(QApplication &app);
-Render createRender();
+void qtTest(QApplication &app, Render &render);
+
+//! Scene shown when none is given
+static const char *defaultScene = "examples/scene1.json";
+
+/* Directory of compiled scenes, made if need be: $XDG_CACHE_HOME/trace-ui,
+ * or ~/.cache/trace-ui.  If it can't be made, scenes just aren't cached. */
+static string sceneCacheDir() {
+    const char *base = getenv("XDG_CACHE_HOME");
+    string dir;
+    if (base && *base) {
+        dir = base;
+    } else {
+        const char *home = getenv("HOME");
+        dir = string(home ? home : ".") + "/.cache";
+    }
+    mkdir(dir.c_str(), 0755);
+    dir += "/trace-ui";
+    mkdir(dir.c_str(), 0755);
+    return dir;
+}
 
+/* Usage: trace-ui [scene.json | compiled.scene]
+ * Without a scene file, the example scene is shown.  JSON scenes are
+ * compiled into a cache the first time they're opened, so unchanged
+ * scenes load quickly after that.  Compiled scenes may also be made by
+ * scene-compile. */
 int main(int argc, char *argv[]) {
     QApplication app(argc, argv);
-    qtTest(app);
+    const char *scenePath = (argc < 2) ? defaultScene : argv[1];
+
+    string path (scenePath);
+    const string compiledExt (".scene");
+    if ((path.size() > compiledExt.size()) &&
+        (path.compare(path.size() - compiledExt.size(), compiledExt.size(),
+                      compiledExt) == 0)) {
+        CompiledScene compiled (scenePath);
+        if (!compiled.load()) {
+            cerr << scenePath << ": " << compiled.getErrors() << endl;
+            return 1;
+        }
+        qtTest(app, compiled.getRender());
+        return 0;
+    }
+
+    string cacheDir = sceneCacheDir();
+    SceneCache cache (cacheDir.c_str());
+    if (!cache.load(scenePath)) {
+        cerr << cache.getErrors() << endl;
+        return 1;
+    }
+    qtTest(app, cache.getRender());
+    return 0;
 }
     
-void qtTest(QApplication &app) {
-    Render render = createRender();
-    render.m_maxDepth = 20;
-    render.m_renderSize = ImageSize(300, 200);
-    render.m_processedSize = ImageSize(1200, 800);
-
+void qtTest(QApplication &app, Render &render) {
     ImageWidget *oiw = new ImageWidget(render);
 
     QHBoxLayout *imgs = new QHBoxLayout();
@@ -69,66 +111,3 @@ void qtTest(QApplication &app) {
 
     app.exec();
 }
-
-Render createRender() {
-    /* Create the world */
-    World *world = new World();
-    world->m_defaultColour.set(0,1.0,0);  
-    world->m_globalDiffuse.set(0.05, 0.05, 0.15); 
-    
-    auto_ptr<RayObject> sph (
-        new Sphere( Coord(0,0,0), 1.0, 
-             RayColour(0.1, 0.25, 1.0),
-             RayColour(0.1,0.25,1.0)));
-    world->addObject(sph);
-
-    auto_ptr<RayObject> sph2 ( 
-        new Sphere( Coord(0.5,1.5,1.5), 1.5, 
-             RayColour(1.0, 1.0, 0.1),
-             RayColour(1.0, 1.0, 0.2)));
-    world->addObject(sph2);
-
-    auto_ptr<RayObject> sph3 (
-        new Sphere(Coord(0,-1.25, 0), 0.5, 
-             RayColour(0.1, 1.0, 0.1), 
-             RayColour(0.2, 1.0, 0.2)));
-    world->addObject(sph3);
-
-    auto_ptr<RayObject> sph4 (
-        new Sphere( Coord(1.2,0.3,0.1), 0.75, 
-             RayColour(1.0, 0.1, 0.1), 
-             RayColour(1.0, 0.2, 0.2)));
-    world->addObject(sph4);
-
-    auto_ptr<RayObject> sph5 (
-        new Sphere( Coord(-3.5,-2, 2), 3,
-             RayColour(0, 0, 0.4),
-             RayColour(1, 1, 1)));
-    world->addObject(sph5);
-
-    auto_ptr<RayObject> light1 (
-        new SphereSource(RayVector(1.5,-2.5,1.5), 0.125, RayColour(90.0,90.0,90.0)));
-    world->addObject(light1);
-
-    auto_ptr<RayObject> light2 (
-        new SphereSource(RayVector(5,-1,-1), 0.125, RayColour(100,100,100)));
-    world->addObject(light2);
-   
-    /* Create the view */
-    ParallelView *view = new ParallelView();
-    view->m_origin = Coord(2.0,-2,2);
-    view->m_xVec = RayVector(0,4.5,0);
-    view->m_yVec = RayVector(0,0,-3);
-   
-    /* Create the image processing pipeline */
-    ImagePipeline *pipeline = new ImagePipeline();
-    pipeline->push(auto_ptr<ImageTransform>(new LogHDRToDisplay(0.0, 0.5)));
-    pipeline->setResampler(auto_ptr<Resampler>(new BilinearInterpolator()));
-
-    Render ret;
-    ret.m_world = shared_ptr<World>(world);
-    ret.m_view = shared_ptr<RayView>(view);
-    ret.m_pipeline = shared_ptr<ImagePipeline>(pipeline);
-    return ret;
-}
-
@@ -0,0 +1,693 @@
+/******************************************************************************
+ * bvh.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Provides a bounding volume hierarchy, which lets the World find the
+ * closest object along a ray without testing every object it contains.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bvh.h"
+
+#include "util/trace.h"
+#include "trace/object.h"
+#include "trace/packet.h"
+#include "trace/ray.h"
+#include "trace/sphere.h"
+
+using std::vector;
+
+static trc_ctl_t bvhTrace = {
+    TRC_DFL_LVL,
+    "BVH",
+    TRC_STDOUT
+};
+#define TRACE(level, args...) \
+    TRC_PRINTF(&bvhTrace,level,1,args)
+
+/* Deepest possible tree.  Nodes are split at the median, so depth is
+ * log2 of the object count; this is plenty. */
+#define BVH_STACK_SIZE 64
+
+BoundingBox::BoundingBox()
+{
+    for (int a=0; a<3; ++a) {
+        m_min[a] = HUGE_VAL;
+        m_max[a] = -HUGE_VAL;
+    }
+}
+
+BoundingBox::BoundingBox(const Coord &min, const Coord &max)
+{
+    m_min[0] = min.x(); m_min[1] = min.y(); m_min[2] = min.z();
+    m_max[0] = max.x(); m_max[1] = max.y(); m_max[2] = max.z();
+}
+
+void BoundingBox::expand(const BoundingBox &other)
+{
+    for (int a=0; a<3; ++a) {
+        if (other.m_min[a] < m_min[a]) m_min[a] = other.m_min[a];
+        if (other.m_max[a] > m_max[a]) m_max[a] = other.m_max[a];
+    }
+}
+
+void BoundingBox::expand(const double point[3])
+{
+    for (int a=0; a<3; ++a) {
+        if (point[a] < m_min[a]) m_min[a] = point[a];
+        if (point[a] > m_max[a]) m_max[a] = point[a];
+    }
+}
+
+int BoundingBox::longestAxis() const
+{
+    int axis = 0;
+    for (int a=1; a<3; ++a) {
+        if ((m_max[a]-m_min[a]) > (m_max[axis]-m_min[axis])) axis = a;
+    }
+    return axis;
+}
+
+//! Slab test.  See e.g. Kay & Kajiya, or any text on ray/box intersection.
+double BoundingBox::entryDist
+(const double orig[3], const double invDir[3], double maxDist) const
+{
+    double tmin = 0.0;
+    double tmax = (maxDist < 0.0) ? HUGE_VAL : maxDist;
+
+    for (int a=0; a<3; ++a) {
+        double t0 = (m_min[a] - orig[a]) * invDir[a];
+        double t1 = (m_max[a] - orig[a]) * invDir[a];
+        if (invDir[a] < 0.0) {
+            double tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        /* NB: a NaN here (ray lying exactly in a slab plane) fails both
+         * comparisons, and so leaves the range unchanged. */
+        if (t0 > tmin) tmin = t0;
+        if (t1 < tmax) tmax = t1;
+        if (tmin > tmax) return -1.0;
+    }
+
+    return tmin;
+}
+
+/** An object to be sorted into the tree during build. */
+struct BvhBuildItem {
+    BoundingBox m_box;
+    double      m_centre[3];
+    unsigned    m_index;
+    RayObject  *m_object;
+    // Whether the object is a plain sphere; see RayObject::sphere()
+    bool        m_isSphere;
+};
+
+/** Orders build items by their centre along one axis */
+struct BvhCentreLess {
+    int m_axis;
+    BvhCentreLess(int axis) : m_axis(axis) {}
+    bool operator()(const BvhBuildItem &a, const BvhBuildItem &b) const
+        { return a.m_centre[m_axis] < b.m_centre[m_axis]; }
+};
+
+//! Selects build items which are spheres
+static bool bvhIsSphere(const BvhBuildItem &item) { return item.m_isSphere; }
+
+void BoundingVolumeHierarchy::clear()
+{
+    m_nodes.clear();
+    m_objects.clear();
+    m_indices.clear();
+    m_sphereX.clear();
+    m_sphereY.clear();
+    m_sphereZ.clear();
+    m_sphereRSq.clear();
+}
+
+void BoundingVolumeHierarchy::build(const vector<RayObject*> &objects)
+{
+    clear();
+
+    vector<BvhBuildItem> items;
+    items.reserve(objects.size());
+    Coord centre;
+    double radius;
+    for (unsigned i=0; i<objects.size(); ++i) {
+        BvhBuildItem item;
+        if (!objects[i]->bounds(item.m_box)) continue;
+        for (int a=0; a<3; ++a) item.m_centre[a] = item.m_box.centre(a);
+        item.m_index = i;
+        item.m_object = objects[i];
+        item.m_isSphere = objects[i]->sphere(centre, radius);
+        items.push_back(item);
+    }
+
+    if (items.empty()) return;
+
+    m_nodes.reserve(2 * (items.size()/LEAF_SIZE + 1));
+    m_nodes.push_back(Node());
+    buildNode(items, 0, items.size(), 0);
+
+    m_objects.reserve(items.size());
+    m_indices.reserve(items.size());
+    for (unsigned i=0; i<items.size(); ++i) {
+        m_objects.push_back(items[i].m_object);
+        m_indices.push_back(items[i].m_index);
+    }
+    fillSpheres();
+
+    TRACE(TRC_STAT, "Built BVH: %u objects, %u nodes.\n",
+          (unsigned)(m_objects.size()), (unsigned)(m_nodes.size()));
+}
+
+void BoundingVolumeHierarchy::fillSpheres()
+{
+    Coord centre;
+    double radius;
+    m_sphereX.assign(m_objects.size() + 1, 0.0);
+    m_sphereY.assign(m_objects.size() + 1, 0.0);
+    m_sphereZ.assign(m_objects.size() + 1, 0.0);
+    m_sphereRSq.assign(m_objects.size() + 1, 0.0);
+    for (unsigned i=0; i<m_objects.size(); ++i) {
+        if (m_objects[i]->sphere(centre, radius)) {
+            m_sphereX[i] = centre.x();
+            m_sphereY[i] = centre.y();
+            m_sphereZ[i] = centre.z();
+            m_sphereRSq[i] = radius*radius;
+        }
+    }
+}
+
+//! Whether box 'inner' lies entirely within box 'outer'
+static bool boxWithin(const BoundingBox &inner, const BoundingBox &outer)
+{
+    for (int a=0; a<3; ++a) {
+        if ((inner.m_min[a] < outer.m_min[a]) ||
+            (inner.m_max[a] > outer.m_max[a])) return false;
+    }
+    return true;
+}
+
+bool BoundingVolumeHierarchy::restore
+(const vector<RayObject*> &objects, const Node nodes[], unsigned numNodes,
+ const unsigned order[], unsigned numOrder)
+{
+    clear();
+
+    // Every bounded object must be in the tree, once.
+    BoundingBox box;
+    Coord centre;
+    double radius;
+    unsigned bounded = 0;
+    vector<bool> seen (objects.size(), false);
+    for (unsigned i=0; i<objects.size(); ++i) {
+        if (objects[i]->bounds(box)) ++bounded;
+    }
+    if (numOrder != bounded) return false;
+    if (!numOrder) return numNodes == 0;
+    if (!numNodes) return false;
+    for (unsigned i=0; i<numOrder; ++i) {
+        if ((order[i] >= objects.size()) || seen[order[i]]) return false;
+        seen[order[i]] = true;
+    }
+
+    /* Walk the tree, checking each node lies within its parent, and each
+     * leaf's objects within the leaf.  Children must come after their
+     * parent, so the walk can't loop. */
+    vector<unsigned> covered (numOrder, 0);
+    unsigned stack[BVH_STACK_SIZE];
+    unsigned depth[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top] = 0;
+    depth[top] = 1;
+    ++top;
+    while (top) {
+        --top;
+        const Node &node = nodes[stack[top]];
+        if (node.m_count) {
+            if ((node.m_first > numOrder) ||
+                (node.m_count > numOrder - node.m_first) ||
+                (node.m_spheres > node.m_count)) return false;
+            for (unsigned i=node.m_first; i<node.m_first+node.m_count; ++i) {
+                RayObject *obj = objects[order[i]];
+                bool isSphere = (i - node.m_first) < node.m_spheres;
+                if (obj->sphere(centre, radius) != isSphere) return false;
+                if (!obj->bounds(box) || !boxWithin(box, node.m_box)) {
+                    return false;
+                }
+                ++covered[i];
+            }
+            continue;
+        }
+        if ((node.m_first <= stack[top]) || (node.m_first + 1 >= numNodes) ||
+            (depth[top] + 1 >= BVH_STACK_SIZE)) return false;
+        for (unsigned c=0; c<2; ++c) {
+            if (!boxWithin(nodes[node.m_first+c].m_box, node.m_box)) {
+                return false;
+            }
+        }
+        unsigned childDepth = depth[top] + 1;
+        unsigned child = node.m_first;
+        stack[top] = child;
+        depth[top] = childDepth;
+        stack[top+1] = child + 1;
+        depth[top+1] = childDepth;
+        top += 2;
+    }
+    for (unsigned i=0; i<numOrder; ++i) {
+        if (covered[i] != 1) return false;
+    }
+
+    m_nodes.assign(nodes, nodes + numNodes);
+    m_indices.assign(order, order + numOrder);
+    m_objects.reserve(numOrder);
+    for (unsigned i=0; i<numOrder; ++i) m_objects.push_back(objects[order[i]]);
+    fillSpheres();
+
+    TRACE(TRC_STAT, "Restored BVH: %u objects, %u nodes.\n",
+          (unsigned)(m_objects.size()), (unsigned)(m_nodes.size()));
+    return true;
+}
+
+void BoundingVolumeHierarchy::buildNode
+(vector<BvhBuildItem> &items, unsigned begin, unsigned end, unsigned node)
+{
+    BoundingBox box;
+    BoundingBox centres;
+    for (unsigned i=begin; i<end; ++i) {
+        box.expand(items[i].m_box);
+        centres.expand(items[i].m_centre);
+    }
+    m_nodes[node].m_box = box;
+
+    if (end - begin <= LEAF_SIZE) {
+        // Spheres first, so they can be tested as a block
+        vector<BvhBuildItem>::iterator split = std::stable_partition
+            (items.begin() + begin, items.begin() + end, bvhIsSphere);
+        m_nodes[node].m_first = begin;
+        m_nodes[node].m_count = end - begin;
+        m_nodes[node].m_spheres = (split - items.begin()) - begin;
+        return;
+    }
+
+    /* Split at the median along the axis where the objects are most
+     * spread out.  This keeps the tree balanced, so its depth is bounded. */
+    unsigned mid = begin + (end - begin)/2;
+    std::nth_element(items.begin() + begin, items.begin() + mid,
+                     items.begin() + end, BvhCentreLess(centres.longestAxis()));
+
+    // Children are adjacent.  NB: push_back may invalidate Node refs.
+    unsigned child = m_nodes.size();
+    m_nodes.push_back(Node());
+    m_nodes.push_back(Node());
+    m_nodes[node].m_first = child;
+    m_nodes[node].m_count = 0;
+    m_nodes[node].m_spheres = 0;
+
+    buildNode(items, begin, mid, child);
+    buildNode(items, mid, end, child+1);
+}
+
+RayObject* BoundingVolumeHierarchy::closest
+(const Ray &ray, double &dist, unsigned &index) const
+{
+    if (m_nodes.empty()) return 0;
+    return closestBelow(0, ray, dist, index);
+}
+
+RayObject* BoundingVolumeHierarchy::closestBelow
+(unsigned node, const Ray &ray, double &dist, unsigned &index) const
+{
+    double orig[3] =
+        { ray.m_endpoint.x(), ray.m_endpoint.y(), ray.m_endpoint.z() };
+    double invDir[3] =
+        { 1.0/ray.m_dir.x(), 1.0/ray.m_dir.y(), 1.0/ray.m_dir.z() };
+
+    RayObject *best = 0;
+
+    /* Stack of nodes known to be hit, with the distance at which
+     * the ray enters them */
+    unsigned stack[BVH_STACK_SIZE];
+    double   stackDist[BVH_STACK_SIZE];
+    int      top = 0;
+
+    double rootDist = m_nodes[node].m_box.entryDist(orig, invDir, dist);
+    if (rootDist < 0.0) return 0;
+    stack[top] = node;
+    stackDist[top] = rootDist;
+    ++top;
+
+    while (top) {
+        --top;
+        // The best hit may have moved closer since this node was pushed.
+        if ((dist >= 0.0) && (stackDist[top] > dist)) continue;
+        const Node &cur = m_nodes[stack[top]];
+
+        if (cur.m_count) {
+            double sphereDist[LEAF_SIZE + 1];
+            unsigned first = cur.m_first;
+            BaseSphere::intersectMany(ray, &m_sphereX[first],
+                &m_sphereY[first], &m_sphereZ[first], &m_sphereRSq[first],
+                cur.m_spheres, sphereDist);
+
+            for (unsigned i=first; i<first+cur.m_count; ++i) {
+                double curDist = (i < first + cur.m_spheres) ?
+                    sphereDist[i - first] : m_objects[i]->intersectDist(ray);
+                if (curDist < 0.0) continue;
+                if ( (dist < 0.0) || (curDist < dist) ||
+                     ((curDist == dist) && (m_indices[i] < index)) ) {
+                    best = m_objects[i];
+                    dist = curDist;
+                    index = m_indices[i];
+                }
+            }
+            continue;
+        }
+
+        /* Visit the nearer child first, by pushing it last */
+        unsigned near = cur.m_first;
+        unsigned far = cur.m_first + 1;
+        double nearDist = m_nodes[near].m_box.entryDist(orig, invDir, dist);
+        double farDist = m_nodes[far].m_box.entryDist(orig, invDir, dist);
+        if ( (farDist >= 0.0) &&
+             ((nearDist < 0.0) || (farDist < nearDist)) ) {
+            std::swap(near, far);
+            std::swap(nearDist, farDist);
+        }
+        if (farDist >= 0.0) {
+            stack[top] = far;
+            stackDist[top] = farDist;
+            ++top;
+        }
+        if (nearDist >= 0.0) {
+            stack[top] = near;
+            stackDist[top] = nearDist;
+            ++top;
+        }
+    }
+
+    return best;
+}
+
+/* Find which rays of a packet enter a box before their current closest
+ * hit.  This is entryDist() for each ray, but since the rays of a packet
+ * all travel into the same octant, the slabs are ordered the same way for
+ * all of them, and two rays can be tested at once with SSE2.
+ * @return Bit mask of the rays which enter the box. */
+static unsigned packetEntry(const BoundingBox &box, const RayPacket &packet,
+                            const double dist[])
+{
+    const double *orig[3] = { packet.m_ox, packet.m_oy, packet.m_oz };
+    const double *invDir[3] = { packet.m_ix, packet.m_iy, packet.m_iz };
+    double lo[3], hi[3];
+    for (int a=0; a<3; ++a) {
+        bool swap = (invDir[a][0] < 0.0);
+        lo[a] = swap ? box.m_max[a] : box.m_min[a];
+        hi[a] = swap ? box.m_min[a] : box.m_max[a];
+    }
+
+    unsigned mask = 0;
+#ifdef __SSE2__
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d huge = _mm_set1_pd(HUGE_VAL);
+    for (unsigned k=0; k<RAY_PACKET_SIZE; k+=2) {
+        __m128d d = _mm_loadu_pd(dist+k);
+        __m128d none = _mm_cmplt_pd(d, zero);
+        __m128d tmin = zero;
+        __m128d tmax = _mm_or_pd(_mm_and_pd(none, huge),
+                                 _mm_andnot_pd(none, d));
+        for (int a=0; a<3; ++a) {
+            __m128d o = _mm_loadu_pd(orig[a]+k);
+            __m128d inv = _mm_loadu_pd(invDir[a]+k);
+            __m128d t0 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(lo[a]), o), inv);
+            __m128d t1 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(hi[a]), o), inv);
+            /* maxpd/minpd return the second operand when either is NaN,
+             * so as in entryDist(), a NaN leaves the range unchanged. */
+            tmin = _mm_max_pd(t0, tmin);
+            tmax = _mm_min_pd(t1, tmax);
+        }
+        mask |= _mm_movemask_pd(_mm_cmple_pd(tmin, tmax)) << k;
+    }
+#else
+    for (unsigned k=0; k<RAY_PACKET_SIZE; ++k) {
+        double tmin = 0.0;
+        double tmax = (dist[k] < 0.0) ? HUGE_VAL : dist[k];
+        for (int a=0; a<3; ++a) {
+            double t0 = (lo[a] - orig[a][k]) * invDir[a][k];
+            double t1 = (hi[a] - orig[a][k]) * invDir[a][k];
+            if (t0 > tmin) tmin = t0;
+            if (t1 < tmax) tmax = t1;
+        }
+        if (tmin <= tmax) mask |= 1 << k;
+    }
+#endif
+
+    return mask & ((1 << packet.m_count) - 1);
+}
+
+void BoundingVolumeHierarchy::closestPacket
+(const RayPacket &packet, double dist[], unsigned index[],
+ RayObject *hit[]) const
+{
+    if (m_nodes.empty()) return;
+
+    const unsigned count = packet.m_count;
+
+    /* The packet visits a node if any of its rays do.  Nodes are visited
+     * in order of distance for the first ray still active, which is a good
+     * guess for the rest, since they all travel into the same octant. */
+    unsigned stack[BVH_STACK_SIZE];
+    int      top = 0;
+    stack[top++] = 0;
+
+    double packetDist[RAY_PACKET_SIZE];
+    while (top) {
+        unsigned node = stack[--top];
+        const Node &cur = m_nodes[node];
+
+        // Which rays actually reach this node?
+        unsigned mask = packetEntry(cur.m_box, packet, dist);
+        if (!mask) continue;
+        unsigned active[RAY_PACKET_SIZE];
+        unsigned numActive = 0;
+        for (unsigned k=0; k<count; ++k) {
+            if (mask & (1 << k)) active[numActive++] = k;
+        }
+
+        if (numActive == 1) {
+            // Packet has lost coherence; carry on with just the one ray.
+            unsigned k = active[0];
+            RayObject *best = closestBelow
+                (node, *packet.m_rays[k], dist[k], index[k]);
+            if (best) hit[k] = best;
+            continue;
+        }
+
+        if (!cur.m_count) {
+            unsigned near = cur.m_first;
+            unsigned far = cur.m_first + 1;
+            unsigned k = active[0];
+            double orig[3] =
+                { packet.m_ox[k], packet.m_oy[k], packet.m_oz[k] };
+            double invDir[3] =
+                { packet.m_ix[k], packet.m_iy[k], packet.m_iz[k] };
+            double nearDist = m_nodes[near].m_box.entryDist
+                (orig, invDir, dist[k]);
+            double farDist = m_nodes[far].m_box.entryDist
+                (orig, invDir, dist[k]);
+            if ( (farDist >= 0.0) &&
+                 ((nearDist < 0.0) || (farDist < nearDist)) ) {
+                std::swap(near, far);
+            }
+            stack[top++] = far;
+            stack[top++] = near;
+            continue;
+        }
+
+        for (unsigned i=cur.m_first; i<cur.m_first+cur.m_count; ++i) {
+            m_objects[i]->intersectPacket(packet, packetDist);
+
+            for (unsigned a=0; a<numActive; ++a) {
+                unsigned k = active[a];
+                double curDist = packetDist[k];
+                if (curDist < 0.0) continue;
+                if ( (dist[k] < 0.0) || (curDist < dist[k]) ||
+                     ((curDist == dist[k]) && (m_indices[i] < index[k])) ) {
+                    hit[k] = m_objects[i];
+                    dist[k] = curDist;
+                    index[k] = m_indices[i];
+                }
+            }
+        }
+    }
+}
+
+bool BoundingVolumeHierarchy::anyHit
+(const Ray &ray, double maxDist, const RayObject *ignore) const
+{
+    if (m_nodes.empty()) return false;
+
+    double orig[3] =
+        { ray.m_endpoint.x(), ray.m_endpoint.y(), ray.m_endpoint.z() };
+    double invDir[3] =
+        { 1.0/ray.m_dir.x(), 1.0/ray.m_dir.y(), 1.0/ray.m_dir.z() };
+
+    // Order of traversal doesn't matter, so just keep nodes to visit.
+    unsigned stack[BVH_STACK_SIZE];
+    int      top = 0;
+    stack[top++] = 0;
+
+    while (top) {
+        const Node &cur = m_nodes[stack[--top]];
+        if (cur.m_box.entryDist(orig, invDir, maxDist) < 0.0) continue;
+
+        if (!cur.m_count) {
+            stack[top++] = cur.m_first;
+            stack[top++] = cur.m_first + 1;
+            continue;
+        }
+
+        double sphereDist[LEAF_SIZE + 1];
+        unsigned first = cur.m_first;
+        BaseSphere::intersectMany(ray, &m_sphereX[first],
+            &m_sphereY[first], &m_sphereZ[first], &m_sphereRSq[first],
+            cur.m_spheres, sphereDist);
+
+        for (unsigned i=first; i<first+cur.m_count; ++i) {
+            if (m_objects[i] == ignore) continue;
+            double curDist = (i < first + cur.m_spheres) ?
+                sphereDist[i - first] : m_objects[i]->intersectDist(ray);
+            if ((curDist >= 0.0) && (curDist < maxDist)) return true;
+        }
+    }
+
+    return false;
+}
+
+//! The hierarchy must find exactly what a linear search finds.
+TEST(BvhTest, MatchesLinearSearch) {
+    srand(1234);
+    vector<RayObject*> objects;
+    for (int i=0; i<500; ++i) {
+        objects.push_back(new Sphere(
+            Coord(rand()%200/10.0 - 10.0,
+                  rand()%200/10.0 - 10.0,
+                  rand()%200/10.0 - 10.0),
+            0.1 + rand()%10/10.0));
+    }
+    BoundingVolumeHierarchy bvh;
+    bvh.build(objects);
+    ASSERT_FALSE(bvh.empty());
+
+    for (int r=0; r<500; ++r) {
+        Ray ray;
+        ray.m_endpoint = Coord(rand()%300/10.0 - 15.0,
+                               rand()%300/10.0 - 15.0,
+                               rand()%300/10.0 - 15.0);
+        ray.m_dir = RayVector(rand()%200 - 100, rand()%200 - 100,
+                              rand()%200 - 100 + 0.5).unitify();
+
+        RayObject *linear = 0;
+        double linearDist = -1.0;
+        for (unsigned i=0; i<objects.size(); ++i) {
+            double d = objects[i]->intersectDist(ray);
+            if ((d >= 0.0) && (!linear || (d < linearDist))) {
+                linear = objects[i];
+                linearDist = d;
+            }
+        }
+
+        double dist = -1.0;
+        unsigned index = 0;
+        RayObject *hit = bvh.closest(ray, dist, index);
+        ASSERT_EQ(linear, hit) << "Ray " << r;
+        if (hit) {
+            ASSERT_EQ(linearDist, dist);
+            // Occlusion must agree with the closest hit on either side.
+            ASSERT_TRUE(bvh.anyHit(ray, dist*1.001, 0));
+            ASSERT_FALSE(bvh.anyHit(ray, dist*0.999, 0));
+            ASSERT_FALSE(bvh.anyHit(ray, dist, 0)) << "maxDist is exclusive";
+        } else {
+            ASSERT_FALSE(bvh.anyHit(ray, 1E6, 0));
+        }
+    }
+
+    for (unsigned i=0; i<objects.size(); ++i) delete objects[i];
+}
+
+/* A restored hierarchy finds the same hits as the one it was saved from,
+ * and one which doesn't fit its objects is refused. */
+TEST(BvhTest, Restore) {
+    srand(4321);
+    vector<RayObject*> objects;
+    for (int i=0; i<300; ++i) {
+        objects.push_back(new Sphere(
+            Coord(rand()%200/10.0 - 10.0,
+                  rand()%200/10.0 - 10.0,
+                  rand()%200/10.0 - 10.0),
+            0.1 + rand()%10/10.0));
+    }
+    BoundingVolumeHierarchy built;
+    built.build(objects);
+    vector<BoundingVolumeHierarchy::Node> nodes = built.nodes();
+    vector<unsigned> order = built.order();
+
+    BoundingVolumeHierarchy restored;
+    ASSERT_TRUE(restored.restore(objects, &nodes[0], nodes.size(),
+                                 &order[0], order.size()));
+    for (int r=0; r<300; ++r) {
+        Ray ray;
+        ray.m_endpoint = Coord(rand()%300/10.0 - 15.0,
+                               rand()%300/10.0 - 15.0,
+                               rand()%300/10.0 - 15.0);
+        ray.m_dir = RayVector(rand()%200 - 100, rand()%200 - 100,
+                              rand()%200 - 100 + 0.5).unitify();
+        double builtDist = -1.0, restoredDist = -1.0;
+        unsigned builtIndex = 0, restoredIndex = 0;
+        ASSERT_EQ(built.closest(ray, builtDist, builtIndex),
+                  restored.closest(ray, restoredDist, restoredIndex));
+        ASSERT_EQ(builtDist, restoredDist);
+    }
+
+    // An object outside its leaf
+    unsigned leaf = nodes.size() - 1;
+    nodes[leaf].m_box.m_max[0] = nodes[leaf].m_box.m_min[0];
+    ASSERT_FALSE(restored.restore(objects, &nodes[0], nodes.size(),
+                                  &order[0], order.size()));
+    ASSERT_TRUE(restored.empty());
+    nodes = built.nodes();
+    // An object missing, and one twice
+    order[1] = order[0];
+    ASSERT_FALSE(restored.restore(objects, &nodes[0], nodes.size(),
+                                  &order[0], order.size()));
+    order = built.order();
+    // A child before its parent
+    nodes[0].m_first = 0;
+    ASSERT_FALSE(restored.restore(objects, &nodes[0], nodes.size(),
+                                  &order[0], order.size()));
+
+    for (unsigned i=0; i<objects.size(); ++i) delete objects[i];
+}
@@ -0,0 +1,187 @@
+/******************************************************************************
+ * bvh.h
+ * Copyright 2011 Iain Peet
+ *
+ * Provides a bounding volume hierarchy, which lets the World find the
+ * closest object along a ray without testing every object it contains.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <vector>
+
+#include "trace/geom.h"
+
+class Ray;
+class RayObject;
+class RayPacket;
+struct BvhBuildItem;
+
+/** An axis-aligned box.  Stored as raw doubles rather than RayVectors,
+ *  since the box tests are in the innermost tracing loop and don't need
+ *  the cached vector lengths. */
+class BoundingBox {
+public:
+    double m_min[3];
+    double m_max[3];
+
+public:
+    //! Creates an empty box, which contains nothing.
+    BoundingBox();
+    //! Creates a box spanning the two given corners.
+    BoundingBox(const Coord &min, const Coord &max);
+
+    //! Grow this box to contain another.
+    void expand(const BoundingBox &other);
+    //! Grow this box to contain a point.
+    void expand(const double point[3]);
+
+    //! Centre of the box along the given axis.
+    double centre(int axis) const { return 0.5*(m_min[axis] + m_max[axis]); }
+    //! Index of the axis along which this box is longest.
+    int longestAxis() const;
+
+    /** Find the distance along a ray at which it enters this box.
+     *  @param orig    The ray endpoint.
+     *  @param invDir  Reciprocal of each component of the ray direction.
+     *  @param maxDist Intersections further than this are ignored.
+     *  @return        The entry distance (0 if orig is inside the box).
+     *                 -1.0 if the ray misses the box within maxDist. */
+    double entryDist(const double orig[3], const double invDir[3],
+                     double maxDist) const;
+};
+
+/** A binary tree of bounding boxes over a fixed set of objects.
+ *  Nodes are kept in one flat array, with the children of an interior
+ *  node stored adjacently, so traversal does no pointer chasing.
+ *  The hierarchy does not own its objects. */
+class BoundingVolumeHierarchy {
+public:
+    /** A node of the tree.  Public so that a built tree can be saved with
+     *  its objects, and restored without building it again. */
+    struct Node {
+        BoundingBox m_box;
+        /* For leaves, the index of the first object in m_objects.
+         * For interior nodes, the index of the first child in m_nodes. */
+        unsigned    m_first;
+        // Number of objects in a leaf.  0 for interior nodes.
+        unsigned    m_count;
+        /* Number of the leaf's objects which are plain spheres.  These
+         * come first, and are tested straight from the sphere arrays. */
+        unsigned    m_spheres;
+    };
+
+private:
+    std::vector<Node>       m_nodes;
+    // Objects, ordered so that each leaf refers to a contiguous run.
+    std::vector<RayObject*> m_objects;
+    // Position of each object in the list it was built from.
+    std::vector<unsigned>   m_indices;
+    /* Centre and squared radius of each object in m_objects which is a
+     * sphere, one array per component, so that a leaf's spheres can be
+     * tested against a ray together.  Entries for other objects are
+     * unused.  There is one extra entry at the end, as padding for SSE2. */
+    std::vector<double>     m_sphereX;
+    std::vector<double>     m_sphereY;
+    std::vector<double>     m_sphereZ;
+    std::vector<double>     m_sphereRSq;
+
+    // Leaves will be split until they contain at most this many objects.
+    static const unsigned LEAF_SIZE = 4;
+
+private:
+    /* Fill in the node at index 'node' to cover items [begin, end),
+     * splitting recursively until leaves are small enough. */
+    void buildNode(std::vector<BvhBuildItem> &items,
+                   unsigned begin, unsigned end, unsigned node);
+
+    /* Fill in the sphere arrays from m_objects. */
+    void fillSpheres();
+
+    /* closest(), searching only the subtree below the given node. */
+    RayObject* closestBelow(unsigned node, const Ray &ray,
+                            double &dist, unsigned &index) const;
+
+public:
+    BoundingVolumeHierarchy() :
+        m_nodes(), m_objects(), m_indices(),
+        m_sphereX(), m_sphereY(), m_sphereZ(), m_sphereRSq()
+        { /* n/a */ }
+
+    /** Build the hierarchy over the given objects.  Objects which report
+     *  no bounds are skipped; the caller must test them some other way.
+     *  Any previous hierarchy is discarded. */
+    void build(const std::vector<RayObject*> &objects);
+
+    /** Restore a hierarchy saved from nodes() and order(), over the same
+     *  objects it was built from.  This is much quicker than build(), but
+     *  the tree is still checked against the objects: every bounded object
+     *  must be in exactly one leaf, within the box of that leaf and of
+     *  each node above it.
+     *  @return false if the tree doesn't fit the objects, in which case
+     *          the hierarchy is left empty. */
+    bool restore(const std::vector<RayObject*> &objects,
+                 const Node nodes[], unsigned numNodes,
+                 const unsigned order[], unsigned numOrder);
+
+    //! Discard the hierarchy.
+    void clear();
+
+    bool empty() const { return m_nodes.empty(); }
+
+    //! The nodes of the tree, root first.
+    const std::vector<Node>& nodes() const { return m_nodes; }
+    /** Position of each object of the tree in the list it was built from,
+     *  in the order the leaves refer to them. */
+    const std::vector<unsigned>& order() const { return m_indices; }
+
+    /** Find the closest object intersecting the ray.  Where two objects are
+     *  at exactly the same distance, the one which came first in the list
+     *  the hierarchy was built from wins, just as for a linear search.
+     *  @param ray      The ray to intersect.
+     *  @param dist     In: only hits closer than this are considered,
+     *                  (negative for no limit).  Out: distance to the hit.
+     *  @param index    In/out: index of the current best hit, used to break
+     *                  ties.  Out: index of the object hit.
+     *  @return         The closest object, or 0 if nothing closer was hit. */
+    RayObject* closest(const Ray &ray, double &dist, unsigned &index) const;
+
+    /** Find the closest object intersecting each ray of a packet.  This is
+     *  the same search as closest(), with the same results, but the world
+     *  is searched once for the whole packet.  Where only one ray of the
+     *  packet reaches part of the tree, it searches that part on its own.
+     *  @param packet   The rays to intersect.
+     *  @param dist     Per ray, as for closest().
+     *  @param index    Per ray, as for closest().
+     *  @param hit      Per ray, set to the object hit, if one is closer than
+     *                  dist was on the way in.  Untouched otherwise. */
+    void closestPacket(const RayPacket &packet, double dist[],
+                       unsigned index[], RayObject *hit[]) const;
+
+    /** Check whether any object intersects the ray closer than maxDist.
+     *  Stops at the first such object found, in no particular order.
+     *  @param ray      The ray to intersect.
+     *  @param maxDist  Hits at or beyond this distance are ignored.
+     *  @param ignore   An object which should never count as a hit. (may be 0)
+     *  @return         true if some object was hit. */
+    bool anyHit(const Ray &ray, double maxDist,
+                const RayObject *ignore) const;
+};
+
+#endif //BVH_H_
@@ -0,0 +1,141 @@
+/******************************************************************************
+ * gbuffer.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Provides GBuffer, which records the primary hits of a view for relighting.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <memory>
+#include <gtest/gtest.h>
+
+#include "gbuffer.h"
+
+#include "image/rayImage.h"
+#include "util/parallel.h"
+#include "util/trace.h"
+#include "light_sources.h"
+#include "ray.h"
+#include "sphere.h"
+#include "view.h"
+#include "world.h"
+
+static trc_ctl_t gbufferTrace = {
+    TRC_DFL_LVL,
+    "GBUFFER",
+    TRC_STDOUT
+};
+#define TRACE(level, args...) \
+    TRC_PRINTF(&gbufferTrace,level,1,args)
+
+void GBuffer::reset(const RayImage &image, int depth)
+{
+    m_width = image.width();
+    m_height = image.height();
+    m_top = image.top();
+    m_rows = image.rows();
+    m_depth = depth;
+    m_hits.assign((size_t)(m_width) * m_rows, PrimaryHit());
+}
+
+/** Hands out rows of a G-buffer to be shaded again */
+class RelightTasks : public ParallelTasks {
+private:
+    const GBuffer &m_gbuffer;
+    RayImage      &m_image;
+    const World   &m_world;
+
+public:
+    RelightTasks(const GBuffer &gbuffer, RayImage &image,
+                 const World &world) :
+        m_gbuffer(gbuffer), m_image(image), m_world(world)
+        { /* n/a */ }
+
+    virtual void run(unsigned task, unsigned thread) {
+        unsigned row = m_gbuffer.top() + task;
+        for (unsigned col=0; col < m_gbuffer.width(); ++col) {
+            Ray ray (m_gbuffer.depth());
+            m_world.relight(ray, m_gbuffer.at(row, col));
+            m_image.set(row, col, ray.m_colour);
+        }
+    }
+};
+
+void GBuffer::relight(RayImage &image, const World &world,
+                      unsigned threads) const
+{
+    TRACE(TRC_STAT, "Relighting %u x %u pixels.\n", m_width, m_rows);
+    RelightTasks tasks (*this, image, world);
+    runParallel(tasks, m_rows, threads);
+}
+
+/* Relighting after changing lights and surface colours must give
+ * exactly the image a full trace would. */
+TEST(GBufferTest, RelightMatchesTrace) {
+    World world;
+    world.m_globalDiffuse.set(0.05, 0.05, 0.15);
+    Sphere *sph = world.addSphere(Coord(0,0,0), 1.0,
+        RayColour(0.1, 0.25, 1.0), RayColour(0.5, 0.5, 0.5));
+    world.addSphere(Coord(0.5,1.5,1.5), 1.5,
+        RayColour(1.0, 1.0, 0.1), RayColour(1.0, 1.0, 0.2));
+    SphereSource *light = new SphereSource(
+        RayVector(1.5,-2.5,1.5), 0.125, RayColour(90.0,90.0,90.0));
+    std::auto_ptr<RayObject> owned (light);
+    world.addObject(owned);
+    world.finalize();
+
+    ParallelView view;
+    view.m_origin = Coord(2.0,-2,2);
+    view.m_xVec = RayVector(0,4.5,0);
+    view.m_yVec = RayVector(0,0,-3);
+
+    GBuffer gbuffer;
+    RayImage first (33, 21);
+    view.render(first, world, 5, 2, 8, &gbuffer);
+    ASSERT_EQ(33u, gbuffer.width());
+    ASSERT_EQ(21u, gbuffer.rows());
+
+    // Primary hits of spheres have outward unit normals
+    unsigned hits = 0;
+    for (unsigned i=0; i<gbuffer.height(); ++i) {
+        for (unsigned j=0; j<gbuffer.width(); ++j) {
+            const PrimaryHit &hit = gbuffer.at(i, j);
+            if (!hit.m_object) continue;
+            ++hits;
+            ASSERT_NEAR(1.0, hit.m_normal.length(), 1E-9);
+            ASSERT_LT(hit.m_normal.dot(hit.m_dir), 1E-9);
+        }
+    }
+    ASSERT_GT(hits, 0u);
+
+    light->setIntensity(RayColour(40.0, 60.0, 120.0));
+    light->setPosition(RayVector(1.0,-2.0,2.5));
+    sph->m_diffusivity.set(0.8, 0.1, 0.1);
+    sph->m_reflectivity.set(0.1, 0.1, 0.1);
+
+    RayImage traced (33, 21);
+    RayImage relit (33, 21);
+    view.render(traced, world, 5, 1, 8);
+    gbuffer.relight(relit, world, 3);
+    for (unsigned i=0; i<traced.height(); ++i) {
+        for (unsigned j=0; j<traced.width(); ++j) {
+            ASSERT_EQ(traced.at(i,j).r, relit.at(i,j).r);
+            ASSERT_EQ(traced.at(i,j).g, relit.at(i,j).g);
+            ASSERT_EQ(traced.at(i,j).b, relit.at(i,j).b);
+        }
+    }
+}
@@ -0,0 +1,103 @@
+/******************************************************************************
+ * gbuffer.h
+ * Copyright 2011 Iain Peet
+ *
+ * Provides GBuffer, which records where the primary ray of each pixel of a
+ * view hit the world, so that the view can be shaded again without
+ * searching the world for those hits.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef GBUFFER_H_
+#define GBUFFER_H_
+
+#include <vector>
+
+#include "trace/geom.h"
+
+class RayImage;
+class RayObject;
+class World;
+
+/** Where a primary ray hit the world. */
+class PrimaryHit {
+public:
+    //! The object hit, or 0 if the ray hit nothing
+    const RayObject *m_object;
+    //! The ray which was traced
+    Coord      m_endpoint;
+    RayVector  m_dir;
+    //! Distance along the ray to the hit, or -1.0 if it hit nothing
+    double     m_dist;
+    //! Surface normal at the hit, if the object has one.  Points outward.
+    RayVector  m_normal;
+
+    PrimaryHit() : m_object(0), m_endpoint(), m_dir(), m_dist(-1.0),
+        m_normal()
+        { /* n/a */ }
+
+    //! Where the ray hit the object
+    Coord point() const { return m_endpoint + m_dir * m_dist; }
+};
+
+/** The primary hits of every pixel of a RayImage (or of the band of rows
+ *  it holds), from RayView::render().  As long as nothing which moves a
+ *  primary hit changes -- the view, or the shape or position of a visible
+ *  object -- the image can be shaded again with relight() for new light
+ *  intensities or positions, or new surface colours, without any primary
+ *  intersection tests.  Shadow and reflected rays are still traced. */
+class GBuffer {
+private:
+    unsigned m_width;
+    unsigned m_height;
+    unsigned m_top;
+    unsigned m_rows;
+    // Depth limit the primary rays were traced with
+    int      m_depth;
+    // Hits of the rows held, row by row
+    std::vector<PrimaryHit> m_hits;
+
+public:
+    GBuffer() : m_width(0), m_height(0), m_top(0), m_rows(0), m_depth(0),
+        m_hits()
+        { /* n/a */ }
+
+    /* Make room for the hits of the pixels held by image, which is to
+     * be traced with the given depth limit.  Any hits are forgotten. */
+    void reset(const RayImage &image, int depth);
+
+    unsigned width() const {return m_width;}
+    unsigned height() const {return m_height;}
+    unsigned top() const {return m_top;}
+    unsigned rows() const {return m_rows;}
+    int depth() const {return m_depth;}
+
+    //! Rows are numbered as in the whole image, as for RayImage.
+    PrimaryHit& at(unsigned row, unsigned col)
+        { return m_hits[(row - m_top)*m_width + col]; }
+    const PrimaryHit& at(unsigned row, unsigned col) const
+        { return m_hits[(row - m_top)*m_width + col]; }
+
+    /* Shade every pixel again from its primary hit.  The result is
+     * exactly what tracing the view would give, given the changes
+     * allowed above.  image must have the same size and band as this.
+     * @param threads  Number of threads to shade with, 0 for one per CPU */
+    void relight(RayImage &image, const World &world,
+                 unsigned threads=1) const;
+};
+
+#endif //GBUFFER_H_
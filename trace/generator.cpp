@@ -0,0 +1,284 @@
+/******************************************************************************
+ * generator.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Provides SceneGenerator, which makes large scenes procedurally, for
+ * measuring how tracing scales with the size and kind of scene.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <memory>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "generator.h"
+
+#include "util/hash.h"
+#include "util/trace.h"
+#include "light_sources.h"
+#include "view.h"
+#include "world.h"
+
+using namespace std;
+
+static trc_ctl_t generatorTrace = {
+    TRC_DFL_LVL,
+    "GENERATOR",
+    TRC_STDOUT
+};
+#define TRACE(level, args...) \
+    TRC_PRINTF(&generatorTrace,level,1,args)
+
+/** splitmix64.  Tiny, fast, and plenty random enough to place spheres;
+ *  chosen over rand() because its sequence is the same everywhere. */
+class SceneRandom {
+private:
+    uint64_t m_state;
+
+public:
+    SceneRandom(uint64_t seed) : m_state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (m_state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    //! Uniform in [lo, hi), from the top 53 bits
+    double uniform(double lo, double hi) {
+        return lo + (hi - lo) * ((next() >> 11) * (1.0 / 9007199254740992.0));
+    }
+
+    //! Roughly normal, with mean 0 and deviation 1
+    double normal() {
+        return 2.0 * (uniform(0, 1) + uniform(0, 1) + uniform(0, 1) - 1.5);
+    }
+
+    RayColour colour(double lo, double hi) {
+        double r = uniform(lo, hi);
+        double g = uniform(lo, hi);
+        double b = uniform(lo, hi);
+        return RayColour(r, g, b);
+    }
+};
+
+/* Smallest k with k*k*k >= n.  In integers, so that the size of a scene
+ * doesn't depend on the platform's pow(). */
+static unsigned cubeRoot(unsigned n)
+{
+    unsigned k = 1;
+    while ((uint64_t)(k)*k*k < n) ++k;
+    return k;
+}
+
+void WorldBuilder::colours(const RayColour &defaultColour,
+                           const RayColour &globalDiffuse)
+{
+    m_world.m_defaultColour = defaultColour;
+    m_world.m_globalDiffuse = globalDiffuse;
+}
+
+void WorldBuilder::sphere(const Coord &origin, double radius,
+                          const RayColour &diffusivity,
+                          const RayColour &reflectivity)
+{
+    m_world.addSphere(origin, radius, diffusivity, reflectivity);
+}
+
+void WorldBuilder::light(const Coord &origin, double radius,
+                         const RayColour &intensity)
+{
+    auto_ptr<RayObject> light;
+    if (radius > 0.0) {
+        light.reset(new SphereSource(origin, radius, intensity));
+    } else {
+        light.reset(new PointSource(origin, intensity));
+    }
+    m_world.addObject(light);
+}
+
+static const char *kindNames[] = { "field", "clusters", "mirrors", "lights" };
+
+const char* SceneGenerator::kindName(Kind kind)
+{
+    return kindNames[kind];
+}
+
+bool SceneGenerator::kindFromName(const std::string &name, Kind &kind)
+{
+    for (unsigned i=0; i < sizeof(kindNames)/sizeof(kindNames[0]); ++i) {
+        if (name == kindNames[i]) {
+            kind = (Kind)(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+double SceneGenerator::side() const
+{
+    return 4.0 * cubeRoot(m_objects);
+}
+
+void SceneGenerator::generate(SceneBuilder &builder) const
+{
+    SceneRandom random (m_seed);
+    double s = side();
+    builder.colours(RayColour(0, 0, 0), RayColour(0.05, 0.05, 0.1));
+
+    /* Lights first.  Two big ones out in front of the cube, between it
+     * and the view, bright enough to light its far side; or, for LIGHTS,
+     * small ones all through it. */
+    unsigned lights = (m_objects < 2) ? m_objects : 2;
+    if (m_kind == LIGHTS) lights = (m_objects > 8) ? m_objects/8 : 1;
+    if (lights > m_objects) lights = m_objects;
+    for (unsigned i=0; i < lights; ++i) {
+        if (m_kind == LIGHTS) {
+            Coord origin (random.uniform(0, s), random.uniform(0, s),
+                          random.uniform(0, s));
+            builder.light(origin, (i % 2) ? 0.1 : 0.0, RayColour(50, 50, 50));
+        } else if (i == 0) {
+            builder.light(Coord(-0.3*s, 0.3*s, 0.2*s), 0.0,
+                          RayColour(6*s*s, 6*s*s, 6*s*s));
+        } else {
+            builder.light(Coord(-0.3*s, 0.7*s, 0.6*s), 0.5,
+                          RayColour(4*s*s, 4*s*s, 5*s*s));
+        }
+    }
+
+    unsigned spheres = m_objects - lights;
+    vector<Coord> clusters;
+    double spread = 0.0;
+    if (m_kind == CLUSTERS) {
+        clusters.resize(cubeRoot(spheres));
+        for (unsigned i=0; i < clusters.size(); ++i) {
+            clusters[i] = Coord(random.uniform(0.1*s, 0.9*s),
+                                random.uniform(0.1*s, 0.9*s),
+                                random.uniform(0.1*s, 0.9*s));
+        }
+        // Packed about as densely as a field of spheres a quarter the size
+        spread = 0.5 * cubeRoot(spheres / clusters.size() + 1);
+    }
+
+    for (unsigned i=0; i < spheres; ++i) {
+        switch (m_kind) {
+        case CLUSTERS: {
+            const Coord &centre = clusters[random.next() % clusters.size()];
+            Coord origin (centre.x() + spread*random.normal(),
+                          centre.y() + spread*random.normal(),
+                          centre.z() + spread*random.normal());
+            double radius = random.uniform(0.1, 0.3);
+            RayColour diffusivity = random.colour(0.2, 0.9);
+            RayColour reflectivity = random.colour(0.0, 0.3);
+            builder.sphere(origin, radius, diffusivity, reflectivity);
+            break;
+        }
+        case MIRRORS: {
+            Coord origin (random.uniform(0, s), random.uniform(0, s),
+                          random.uniform(0, s));
+            double radius = random.uniform(0.2, 1.0);
+            RayColour diffusivity = random.colour(0.02, 0.1);
+            RayColour reflectivity = random.colour(0.8, 0.95);
+            builder.sphere(origin, radius, diffusivity, reflectivity);
+            break;
+        }
+        default: {
+            Coord origin (random.uniform(0, s), random.uniform(0, s),
+                          random.uniform(0, s));
+            double radius = random.uniform(0.2, 1.0);
+            RayColour diffusivity = random.colour(0.2, 0.9);
+            RayColour reflectivity = random.colour(0.0, 0.3);
+            builder.sphere(origin, radius, diffusivity, reflectivity);
+            break;
+        }
+        }
+    }
+
+    TRACE(TRC_INFO, "Generated %s scene: %u spheres, %u lights.\n",
+          kindName(m_kind), spheres, lights);
+}
+
+void SceneGenerator::generate(World &world) const
+{
+    WorldBuilder builder (world);
+    generate(builder);
+    world.finalize();
+}
+
+/* The view sits in front of the cube's x=0 face, looking along +x, with
+ * the whole face in a 4:3 image. */
+void SceneGenerator::view(AngleView &view) const
+{
+    double s = side();
+    view.m_origin = Coord(-0.6*s, 0.5*s, 0.5*s);
+    view.m_xvec = RayVector(0, 1, 0);
+    view.m_yvec = RayVector(0, 0, 1);
+    view.m_xFov = 1.4;
+    view.m_yFov = 1.05;
+}
+
+//! Hash of a generated world
+static uint64_t generatedHash(SceneGenerator::Kind kind, unsigned objects,
+                              uint64_t seed)
+{
+    World world;
+    SceneGenerator(kind, objects, seed).generate(world);
+    Hasher hasher;
+    world.hash(hasher);
+    return hasher.value();
+}
+
+/* Each kind of scene has the number of objects asked for, and the same
+ * settings always give the same scene. */
+TEST(SceneGeneratorTest, Deterministic) {
+    const unsigned sizes[] = { 1, 10, 1000 };
+    for (unsigned k=0; k < 4; ++k) {
+        SceneGenerator::Kind kind = (SceneGenerator::Kind)(k);
+        SceneGenerator::Kind named;
+        ASSERT_TRUE(SceneGenerator::kindFromName
+            (SceneGenerator::kindName(kind), named));
+        ASSERT_EQ(kind, named);
+
+        for (unsigned s=0; s < sizeof(sizes)/sizeof(sizes[0]); ++s) {
+            World world;
+            SceneGenerator(kind, sizes[s], 7).generate(world);
+            ASSERT_EQ(sizes[s], world.objects().size());
+            ASSERT_FALSE(world.lights().empty());
+        }
+        ASSERT_EQ(generatedHash(kind, 1000, 7), generatedHash(kind, 1000, 7));
+        ASSERT_NE(generatedHash(kind, 1000, 7), generatedHash(kind, 1000, 8));
+    }
+
+    World lit;
+    SceneGenerator(SceneGenerator::LIGHTS, 800).generate(lit);
+    ASSERT_EQ(100u, lit.lights().size());
+
+    /* Fixed scenes of each kind, so that a change to what is generated
+     * (and so to every benchmark made with it) doesn't go unnoticed.  If
+     * a change is meant, update these, and expect benchmark results from
+     * before it to differ. */
+    const uint64_t pinned[] = {
+        0x86D20193BF555FD3ULL, 0x602F1CB4C0083DE5ULL,
+        0xE2425A86CCAA8275ULL, 0x37022DE25E1BADE8ULL
+    };
+    for (unsigned k=0; k < 4; ++k) {
+        SceneGenerator::Kind kind = (SceneGenerator::Kind)(k);
+        EXPECT_EQ(pinned[k], generatedHash(kind, 1000, 7))
+            << SceneGenerator::kindName(kind);
+    }
+}
@@ -0,0 +1,120 @@
+/******************************************************************************
+ * generator.h
+ * Copyright 2011 Iain Peet
+ *
+ * Provides SceneGenerator, which makes large scenes procedurally, for
+ * measuring how tracing scales with the size and kind of scene.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef GENERATOR_H_
+#define GENERATOR_H_
+
+#include <string>
+#include <stdint.h>
+
+#include "image/colour.h"
+#include "trace/geom.h"
+
+class AngleView;
+class World;
+
+/** Receives the objects of a generated scene, one at a time, so that a
+ *  scene can be built into a World or written out as it's generated. */
+class SceneBuilder {
+public:
+    virtual ~SceneBuilder() {}
+
+    //! The world's colours; see World.  Given before any object.
+    virtual void colours(const RayColour &defaultColour,
+                         const RayColour &globalDiffuse) = 0;
+    virtual void sphere(const Coord &origin, double radius,
+                        const RayColour &diffusivity,
+                        const RayColour &reflectivity) = 0;
+    /** A light source.  A radius of 0 gives a point source, otherwise a
+     *  visible sphere source. */
+    virtual void light(const Coord &origin, double radius,
+                       const RayColour &intensity) = 0;
+};
+
+/** Adds generated objects straight to a world. */
+class WorldBuilder : public SceneBuilder {
+private:
+    World &m_world;
+
+public:
+    WorldBuilder(World &world) : m_world(world) {}
+
+    virtual void colours(const RayColour &defaultColour,
+                         const RayColour &globalDiffuse);
+    virtual void sphere(const Coord &origin, double radius,
+                        const RayColour &diffusivity,
+                        const RayColour &reflectivity);
+    virtual void light(const Coord &origin, double radius,
+                       const RayColour &intensity);
+};
+
+/** Makes scenes of any size, from a handful of objects to tens of
+ *  millions, for benchmarks.  The objects fill a cube whose side grows
+ *  with the cube root of their number, so the density, and so the work
+ *  per ray, stays about the same as scenes grow.  A scene depends only
+ *  on its kind, size and seed: the random numbers come from a generator
+ *  of our own, not rand(), so they are the same on every platform. */
+class SceneGenerator {
+public:
+    enum Kind {
+        //! Spheres scattered evenly, mostly diffuse.  Two lights.
+        FIELD,
+        //! Small spheres in dense clumps with empty space between.
+        CLUSTERS,
+        //! As FIELD, but the spheres are near-perfect mirrors.
+        MIRRORS,
+        //! As FIELD, but one object in eight is a small light.
+        LIGHTS
+    };
+
+    Kind     m_kind;
+    //! Number of objects, lights included.
+    unsigned m_objects;
+    uint64_t m_seed;
+
+public:
+    SceneGenerator(Kind kind = FIELD, unsigned objects = 1000,
+                   uint64_t seed = 1) :
+        m_kind(kind), m_objects(objects), m_seed(seed)
+        { /* n/a */ }
+
+    //! Name of a kind, as used by kindFromName()
+    static const char* kindName(Kind kind);
+    /* Look up a kind by its name.
+     * @return false if there's no such kind */
+    static bool kindFromName(const std::string &name, Kind &kind);
+
+    //! Length of the side of the cube the objects fill, from the origin.
+    double side() const;
+
+    /** Generate the scene's objects. */
+    void generate(SceneBuilder &builder) const;
+
+    /** Generate the scene into a world, and finalize it. */
+    void generate(World &world) const;
+
+    /** Set up a view from outside the cube, looking across it. */
+    void view(AngleView &view) const;
+};
+
+#endif //GENERATOR_H_
@@ -33,7 +33,7 @@ static trc_ctl_t geomTrace = {
     TRC_STDOUT
 };
 #define TRACE(level, args...) \
-    trc_printf(&geomTrace,level,1,args)
+    TRC_PRINTF(&geomTrace,level,1,args)
 
 //! Assignment
 RayVector& RayVector::operator=(const RayVector& other)
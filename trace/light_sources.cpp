@@ -22,6 +22,8 @@
 
 #include <cmath>
 #include <iostream>
+#include <memory>
+#include <gtest/gtest.h>
 
 #include "trace/light_sources.h"
 #include "trace/ray.h"
@@ -29,7 +31,7 @@
 
 using namespace std;
 
-Lighting PointSource::lightingAt(Coord &point, World &world )
+Lighting PointSource::lightingAt(const Coord &point, const World &world) const
 {
     Ray lightRay;
     RayVector toHere = m_origin - point;
@@ -38,23 +40,17 @@ Lighting PointSource::lightingAt(Coord &point, World &world )
     lightRay.m_dir.unitify();
     lightRay.nudge();
 
-    RayObject *obj = world.intersect(lightRay);
-
     Lighting result;
     result.m_dir.set(1,0,0); // want nonzero vector incase somebody tries to math it
     result.m_intensity.set(0,0,0);
 
-    // If an intersection was found and is closer than this light...
-    if( obj && (lightRay.m_intersectDist < toHere.length() ) ) {
-        if( dynamic_cast<RayObject*>(this) != obj ) {
-            /* Some entities will be both lights and objects, and will want to 
-             * inherit this functionality.  This check is in place to make sure
-             * that a point/light object does not obscure itself.  dynamic_cast
-             * retrieves the correct pointer for comparison for multiply
-             * inherited class, and zero if this is not an object.  */
-            return result;
-        }
-    } 
+    /* Some entities will be both lights and objects, and will want to 
+     * inherit this functionality.  Such a light must not obscure itself,
+     * so it is excluded from the occlusion search. */
+    if (world.occluded(lightRay.m_endpoint, lightRay.m_dir, toHere.length(),
+                       this)) {
+        return result;
+    }
 
     /* Now, calculate the decrease in intensity due to distance
      * (Calculation comes from surface area of a sphere) */
@@ -65,9 +61,26 @@ Lighting PointSource::lightingAt(Coord &point, World &world )
     return result;
 }
 
-bool SphereSource::colour(Ray &inbound, World &world)
+bool SphereSource::colour(Ray &inbound, const World &world) const
 {
     inbound.m_colour = m_intensity;
     return true;
 }
 
+//! Only emitters should end up in the World's light list.
+TEST(LightSourceTest, LightRegistry) {
+    World world;
+    auto_ptr<RayObject> sph (new Sphere(Coord(0,0,0), 1.0));
+    world.addObject(sph);
+    auto_ptr<RayObject> point (
+        new PointSource(Coord(0,5,0), RayColour(1,1,1)));
+    world.addObject(point);
+    auto_ptr<RayObject> sphSrc (
+        new SphereSource(Coord(5,0,0), 0.5, RayColour(1,1,1)));
+    world.addObject(sphSrc);
+
+    ASSERT_EQ(3u, world.objects().size());
+    ASSERT_EQ(2u, world.lights().size());
+    ASSERT_EQ(world.objects()[1], world.lights()[0]);
+    ASSERT_EQ(world.objects()[2], world.lights()[1]);
+}
@@ -37,7 +37,19 @@ public:
         m_intensity(intensity), m_origin(origin)
         {}
 
-    virtual Lighting lightingAt(Coord &point, World &world);
+    virtual Lighting lightingAt(const Coord &point, const World &world) const;
+
+    /* Change the light given off.  Moving the point of a SphereSource
+     * doesn't move its visible sphere. */
+    void setIntensity(const RayColour &intensity) { m_intensity = intensity; }
+    void setPosition(const RayVector &origin) { m_origin = origin; }
+    const RayColour& intensity() const { return m_intensity; }
+    const RayVector& position() const { return m_origin; }
+
+    virtual void hash(Hasher &hasher) const {
+        hasher.addXYZ(m_origin);
+        hasher.addRGB(m_intensity);
+    }
 };
 
 /** A visible, spherical light source.  Acts as a point source, but
@@ -49,12 +61,27 @@ public:
         PointSource(origin, intensity)
         {}
 
-    virtual bool colour(Ray &inbound, World &world);
+    virtual bool colour(Ray &inbound, const World &world) const;
 
-    virtual double intersectDist(Ray &inbound)
+    virtual double intersectDist(const Ray &inbound) const
         { return BaseSphere::intersectDist(inbound); }
-    virtual Lighting lightingAt(Coord &point, World &world)
+    virtual void intersectPacket(const RayPacket &packet, double dist[]) const
+        { BaseSphere::intersectPacket(packet, dist); }
+    virtual Lighting lightingAt(const Coord &point, const World &world) const
         { return PointSource::lightingAt(point, world); }
+    virtual bool emitsLight() const { return true; }
+    virtual bool sphere(Coord &centre, double &radius) const {
+        centre = BaseSphere::m_origin;
+        radius = m_radius;
+        return true;
+    }
+    virtual void hash(Hasher &hasher) const {
+        PointSource::hash(hasher);
+        hasher.addXYZ(BaseSphere::m_origin);
+        hasher.add(m_radius);
+    }
+    virtual void hashGeometry(Hasher &hasher) const
+        { BaseSphere::hashGeometry(hasher); }
 
 };
 
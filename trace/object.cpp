@@ -28,6 +28,7 @@
 
 #include "util/trace.h"
 #include "lighting.h"
+#include "packet.h"
 #include "ray.h"
 #include "world.h"
 
@@ -37,6 +38,12 @@ static trc_ctl_t rayObjectTrc = {
     TRC_DFL_PRINT
 };
 #define TRACE(level, args...) \
-    trc_printf(&rayObjectTrc,(level),1,args)
-
+    TRC_PRINTF(&rayObjectTrc,(level),1,args)
 
+//! Intersect a packet one ray at a time
+void RayObject::intersectPacket(const RayPacket &packet, double dist[]) const
+{
+    for (unsigned k=0; k < packet.m_count; ++k) {
+        dist[k] = intersectDist(*packet.m_rays[k]);
+    }
+}
@@ -32,8 +32,11 @@
 #include "image/colour.h"
 #include "trace/geom.h"
 #include "trace/lighting.h"
+#include "util/hash.h"
 
+class BoundingBox;
 class Ray;
+class RayPacket;
 class World;
 
 /** Abstract base for any objects within the world which effect
@@ -41,41 +44,95 @@ class World;
  *  objects which affect lighting conditions. */
 class RayObject {
 public:
+    virtual ~RayObject() {}
+
     /** Determine this object's contribution to lighting at a 
      *  given point in the world.
      *  @param  point The point where lighting should be evaluated 
      *  @return The intensity of light at the point */
-    virtual Lighting lightingAt(Coord &point, World &world) = 0;
+    virtual Lighting lightingAt
+        (const Coord &point, const World &world) const = 0;
+
+    /** Whether lightingAt() can ever return any light.  Objects which
+     *  emit light are kept in a separate list by the World, so that
+     *  shading only has to consult those. */
+    virtual bool emitsLight() const { return true; }
 
     /** Determine the distance from the ray's origin to the
      *  (nearest) intersection of the ray with this object 
      *  @param inbound The ray whose interesect distance is reauired. 
      *  @return        The intersect distance, if the ray intersects.
      *                 -1.0 If the ray does not intersect. */
-    virtual double intersectDist(Ray &inbound) = 0;
+    virtual double intersectDist(const Ray &inbound) const = 0;
+
+    /** Determine the intersect distance for every ray in a packet at once.
+     *  By default, this just calls intersectDist for each ray.
+     *  @param packet The rays to intersect.
+     *  @param dist   Set to the intersect distance of each ray in the packet,
+     *                as for intersectDist.  Has RAY_PACKET_SIZE entries. */
+    virtual void intersectPacket(const RayPacket &packet, double dist[]) const;
+
+    /** Find an axis-aligned box containing every point at which this
+     *  object may intersect a ray.  Objects which are not bounded are
+     *  tested against every ray.
+     *  @param box  Set to the bounds of this object, if it has any.
+     *  @return     true if box was set, false if this object is unbounded */
+    virtual bool bounds(BoundingBox &box) const { return false; }
 
+    /** If this object intersects rays exactly as a plain sphere would, get
+     *  that sphere.  Spheres can be kept together and tested against a ray
+     *  many at a time, rather than through intersectDist.
+     *  @param centre  Set to the centre of the sphere, if this is one.
+     *  @param radius  Set to the radius of the sphere, if this is one.
+     *  @return        true if this object is a sphere. */
+    virtual bool sphere(Coord &centre, double &radius) const { return false; }
+
+    /** Get the outward surface normal of this object at a point on its
+     *  surface, where a ray hit it.
+     *  @param point   The point on the surface.
+     *  @param normal  Set to the unit normal there, if this object has one.
+     *  @return        false if this object has no surface normal. */
+    virtual bool normalAt(const Coord &point, RayVector &normal) const
+        { return false; }
    
     /* Determine the colour of a given ray.
      * @param inbound The ray to colour.
      * @param world   The world in which this object exists.  
      * @return        true if inbound intersects and has been coloured.
      *                false if inbound does not actally intersect */
-    virtual bool colour(Ray &inbound, World &world) = 0;
+    virtual bool colour(Ray &inbound, const World &world) const = 0;
+
+    /* Add everything which affects how this object looks to a hash, so
+     * that changes to a scene can be noticed.  Objects which don't
+     * override this are only told apart by address, so changes to them
+     * in place go unnoticed. */
+    virtual void hash(Hasher &hasher) const {
+        hasher.add((const void*)(this));
+    }
+
+    /* Add just what decides where rays hit this object, i.e. its shape
+     * and position, to a hash.  See GBuffer.  Unless overridden, this is
+     * everything hash() adds. */
+    virtual void hashGeometry(Hasher &hasher) const { hash(hasher); }
 };
 
 /** Object which does not produce light. */
 class NonLightingObject: public virtual RayObject {
 public:
-    virtual Lighting lightingAt(Coord &point, World &world) {
+    virtual Lighting lightingAt
+        (const Coord &point, const World &world) const {
         return Lighting();
     }
+    virtual bool emitsLight() const { return false; }
 };
 
 /** Object which cannot intersect rays. */
 class InvisibleObject: public virtual RayObject {
 public:
-    virtual double intersectDist(Ray &inbound) { return -1; }
-    virtual bool   colour(Ray &inbound, World &world) { return true; }
+    virtual double intersectDist(const Ray &inbound) const { return -1; }
+    virtual bool   colour(Ray &inbound, const World &world) const
+        { return true; }
+    virtual void hashGeometry(Hasher &hasher) const { /* never hit */ }
 };
 
 #endif // ray_object_h_
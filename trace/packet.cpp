@@ -0,0 +1,116 @@
+/******************************************************************************
+ * packet.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Provides RayPacket, a small bundle of rays which are traced together.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <cstdlib>
+#include <memory>
+#include <gtest/gtest.h>
+
+#include "packet.h"
+
+#include "trace/light_sources.h"
+#include "trace/ray.h"
+#include "trace/sphere.h"
+#include "trace/world.h"
+
+RayPacket::RayPacket(Ray **rays, unsigned count) :
+    m_count(count)
+{
+    for (unsigned k=0; k<RAY_PACKET_SIZE; ++k) {
+        Ray *ray = rays[(k < count) ? k : 0];
+        m_rays[k] = ray;
+        m_ox[k] = ray->m_endpoint.x();
+        m_oy[k] = ray->m_endpoint.y();
+        m_oz[k] = ray->m_endpoint.z();
+        m_dx[k] = ray->m_dir.x();
+        m_dy[k] = ray->m_dir.y();
+        m_dz[k] = ray->m_dir.z();
+        m_ix[k] = 1.0/m_dx[k];
+        m_iy[k] = 1.0/m_dy[k];
+        m_iz[k] = 1.0/m_dz[k];
+    }
+}
+
+bool RayPacket::coherent() const
+{
+    /* Compare the signs of the reciprocals, since a zero component may
+     * be -0, whose reciprocal is -infinity */
+    for (unsigned k=1; k<m_count; ++k) {
+        if (((m_ix[k] < 0.0) != (m_ix[0] < 0.0)) ||
+            ((m_iy[k] < 0.0) != (m_iy[0] < 0.0)) ||
+            ((m_iz[k] < 0.0) != (m_iz[0] < 0.0))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! Packets must find exactly the same hits and colours as single rays.
+TEST(PacketTest, MatchesSingleRays) {
+    srand(4321);
+    World world;
+    world.m_globalDiffuse.set(0.05, 0.05, 0.15);
+    for (int i=0; i<300; ++i) {
+        std::auto_ptr<RayObject> sph (new Sphere(
+            Coord(rand()%200/10.0 - 10.0,
+                  rand()%200/10.0 - 10.0,
+                  rand()%200/10.0),
+            0.1 + rand()%10/10.0,
+            RayColour(0.5, 0.5, 0.5), RayColour(0.2, 0.2, 0.2)));
+        world.addObject(sph);
+    }
+    std::auto_ptr<RayObject> light (new SphereSource(
+        Coord(0, 0, -5), 0.5, RayColour(100, 100, 100)));
+    world.addObject(light);
+    world.finalize();
+
+    RayVector dir = RayVector(0.1, -0.05, 1).unitify();
+    for (int p=0; p<200; ++p) {
+        Ray single[RAY_PACKET_SIZE];
+        Ray packed[RAY_PACKET_SIZE];
+        Ray *rays[RAY_PACKET_SIZE];
+        // Every other packet fans out from one point, like an AngleView
+        Coord fanOrig (rand()%200/10.0 - 10.0, rand()%200/10.0 - 10.0, -12);
+        for (unsigned k=0; k<RAY_PACKET_SIZE; ++k) {
+            Coord orig (rand()%200/10.0 - 10.0, rand()%200/10.0 - 10.0, -12);
+            RayVector fanDir = RayVector(0.1 + k*0.02, -0.05 + k*0.01,
+                                         1).unitify();
+            single[k].m_endpoint = packed[k].m_endpoint =
+                (p % 2) ? fanOrig : orig;
+            single[k].m_dir = packed[k].m_dir = (p % 2) ? fanDir : dir;
+            single[k].m_depthLimit = packed[k].m_depthLimit = 3;
+            rays[k] = &packed[k];
+        }
+
+        // Also try partial packets
+        unsigned count = (p % 3) ? RAY_PACKET_SIZE : 1 + p % RAY_PACKET_SIZE;
+        RayPacket packet (rays, count);
+        ASSERT_TRUE(packet.coherent());
+        world.tracePacket(packet);
+        for (unsigned k=0; k<count; ++k) {
+            world.trace(single[k]);
+            ASSERT_EQ(single[k].m_intersectDist, packed[k].m_intersectDist);
+            ASSERT_EQ(single[k].m_colour.r, packed[k].m_colour.r);
+            ASSERT_EQ(single[k].m_colour.g, packed[k].m_colour.g);
+            ASSERT_EQ(single[k].m_colour.b, packed[k].m_colour.b);
+        }
+    }
+}
@@ -0,0 +1,72 @@
+/******************************************************************************
+ * packet.h
+ * Copyright 2011 Iain Peet
+ *
+ * Provides RayPacket, a small bundle of rays which are traced together.
+ * Rays which start close together and travel in the same direction (like
+ * the primary rays of a ParallelView) tend to visit the same parts of the
+ * world, so tracing them as a group lets us share the cost of searching
+ * the world, and test several rays against an object at once with SIMD.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef PACKET_H_
+#define PACKET_H_
+
+class Ray;
+
+//! Number of rays in a packet.  Must be a multiple of 2 for SSE2.
+#define RAY_PACKET_SIZE 4
+
+/** A bundle of up to RAY_PACKET_SIZE rays.  The ray endpoints and
+ *  directions are copied out into one array per component, so that
+ *  each component can be loaded for several rays at once. */
+class RayPacket {
+public:
+    //! The rays in the packet.  Only the first m_count are valid.
+    Ray     *m_rays[RAY_PACKET_SIZE];
+    unsigned m_count;
+
+    //! Ray endpoints, by component
+    double   m_ox[RAY_PACKET_SIZE];
+    double   m_oy[RAY_PACKET_SIZE];
+    double   m_oz[RAY_PACKET_SIZE];
+    //! Ray directions, by component
+    double   m_dx[RAY_PACKET_SIZE];
+    double   m_dy[RAY_PACKET_SIZE];
+    double   m_dz[RAY_PACKET_SIZE];
+    //! Reciprocals of the ray directions, by component
+    double   m_ix[RAY_PACKET_SIZE];
+    double   m_iy[RAY_PACKET_SIZE];
+    double   m_iz[RAY_PACKET_SIZE];
+
+public:
+    /* Fill the packet from some rays.  Unused lanes are filled with
+     * copies of the first ray, so they are safe to compute on.
+     * @param count Number of rays, at most RAY_PACKET_SIZE */
+    RayPacket(Ray **rays, unsigned count);
+
+    /* Whether these rays are worth tracing as a packet.  This requires that
+     * all of the rays travel into the same octant (each component of their
+     * directions has the same sign), so that they cross the slabs of a
+     * bounding box in the same order.  Rays from a point, or parallel
+     * rays, which start close together then visit the same parts of the
+     * world. */
+    bool coherent() const;
+};
+
+#endif //PACKET_H_
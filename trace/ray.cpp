@@ -20,24 +20,60 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  *****************************************************************************/
 
+#include <gtest/gtest.h>
+
 #include "ray.h"
 
-using namespace std::tr1;
+#include <algorithm>
+
+#include "util/hash.h"
 
 Ray::~Ray()
 {
 }
 
-//! Allocate a new Ray, if we haven't reached limit of the hierarchy
-shared_ptr<Ray> Ray::createChild()
+//! Set up a child Ray, if we haven't reached limit of the hierarchy
+bool Ray::createChild(Ray &child) const
+{
+    if( m_depth >= m_depthLimit ) return false;
+
+    child.m_depthLimit = m_depthLimit;
+    child.m_depth = m_depth + 1;
+    child.m_throughput = m_throughput;
+    return true;
+}
+
+//! Set up a child Ray, if it will contribute enough to be worth tracing
+bool Ray::createChild(Ray &child, RayColour &gain, double minThroughput,
+                      bool roulette) const
 {
-    if( m_depth >= m_depthLimit ) return shared_ptr<Ray> ();
+    if( m_depth >= m_depthLimit ) return false;
 
-    shared_ptr<Ray> newChild (new Ray(m_depthLimit));
-    newChild->m_depth = m_depth + 1;
-    m_children.push_back(newChild);
+    RayColour throughput = m_throughput * gain;
+    double largest = std::max(throughput.r,
+                              std::max(throughput.g, throughput.b));
+    if ((minThroughput > 0.0) && (largest < minThroughput)) {
+        if (!roulette || (largest <= 0.0)) return false;
 
-    return newChild;
+        /* Draw from a hash of this ray, rather than a generator shared
+         * between threads */
+        Hasher hasher;
+        hasher.addXYZ(m_endpoint);
+        hasher.addXYZ(m_dir);
+        hasher.add(m_intersectDist);
+        hasher.add(m_depth);
+        double draw = (hasher.value() >> 11) * (1.0 / 9007199254740992.0);
+        double survive = largest / minThroughput;
+        if (draw >= survive) return false;
+
+        gain = gain * (1.0 / survive);
+        throughput = m_throughput * gain;
+    }
+
+    child.m_depthLimit = m_depthLimit;
+    child.m_depth = m_depth + 1;
+    child.m_throughput = throughput;
+    return true;
 }
 
 //! Moves the origin of the ray a little bit.
@@ -46,3 +82,41 @@ void Ray::nudge(double distance)
     m_endpoint = m_endpoint + distance * m_dir;
 }
 
+//! Children can be made until the depth limit is reached
+TEST(RayTest, ChildDepth) {
+    Ray rays[4];
+    rays[0].m_depthLimit = 2;
+    ASSERT_TRUE(rays[0].createChild(rays[1]));
+    ASSERT_TRUE(rays[1].createChild(rays[2]));
+    ASSERT_EQ(2, rays[2].m_depthLimit);
+    ASSERT_FALSE(rays[2].createChild(rays[3]));
+}
+
+/* Children are cut off once their throughput is too low.  With roulette
+ * some survive, with their gain raised to make up for the rest. */
+TEST(RayTest, ThroughputCutoff) {
+    Ray parent (10);
+    parent.m_throughput.set(0.5, 0.5, 0.5);
+    Ray child;
+    RayColour gain (0.5, 0.1, 0.1);
+    ASSERT_TRUE(parent.createChild(child, gain, 0.2, false));
+    ASSERT_EQ(0.25, child.m_throughput.r);
+    ASSERT_EQ(0.5, gain.r);
+    gain.set(0.2, 0.1, 0.1);
+    ASSERT_FALSE(parent.createChild(child, gain, 0.2, false));
+    ASSERT_TRUE(parent.createChild(child, gain, 0.0, false));
+
+    // Survivors of the roulette carry, on average, the gain they were given
+    double total = 0.0;
+    const unsigned trials = 20000;
+    for (unsigned i=0; i<trials; ++i) {
+        parent.m_endpoint = Coord(i*0.001, 1.0, -i*0.002);
+        parent.m_dir = RayVector(0.0, 0.6, 0.8);
+        RayColour rouletteGain (0.2, 0.1, 0.1);
+        if (parent.createChild(child, rouletteGain, 0.2, true)) {
+            ASSERT_NEAR(0.2, child.m_throughput.r, 1E-12);
+            total += rouletteGain.r;
+        }
+    }
+    ASSERT_NEAR(0.2, total / trials, 0.01);
+}
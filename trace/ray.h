@@ -38,8 +38,6 @@
 #ifndef ray_h_
 #define ray_h_
 
-#include <vector>
-#include <tr1/memory>
 #include "image/colour.h"
 #include "geom.h"
 
@@ -56,12 +54,6 @@ class Ray {
 private:
     // Current ray hierarchy depth.
     int m_depth;
-    std::vector<std::tr1::shared_ptr<Ray> > m_children;
-
-private:
-    // We would need to do a deep copy.  So, no copying!
-    Ray(const Ray& other);
-    Ray& operator=(const Ray& other);
 
 public:  
     //! A unit vector with the direction of this Ray
@@ -74,9 +66,12 @@ public:
     RayColour   m_colour;
     //! Maximum number of rays to create
     int         m_depthLimit;
+    /** Product of the gains applied to this ray's colour on its way to
+     *  the view.  1 for primary rays. */
+    RayColour   m_throughput;
     
     Ray(int depthLimit=0) : 
-        m_depth(0), m_depthLimit(depthLimit)
+        m_depth(0), m_depthLimit(depthLimit), m_throughput(1.0, 1.0, 1.0)
         {}
     virtual ~Ray();
 
@@ -85,10 +80,28 @@ public:
      *  @param distance  The distance to move the origin. */
     void nudge(double distance=1E-5);
 	
-    /** Create a child for this Ray, if possible.  
-     *  @return The new child.  0 if creation fails (ie. we've reached the
-     *          limit of the Ray hierarchy) */
-    std::tr1::shared_ptr<Ray> createChild();
+    /** Set up a child for this Ray, if possible.  The child belongs to
+     *  the caller, and is normally on the stack, so that tracing a tree
+     *  of rays does no heap allocation at all.
+     *  @param child  Made into a child of this ray, one level deeper.
+     *  @return       false if we've reached the limit of the Ray hierarchy,
+     *                in which case child is untouched. */
+    bool createChild(Ray &child) const;
+
+    /** As above, for a child whose colour is scaled by gain before it's
+     *  added to this ray's.  Children whose throughput (largest
+     *  component) would fall below minThroughput aren't worth tracing.
+     *  With roulette, such children are instead traced at random, with
+     *  probability throughput / minThroughput, and gain is raised to
+     *  make up for the ones not traced, so that the colour is right on
+     *  average.  Which children survive depends only on this ray, so an
+     *  image comes out the same however it is split between threads.
+     *  @param gain  The gain applied to the child's colour.  May be
+     *               raised by roulette.
+     *  @param minThroughput  0 to trace every child the depth allows.
+     *  @return      false if the child shouldn't be traced. */
+    bool createChild(Ray &child, RayColour &gain, double minThroughput,
+                     bool roulette) const;
 };
 
 #endif // ray_h_
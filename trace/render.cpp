@@ -21,17 +21,466 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  *****************************************************************************/
 
+#include <algorithm>
+#include <deque>
+#include <pthread.h>
+
 #include "trace/render.h"
 
+#include <gtest/gtest.h>
+
+#include "image/colour.h"
 #include "image/rayImage.h"
+#include "image/resample.h"
+#include "trace/light_sources.h"
 #include "trace/view.h"
+#include "util/clock.h"
+#include "util/hash.h"
+#include "util/trace.h"
 
 using namespace std;
 
+static trc_ctl_t renderTrace = {
+    TRC_DFL_LVL,
+    "RENDER",
+    TRC_STDOUT
+};
+#define TRACE(level, args...) \
+    TRC_PRINTF(&renderTrace,level,1,args)
+
+uint64_t Render::traceKey() const {
+    Hasher hasher;
+    m_world->hash(hasher);
+    m_view->hash(hasher);
+    hasher.add(m_maxDepth);
+    hasher.add(m_renderSize.m_width);
+    hasher.add(m_renderSize.m_height);
+    hasher.add((int)(m_pipeline->precision()));
+    return hasher.value();
+}
+
+uint64_t Render::hitKey() const {
+    Hasher hasher;
+    m_world->hashGeometry(hasher);
+    m_view->hash(hasher);
+    hasher.add(m_maxDepth);
+    hasher.add(m_renderSize.m_width);
+    hasher.add(m_renderSize.m_height);
+    hasher.add((int)(m_pipeline->precision()));
+    return hasher.value();
+}
+
+void Render::dropTraced() {
+    m_traced.resize(0, 0, 0);
+    m_haveTraced = false;
+    m_gbuffer = GBuffer();
+    m_haveGBuffer = false;
+}
+
+/* Bands traced but not yet processed, passed from the tracing thread to
+ * the thread which streams them through the pipeline. */
+struct BandQueue {
+    pthread_mutex_t   m_lock;
+    pthread_cond_t    m_changed;
+    deque<RayImage*>  m_bands;
+    ImagePipeline    *m_pipeline;
+    // Bands not yet processed, queued or still to be traced
+    unsigned          m_remaining;
+};
+
+/* Bands which may wait to be processed.  Tracing stalls beyond this, so
+ * no more than this many bands, plus the one being traced and the one
+ * being processed, are held at once. */
+static const unsigned bandQueueDepth = 1;
+
+//! Stream queued bands through the pipeline, in order, until all are done
+static void* processBands(void *arg) {
+    BandQueue &queue = *static_cast<BandQueue*>(arg);
+    pthread_mutex_lock(&queue.m_lock);
+    while (queue.m_remaining) {
+        if (queue.m_bands.empty()) {
+            pthread_cond_wait(&queue.m_changed, &queue.m_lock);
+            continue;
+        }
+        RayImage *band = queue.m_bands.front();
+        queue.m_bands.pop_front();
+        pthread_cond_broadcast(&queue.m_changed);
+        pthread_mutex_unlock(&queue.m_lock);
+
+        queue.m_pipeline->streamBand(*band);
+        delete band;
+
+        pthread_mutex_lock(&queue.m_lock);
+        --queue.m_remaining;
+    }
+    pthread_mutex_unlock(&queue.m_lock);
+    return 0;
+}
+
 // Traces and processes a scene
 auto_ptr<Image> Render::execute() {
-    RayImage ri (m_renderSize);
-    m_view->render(ri, *m_world, 20); 
+    m_pipeline->setThreads(m_threads);
+
+    uint64_t key = traceKey();
+    if (m_haveTraced && (key == m_tracedKey)) {
+        TRACE(TRC_INFO, "Scene unchanged, reprocessing traced image.\n");
+        return m_pipeline->process(m_traced, m_processedSize);
+    }
+    dropTraced();
+    m_world->finalize();
+
+    if (!m_bandRows) {
+        RayImage ri (m_renderSize, m_pipeline->precision());
+        m_view->render(ri, *m_world, m_maxDepth, m_threads, m_tileSize,
+                       m_keepGBuffer ? &m_gbuffer : 0);
+        m_haveGBuffer = m_keepGBuffer;
+        if (m_haveGBuffer) m_gbufferKey = hitKey();
+        m_traced = ri.image();
+        m_tracedKey = key;
+        m_haveTraced = (m_traced.width() == ri.width()); // copy may fail
+        return m_pipeline->process(ri, m_processedSize);
+    }
+
+    /* Hand each band to another thread to be processed as soon as it's
+     * traced, and trace the next band meanwhile. */
+    unsigned height = m_renderSize.m_height;
+    m_pipeline->beginStream(m_renderSize, m_processedSize);
+    BandQueue queue;
+    pthread_mutex_init(&queue.m_lock, 0);
+    pthread_cond_init(&queue.m_changed, 0);
+    queue.m_pipeline = m_pipeline.get();
+    queue.m_remaining = (height + m_bandRows - 1) / m_bandRows;
+    pthread_t processor;
+    bool overlap = !pthread_create(&processor, 0, processBands, &queue);
+    if (!overlap) {
+        TRACE(TRC_WARN, "Can't start band thread; processing in turn.\n");
+    }
+
+    for (unsigned top=0; top < height; top += m_bandRows) {
+        auto_ptr<RayImage> band (new RayImage(0, 0, m_pipeline->precision()));
+        band->setBand(m_renderSize.m_width, height, top,
+                      min(m_bandRows, height - top));
+        m_view->render(*band, *m_world, m_maxDepth, m_threads, m_tileSize);
+        if (!overlap) {
+            m_pipeline->streamBand(*band);
+            continue;
+        }
+        pthread_mutex_lock(&queue.m_lock);
+        while (queue.m_bands.size() >= bandQueueDepth) {
+            pthread_cond_wait(&queue.m_changed, &queue.m_lock);
+        }
+        queue.m_bands.push_back(band.release());
+        pthread_cond_broadcast(&queue.m_changed);
+        pthread_mutex_unlock(&queue.m_lock);
+    }
+
+    if (overlap) pthread_join(processor, 0);
+    pthread_cond_destroy(&queue.m_changed);
+    pthread_mutex_destroy(&queue.m_lock);
+    return m_pipeline->endStream();
+}
+
+//! Number of levels refined by executeWithin
+static const unsigned deadlineLevels = 6;
+
+//! Fill an image with the nearest pixels of a smaller one
+static void fillFrom(RayImage &image, const RayImage &coarse) {
+    for (unsigned i=0; i < image.height(); ++i) {
+        unsigned ci = i * coarse.height() / image.height();
+        for (unsigned j=0; j < image.width(); ++j) {
+            image.set(i, j, coarse.at(ci, j * coarse.width() / image.width()));
+        }
+    }
+}
+
+// Traces coarse to fine until the deadline
+auto_ptr<Image> Render::executeWithin(double seconds, RenderQuality *quality) {
+    RenderQuality unused;
+    if (!quality) quality = &unused;
+    double start = monotonicSeconds();
+    m_pipeline->setThreads(m_threads);
+
+    *quality = RenderQuality();
+    quality->m_levels = deadlineLevels;
+
+    uint64_t key = traceKey();
+    if (m_haveTraced && (key == m_tracedKey)) {
+        auto_ptr<Image> result = m_pipeline->process(m_traced,
+                                                     m_processedSize);
+        quality->m_level = deadlineLevels - 1;
+        quality->m_tracedSize = m_renderSize;
+        quality->m_coverage = 1.0;
+        quality->m_complete = true;
+        quality->m_seconds = monotonicSeconds() - start;
+        return result;
+    }
+    dropTraced();
+    m_world->finalize();
+
+    auto_ptr<RayImage> best;
+    auto_ptr<Image> result;
+    double reserve = 0.0;
+    double deadline = start + seconds;
+    for (unsigned level=0; level < deadlineLevels; ++level) {
+        unsigned scale = 1 << (deadlineLevels - 1 - level);
+        unsigned width = (m_renderSize.m_width + scale - 1) / scale;
+        unsigned height = (m_renderSize.m_height + scale - 1) / scale;
+        auto_ptr<RayImage> ri (new RayImage(width, height,
+                                            m_pipeline->precision()));
+        double traceBy = 0.0;
+        if (best.get()) {
+            traceBy = deadline - reserve;
+            if (monotonicSeconds() >= traceBy) break;
+            fillFrom(*ri, *best);
+        }
+        unsigned traced = m_view->render(*ri, *m_world, m_maxDepth,
+                                         m_threads, m_tileSize, 0, traceBy);
+
+        quality->m_level = level;
+        quality->m_tracedSize = ImageSize(width, height);
+        quality->m_coverage = (double)(traced) / ((double)(width) * height);
+        best = ri;
+        result.reset();
+
+        if (!level) {
+            /* Process the coarsest level straight away, so there's an
+             * image however soon the deadline is, and keep back at least
+             * as long as that took to process the final image */
+            double processStart = monotonicSeconds();
+            result = m_pipeline->process(best->image(), m_processedSize);
+            reserve = 1.5 * (monotonicSeconds() - processStart);
+        }
+        TRACE(TRC_STAT, "Deadline render: level %u, %ux%u, %.1f%% traced.\n",
+              level, width, height, 100.0 * quality->m_coverage);
+        if (quality->m_coverage < 1.0) break;
+    }
+
+    quality->m_complete = (quality->m_level == deadlineLevels - 1) &&
+                          (quality->m_coverage == 1.0);
+    if (quality->m_complete) {
+        m_traced = best->image();
+        m_tracedKey = key;
+        m_haveTraced = (m_traced.width() == best->width()); // copy may fail
+    }
+    if (!result.get()) result = m_pipeline->process(*best, m_processedSize);
+    quality->m_seconds = monotonicSeconds() - start;
+    return result;
+}
+
+auto_ptr<Image> Render::reprocess() {
+    if (!m_haveTraced) return execute();
+
+    m_pipeline->setThreads(m_threads);
+    return m_pipeline->process(m_traced, m_processedSize);
+}
+
+auto_ptr<Image> Render::relight() {
+    if (!m_haveGBuffer || (hitKey() != m_gbufferKey)) {
+        TRACE(TRC_INFO, "No primary hits for this view, rendering in full.\n");
+        return execute();
+    }
+
+    m_pipeline->setThreads(m_threads);
+    RayImage ri (m_renderSize, m_pipeline->precision());
+    m_gbuffer.relight(ri, *m_world, m_threads);
+    m_traced = ri.image();
+    m_tracedKey = traceKey();
+    m_haveTraced = (m_traced.width() == ri.width()); // copy may fail
     return m_pipeline->process(ri, m_processedSize);
 }
 
+//! A view which counts how many times it is rendered
+class CountingView : public ParallelView {
+public:
+    unsigned m_renders;
+    CountingView() : m_renders(0) {}
+protected:
+    virtual void prepare(const RayImage &image) {
+        ++m_renders;
+        ParallelView::prepare(image);
+    }
+};
+
+/* Changing only the processing reuses the traced image; changing the
+ * scene traces it again. */
+TEST(RenderTest, ReusesTracedImage) {
+    Render render;
+    render.m_world = tr1::shared_ptr<World>(new World());
+    Sphere *sph = render.m_world->addSphere(Coord(0,0,0), 1.0,
+        RayColour(0.1, 0.25, 1.0), RayColour(0.5, 0.5, 0.5));
+    auto_ptr<RayObject> light (new SphereSource(
+        RayVector(1.5,-2.5,1.5), 0.125, RayColour(90.0,90.0,90.0)));
+    render.m_world->addObject(light);
+    CountingView *view = new CountingView();
+    view->m_origin = Coord(2.0,-2,2);
+    view->m_xVec = RayVector(0,4.5,0);
+    view->m_yVec = RayVector(0,0,-3);
+    render.m_view = tr1::shared_ptr<RayView>(view);
+    render.m_pipeline = tr1::shared_ptr<ImagePipeline>(new ImagePipeline());
+    render.m_pipeline->push(
+        auto_ptr<ImageTransform>(new LogHDRToDisplay(0.0, 0.5)));
+    render.m_maxDepth = 5;
+    render.m_renderSize = ImageSize(30, 20);
+    render.m_processedSize = render.m_renderSize;
+    render.m_threads = 1;
+
+    auto_ptr<Image> first = render.execute();
+    ASSERT_EQ(1u, view->m_renders);
+
+    // New tone map: reprocessed, and the same as a fresh render
+    ImagePipeline *pipeline = new ImagePipeline();
+    pipeline->push(auto_ptr<ImageTransform>(new LogHDRToDisplay(0.0, 2.0)));
+    render.m_pipeline = tr1::shared_ptr<ImagePipeline>(pipeline);
+    auto_ptr<Image> second = render.execute();
+    ASSERT_EQ(1u, view->m_renders);
+    auto_ptr<Image> reprocessed = render.reprocess();
+    ASSERT_EQ(1u, view->m_renders);
+    render.dropTraced();
+    auto_ptr<Image> fresh = render.execute();
+    ASSERT_EQ(2u, view->m_renders);
+    for (unsigned i=0; i<fresh->height(); ++i) {
+        for (unsigned j=0; j<fresh->width(); ++j) {
+            for (unsigned k=0; k<fresh->colours(); ++k) {
+                ASSERT_EQ(fresh->at(i,j,k), second->at(i,j,k));
+                ASSERT_EQ(fresh->at(i,j,k), reprocessed->at(i,j,k));
+            }
+        }
+    }
+
+    // Changes to the scene or view are noticed
+    sph->m_diffusivity.set(1.0, 0.0, 0.0);
+    render.execute();
+    ASSERT_EQ(3u, view->m_renders);
+    view->m_origin = Coord(2.0,-2,2.5);
+    render.execute();
+    ASSERT_EQ(4u, view->m_renders);
+    render.m_renderSize = ImageSize(31, 20);
+    render.execute();
+    ASSERT_EQ(5u, view->m_renders);
+    render.execute();
+    ASSERT_EQ(5u, view->m_renders);
+
+    // Relighting shades the kept primary hits without tracing the view
+    render.m_keepGBuffer = true;
+    render.dropTraced();
+    render.execute();
+    ASSERT_EQ(6u, view->m_renders);
+    sph->m_diffusivity.set(0.2, 0.9, 0.3);
+    auto_ptr<Image> relit = render.relight();
+    ASSERT_EQ(6u, view->m_renders);
+    render.execute();
+    ASSERT_EQ(6u, view->m_renders);
+    render.dropTraced();
+    auto_ptr<Image> traced = render.execute();
+    ASSERT_EQ(7u, view->m_renders);
+    for (unsigned i=0; i<traced->height(); ++i) {
+        for (unsigned j=0; j<traced->width(); ++j) {
+            for (unsigned k=0; k<traced->colours(); ++k) {
+                ASSERT_EQ(traced->at(i,j,k), relit->at(i,j,k));
+            }
+        }
+    }
+
+    // Moving an object, or the view, makes the primary hits stale
+    sph->setOrigin(Coord(0,0,0.25));
+    render.relight();
+    ASSERT_EQ(8u, view->m_renders);
+    render.relight();
+    ASSERT_EQ(8u, view->m_renders);
+    view->m_origin = Coord(2.0,-2,2);
+    render.relight();
+    ASSERT_EQ(9u, view->m_renders);
+}
+
+/* Rendering in bands, processed while later bands are traced, gives just
+ * what rendering the whole image does. */
+TEST(RenderTest, StreamedBands) {
+    Render render;
+    render.m_world = tr1::shared_ptr<World>(new World());
+    render.m_world->addSphere(Coord(0,0,0), 1.0,
+        RayColour(0.1, 0.25, 1.0), RayColour(0.5, 0.5, 0.5));
+    auto_ptr<RayObject> light (new SphereSource(
+        RayVector(1.5,-2.5,1.5), 0.125, RayColour(90.0,90.0,90.0)));
+    render.m_world->addObject(light);
+    ParallelView *view = new ParallelView();
+    view->m_origin = Coord(2.0,-2,2);
+    view->m_xVec = RayVector(0,4.5,0);
+    view->m_yVec = RayVector(0,0,-3);
+    render.m_view = tr1::shared_ptr<RayView>(view);
+    render.m_pipeline = tr1::shared_ptr<ImagePipeline>(new ImagePipeline());
+    render.m_pipeline->push(
+        auto_ptr<ImageTransform>(new LogHDRToDisplay(0.0, 0.5)));
+    render.m_pipeline->setResampler(
+        auto_ptr<Resampler>(new NearestNeighbor()));
+    render.m_maxDepth = 5;
+    render.m_renderSize = ImageSize(40, 37);
+    render.m_processedSize = ImageSize(60, 50);
+    render.m_threads = 2;
+
+    auto_ptr<Image> whole = render.execute();
+    unsigned bandRows[] = { 1, 5, 37, 100 };
+    for (unsigned b=0; b < sizeof(bandRows)/sizeof(bandRows[0]); ++b) {
+        render.dropTraced();
+        render.m_bandRows = bandRows[b];
+        auto_ptr<Image> banded = render.execute();
+        ASSERT_EQ(whole->width(), banded->width());
+        ASSERT_EQ(whole->height(), banded->height());
+        for (unsigned i=0; i<whole->height(); ++i) {
+            for (unsigned j=0; j<whole->width(); ++j) {
+                for (unsigned k=0; k<whole->colours(); ++k) {
+                    ASSERT_EQ(whole->at(i,j,k), banded->at(i,j,k));
+                }
+            }
+        }
+    }
+}
+
+/* A render against a deadline gives an image of the right size however
+ * short the budget, and just what execute() does given long enough. */
+TEST(RenderTest, DeadlineRender) {
+    Render render;
+    render.m_world = tr1::shared_ptr<World>(new World());
+    render.m_world->addSphere(Coord(0,0,0), 1.0,
+        RayColour(0.1, 0.25, 1.0), RayColour(0.5, 0.5, 0.5));
+    auto_ptr<RayObject> light (new SphereSource(
+        RayVector(1.5,-2.5,1.5), 0.125, RayColour(90.0,90.0,90.0)));
+    render.m_world->addObject(light);
+    ParallelView *view = new ParallelView();
+    view->m_origin = Coord(2.0,-2,2);
+    view->m_xVec = RayVector(0,4.5,0);
+    view->m_yVec = RayVector(0,0,-3);
+    render.m_view = tr1::shared_ptr<RayView>(view);
+    render.m_pipeline = tr1::shared_ptr<ImagePipeline>(new ImagePipeline());
+    render.m_pipeline->push(
+        auto_ptr<ImageTransform>(new LogHDRToDisplay(0.0, 0.5)));
+    render.m_pipeline->setResampler(
+        auto_ptr<Resampler>(new NearestNeighbor()));
+    render.m_maxDepth = 5;
+    render.m_renderSize = ImageSize(60, 35);
+    render.m_processedSize = ImageSize(90, 50);
+    render.m_threads = 2;
+    render.m_tileSize = 4;
+
+    RenderQuality quality;
+    auto_ptr<Image> rushed = render.executeWithin(0.0, &quality);
+    ASSERT_EQ(90u, rushed->width());
+    ASSERT_EQ(50u, rushed->height());
+    ASSERT_EQ(0u, quality.m_level);
+    ASSERT_EQ(2u, quality.m_tracedSize.m_width);
+    ASSERT_EQ(2u, quality.m_tracedSize.m_height);
+    ASSERT_EQ(1.0, quality.m_coverage);
+    ASSERT_FALSE(quality.m_complete);
+
+    auto_ptr<Image> finished = render.executeWithin(100.0, &quality);
+    ASSERT_TRUE(quality.m_complete);
+    ASSERT_EQ(60u, quality.m_tracedSize.m_width);
+    render.dropTraced();
+    auto_ptr<Image> whole = render.execute();
+    for (unsigned i=0; i<whole->height(); ++i) {
+        for (unsigned j=0; j<whole->width(); ++j) {
+            for (unsigned k=0; k<whole->colours(); ++k) {
+                ASSERT_EQ(whole->at(i,j,k), finished->at(i,j,k));
+            }
+        }
+    }
+}
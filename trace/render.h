@@ -25,14 +25,37 @@
 #define RENDER_H_
 
 #include <memory>
+#include <stdint.h>
 #include <tr1/memory>
 
 #include "image/image.h"
 #include "image/imageSize.h"
 #include "image/pipeline.h"
+#include "trace/gbuffer.h"
 #include "trace/view.h"
 #include "trace/world.h"
 
+/* How far a render against a deadline got.  See Render::executeWithin. */
+class RenderQuality {
+public:
+    //! The finest level traced, from 0 (coarsest) to m_levels-1
+    unsigned  m_level;
+    unsigned  m_levels;
+    //! Size that level was traced at
+    ImageSize m_tracedSize;
+    /* Proportion of that level's pixels which were traced.  The rest are
+     * filled in from the level before. */
+    double    m_coverage;
+    //! Whether the image is just what execute() would have given
+    bool      m_complete;
+    //! Time taken, in seconds
+    double    m_seconds;
+
+    RenderQuality() : m_level(0), m_levels(0), m_tracedSize(),
+        m_coverage(0.0), m_complete(false), m_seconds(0.0)
+        { /* n/a */ }
+};
+
 /* Encapsulates a raytrace render. */
 class Render {
 public:
@@ -45,6 +68,28 @@ public:
     ImageSize m_renderSize;
     // Size to interpolate to in postprocessing
     ImageSize m_processedSize;
+    // Number of threads to trace and process with.  0 for one per CPU.
+    unsigned m_threads;
+    // Width and height of the blocks of pixels traced by each thread
+    unsigned m_tileSize;
+    /* If not 0, the image is traced this many rows at a time.  Each band
+     * is handed to another thread, which processes it while the next is
+     * traced, so the whole traced image is never held at once. */
+    unsigned m_bandRows;
+    /* Whether to record the primary hits of each render, so that it can
+     * be relit.  Ignored when tracing in bands. */
+    bool m_keepGBuffer;
+
+private:
+    /* The last image traced, before processing, and traceKey() when it
+     * was traced.  Not kept when tracing in bands. */
+    Image    m_traced;
+    uint64_t m_tracedKey;
+    bool     m_haveTraced;
+    // Primary hits of the last render, if m_keepGBuffer, and hitKey() then
+    GBuffer  m_gbuffer;
+    uint64_t m_gbufferKey;
+    bool     m_haveGBuffer;
 
 public:
     Render() : 
@@ -53,12 +98,64 @@ public:
         m_pipeline(), 
         m_maxDepth(0),
         m_renderSize(), 
-        m_processedSize()
+        m_processedSize(),
+        m_threads(0),
+        m_tileSize(32),
+        m_bandRows(0),
+        m_keepGBuffer(false),
+        m_traced(),
+        m_tracedKey(0),
+        m_haveTraced(false),
+        m_gbuffer(),
+        m_gbufferKey(0),
+        m_haveGBuffer(false)
         { /* n/a */ }
 
-    /* Execute the render.
+    /* Execute the render.  If nothing which affects tracing has changed
+     * since the last render (see traceKey()), the image traced then is
+     * just processed again, e.g. with a new tone map or output size.
      * @return the rendered image */
     std::auto_ptr<Image> execute();
+
+    /* Render within a time budget.  The image is traced coarse first,
+     * at 1/32 of m_renderSize, then refined at twice the size each time
+     * until the budget runs out.  Each level is traced from the centre
+     * out, and any pixels not traced before the deadline are filled in
+     * from the level before.  The best image traced is then processed to
+     * m_processedSize, the pipeline's resampler doing any upscaling.
+     * The coarsest level is always finished, so very small budgets may
+     * be overrun by that.
+     * @param seconds  The budget, including processing
+     * @param quality  If not 0, set to how far the render got
+     * @return the rendered image */
+    std::auto_ptr<Image> executeWithin(double seconds,
+                                       RenderQuality *quality = 0);
+
+    /* Process the image traced by the last render again, without
+     * checking whether the scene has changed since.  Traces first if
+     * there is no traced image.
+     * @return the rendered image */
+    std::auto_ptr<Image> reprocess();
+
+    /* Shade the last render again from its primary hits, and process
+     * it.  For when only lights or surface colours have changed since;
+     * see GBuffer.  Renders in full if no primary hits were kept, or if
+     * anything which moves them has changed (see hitKey()).
+     * @return the rendered image */
+    std::auto_ptr<Image> relight();
+
+    /* A hash of everything which affects the traced image: the world,
+     * the view, the tracing depth, the render size and the precision of
+     * the pipeline.  Hashing the world visits every object. */
+    uint64_t traceKey() const;
+
+    /* As traceKey(), but of the world, only the shape and position of
+     * its objects, which decide where primary rays hit.  Primary hits
+     * kept for relight() stay valid while this is unchanged. */
+    uint64_t hitKey() const;
+
+    //! Forget the traced image and primary hits, to free their memory.
+    void dropTraced();
 };
 
 #endif //RENDER_H_
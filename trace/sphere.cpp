@@ -21,20 +21,23 @@
  *****************************************************************************/
 
 #include <cmath>
-#include <tr1/memory>
 #include <gtest/gtest.h>
 #include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "sphere.h"
 
 #include "util/trace.h"
+#include "trace/bvh.h"
 #include "trace/lighting.h"
 #include "trace/object.h"
+#include "trace/packet.h"
 #include "trace/ray.h"
 #include "trace/world.h"
 
 using namespace std;
-using namespace std::tr1;
 
 static trc_ctl_t sphereTrc = {
     TRC_DFL_LVL,
@@ -42,10 +45,10 @@ static trc_ctl_t sphereTrc = {
     TRC_DFL_PRINT
 };
 #define TRACE(level, args...) \
-    trc_printf(&sphereTrc,(level),1,args)
+    TRC_PRINTF(&sphereTrc,(level),1,args)
 
 //! Checks if a ray intersects this object.  
-double BaseSphere::intersectDist(Ray &inbound)
+double BaseSphere::intersectDist(const Ray &inbound) const
 {
     /* Find the intersections between the inbound unit vector and
      * this sphere. You will need a whiteboard to verify.*/
@@ -90,13 +93,132 @@ double BaseSphere::intersectDist(Ray &inbound)
     return d2;
 }    
 
+#ifdef __SSE2__
+/* Intersect two rays with two spheres, given the vectors from the ray
+ * endpoints to the sphere centres.  This is the same calculation as
+ * BaseSphere::intersectDist, with every operation done in the same order,
+ * so the results are identical. */
+static inline __m128d intersect2(__m128d tx, __m128d ty, __m128d tz,
+                                 __m128d dx, __m128d dy, __m128d dz,
+                                 __m128d rSq)
+{
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d miss = _mm_set1_pd(-1.0);
+
+    /* Square of the distance to the centre.  NB: intersectDist gets
+     * this by squaring RayVector's length, so we do too. */
+    __m128d cSq = _mm_add_pd(_mm_add_pd(
+        _mm_mul_pd(tx, tx), _mm_mul_pd(ty, ty)), _mm_mul_pd(tz, tz));
+    cSq = _mm_sqrt_pd(cSq);
+    cSq = _mm_mul_pd(cSq, cSq);
+
+    // Distance from ray endpoint to point nearest sphere centre
+    __m128d D = _mm_add_pd(_mm_add_pd(
+        _mm_mul_pd(dx, tx), _mm_mul_pd(dy, ty)), _mm_mul_pd(dz, tz));
+
+    __m128d discr = _mm_sub_pd(_mm_add_pd(rSq, _mm_mul_pd(D, D)), cSq);
+    __m128d sqrtDiscr = _mm_sqrt_pd(_mm_max_pd(discr, zero));
+    __m128d d1 = _mm_add_pd(D, sqrtDiscr);
+    __m128d d2 = _mm_sub_pd(D, sqrtDiscr);
+
+    /* d2 if it is ahead of the endpoint, otherwise d1.  A miss if the
+     * discriminant is negative, or both are behind (d2 <= d1 always) */
+    __m128d behind = _mm_cmplt_pd(d2, zero);
+    __m128d result = _mm_or_pd(_mm_and_pd(behind, d1),
+                               _mm_andnot_pd(behind, d2));
+    __m128d missed = _mm_or_pd(_mm_cmplt_pd(discr, zero),
+                               _mm_cmplt_pd(d1, zero));
+    return _mm_or_pd(_mm_and_pd(missed, miss),
+                     _mm_andnot_pd(missed, result));
+}
+#endif
+
+//! Checks a packet of rays against this sphere.
+void BaseSphere::intersectPacket(const RayPacket &packet, double dist[]) const
+{
+#ifdef __SSE2__
+    const __m128d cx = _mm_set1_pd(m_origin.x());
+    const __m128d cy = _mm_set1_pd(m_origin.y());
+    const __m128d cz = _mm_set1_pd(m_origin.z());
+    const __m128d rSq = _mm_set1_pd(m_radius*m_radius);
+
+    for (unsigned k=0; k < RAY_PACKET_SIZE; k+=2) {
+        // Vector from ray endpoint to centre of sphere
+        __m128d tx = _mm_sub_pd(cx, _mm_loadu_pd(packet.m_ox + k));
+        __m128d ty = _mm_sub_pd(cy, _mm_loadu_pd(packet.m_oy + k));
+        __m128d tz = _mm_sub_pd(cz, _mm_loadu_pd(packet.m_oz + k));
+
+        _mm_storeu_pd(dist + k, intersect2(tx, ty, tz,
+            _mm_loadu_pd(packet.m_dx + k), _mm_loadu_pd(packet.m_dy + k),
+            _mm_loadu_pd(packet.m_dz + k), rSq));
+    }
+#else
+    RayObject::intersectPacket(packet, dist);
+#endif
+}
+
+//! Checks a ray against many spheres.
+void BaseSphere::intersectMany(const Ray &inbound, const double cx[],
+                               const double cy[], const double cz[],
+                               const double rSq[], unsigned count,
+                               double dist[])
+{
+#ifdef __SSE2__
+    const __m128d ox = _mm_set1_pd(inbound.m_endpoint.x());
+    const __m128d oy = _mm_set1_pd(inbound.m_endpoint.y());
+    const __m128d oz = _mm_set1_pd(inbound.m_endpoint.z());
+    const __m128d dx = _mm_set1_pd(inbound.m_dir.x());
+    const __m128d dy = _mm_set1_pd(inbound.m_dir.y());
+    const __m128d dz = _mm_set1_pd(inbound.m_dir.z());
+
+    for (unsigned i=0; i < count; i+=2) {
+        __m128d tx = _mm_sub_pd(_mm_loadu_pd(cx + i), ox);
+        __m128d ty = _mm_sub_pd(_mm_loadu_pd(cy + i), oy);
+        __m128d tz = _mm_sub_pd(_mm_loadu_pd(cz + i), oz);
+        _mm_storeu_pd(dist + i, intersect2(tx, ty, tz, dx, dy, dz,
+                                           _mm_loadu_pd(rSq + i)));
+    }
+#else
+    for (unsigned i=0; i < count; ++i) {
+        Coord centre (cx[i], cy[i], cz[i]);
+        RayVector toCent = centre - inbound.m_endpoint;
+        double cSq = toCent.length();
+        cSq = cSq * cSq;
+        double D = inbound.m_dir.dot(toCent);
+        double discr = rSq[i] + (D*D) - cSq;
+        if (discr < 0) {
+            dist[i] = -1.0;
+            continue;
+        }
+        double sqrtDiscr = sqrt(discr);
+        double d1 = D + sqrtDiscr;
+        double d2 = D - sqrtDiscr;
+        if (d1 < 0.0) {
+            dist[i] = -1.0;
+        } else {
+            dist[i] = (d2 < 0.0) ? d1 : d2;
+        }
+    }
+#endif
+}
+
+//! Box around the sphere
+bool BaseSphere::bounds(BoundingBox &box) const {
+    /* Intersection only uses the square of the radius, so a negative one
+     * works too; the box must still be the right way round. */
+    double r = fabs(m_radius);
+    RayVector corner (r, r, r);
+    box = BoundingBox(m_origin - corner, m_origin + corner);
+    return true;
+}
+
 //! Find the normal vector at the intersection point
-RayVector BaseSphere::normal(const Coord &point) {
+RayVector BaseSphere::normal(const Coord &point) const {
     return (point - m_origin).unitify();
 }
 
 //! Colour a ray
-bool Sphere::colour(Ray &inbound, World &world) {
+bool Sphere::colour(Ray &inbound, const World &world) const {
     // Diffuse light:
     RayColour colour = m_diffusivity * world.m_globalDiffuse;
 
@@ -104,8 +226,9 @@ bool Sphere::colour(Ray &inbound, World &world) {
     RayVector intersect = inbound.m_endpoint + 
         inbound.m_dir * inbound.m_intersectDist;;
     RayVector interNorm = -normal(intersect);
-    for(unsigned i=0; i<world.objects().size(); ++i) {
-        Lighting cur = world.objects().at(i)->lightingAt(intersect, world);
+    const vector<RayObject*> &lights = world.lights();
+    for(unsigned i=0; i<lights.size(); ++i) {
+        Lighting cur = lights[i]->lightingAt(intersect, world);
  
         // Short-circuit if the object produces no light.
         if (cur.m_intensity.magnitude() == 0.0) continue;
@@ -117,16 +240,19 @@ bool Sphere::colour(Ray &inbound, World &world) {
     }
 
     /* Attempt to trace a reflection */
-    shared_ptr<Ray> reflect = inbound.createChild();
-    if ((reflect != 0) && (m_reflectivity.magnitude() != 0)) {
-        reflect->m_endpoint = intersect;
+    Ray reflect;
+    RayColour gain = m_reflectivity;
+    if ((m_reflectivity.magnitude() != 0) &&
+        inbound.createChild(reflect, gain, world.m_minThroughput,
+                            world.m_roulette)) {
+        reflect.m_endpoint = intersect;
         RayVector incNormal (interNorm.dot(inbound.m_dir) * interNorm);
         RayVector incTangent ( (inbound.m_dir) - incNormal );
-        reflect->m_dir = incTangent - incNormal;
-        reflect->nudge();
+        reflect.m_dir = incTangent - incNormal;
+        reflect.nudge();
         
-        if(world.trace(*reflect)) {
-            colour = colour + (m_reflectivity * reflect->m_colour);
+        if(world.trace(reflect)) {
+            colour = colour + (gain * reflect.m_colour);
         }
     }
 
@@ -43,7 +43,7 @@ protected:
     double    m_radius;
 
 protected:
-    RayVector normal(const Coord &point);
+    RayVector normal(const Coord &point) const;
 
 public:
     BaseSphere(const Coord& origin, double radius) : 
@@ -53,7 +53,32 @@ public:
     void setOrigin(const Coord& newOrig) { m_origin = newOrig; }
     void setRadius(double newRad) { m_radius = newRad; }
 
-    virtual double intersectDist(Ray &inbound);
+    virtual double intersectDist(const Ray &inbound) const;
+    virtual void intersectPacket(const RayPacket &packet, double dist[]) const;
+    virtual bool bounds(BoundingBox &box) const;
+    virtual bool normalAt(const Coord &point, RayVector &normal) const {
+        normal = this->normal(point);
+        return true;
+    }
+    virtual void hashGeometry(Hasher &hasher) const {
+        hasher.addXYZ(m_origin);
+        hasher.add(m_radius);
+    }
+
+    /** Check one ray against many spheres, two at a time with SSE2.  The
+     *  results are exactly those of intersectDist() for each sphere.
+     *  @param inbound  The ray to intersect.
+     *  @param cx       Centres of the spheres, by component.
+     *  @param cy       ...
+     *  @param cz       ...
+     *  @param rSq      Radius of each sphere, squared.
+     *  @param count    Number of spheres.  Every array, including dist,
+     *                  must have room for count rounded up to even.
+     *  @param dist     Set to the intersect distance for each sphere. */
+    static void intersectMany(const Ray &inbound, const double cx[],
+                              const double cy[], const double cz[],
+                              const double rSq[], unsigned count,
+                              double dist[]);
 };
 
 /** A solid sphere */
@@ -75,7 +100,20 @@ public:
         m_reflectivity(reflectivity)
         {}
 
-    virtual bool colour(Ray &inbound, World &world);
+    virtual bool colour(Ray &inbound, const World &world) const;
+
+    virtual bool sphere(Coord &centre, double &radius) const {
+        centre = m_origin;
+        radius = m_radius;
+        return true;
+    }
+
+    virtual void hash(Hasher &hasher) const {
+        hasher.addXYZ(m_origin);
+        hasher.add(m_radius);
+        hasher.addRGB(m_diffusivity);
+        hasher.addRGB(m_reflectivity);
+    }
 };
 
 #endif //SPHERE_H_
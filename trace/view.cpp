@@ -23,15 +23,24 @@
 * along with this program.  If not, see <http://www.gnu.org/licenses/>
 *****************************************************************************/
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
+#include <gtest/gtest.h>
 
 #include "view.h"
 
 #include "image/rayImage.h"
+#include "util/clock.h"
+#include "util/parallel.h"
+#include "gbuffer.h"
 #include "util/trace.h"
 #include "geom.h"
 #include "ray.h"
 #include "object.h"
+#include "packet.h"
+#include "sphere.h"
+#include "light_sources.h"
 #include "world.h"
 
 using std::vector;
@@ -42,53 +51,371 @@ static trc_ctl_t viewTrace = {
     TRC_STDOUT
 };
 #define TRACE(level,args...) \
-    trc_printf(&viewTrace,level,1,args)
+    TRC_PRINTF(&viewTrace,level,1,args)
 
-//! Render the given image using the given object list
-void ParallelView::render(RayImage &image, World &world, int depth)
+/** Hands out the tiles of an image to RayView::renderTile */
+class TileTasks : public ParallelTasks {
+private:
+    const RayView &m_view;
+    RayImage      &m_image;
+    const World   &m_world;
+    int            m_depth;
+    unsigned       m_tileSize;
+    unsigned       m_tilesPerRow;
+    GBuffer       *m_gbuffer;
+    double         m_deadline;
+    // Which tile each task traces, if not in order
+    vector<unsigned> m_order;
+    // Pixels traced by each task
+    vector<unsigned> m_traced;
+
+public:
+    TileTasks(const RayView &view, RayImage &image, const World &world,
+              int depth, unsigned tileSize, GBuffer *gbuffer,
+              double deadline) :
+        m_view(view), m_image(image), m_world(world), m_depth(depth),
+        m_tileSize(tileSize),
+        m_tilesPerRow((image.width() + tileSize - 1) / tileSize),
+        m_gbuffer(gbuffer), m_deadline(deadline), m_order(),
+        m_traced(count(), 0)
+    {
+        if (deadline) centreOut();
+    }
+
+    unsigned count() const {
+        unsigned tileRows = (m_image.rows() + m_tileSize - 1) / m_tileSize;
+        return tileRows * m_tilesPerRow;
+    }
+
+    //! Order tiles by the distance of their centres from the image's.
+    void centreOut() {
+        vector<std::pair<double, unsigned> > byDist (count());
+        double midRow = m_image.rows()/2.0;
+        double midCol = m_image.width()/2.0;
+        for (unsigned t=0; t < byDist.size(); ++t) {
+            double dr = (t / m_tilesPerRow + 0.5) * m_tileSize - midRow;
+            double dc = (t % m_tilesPerRow + 0.5) * m_tileSize - midCol;
+            byDist[t] = std::make_pair(dr*dr + dc*dc, t);
+        }
+        std::sort(byDist.begin(), byDist.end());
+        m_order.resize(byDist.size());
+        for (unsigned t=0; t < byDist.size(); ++t) {
+            m_order[t] = byDist[t].second;
+        }
+    }
+
+    unsigned traced() const {
+        unsigned total = 0;
+        for (unsigned t=0; t < m_traced.size(); ++t) total += m_traced[t];
+        return total;
+    }
+
+    virtual void run(unsigned task, unsigned thread) {
+        if (m_deadline && (monotonicSeconds() > m_deadline)) return;
+        unsigned tile = m_order.empty() ? task : m_order[task];
+
+        // Only the rows the image holds are traced
+        unsigned end = m_image.top() + m_image.rows();
+        unsigned row = m_image.top() + (tile / m_tilesPerRow) * m_tileSize;
+        unsigned col = (tile % m_tilesPerRow) * m_tileSize;
+        unsigned rows = std::min(m_tileSize, end - row);
+        unsigned cols = std::min(m_tileSize, m_image.width() - col);
+        m_view.renderTile(m_image, m_world, m_depth, row, col, rows, cols,
+                          m_gbuffer);
+        m_traced[task] = rows * cols;
+    }
+};
+
+//! Render the image (or the band of it held), tile by tile.
+unsigned RayView::render(RayImage &image, const World &world, int depth,
+                         unsigned threads, unsigned tileSize,
+                         GBuffer *gbuffer, double deadline)
+{
+    if (!tileSize) tileSize = 1;
+    prepare(image);
+    if (gbuffer) gbuffer->reset(image, depth);
+
+    TileTasks tiles (*this, image, world, depth, tileSize, gbuffer,
+                     deadline);
+    TRACE(TRC_STAT,"Rendering %u tiles of %u pixels, with %u threads.\n",
+          tiles.count(), tileSize, threads ? threads : defaultThreadCount());
+    runParallel(tiles, tiles.count(), threads);
+    return tiles.traced();
+}
+
+//! Work out the ray direction, which is the same for every pixel
+void ParallelView::prepare(const RayImage &image)
 {
     char trcbuf[36];  // for trace messages
     
-    RayVector viewDir = m_xVec.cross(m_yVec).unitify();
+    m_viewDir = m_xVec.cross(m_yVec).unitify();
 
     TRACE(TRC_STAT,"Beginning ParallelView render.\n");
     TRACE(TRC_STAT,"Image size: %d x %d\n",image.width(),image.height());
     TRACE(TRC_STAT,"Origin: %s\n",m_origin.snprint(trcbuf,36));
     TRACE(TRC_STAT,"xVec: %s\n",m_xVec.snprint(trcbuf,36));
     TRACE(TRC_STAT,"yVec: %s\n",m_yVec.snprint(trcbuf,36));
-    TRACE(TRC_STAT,"Ray direction: %s\n",viewDir.snprint(trcbuf,36));
+    TRACE(TRC_STAT,"Ray direction: %s\n",m_viewDir.snprint(trcbuf,36));
+}
+
+//! Render a block of the image
+void ParallelView::renderTile(RayImage &image, const World &world, int depth,
+                              unsigned row, unsigned col,
+                              unsigned rows, unsigned cols,
+                              GBuffer *gbuffer) const
+{
+    char trcbuf[36];  // for trace messages
 
-    /* Render the image */
     // The proportion of the width vector that is the distance from one pixel 
     // to the next
     double pixStepX = 1.0/image.width();
     double pixStepY = 1.0/image.height();
-    for(unsigned i=0; i<image.height(); i+=1) {
-        for(unsigned j=0; j<image.width(); j+=1) {
-            double xDist =
-                pixStepX/2.0 // middle of pixel
-                + pixStepX*j; // which pixel
-            double yDist = 
-                pixStepY/2.0 
-                + pixStepY*i;
-            
-            image.at(i,j).m_dir = viewDir;
-            image.at(i,j).m_endpoint = m_origin + xDist*m_xVec + yDist*m_yVec;
-            image.at(i,j).m_depthLimit = depth;
-
-            TRACE(TRC_INFO,"Pixel endpoint: %s\n",
-                  image.at(i,j).m_endpoint.snprint(trcbuf,36));
-
-            world.trace(image.at(i,j));
-
-            TRACE(TRC_INFO,"Render [%d,%d]: %s\n",
-                  i,j,image.at(i,j).m_colour.snprint(trcbuf,32));
+    /* All rays are parallel, so runs of pixels along a row make good
+     * packets. */
+    unsigned packetSize = m_packets ? RAY_PACKET_SIZE : 1;
+    for(unsigned i=row; i<row+rows; i+=1) {
+        for(unsigned j=col; j<col+cols; j+=packetSize) {
+            // Rays only live while their pixels are traced
+            Ray packetRays[RAY_PACKET_SIZE];
+            Ray *rays[RAY_PACKET_SIZE];
+            unsigned count = std::min(packetSize, col+cols-j);
+            for(unsigned k=0; k<count; ++k) {
+                double xDist =
+                    pixStepX/2.0 // middle of pixel
+                    + pixStepX*(j+k); // which pixel
+                double yDist = 
+                    pixStepY/2.0 
+                    + pixStepY*i;
+                
+                rays[k] = &packetRays[k];
+                rays[k]->m_dir = m_viewDir;
+                rays[k]->m_endpoint = m_origin + xDist*m_xVec + yDist*m_yVec;
+                rays[k]->m_depthLimit = depth;
+
+                TRACE(TRC_INFO,"Pixel endpoint: %s\n",
+                      rays[k]->m_endpoint.snprint(trcbuf,36));
+            }
+
+            tracePixels(image, world, rays, count, i, j, gbuffer);
         }
     }
 }
 
-void AngleView::render(RayImage &image, World &object, int depth)
+//! Trace a run of pixels along a row, and store their colours
+void RayView::tracePixels(RayImage &image, const World &world,
+                          Ray *rays[], unsigned count,
+                          unsigned row, unsigned col, GBuffer *gbuffer)
 {
-    #warning todo: implement
+    char trcbuf[36];  // for trace messages
+
+    // Pixels along a row are next to each other in the G-buffer
+    PrimaryHit *hits = gbuffer ? &gbuffer->at(row, col) : 0;
+    if (count == 1) {
+        world.trace(*rays[0], hits);
+    } else {
+        RayPacket packet (rays, count);
+        world.tracePacket(packet, hits);
+    }
+
+    for(unsigned k=0; k<count; ++k) {
+        image.set(row, col+k, rays[k]->m_colour);
+        TRACE(TRC_INFO,"Render [%d,%d]: %s\n",
+              row,col+k,rays[k]->m_colour.snprint(trcbuf,32));
+    }
 }
 
+/* Work out the direction of each column and row.  Each pixel covers the
+ * same angle, so the direction of a pixel is its column's direction,
+ * turned towards the image's 'down' by its row's angle:
+ *   dir = cos(rowAngle) * column + sin(rowAngle) * down
+ * which is a unit vector, since column and down are. */
+void AngleView::prepare(const RayImage &image)
+{
+    char trcbuf[36];  // for trace messages
+
+    RayVector right = m_xvec;
+    right.unitify();
+    RayVector forward = m_xvec.cross(m_yvec).unitify();
+    m_down = forward.cross(right);
+
+    m_columns.resize(image.width());
+    for (unsigned j=0; j < image.width(); ++j) {
+        double angle = ((j + 0.5)/image.width() - 0.5) * m_xFov;
+        m_columns[j] = cos(angle)*forward + sin(angle)*right;
+    }
+    m_rowCos.resize(image.height());
+    m_rowSin.resize(image.height());
+    for (unsigned i=0; i < image.height(); ++i) {
+        double angle = ((i + 0.5)/image.height() - 0.5) * m_yFov;
+        m_rowCos[i] = cos(angle);
+        m_rowSin[i] = sin(angle);
+    }
+
+    TRACE(TRC_STAT,"Beginning AngleView render.\n");
+    TRACE(TRC_STAT,"Image size: %d x %d\n",image.width(),image.height());
+    TRACE(TRC_STAT,"Origin: %s\n",m_origin.snprint(trcbuf,36));
+    TRACE(TRC_STAT,"Forward: %s\n",forward.snprint(trcbuf,36));
+    TRACE(TRC_STAT,"Field of view: %f x %f\n",m_xFov,m_yFov);
+}
+
+//! Render a block of the image
+void AngleView::renderTile(RayImage &image, const World &world, int depth,
+                           unsigned row, unsigned col,
+                           unsigned rows, unsigned cols,
+                           GBuffer *gbuffer) const
+{
+    /* Neighbouring rays along a row start at the same point and diverge
+     * only slightly, so they make good packets too. */
+    unsigned packetSize = m_packets ? RAY_PACKET_SIZE : 1;
+    const double dx = m_down.x(), dy = m_down.y(), dz = m_down.z();
+    for(unsigned i=row; i<row+rows; i+=1) {
+        const double c = m_rowCos[i], s = m_rowSin[i];
+        for(unsigned j=col; j<col+cols; j+=packetSize) {
+            // Rays only live while their pixels are traced
+            Ray packetRays[RAY_PACKET_SIZE];
+            Ray *rays[RAY_PACKET_SIZE];
+            unsigned count = std::min(packetSize, col+cols-j);
+            for(unsigned k=0; k<count; ++k) {
+                const RayVector &column = m_columns[j+k];
+                rays[k] = &packetRays[k];
+                rays[k]->m_dir = RayVector(c*column.x() + s*dx,
+                                           c*column.y() + s*dy,
+                                           c*column.z() + s*dz);
+                rays[k]->m_endpoint = m_origin;
+                rays[k]->m_depthLimit = depth;
+            }
+
+            tracePixels(image, world, rays, count, i, j, gbuffer);
+        }
+    }
+}
+
+/* Threaded, tiled rendering with packets must match a plain serial
+ * render exactly. */
+TEST(ViewTest, ThreadedRenderMatchesSerial) {
+    World world;
+    world.m_globalDiffuse.set(0.05, 0.05, 0.15);
+    std::auto_ptr<RayObject> sph (new Sphere(Coord(0,0,0), 1.0,
+        RayColour(0.1, 0.25, 1.0), RayColour(0.5, 0.5, 0.5)));
+    world.addObject(sph);
+    std::auto_ptr<RayObject> sph2 (new Sphere(Coord(0.5,1.5,1.5), 1.5,
+        RayColour(1.0, 1.0, 0.1), RayColour(1.0, 1.0, 0.2)));
+    world.addObject(sph2);
+    std::auto_ptr<RayObject> light (new SphereSource(
+        RayVector(1.5,-2.5,1.5), 0.125, RayColour(90.0,90.0,90.0)));
+    world.addObject(light);
+    world.finalize();
+
+    ParallelView view;
+    view.m_origin = Coord(2.0,-2,2);
+    view.m_xVec = RayVector(0,4.5,0);
+    view.m_yVec = RayVector(0,0,-3);
+
+    RayImage serial (37, 23);
+    RayImage threaded (37, 23);
+    view.m_packets = false;
+    view.render(serial, world, 5, 1, 1000);
+    view.m_packets = true;
+    view.render(threaded, world, 5, 4, 8);
+    for (unsigned i=0; i<serial.height(); ++i) {
+        for (unsigned j=0; j<serial.width(); ++j) {
+            ASSERT_EQ(serial.at(i,j).r, threaded.at(i,j).r);
+            ASSERT_EQ(serial.at(i,j).g, threaded.at(i,j).g);
+            ASSERT_EQ(serial.at(i,j).b, threaded.at(i,j).b);
+        }
+    }
+}
+
+/* Tracing an image a band of rows at a time gives the same pixels. */
+TEST(ViewTest, BandsMatchWhole) {
+    World world;
+    world.m_globalDiffuse.set(0.05, 0.05, 0.15);
+    world.addSphere(Coord(0,0,0), 1.0,
+        RayColour(0.1, 0.25, 1.0), RayColour(0.5, 0.5, 0.5));
+    std::auto_ptr<RayObject> light (new SphereSource(
+        RayVector(1.5,-2.5,1.5), 0.125, RayColour(90.0,90.0,90.0)));
+    world.addObject(light);
+    world.finalize();
+
+    ParallelView view;
+    view.m_origin = Coord(2.0,-2,2);
+    view.m_xVec = RayVector(0,4.5,0);
+    view.m_yVec = RayVector(0,0,-3);
+
+    RayImage whole (29, 23);
+    view.render(whole, world, 5, 1, 8);
+    for (unsigned top=0; top<whole.height(); top+=5) {
+        unsigned rows = std::min(5u, whole.height() - top);
+        RayImage band;
+        band.setBand(29, 23, top, rows);
+        view.render(band, world, 5, 2, 4);
+        for (unsigned i=top; i<top+rows; ++i) {
+            for (unsigned j=0; j<whole.width(); ++j) {
+                ASSERT_EQ(whole.at(i,j).r, band.at(i,j).r);
+                ASSERT_EQ(whole.at(i,j).g, band.at(i,j).g);
+                ASSERT_EQ(whole.at(i,j).b, band.at(i,j).b);
+            }
+        }
+    }
+}
+
+/* A perspective view traces the same pixels however it's split into
+ * threads, tiles, packets and bands, and its rays fan out evenly over
+ * the field of view. */
+TEST(ViewTest, AngleView) {
+    World world;
+    world.m_globalDiffuse.set(0.05, 0.05, 0.15);
+    world.addSphere(Coord(0,0,0), 1.0,
+        RayColour(0.1, 0.25, 1.0), RayColour(0.5, 0.5, 0.5));
+    world.addSphere(Coord(1.5,1.5,0.5), 0.75,
+        RayColour(1.0, 1.0, 0.1), RayColour(1.0, 1.0, 0.2));
+    std::auto_ptr<RayObject> light (new SphereSource(
+        RayVector(1.5,-2.5,1.5), 0.125, RayColour(90.0,90.0,90.0)));
+    world.addObject(light);
+    world.finalize();
+
+    AngleView view;
+    view.m_origin = Coord(6.0,0,0);
+    view.m_xvec = RayVector(0,1,0);
+    view.m_yvec = RayVector(0,0,-1);
+    view.m_xFov = 0.8;
+    view.m_yFov = 0.6;
+
+    RayImage serial (41, 27);
+    GBuffer gbuffer;
+    view.m_packets = false;
+    view.render(serial, world, 5, 1, 1000, &gbuffer);
+    RayImage threaded (41, 27);
+    view.m_packets = true;
+    view.render(threaded, world, 5, 3, 8);
+    RayImage band;
+    band.setBand(41, 27, 10, 9);
+    view.render(band, world, 5, 2, 4);
+    for (unsigned i=0; i<serial.height(); ++i) {
+        for (unsigned j=0; j<serial.width(); ++j) {
+            ASSERT_EQ(serial.at(i,j).r, threaded.at(i,j).r);
+            ASSERT_EQ(serial.at(i,j).g, threaded.at(i,j).g);
+            ASSERT_EQ(serial.at(i,j).b, threaded.at(i,j).b);
+            if ((i >= band.top()) && (i < band.top() + band.rows())) {
+                ASSERT_EQ(serial.at(i,j).b, band.at(i,j).b);
+            }
+        }
+    }
+
+    // The centre looks along -x, at the sphere; the corners miss it
+    RayVector forward (-1,0,0);
+    ASSERT_NEAR(1.0, gbuffer.at(13, 20).m_dir.dot(forward), 1E-12);
+    ASSERT_TRUE(gbuffer.at(13, 20).m_object != 0);
+    ASSERT_TRUE(gbuffer.at(0, 0).m_object == 0);
+    for (unsigned i=0; i<gbuffer.height(); ++i) {
+        for (unsigned j=0; j<gbuffer.width(); ++j) {
+            const RayVector &dir = gbuffer.at(i, j).m_dir;
+            ASSERT_NEAR(1.0, dir.length(), 1E-12);
+            // Angle across the image, from the centre of the row
+            double across = atan2(dir.y(), -dir.x());
+            ASSERT_NEAR((j + 0.5)/41 * 0.8 - 0.4, across, 1E-12);
+            double down = asin(-dir.z());
+            ASSERT_NEAR((i + 0.5)/27 * 0.6 - 0.3, down, 1E-12);
+        }
+    }
+}
@@ -29,16 +29,73 @@
 #include <vector>
 #include "image/colour.h"
 #include "geom.h"
+#include "util/hash.h"
 
+class GBuffer;
 class RayObject;
 class RayImage;
 class Ray;
 class World;
 
-/** The RayView class interface. */
+/** The RayView class interface.  A view is rendered in square tiles,
+ *  which may be traced by several threads at once. */
 class RayView {
+    // Hands tiles to renderTile()
+    friend class TileTasks;
+
+protected:
+    /* Called once per render, before any tiles are traced, to set up
+     * whatever renderTile() needs. */
+    virtual void prepare(const RayImage &image) {}
+
+    /* Trace one rectangular block of the image.  This may be called from
+     * several threads at once, for different blocks.
+     * @param row, col    The top-left pixel of the block
+     * @param rows, cols  The size of the block
+     * @param gbuffer     If not 0, the primary hit of each pixel is
+     *                    recorded here. */
+    virtual void renderTile(RayImage &image, const World &world, int depth,
+                            unsigned row, unsigned col,
+                            unsigned rows, unsigned cols,
+                            GBuffer *gbuffer) const = 0;
+
+    /* Trace a run of up to RAY_PACKET_SIZE pixels along a row, starting at
+     * (row, col), as a packet if there's more than one, and set their
+     * colours (and G-buffer entries, if gbuffer isn't 0). */
+    static void tracePixels(RayImage &image, const World &world,
+                            Ray *rays[], unsigned count,
+                            unsigned row, unsigned col, GBuffer *gbuffer);
+
 public:
-    virtual void render(RayImage &image, World &world, int depth=0) = 0;
+    /** Whether to trace neighbouring primary rays together in packets,
+     *  where the view allows it.  This doesn't change the output. */
+    bool m_packets;
+
+    RayView() : m_packets(true) {}
+    virtual ~RayView() {}
+
+    /* Add everything which affects the traced image to a hash, so that
+     * changes to the view can be noticed. */
+    virtual void hash(Hasher &hasher) const = 0;
+
+    /* Trace every pixel in the image.  If the image only holds a band of
+     * rows, just those are traced.  The output doesn't depend on the
+     * number of threads, the tile size or the bands.
+     * @param depth    The maximum number of reflections to trace
+     * @param threads  The number of threads to trace with.  0 for one
+     *                 per CPU.
+     * @param tileSize The width and height of the blocks of pixels handed
+     *                 out to each thread
+     * @param gbuffer  If not 0, reset to the size of the image and given
+     *                 the primary hit of every pixel, for relighting
+     * @param deadline If not 0, a time from monotonicSeconds() after which
+     *                 no more tiles are started.  Tiles are then traced
+     *                 from the centre of the image out, and pixels of the
+     *                 tiles not traced are left as they were.
+     * @return the number of pixels traced */
+    unsigned render(RayImage &image, const World &world, int depth=0,
+                    unsigned threads=1, unsigned tileSize=32,
+                    GBuffer *gbuffer=0, double deadline=0.0);
 };
 
 /** A simple RayView implementation, which traces a number of parallel rays
@@ -53,21 +110,65 @@ public:
     Coord       m_origin;
     RayVector   m_xVec;
     RayVector   m_yVec;
-  
-    virtual void render(RayImage &image, World &world, int depth=0);
+
+    virtual void hash(Hasher &hasher) const {
+        hasher.addXYZ(m_origin);
+        hasher.addXYZ(m_xVec);
+        hasher.addXYZ(m_yVec);
+    }
+
+private:
+    // Direction of all rays, computed in prepare()
+    RayVector   m_viewDir;
+
+protected:
+    virtual void prepare(const RayImage &image);
+    virtual void renderTile(RayImage &image, const World &world, int depth,
+                            unsigned row, unsigned col,
+                            unsigned rows, unsigned cols,
+                            GBuffer *gbuffer) const;
 };
 
 /** A view projected from a single point, with rays diverging over a given
  *  field of view */
 class AngleView: public RayView {
 public:
+    /** View geometry.
+     *  m_origin is the point all rays start from.
+     *  m_xvec points in the image's 'right' direction
+     *  m_yvec points in the image's 'down' direction
+     *  The centre of the image looks along the cross of m_xvec with m_yvec.
+     *  m_xFov and m_yFov are the angles, in radians, across the image's
+     *  width and height.  Every pixel covers the same angle. */
     Coord     m_origin;
     RayVector m_xvec;
     double    m_xFov;
     RayVector m_yvec;
     double    m_yFov;
 
-    virtual void render(RayImage &image, World &world, int depth=0);
+    virtual void hash(Hasher &hasher) const {
+        hasher.addXYZ(m_origin);
+        hasher.addXYZ(m_xvec);
+        hasher.add(m_xFov);
+        hasher.addXYZ(m_yvec);
+        hasher.add(m_yFov);
+    }
+
+private:
+    /* Worked out in prepare(): unit vectors towards the centre of each
+     * column, the image's 'down', and the sine and cosine of the angle
+     * of each row (of the whole image) from the centre. */
+    std::vector<RayVector> m_columns;
+    RayVector              m_down;
+    std::vector<double>    m_rowCos;
+    std::vector<double>    m_rowSin;
+
+protected:
+    virtual void prepare(const RayImage &image);
+    virtual void renderTile(RayImage &image, const World &world, int depth,
+                            unsigned row, unsigned col,
+                            unsigned rows, unsigned cols,
+                            GBuffer *gbuffer) const;
 };
 
 #endif //view_h_
@@ -21,16 +21,21 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  *****************************************************************************/
 
+#include <cstdlib>
 #include <vector>
 #include <cmath>
+#include <gtest/gtest.h>
 
 #include "world.h"
 
 #include "image/colour.h"
 #include "util/trace.h"
+#include "gbuffer.h"
 #include "lighting.h"
 #include "object.h"
+#include "packet.h"
 #include "ray.h"
+#include "sphere.h"
 
 using std::vector;
 
@@ -40,35 +45,210 @@ static trc_ctl_t worldTrace = {
     TRC_STDOUT
 };
 #define TRACE(level, args...) \
-   trc_printf(&worldTrace,level,1,args)
+   TRC_PRINTF(&worldTrace,level,1,args)
 
 World::~World() {
+    for (unsigned i=0; i < m_owned.size(); ++i) {
+        delete m_owned[i];
+    }
+}
+
+//! Add an object, noting whether it is a light
+void World::addObject(std::auto_ptr<RayObject> &obj)
+{
+    RayObject *added = obj.release();
+    m_owned.push_back(added);
+    m_objects.push_back(added);
+    if (added->emitsLight()) {
+        m_lights.push_back(added);
+    }
+    m_dirty = true;
+}
+
+//! Add a sphere from the pool
+Sphere* World::addSphere(const Coord &origin, double radius,
+                         const RayColour &diffusivity,
+                         const RayColour &reflectivity)
+{
+    Sphere *added = m_spheres.create
+        (Sphere(origin, radius, diffusivity, reflectivity));
+    m_objects.push_back(added);
+    m_dirty = true;
+    return added;
+}
+
+//! Feed everything that affects tracing into the hasher
+void World::hash(Hasher &hasher) const
+{
+    hasher.addRGB(m_defaultColour);
+    hasher.addRGB(m_globalDiffuse);
+    hasher.add(m_minThroughput);
+    hasher.add(m_roulette ? 1 : 0);
+    hasher.add((unsigned)(m_objects.size()));
     for (unsigned i=0; i < m_objects.size(); ++i) {
-        delete m_objects[i];
+        m_objects[i]->hash(hasher);
     }
 }
 
-//! Trace a ray
-bool World::trace(Ray &ray)
+//! Feed the shape and position of every object into the hasher
+void World::hashGeometry(Hasher &hasher) const
 {
-    ray.m_colour = m_defaultColour;
+    hasher.add((unsigned)(m_objects.size()));
+    for (unsigned i=0; i < m_objects.size(); ++i) {
+        m_objects[i]->hashGeometry(hasher);
+    }
+}
+
+uint64_t World::geometryKey() const
+{
+    Hasher hasher;
+    hashGeometry(hasher);
+    return hasher.value();
+}
+
+//! Build the search structures, unless they still fit the objects
+void World::finalize()
+{
+    uint64_t key = geometryKey();
+    if (!m_dirty && (key == m_geometryKey)) {
+        TRACE(TRC_INFO, "World unchanged since finalized.\n");
+        return;
+    }
+    m_bvh.build(m_objects);
+    findUnbounded();
+    m_geometryKey = key;
+    m_restored = false;
+}
+
+bool World::finalize(const BoundingVolumeHierarchy::Node nodes[],
+                     unsigned numNodes, const unsigned order[],
+                     unsigned numOrder)
+{
+    if (!m_bvh.restore(m_objects, nodes, numNodes, order, numOrder)) {
+        TRACE(TRC_WARN, "Saved hierarchy doesn't fit the world; rebuilding.\n");
+        finalize();
+        return false;
+    }
+    findUnbounded();
+    m_geometryKey = geometryKey();
+    m_restored = true;
+    return true;
+}
+
+void World::findUnbounded()
+{
+    BoundingBox unused;
+    m_unbounded.clear();
+    m_unboundedIndex.clear();
+    for (unsigned i=0; i < m_objects.size(); ++i) {
+        if (!m_objects[i]->bounds(unused)) {
+            m_unbounded.push_back(m_objects[i]);
+            m_unboundedIndex.push_back(i);
+        }
+    }
+
+    TRACE(TRC_STAT, "Finalized world: %u objects, %u unbounded.\n",
+          (unsigned)(m_objects.size()), (unsigned)(m_unbounded.size()));
+    m_dirty = false;
+}
+
+//! Find the closest object intersecting a ray
+RayObject* World::closest(const Ray &ray, double &dist) const
+{
+    /* Until the world is finalized again, every object is 'unbounded' */
+    const vector<RayObject*> &unbounded = m_dirty ? m_objects : m_unbounded;
+
     RayObject *closest = 0;
+    unsigned closestIndex = 0;
+    dist = -1.0;
+
+    /* Unbounded objects are few, and just get checked linearly.
+     * closestIndex lets the BVH break exact ties by the order objects
+     * were added, as a linear search of every object would. */
+    for (unsigned i=0; i < unbounded.size(); ++i) {
+        double curDist = unbounded[i]->intersectDist(ray);
+        TRACE(TRC_DTL, "Unbounded object %d distance: %f\n", i, curDist);
+        if ((curDist >= 0.0) && ((!closest) || (curDist < dist))) {
+            closest = unbounded[i];
+            closestIndex = m_dirty ? i : m_unboundedIndex[i];
+            dist = curDist;
+        }
+    }
+    if (m_dirty) return closest;
+
+    RayObject *bvhClosest = m_bvh.closest(ray, dist, closestIndex);
+    if (bvhClosest) closest = bvhClosest;
+
+    return closest;
+}
+
+//! Trace a ray
+bool World::trace(Ray &ray, PrimaryHit *hit) const
+{
     double closestDist = 0.0;
    
     /* See if the ray hits any objects */
-    for(unsigned i=0; i < m_objects.size(); ++i) {
-        double curDist = m_objects.at(i)->intersectDist(ray);
-        TRACE(TRC_DTL, "Object %d distance: %f\n", i, curDist);
-
-        if(curDist >= 0.0) { // Actually intersects
-            if( (!closest) || (curDist < closestDist) ) {
-                // First intersection, or smallest intersection yet
-                closest = m_objects.at(i);
-                closestDist = curDist;
+    RayObject *closest = this->closest(ray, closestDist);
+    return shade(ray, closest, closestDist, hit);
+}
+
+//! Trace a packet of rays
+bool World::tracePacket(RayPacket &packet, PrimaryHit hits[]) const
+{
+    bool ok = true;
+
+    if (m_dirty || !packet.coherent()) {
+        // Not worth tracing together.
+        for (unsigned k=0; k < packet.m_count; ++k) {
+            ok = trace(*packet.m_rays[k], hits ? hits + k : 0) && ok;
+        }
+        return ok;
+    }
+
+    /* Same search as closest(), but for all rays at once */
+    RayObject *closest[RAY_PACKET_SIZE];
+    double dist[RAY_PACKET_SIZE];
+    unsigned index[RAY_PACKET_SIZE];
+    for (unsigned k=0; k < RAY_PACKET_SIZE; ++k) {
+        closest[k] = 0;
+        dist[k] = -1.0;
+        index[k] = 0;
+    }
+    for (unsigned k=0; k < packet.m_count; ++k) {
+        for (unsigned i=0; i < m_unbounded.size(); ++i) {
+            double curDist = m_unbounded[i]->intersectDist(*packet.m_rays[k]);
+            if ((curDist >= 0.0) && ((!closest[k]) || (curDist < dist[k]))) {
+                closest[k] = m_unbounded[i];
+                index[k] = m_unboundedIndex[i];
+                dist[k] = curDist;
             }
         }
     }
-    
+
+    m_bvh.closestPacket(packet, dist, index, closest);
+
+    for (unsigned k=0; k < packet.m_count; ++k) {
+        ok = shade(*packet.m_rays[k], closest[k], dist[k],
+                   hits ? hits + k : 0) && ok;
+    }
+    return ok;
+}
+
+//! Colour a ray by the object it hits
+bool World::shade(Ray &ray, const RayObject *closest, double dist,
+                  PrimaryHit *hit) const
+{
+    ray.m_colour = m_defaultColour;
+
+    if (hit) {
+        hit->m_object = closest;
+        hit->m_endpoint = ray.m_endpoint;
+        hit->m_dir = ray.m_dir;
+        hit->m_dist = closest ? dist : -1.0;
+        hit->m_normal.set(0, 0, 0);
+        if (closest) closest->normalAt(hit->point(), hit->m_normal);
+    }
+
     if( !closest ) {
         // Ray hits no objects, use background colour
         TRACE(TRC_INFO,"Ray hit no objects, given background colour.\n");
@@ -77,7 +257,7 @@ bool World::trace(Ray &ray)
         return true;
     }
 
-    ray.m_intersectDist = closestDist;
+    ray.m_intersectDist = dist;
     if( closest->colour(ray, *this) ) {
         // Found colour successfully
         TRACE(TRC_INFO,"Got ray colour from intersect object.\n");
@@ -88,24 +268,157 @@ bool World::trace(Ray &ray)
     return false;   
 }
 
+//! Colour a ray from a recorded hit
+bool World::relight(Ray &ray, const PrimaryHit &hit) const
+{
+    ray.m_endpoint = hit.m_endpoint;
+    ray.m_dir = hit.m_dir;
+    return shade(ray, hit.m_object, hit.m_dist);
+}
+
 //! Find the first object intersecting a ray
-RayObject* World::intersect(Ray &ray)
+RayObject* World::intersect(Ray &ray) const
 {
-    RayObject *closest = 0;
     double closestDist = -1.0;
+    RayObject *closest = this->closest(ray, closestDist);
 
-    /* Look for objects for intersections */
-    for(unsigned i=0; i < m_objects.size(); ++i) {
-        double curDist = m_objects.at(i)->intersectDist(ray);
-        if(curDist >= 0.0) {
-            if( (!closest) || (curDist < closestDist) ) {
-                closest = m_objects.at(i);
-                closestDist = curDist;
-            }
+    ray.m_intersectDist = closestDist;
+    return closest;
+}
+
+//! Check for any object along a ray
+bool World::occluded(const Coord &origin, const RayVector &dir, double maxDist,
+                     const RayObject *ignore) const
+{
+    Ray ray;
+    ray.m_endpoint = origin;
+    ray.m_dir = dir;
+
+    const vector<RayObject*> &unbounded = m_dirty ? m_objects : m_unbounded;
+    for (unsigned i=0; i < unbounded.size(); ++i) {
+        if (unbounded[i] == ignore) continue;
+        double curDist = unbounded[i]->intersectDist(ray);
+        if ((curDist >= 0.0) && (curDist < maxDist)) return true;
+    }
+    if (m_dirty) return false;
+
+    return m_bvh.anyHit(ray, maxDist, ignore);
+}
+
+/* A sphere which reports no bounds, so the world tests it linearly rather
+ * than through the hierarchy. */
+class UnboundedSphere : public Sphere {
+public:
+    UnboundedSphere(const Coord &origin, double radius,
+                    const RayColour &diffusivity) :
+        Sphere(origin, radius, diffusivity)
+        { /* n/a */ }
+    virtual bool bounds(BoundingBox &box) const { return false; }
+};
+
+//! Exact ties go to the object added first, bounded or not.
+TEST(WorldTest, TiesKeepOrder) {
+    for (int unboundedFirst=0; unboundedFirst<2; ++unboundedFirst) {
+        World world;
+        Coord origin (0, 0, 10);
+        std::auto_ptr<RayObject> bounded
+            (new Sphere(origin, 1.0, RayColour(1, 0, 0)));
+        std::auto_ptr<RayObject> unbounded
+            (new UnboundedSphere(origin, 1.0, RayColour(0, 1, 0)));
+        RayObject *first = unboundedFirst ? unbounded.get() : bounded.get();
+        if (unboundedFirst) world.addObject(unbounded);
+        world.addObject(bounded);
+        if (!unboundedFirst) world.addObject(unbounded);
+
+        for (int pass=0; pass<2; ++pass) {
+            Ray ray;
+            ray.m_endpoint = Coord(0, 0, 0);
+            ray.m_dir = RayVector(0, 0, 1);
+            EXPECT_EQ(first, world.intersect(ray));
+            world.finalize();
+        }
+
+        // And the same for packets
+        Ray rays[RAY_PACKET_SIZE];
+        Ray *rayPtrs[RAY_PACKET_SIZE];
+        for (unsigned k=0; k<RAY_PACKET_SIZE; ++k) {
+            rays[k].m_endpoint = Coord(0.01*k, 0, 0);
+            rays[k].m_dir = RayVector(0, 0, 1);
+            rayPtrs[k] = rays + k;
+        }
+        RayPacket packet (rayPtrs, RAY_PACKET_SIZE);
+        PrimaryHit hits[RAY_PACKET_SIZE];
+        ASSERT_TRUE(world.tracePacket(packet, hits));
+        for (unsigned k=0; k<RAY_PACKET_SIZE; ++k) {
+            EXPECT_EQ(first, hits[k].m_object);
         }
     }
+}
 
-    ray.m_intersectDist = closestDist;
-    return closest;
+/* Finalizing again keeps the hierarchy if nothing has changed, but
+ * notices spheres moved in place. */
+TEST(WorldTest, FinalizeAfterMove) {
+    World world;
+    Sphere *sph = world.addSphere(Coord(0, 0, 10), 1.0, RayColour(1, 0, 0));
+    world.addSphere(Coord(5, 5, 10), 1.0, RayColour(0, 1, 0));
+    world.finalize();
+    world.finalize();
+
+    sph->setOrigin(Coord(0, 0, 20));
+    world.finalize();
+    Ray ray;
+    ray.m_endpoint = Coord(0, 0, 0);
+    ray.m_dir = RayVector(0, 0, 1);
+    ASSERT_EQ(sph, world.intersect(ray));
+    ASSERT_EQ(19.0, ray.m_intersectDist);
+}
+
+/* A sphere of negative radius traces as one of the positive radius, so it
+ * must be found the same way through the hierarchy as without it. */
+TEST(WorldTest, NegativeRadius) {
+    World world;
+    world.addSphere(Coord(0, 0, 10), -1.0, RayColour(1, 0, 0));
+    for (int pass=0; pass<2; ++pass) {
+        Ray ray;
+        ray.m_endpoint = Coord(0, 0, 0);
+        ray.m_dir = RayVector(0, 0, 1);
+        ASSERT_TRUE(world.intersect(ray) != 0);
+        ASSERT_EQ(9.0, ray.m_intersectDist);
+        world.finalize();
+    }
 }
 
+//! Pooled spheres must trace exactly like ones added by addObject().
+TEST(WorldTest, PooledSpheres) {
+    World pooled;
+    World added;
+    srand(2468);
+    for (int i=0; i<200; ++i) {
+        Coord origin (rand()%200/10.0 - 10.0,
+                      rand()%200/10.0 - 10.0,
+                      rand()%200/10.0);
+        double radius = 0.1 + rand()%10/10.0;
+        RayColour diffuse (0.5, 0.2, 0.2);
+        pooled.addSphere(origin, radius, diffuse);
+        std::auto_ptr<RayObject> sph (new Sphere(origin, radius, diffuse));
+        added.addObject(sph);
+    }
+    ASSERT_EQ(added.objects().size(), pooled.objects().size());
+
+    // Results must also hold before finalizing.
+    for (int pass=0; pass<2; ++pass) {
+        for (int r=0; r<200; ++r) {
+            Ray a, b;
+            a.m_endpoint = b.m_endpoint = Coord(rand()%100/10.0 - 5.0,
+                                                rand()%100/10.0 - 5.0, -5);
+            a.m_dir = b.m_dir = RayVector(rand()%100 - 50, rand()%100 - 50,
+                                          100).unitify();
+            RayObject *hitA = added.intersect(a);
+            RayObject *hitB = pooled.intersect(b);
+            ASSERT_EQ(hitA == 0, hitB == 0);
+            ASSERT_EQ(a.m_intersectDist, b.m_intersectDist);
+        }
+        pooled.finalize();
+        added.finalize();
+    }
+}
@@ -27,19 +27,73 @@
 #include <vector>
 #include <memory>
 #include "image/colour.h"
+#include "trace/bvh.h"
+#include "trace/geom.h"
+#include "trace/sphere.h"
+#include "util/hash.h"
+#include "util/pool.h"
 
 class LightSource;
+class PrimaryHit;
 class Ray;
 class RayObject;
+class RayPacket;
 
 /** A simple list of objects which may appear in a raytraced image.
- *  ( Could just use a std::vector right now, but I plan to add 
- *    extra features to speed up searches, so it's its own class */
+ *  Searches for intersecting objects go through a bounding volume
+ *  hierarchy, which is built when the world is finalized. */
 class World {
 private:
     std::vector<RayObject*> m_objects;
-    
+    /* The subset of m_objects which were added by addObject(), and so
+     * must be deleted by the world. */
+    std::vector<RayObject*> m_owned;
+    // Spheres added by addSphere().  These are also in m_objects.
+    ObjectPool<Sphere>      m_spheres;
+    // The subset of m_objects which emit light.
+    std::vector<RayObject*> m_lights;
+
+    // Hierarchy over all objects which have bounds.
+    BoundingVolumeHierarchy m_bvh;
+    // Objects without bounds, which must be tested against every ray.
+    std::vector<RayObject*> m_unbounded;
+    /* Position of each of m_unbounded in m_objects, so that exact ties
+     * with the hierarchy go to the object added first. */
+    std::vector<unsigned>   m_unboundedIndex;
+    /* Whether objects have been added since the last finalize().  If so,
+     * searches fall back to testing every object. */
+    bool m_dirty;
+    // hashGeometry() as of the last finalize()
+    uint64_t m_geometryKey;
+    // Whether the hierarchy was restored, rather than built
+    bool m_restored;
+
+private:
+    /* Find the closest object intersecting the ray.
+     * @param dist Set to the intersect distance, or -1.0 if no hit.
+     * @return The closest object, 0 if none intersect. */
+    RayObject* closest(const Ray &ray, double &dist) const;
+
+    /* Colour a ray, once the closest object has been found.
+     * @param hit  If not 0, where the ray hit is recorded here.
+     * @return as for trace() */
+    bool shade(Ray &ray, const RayObject *closest, double dist,
+               PrimaryHit *hit = 0) const;
+
+    /* Finish finalizing, once the hierarchy is built: list the objects
+     * it doesn't cover. */
+    void findUnbounded();
+
+    //! hashGeometry(), as a single value
+    uint64_t geometryKey() const;
+
 public:
+    World() : m_objects(), m_owned(), m_spheres(), m_lights(), m_bvh(),
+        m_unbounded(), m_unboundedIndex(), m_dirty(false),
+        m_geometryKey(0), m_restored(false), m_minThroughput(0.0),
+        m_roulette(false)
+        { /* n/a */ }
+
     ~World();
 
     //! Colour returned when a ray trace fails
@@ -47,13 +101,44 @@ public:
     /** Diffuse light experienced by all objects.  This is also the background
      *  colour that is set to any non-intersecting rays */
     RayColour m_globalDiffuse;
-  
+    /** Reflections which would contribute less than this (in their
+     *  largest colour component) to a pixel aren't traced.  0 to trace
+     *  every reflection the depth limit allows.  See Ray::createChild. */
+    double    m_minThroughput;
+    /** Trace some of the reflections cut off by m_minThroughput at
+     *  random, weighted so the image is right on average, rather than
+     *  dropping them all. */
+    bool      m_roulette;
+
+    /* Searching the world does not modify it, so once the world has been
+     * finalized, any number of threads may trace rays through it at once. */
+
     /** Trace a ray.
      *  @param ray  The ray to trace.
      *              The final colour of the ray will be stored in ray->m_colour
+     *  @param hit  If not 0, the object the ray hits first, and where, is
+     *              recorded here, so that relight() can shade it again.
      *  @return true if the trace succeeds
      *          false if the trace fails, (e.g. too many reflections) */
-    bool trace(Ray &ray);
+    bool trace(Ray &ray, PrimaryHit *hit = 0) const;
+
+    /** Trace every ray in a packet.  The results are exactly the same as
+     *  calling trace() on each ray, but if the packet is coherent, the
+     *  closest objects are found for all of its rays in one search.
+     *  @param packet The rays to trace.
+     *  @param hits   If not 0, the hit of each ray is recorded here, as
+     *                for trace().  Has an entry for each ray.
+     *  @return true if all of the traces succeed */
+    bool tracePacket(RayPacket &packet, PrimaryHit hits[] = 0) const;
+
+    /** Colour a ray again from a hit recorded by trace(), without
+     *  searching for it.  The result is exactly what trace() would give,
+     *  provided the hit object hasn't moved and nothing now lies in front
+     *  of it; lights and surface colours may have changed.
+     *  @param ray  Given the ray of the hit, and coloured.  The depth
+     *              limit must be set by the caller.
+     *  @return as for trace() */
+    bool relight(Ray &ray, const PrimaryHit &hit) const;
 
     /** Determine which object a ray first intersects, but do not colour
      *  or continue tracing 
@@ -61,15 +146,70 @@ public:
      *             Intersect distance will be set if an intersect is found.
      *  @return    The first object intersecting the ray. 
      *             null if no objects intersect. */
-    RayObject* intersect(Ray &ray);
+    RayObject* intersect(Ray &ray) const;
+
+    /** Determine whether anything lies along a ray within some distance.
+     *  This is cheaper than intersect(), since the search stops at the
+     *  first object found.  (e.g. for shadow rays)
+     *  @param origin  Where the ray starts.
+     *  @param dir     Unit vector along which the ray travels.
+     *  @param maxDist Objects at or beyond this distance are ignored.
+     *  @param ignore  An object which never occludes, e.g. a visible light
+     *                 source checking its own shadow rays.  May be 0.
+     *  @return        true if some object intersects the ray within maxDist */
+    bool occluded(const Coord &origin, const RayVector &dir, double maxDist,
+                  const RayObject *ignore = 0) const;
  
     /** Add an object to the world. */
-    void addObject(std::auto_ptr<RayObject> &obj)
-        { m_objects.push_back(obj.release()); }
+    void addObject(std::auto_ptr<RayObject> &obj);
+
+    /** Add a sphere to the world.  This is the same as adding a Sphere
+     *  with addObject(), but the spheres are allocated in large blocks,
+     *  which is much quicker for scenes with many of them.
+     *  @return The new sphere, which belongs to the world. */
+    Sphere* addSphere(const Coord &origin, double radius,
+                      const RayColour &diffusivity = RayColour(0,0,0),
+                      const RayColour &reflectivity = RayColour(0,0,0));
+
+    /** Add everything which affects how the world looks to a hash. */
+    void hash(Hasher &hasher) const;
+
+    /** Add just what decides where rays hit the world's objects to a
+     *  hash.  Lights and surface colours are left out; see GBuffer. */
+    void hashGeometry(Hasher &hasher) const;
+
+    /** Build search structures once all objects have been added.
+     *  Searches still work if objects are added afterwards, but they
+     *  will be slow until this is called again.  If nothing has been
+     *  added, and no object has changed shape or moved (see
+     *  hashGeometry()), the structures are kept as they are. */
+    void finalize();
 
-    /* Access objects.  (For lighting) */
+    /** As finalize(), restoring a hierarchy saved from hierarchy() of a
+     *  world with the same objects, rather than building it again.  If
+     *  the hierarchy doesn't fit the objects, it is built as usual.
+     *  @return true if the hierarchy was restored */
+    bool finalize(const BoundingVolumeHierarchy::Node nodes[],
+                  unsigned numNodes, const unsigned order[],
+                  unsigned numOrder);
+
+    //! Whether nothing has been added since the last finalize().
+    bool isFinalized() const { return !m_dirty; }
+
+    /** Whether the current hierarchy was restored by finalize(nodes, ...)
+     *  rather than built. */
+    bool isRestored() const { return m_restored; }
+
+    //! The search hierarchy, as of the last finalize().
+    const BoundingVolumeHierarchy& hierarchy() const { return m_bvh; }
+
+    /* Access objects. */
     const std::vector<RayObject*>& objects() const 
         {return m_objects;}
+
+    /* Access the objects which emit light.  (For lighting) */
+    const std::vector<RayObject*>& lights() const
+        {return m_lights;}
 };
 
 #endif //world_h_
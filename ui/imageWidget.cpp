@@ -37,7 +37,7 @@ static trc_ctl_t imgWidgetTrace = {
     TRC_STDOUT
 };
 #define TRACE(level, args...) \
-    trc_printf(&imgWidgetTrace,level,1,args)
+    TRC_PRINTF(&imgWidgetTrace,level,1,args)
 
 ImageWidget::ImageWidget(Image &img, QWidget * parent) :
     QWidget(parent),
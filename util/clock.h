@@ -0,0 +1,36 @@
+/******************************************************************************
+ * clock.h
+ * Copyright 2011 Iain Peet
+ *
+ * Provides a monotonic clock, for timing work against a deadline.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <time.h>
+
+/* Seconds since some fixed point in the past.  Never goes backwards, even
+ * if the system time is changed. */
+inline double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1E-9;
+}
+
+#endif //CLOCK_H_
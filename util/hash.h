@@ -0,0 +1,82 @@
+/******************************************************************************
+ * hash.h
+ * Copyright 2011 Iain Peet
+ *
+ * Provides a simple hash for noticing when things change.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <cstring>
+#include <stdint.h>
+
+/** Accumulates a 64 bit FNV-1a hash, a word at a time.  Not for
+ *  security, just for telling whether something has changed. */
+class Hasher {
+private:
+    uint64_t m_hash;
+
+public:
+    Hasher() : m_hash(14695981039346656037ULL) {}
+
+    void add(uint64_t word) {
+        m_hash = (m_hash ^ word) * 1099511628211ULL;
+    }
+    void add(double value) {
+        uint64_t word;
+        memcpy(&word, &value, sizeof(word));
+        add(word);
+    }
+    void add(int value) { add((uint64_t)(value)); }
+    void add(unsigned value) { add((uint64_t)(value)); }
+    void add(const void *ptr) { add((uint64_t)(uintptr_t)(ptr)); }
+
+    //! Add raw bytes, a word at a time.  The tail is zero padded.
+    void addBytes(const void *data, size_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char*>(data);
+        uint64_t word;
+        for (; size >= sizeof(word); size -= sizeof(word)) {
+            memcpy(&word, bytes, sizeof(word));
+            add(word);
+            bytes += sizeof(word);
+        }
+        if (size) {
+            word = 0;
+            memcpy(&word, bytes, size);
+            add(word);
+        }
+    }
+
+    //! Add anything with x(), y() and z(), e.g. a RayVector
+    template <class V> void addXYZ(const V &v) {
+        add(v.x());
+        add(v.y());
+        add(v.z());
+    }
+    //! Add anything with r, g and b, e.g. a RayColour
+    template <class C> void addRGB(const C &c) {
+        add(c.r);
+        add(c.g);
+        add(c.b);
+    }
+
+    uint64_t value() const { return m_hash; }
+};
+
+#endif //HASH_H_
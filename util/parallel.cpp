@@ -0,0 +1,199 @@
+/******************************************************************************
+ * parallel.cpp
+ * Copyright 2011 Iain Peet
+ *
+ * Provides a simple way of spreading a batch of independent tasks across
+ * several threads.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "parallel.h"
+
+#include "util/trace.h"
+
+using std::vector;
+
+static trc_ctl_t parallelTrace = {
+    TRC_DFL_LVL,
+    "PARALLEL",
+    TRC_STDOUT
+};
+#define TRACE(level, args...) \
+    TRC_PRINTF(&parallelTrace,level,1,args)
+
+/** The tasks [next, end) still waiting to be run by one thread. */
+struct TaskRange {
+    pthread_mutex_t m_lock;
+    unsigned        m_next;
+    unsigned        m_end;
+};
+
+/** Everything a worker thread needs to know */
+struct TaskWorker {
+    ParallelTasks *m_tasks;
+    TaskRange     *m_ranges;
+    unsigned       m_threads;
+    unsigned       m_id;
+};
+
+//! Take the next task from the front of a thread's own range.
+static bool takeOwn(TaskRange &range, unsigned &task) {
+    bool found = false;
+    pthread_mutex_lock(&range.m_lock);
+    if (range.m_next < range.m_end) {
+        task = range.m_next++;
+        found = true;
+    }
+    pthread_mutex_unlock(&range.m_lock);
+    return found;
+}
+
+/* Steal the back half of the busiest other range.  The first stolen task
+ * is returned, and the rest become the thief's own range.
+ * @return false if there is nothing left to steal anywhere */
+static bool steal(TaskWorker &worker, unsigned &task) {
+    for (;;) {
+        unsigned victim = worker.m_id;
+        unsigned most = 0;
+        for (unsigned i=0; i<worker.m_threads; ++i) {
+            if (i == worker.m_id) continue;
+            TaskRange &range = worker.m_ranges[i];
+            pthread_mutex_lock(&range.m_lock);
+            unsigned remaining = range.m_end - range.m_next;
+            pthread_mutex_unlock(&range.m_lock);
+            if (remaining > most) {
+                most = remaining;
+                victim = i;
+            }
+        }
+        if (!most) return false;
+
+        /* Only one lock is ever held at once, so thieves can't deadlock.
+         * The victim may have drained in the meantime; if so, look again. */
+        TaskRange &from = worker.m_ranges[victim];
+        unsigned begin, end;
+        pthread_mutex_lock(&from.m_lock);
+        end = from.m_end;
+        begin = end - (end - from.m_next)/2;
+        if (begin == end) begin = from.m_next;
+        from.m_end = begin;
+        pthread_mutex_unlock(&from.m_lock);
+        if (begin == end) continue;
+
+        TaskRange &own = worker.m_ranges[worker.m_id];
+        pthread_mutex_lock(&own.m_lock);
+        own.m_next = begin + 1;
+        own.m_end = end;
+        pthread_mutex_unlock(&own.m_lock);
+        task = begin;
+        return true;
+    }
+}
+
+//! Thread entry point.  Runs tasks until there are none left.
+static void* runWorker(void *arg) {
+    TaskWorker &worker = *(TaskWorker*)(arg);
+    unsigned task;
+    for (;;) {
+        if (!takeOwn(worker.m_ranges[worker.m_id], task) &&
+            !steal(worker, task)) {
+            break;
+        }
+        worker.m_tasks->run(task, worker.m_id);
+    }
+    return 0;
+}
+
+unsigned defaultThreadCount() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cpus > 0) ? cpus : 1;
+}
+
+void runParallel(ParallelTasks &tasks, unsigned count, unsigned threads) {
+    if (!count) return;
+    if (!threads) threads = defaultThreadCount();
+    if (threads > count) threads = count;
+
+    if (threads == 1) {
+        for (unsigned i=0; i<count; ++i) tasks.run(i, 0);
+        return;
+    }
+
+    /* Give each thread an even, contiguous share to start with */
+    vector<TaskRange> ranges (threads);
+    vector<TaskWorker> workers (threads);
+    for (unsigned i=0; i<threads; ++i) {
+        pthread_mutex_init(&ranges[i].m_lock, 0);
+        ranges[i].m_next = (unsigned long long)(count) * i / threads;
+        ranges[i].m_end = (unsigned long long)(count) * (i+1) / threads;
+        workers[i].m_tasks = &tasks;
+        workers[i].m_ranges = &ranges[0];
+        workers[i].m_threads = threads;
+        workers[i].m_id = i;
+    }
+
+    /* The calling thread acts as worker 0.  If a thread can't be
+     * created, its share just gets stolen by the others. */
+    vector<pthread_t> handles (threads);
+    vector<bool> started (threads, false);
+    for (unsigned i=1; i<threads; ++i) {
+        if (pthread_create(&handles[i], 0, runWorker, &workers[i])) {
+            TRACE(TRC_WARN, "Failed to create worker thread %u\n", i);
+            continue;
+        }
+        started[i] = true;
+    }
+    runWorker(&workers[0]);
+    for (unsigned i=1; i<threads; ++i) {
+        if (started[i]) pthread_join(handles[i], 0);
+    }
+
+    for (unsigned i=0; i<threads; ++i) {
+        pthread_mutex_destroy(&ranges[i].m_lock);
+    }
+}
+
+/** Counts how many times each task was run */
+class CountingTasks : public ParallelTasks {
+public:
+    vector<int> m_runs;
+    CountingTasks(unsigned count) : m_runs(count, 0) {}
+    virtual void run(unsigned task, unsigned thread) {
+        // Uneven task lengths, so that some stealing happens.
+        volatile unsigned spin = 0;
+        for (unsigned i=0; i < (task % 7) * 1000; ++i) spin = spin + 1;
+        ++m_runs[task];
+    }
+};
+
+//! Every task runs exactly once, whatever the thread count.
+TEST(ParallelTest, RunsEachTaskOnce) {
+    const unsigned threads[] = { 1, 2, 5, 16 };
+    for (unsigned t=0; t<sizeof(threads)/sizeof(threads[0]); ++t) {
+        CountingTasks tasks (1000);
+        runParallel(tasks, 1000, threads[t]);
+        for (unsigned i=0; i<1000; ++i) {
+            ASSERT_EQ(1, tasks.m_runs[i]) << "Task " << i << ", "
+                << threads[t] << " threads";
+        }
+    }
+}
@@ -0,0 +1,54 @@
+/******************************************************************************
+ * parallel.h
+ * Copyright 2011 Iain Peet
+ *
+ * Provides a simple way of spreading a batch of independent tasks across
+ * several threads.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+/** A batch of numbered tasks, which may be run in any order, from any
+ *  thread.  Tasks must not depend on each other. */
+class ParallelTasks {
+public:
+    virtual ~ParallelTasks() {}
+
+    /* Run a single task.
+     * @param task   Which task to run, in [0, count)
+     * @param thread Which thread is running it, in [0, threads).  Useful
+     *               for indexing per-thread scratch space. */
+    virtual void run(unsigned task, unsigned thread) = 0;
+};
+
+/* Get the number of threads to use when 0 is requested: one per CPU. */
+unsigned defaultThreadCount();
+
+/* Run tasks [0, count) across a number of threads, and wait for them
+ * all to finish.  Each thread starts on its own contiguous share of the
+ * tasks, in order, and steals from the back of the busiest other share
+ * once its own runs out.  With one thread, the tasks are run in order on
+ * the calling thread.
+ * @param tasks   The tasks to run.
+ * @param count   Number of tasks.
+ * @param threads Number of threads to use, including the calling thread.
+ *                0 uses defaultThreadCount(). */
+void runParallel(ParallelTasks &tasks, unsigned count, unsigned threads=0);
+
+#endif //PARALLEL_H_
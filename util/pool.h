@@ -0,0 +1,96 @@
+/******************************************************************************
+ * pool.h
+ * Copyright 2011 Iain Peet
+ *
+ * Provides a pool which allocates many objects of one type in large blocks.
+ ******************************************************************************
+ * This program is distributed under the of the GNU Lesser Public License.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *****************************************************************************/
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <new>
+#include <vector>
+
+/** Allocates objects of type T in blocks, rather than one at a time.
+ *  Objects in a pool are contiguous, which is kind to the cache, and
+ *  creating one is just a copy into the next free slot.  Objects can't
+ *  be freed one at a time; they are all destroyed together by clear(),
+ *  or when the pool is destroyed. */
+template <class T>
+class ObjectPool {
+private:
+    std::vector<T*> m_blocks;
+    // Number of objects in each block
+    unsigned        m_blockSize;
+    // Number of objects created in the last block in use
+    unsigned        m_used;
+    // Index of the last block in use.  Later blocks are spare.
+    unsigned        m_current;
+
+    // Not copyable
+    ObjectPool(const ObjectPool&);
+    ObjectPool& operator=(const ObjectPool&);
+
+public:
+    ObjectPool(unsigned blockSize = 1024) :
+        m_blocks(), m_blockSize(blockSize ? blockSize : 1),
+        m_used(0), m_current(0)
+        { /* n/a */ }
+
+    ~ObjectPool() {
+        clear();
+        for (unsigned i=0; i < m_blocks.size(); ++i) {
+            ::operator delete(m_blocks[i]);
+        }
+    }
+
+    /** Create a new object in the pool, as a copy of another.
+     *  @return The new object, which belongs to the pool. */
+    T* create(const T &from) {
+        if (m_blocks.empty() || (m_used == m_blockSize)) {
+            if (!m_blocks.empty()) ++m_current;
+            if (m_current == m_blocks.size()) {
+                m_blocks.push_back(static_cast<T*>(
+                    ::operator new(m_blockSize * sizeof(T))));
+            }
+            m_used = 0;
+        }
+        T *obj = new (m_blocks[m_current] + m_used) T(from);
+        ++m_used;
+        return obj;
+    }
+
+    /** Destroy every object in the pool.  The memory is kept, and reused
+     *  by later calls to create(). */
+    void clear() {
+        if (m_blocks.empty()) return;
+        for (unsigned b=0; b <= m_current; ++b) {
+            unsigned count = (b == m_current) ? m_used : m_blockSize;
+            for (unsigned i=0; i < count; ++i) m_blocks[b][i].~T();
+        }
+        m_used = 0;
+        m_current = 0;
+    }
+
+    //! Number of objects in the pool.
+    unsigned size() const {
+        return m_blocks.empty() ? 0 : m_current*m_blockSize + m_used;
+    }
+};
+
+#endif //POOL_H_
@@ -21,9 +21,15 @@
 * along with this program.  If not, see <http://www.gnu.org/licenses/>
 *****************************************************************************/
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 #include <gtest/gtest.h>
 
 #include "trace.h"
@@ -71,6 +77,397 @@ void trc_def_fprint(const char* msg) {
     fflush(out_file);
 }
 
+/*****************************************************************************
+ * Binary trace rings
+ *
+ * Each thread which traces while recording gets a ring of records, which
+ * only it writes to, and which only trc_ring_flush() reads from.  The
+ * writer advances 'head' after filling a record, and the flusher advances
+ * 'tail' after copying records out, so neither needs a lock.  Rings are
+ * never freed; when a thread exits its ring is handed to the next new
+ * thread, so there are only ever as many as the most threads alive. */
+
+//! Bytes available in a record for arguments
+#define TRC_REC_PAYLOAD  96
+
+/** One traced message */
+typedef struct trc_record_s {
+    // Nanoseconds since recording started:
+    unsigned long long stamp;
+    trc_ctl_t*         ctl;
+    // Message format, or 0 if the payload holds the formatted message:
+    const char*        fmt;
+    int                do_tag;
+    // Raw arguments, packed one after another.  Strings are copied in.
+    char               payload[TRC_REC_PAYLOAD];
+} trc_record_t;
+
+/** A thread's ring of records */
+typedef struct trc_ring_s {
+    trc_record_t*      records;
+    // Next record to write.  Only the owning thread changes this.
+    volatile unsigned  head;
+    // Next record to flush.  Only the flusher changes this.
+    volatile unsigned  tail;
+    // Records dropped because the ring was full, and how many of those
+    // have been reported:
+    volatile unsigned  dropped;
+    unsigned           reported;
+    // Whether a live thread owns this ring:
+    int                in_use;
+    struct trc_ring_s* next;
+} trc_ring_t;
+
+static volatile int    _trc_ring_on = 0;
+// All rings.  Guarded by _trc_ring_lock; rings are only ever added.
+static trc_ring_t*     _trc_rings = 0;
+static pthread_mutex_t _trc_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+// Only one flush at a time, so output isn't interleaved:
+static pthread_mutex_t _trc_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+// Releases a thread's ring when it exits:
+static pthread_key_t   _trc_ring_key;
+static pthread_once_t  _trc_ring_once = PTHREAD_ONCE_INIT;
+static __thread trc_ring_t* _trc_my_ring = 0;
+// When recording started, for turning stamps back into times:
+static struct timespec _trc_ring_base;
+static time_t          _trc_ring_base_time;
+
+//! Kinds of argument taken by a printf conversion
+enum trc_arg_kind {
+    TRC_ARG_NONE,       // %%
+    TRC_ARG_INT,
+    TRC_ARG_LONG,
+    TRC_ARG_LLONG,
+    TRC_ARG_SIZE,
+    TRC_ARG_DOUBLE,
+    TRC_ARG_STR,
+    TRC_ARG_PTR,
+    TRC_ARG_BAD         // Anything we can't record, e.g. %*d or %n
+};
+
+/** Parse a printf conversion.
+ *  @param spec  Points just after the '%'
+ *  @param kind  Set to the kind of argument the conversion takes
+ *  @return      Points just after the conversion */
+static const char* trc_parse_spec(const char *spec, enum trc_arg_kind *kind) {
+    const char *p = spec;
+    while (*p && strchr("-+ #0", *p)) ++p;
+    while (*p >= '0' && *p <= '9') ++p;
+    if (*p == '.') {
+        ++p;
+        while (*p >= '0' && *p <= '9') ++p;
+    }
+
+    int longs = 0;
+    int size = 0;
+    for (;; ++p) {
+        if (*p == 'l') ++longs;
+        else if (*p == 'z') size = 1;
+        else if (*p != 'h') break;
+    }
+
+    *kind = TRC_ARG_BAD;
+    if (!*p) return p;
+    switch (*p) {
+        case '%':
+            if (p == spec) *kind = TRC_ARG_NONE;
+            break;
+        case 'd': case 'i': case 'u': case 'o':
+        case 'x': case 'X': case 'c':
+            if (size) *kind = TRC_ARG_SIZE;
+            else if (longs == 0) *kind = TRC_ARG_INT;
+            else if (longs == 1) *kind = TRC_ARG_LONG;
+            else if (longs == 2) *kind = TRC_ARG_LLONG;
+            break;
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A':
+            if (!size && longs <= 1) *kind = TRC_ARG_DOUBLE;
+            break;
+        case 's':
+            if (!size && !longs) *kind = TRC_ARG_STR;
+            break;
+        case 'p':
+            *kind = TRC_ARG_PTR;
+            break;
+    }
+    return p+1;
+}
+
+/* Pack a message's arguments into a record payload.
+ * @return 0 if they can't be packed */
+static int trc_pack(char *payload, const char *fmt, va_list args) {
+    unsigned pos = 0;
+    for (const char *p = fmt; *p; ) {
+        if (*p++ != '%') continue;
+        enum trc_arg_kind kind;
+        p = trc_parse_spec(p, &kind);
+
+        #define TRC_PACK(type) { \
+            type val = va_arg(args, type); \
+            if (pos + sizeof(val) > TRC_REC_PAYLOAD) return 0; \
+            memcpy(payload + pos, &val, sizeof(val)); \
+            pos += sizeof(val); \
+            break; }
+        switch (kind) {
+            case TRC_ARG_NONE:   break;
+            case TRC_ARG_INT:    TRC_PACK(int)
+            case TRC_ARG_LONG:   TRC_PACK(long)
+            case TRC_ARG_LLONG:  TRC_PACK(long long)
+            case TRC_ARG_SIZE:   TRC_PACK(size_t)
+            case TRC_ARG_DOUBLE: TRC_PACK(double)
+            case TRC_ARG_PTR:    TRC_PACK(void*)
+            case TRC_ARG_STR: {
+                // Strings are often in temporary buffers, so copy them.
+                const char *str = va_arg(args, const char*);
+                if (!str) str = "(null)";
+                if (pos >= TRC_REC_PAYLOAD) return 0;
+                unsigned len = strlen(str);
+                if (len > TRC_REC_PAYLOAD - pos - 1) {
+                    len = TRC_REC_PAYLOAD - pos - 1;
+                }
+                memcpy(payload + pos, str, len);
+                payload[pos + len] = '\0';
+                pos += len + 1;
+                break;
+            }
+            default:
+                return 0;
+        }
+        #undef TRC_PACK
+    }
+    return 1;
+}
+
+/* Format a record's message, the way trc_printf would have. */
+static void trc_unpack(const trc_record_t *rec, char *out, unsigned size) {
+    if (!rec->fmt) {
+        snprintf(out, size, "%s", rec->payload);
+        return;
+    }
+
+    unsigned len = 0;
+    unsigned pos = 0;
+    out[0] = '\0';
+    for (const char *p = rec->fmt; *p && (len < size-1); ) {
+        if (*p != '%') {
+            out[len++] = *p++;
+            out[len] = '\0';
+            continue;
+        }
+        const char *start = p++;
+        enum trc_arg_kind kind;
+        p = trc_parse_spec(p, &kind);
+
+        // Format just this conversion, with its own specifier
+        char spec[32];
+        unsigned specLen = p - start;
+        if (specLen >= sizeof(spec)) break;
+        memcpy(spec, start, specLen);
+        spec[specLen] = '\0';
+
+        int wrote = 0;
+        #define TRC_UNPACK(type) { \
+            type val; \
+            memcpy(&val, rec->payload + pos, sizeof(val)); \
+            pos += sizeof(val); \
+            wrote = snprintf(out + len, size - len, spec, val); \
+            break; }
+        switch (kind) {
+            case TRC_ARG_NONE:   wrote = snprintf(out + len, size - len, "%%");
+                                 break;
+            case TRC_ARG_INT:    TRC_UNPACK(int)
+            case TRC_ARG_LONG:   TRC_UNPACK(long)
+            case TRC_ARG_LLONG:  TRC_UNPACK(long long)
+            case TRC_ARG_SIZE:   TRC_UNPACK(size_t)
+            case TRC_ARG_DOUBLE: TRC_UNPACK(double)
+            case TRC_ARG_PTR:    TRC_UNPACK(void*)
+            case TRC_ARG_STR: {
+                const char *str = rec->payload + pos;
+                pos += strlen(str) + 1;
+                wrote = snprintf(out + len, size - len, spec, str);
+                break;
+            }
+            default:
+                break;
+        }
+        #undef TRC_UNPACK
+        if (wrote < 0) break;
+        len += wrote;
+        if (len > size-1) len = size-1;
+    }
+}
+
+//! Hands a ring back when its thread exits
+static void trc_ring_release(void *arg) {
+    trc_ring_t *ring = (trc_ring_t*)(arg);
+    pthread_mutex_lock(&_trc_ring_lock);
+    ring->in_use = 0;
+    pthread_mutex_unlock(&_trc_ring_lock);
+}
+
+static void trc_ring_make_key(void) {
+    pthread_key_create(&_trc_ring_key, trc_ring_release);
+}
+
+//! Get the calling thread's ring, finding it one if need be
+static trc_ring_t* trc_ring_get(void) {
+    trc_ring_t *ring = _trc_my_ring;
+    if (ring) return ring;
+
+    pthread_once(&_trc_ring_once, trc_ring_make_key);
+    pthread_mutex_lock(&_trc_ring_lock);
+    for (ring = _trc_rings; ring && ring->in_use; ring = ring->next);
+    if (!ring) {
+        ring = (trc_ring_t*)(calloc(1, sizeof(trc_ring_t)));
+        if (ring) {
+            ring->records = (trc_record_t*)
+                (malloc(TRC_RING_RECORDS * sizeof(trc_record_t)));
+            if (!ring->records) {
+                free(ring);
+                ring = 0;
+            }
+        }
+        if (ring) {
+            ring->next = _trc_rings;
+            _trc_rings = ring;
+        }
+    }
+    if (ring) ring->in_use = 1;
+    pthread_mutex_unlock(&_trc_ring_lock);
+
+    if (ring) pthread_setspecific(_trc_ring_key, ring);
+    _trc_my_ring = ring;
+    return ring;
+}
+
+//! Nanoseconds since recording started
+static unsigned long long trc_ring_stamp(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - _trc_ring_base.tv_sec) * 1000000000ULL
+        + now.tv_nsec - _trc_ring_base.tv_nsec;
+}
+
+//! Store a message in the calling thread's ring
+static void trc_ring_record
+(trc_ctl_t *ctl, int do_tag, const char *fmt, va_list args) {
+    trc_ring_t *ring = trc_ring_get();
+    if (!ring) return;
+
+    unsigned head = ring->head;
+    if (head - ring->tail >= TRC_RING_RECORDS) {
+        ring->dropped = ring->dropped + 1;
+        return;
+    }
+
+    trc_record_t *rec = &ring->records[head % TRC_RING_RECORDS];
+    rec->stamp = trc_ring_stamp();
+    rec->ctl = ctl;
+    rec->do_tag = do_tag;
+    rec->fmt = fmt;
+    va_list copy;
+    va_copy(copy, args);
+    if (!trc_pack(rec->payload, fmt, copy)) {
+        // Can't keep the raw arguments, so settle for formatting now.
+        rec->fmt = 0;
+        vsnprintf(rec->payload, TRC_REC_PAYLOAD, fmt, args);
+        rec->payload[TRC_REC_PAYLOAD-1] = '\0';
+    }
+    va_end(copy);
+
+    // The record must be complete before the flusher can see it
+    __sync_synchronize();
+    ring->head = head + 1;
+}
+
+//! Orders records by time
+static bool trc_record_before(const trc_record_t &a, const trc_record_t &b) {
+    return a.stamp < b.stamp;
+}
+
+//! Write out one record
+static void trc_ring_write(const trc_record_t *rec) {
+    char prbuf [TRC_PRBUF_SIZE];
+    trc_ctl_t *ctl = rec->ctl;
+
+    if(rec->do_tag) {
+        time_t timer = _trc_ring_base_time + rec->stamp / 1000000000ULL;
+        struct tm cur_time;
+        localtime_r(&timer, &cur_time);
+        strftime(prbuf,TRC_PRBUF_SIZE,"[%b%d-%H:%M:%S]",&cur_time);
+        prbuf[TRC_PRBUF_SIZE-1]='\0';
+        (ctl->write_fn)(prbuf);
+        if(ctl->name) {
+            snprintf(prbuf,TRC_PRBUF_SIZE,"[%s]",ctl->name);
+            prbuf[TRC_PRBUF_SIZE-1]='\0';
+            (ctl->write_fn)(prbuf);
+        }
+    }
+
+    trc_unpack(rec, prbuf, TRC_PRBUF_SIZE);
+    (ctl->write_fn)(prbuf);
+}
+
+void trc_ring_flush(void) {
+    pthread_mutex_lock(&_trc_flush_lock);
+
+    pthread_mutex_lock(&_trc_ring_lock);
+    trc_ring_t *rings = _trc_rings;
+    pthread_mutex_unlock(&_trc_ring_lock);
+
+    /* Copy out everything written so far, then let the writers reuse it */
+    std::vector<trc_record_t> pending;
+    unsigned dropped = 0;
+    for (trc_ring_t *ring = rings; ring; ring = ring->next) {
+        unsigned head = ring->head;
+        __sync_synchronize();
+        for (unsigned i = ring->tail; i != head; ++i) {
+            pending.push_back(ring->records[i % TRC_RING_RECORDS]);
+        }
+        __sync_synchronize();
+        ring->tail = head;
+
+        unsigned ringDropped = ring->dropped;
+        dropped += ringDropped - ring->reported;
+        ring->reported = ringDropped;
+    }
+
+    std::stable_sort(pending.begin(), pending.end(), trc_record_before);
+    for (unsigned i=0; i < pending.size(); ++i) {
+        trc_ring_write(&pending[i]);
+    }
+    if (dropped) {
+        char prbuf [TRC_PRBUF_SIZE];
+        snprintf(prbuf,TRC_PRBUF_SIZE,
+                 "[TRC] %u trace records dropped; ring full.\n",dropped);
+        (trc_default.write_fn)(prbuf);
+    }
+
+    pthread_mutex_unlock(&_trc_flush_lock);
+}
+
+static void trc_ring_at_exit(void) {
+    if (_trc_ring_on) trc_ring_flush();
+}
+
+void trc_ring_start(void) {
+    static int registered = 0;
+    if (_trc_ring_on) return;
+    if (!registered) {
+        atexit(trc_ring_at_exit);
+        registered = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &_trc_ring_base);
+    _trc_ring_base_time = time(0);
+    _trc_ring_on = 1;
+}
+
+void trc_ring_stop(void) {
+    if (!_trc_ring_on) return;
+    trc_ring_flush();
+    _trc_ring_on = 0;
+}
+
 //! Prints a trace message
 void trc_printf
 (trc_ctl_t *ctl, int level, int do_tag, const char *fmt, ...) {
@@ -86,10 +483,6 @@ void trc_printf
         TRACE("Error: trace control has null write pointer.");
         return;
     }
-    // Variable length args:
-    va_list args;
-    va_start(args,fmt);
-    
     /* Check level */
     switch(_trc_type) {
         case TRC_NORMAL:
@@ -105,6 +498,17 @@ void trc_printf
             TRACE("Error: invalid _trc_type\n");
             break;
     }
+
+    // Variable length args:
+    va_list args;
+    va_start(args,fmt);
+
+    /* Record it for later, if recording */
+    if(_trc_ring_on) {
+        trc_ring_record(ctl,do_tag,fmt,args);
+        va_end(args);
+        return;
+    }
     
     /* Print the tag, if desired */
     if(do_tag) {
@@ -122,6 +526,7 @@ void trc_printf
     
     /* Print the message */
     vsnprintf(prbuf,TRC_PRBUF_SIZE,fmt,args);
+    va_end(args);
     prbuf[TRC_PRBUF_SIZE-1]='\0';
     (ctl->write_fn)(prbuf);
 }
@@ -189,3 +594,64 @@ TEST(TraceTest, ChangeConfig) {
     trc_printf(0,5,0,"This should print.\n");
 }
 
+
+static int countedArg(int *count) { ++(*count); return 0; }
+
+TEST(TraceTest, CompiledOut) {
+    // Messages above the ceiling are dropped without evaluating arguments
+    int count = 0;
+    TRC_PRINTF(0,TRC_MAX_LEVEL+1,0,"This should NOT print %d\n",
+               countedArg(&count));
+    ASSERT_EQ(0, count);
+    TRC_PRINTF(0,1,0,"Printed through TRC_PRINTF %d\n",countedArg(&count));
+    ASSERT_EQ(1, count);
+}
+
+//! Collects recorded trace output
+static std::string _trc_test_output;
+static void trc_test_write(const char *msg) { _trc_test_output += msg; }
+
+static void* trc_test_thread(void *arg) {
+    trc_ctl_t *ctl = (trc_ctl_t*)(arg);
+    for (int i=0; i<100; ++i) trc_printf(ctl,1,0,"%d\n",i);
+    return 0;
+}
+
+TEST(TraceTest, RingBuffer) {
+    trc_ctl_t ctl = {
+        TRC_STAT,
+        "RING",
+        trc_test_write
+    };
+    trc_global_set(TRC_NORMAL,TRC_DFL_LVL);
+    _trc_test_output.clear();
+    trc_ring_start();
+
+    // Nothing is written until a flush
+    char temp[16] = "temporary";
+    trc_printf(&ctl,1,0,"Args: %s %d %.03f %u%% %lld %c\n",
+               temp,-42,3.14159,7u,1LL<<40,'x');
+    strcpy(temp, "overwritten");
+    trc_printf(&ctl,TRC_INFO,0,"This should NOT print\n");
+    trc_printf(&ctl,1,0,"Unrecordable: %*d\n",4,2);
+    ASSERT_EQ("", _trc_test_output);
+    trc_ring_flush();
+    ASSERT_EQ("Args: temporary -42 3.142 7% 1099511627776 x\n"
+              "Unrecordable:    2\n", _trc_test_output);
+
+    // Each thread gets its own ring
+    _trc_test_output.clear();
+    pthread_t threads[4];
+    for (int t=0; t<4; ++t) {
+        pthread_create(&threads[t], 0, trc_test_thread, &ctl);
+    }
+    for (int t=0; t<4; ++t) pthread_join(threads[t], 0);
+    trc_ring_stop();
+    ASSERT_EQ(400, std::count(_trc_test_output.begin(),
+                              _trc_test_output.end(), '\n'));
+
+    // Back to printing straight away
+    _trc_test_output.clear();
+    trc_printf(&ctl,1,0,"Direct\n");
+    ASSERT_EQ("Direct\n", _trc_test_output);
+}
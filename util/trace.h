@@ -53,6 +53,18 @@ typedef struct trc_ctrl_s {
 // A nice default level for programs to use
 #define TRC_DFL_LVL  TRC_WARN
 
+/** Messages above this level are removed at compile time, whatever the
+ *  runtime settings.  Detail traces sit in the innermost tracing loops,
+ *  where even a call which prints nothing is costly, so release builds
+ *  (NDEBUG) drop them.  Override with -DTRC_MAX_LEVEL=<level>. */
+#ifndef TRC_MAX_LEVEL
+#ifdef NDEBUG
+#define TRC_MAX_LEVEL    TRC_INFO
+#else
+#define TRC_MAX_LEVEL    TRC_DTL
+#endif
+#endif
+
 /** Define some standard output functions */
 // Print to stdout:
 inline void trc_stdprint(const char* msg) {
@@ -91,6 +103,14 @@ extern trc_ctl_t       trc_default;
  *  (It is suggested that you use a macro to simplify this appropriately) */
 void trc_printf
     (trc_ctl_t* ctl, int level, int do_tag, const char * fmt, ...);
+
+/** As trc_printf, but compiles to nothing if level is a constant above
+ *  TRC_MAX_LEVEL.  The arguments are still checked by the compiler, but
+ *  are not evaluated.  This is what per-file TRACE macros should use. */
+#define TRC_PRINTF(ctl, level, do_tag, args...) \
+    do { \
+        if ((level) <= TRC_MAX_LEVEL) trc_printf(ctl,level,do_tag,args); \
+    } while (0)
  
 /** Ways in which the trace can be configured at runtime */
 enum trc_global_type {
@@ -111,6 +131,30 @@ enum trc_global_type {
  *  @param level         The global level to set, effect varies according
  *                       to type */
 void trc_global_set(enum trc_global_type type, int level);
+
+/** Number of records in each thread's trace ring. */
+#ifndef TRC_RING_RECORDS
+#define TRC_RING_RECORDS 4096
+#endif
+
+/** Starts recording traces in binary.  Rather than formatting each message
+ *  as it is traced, trc_printf stores a compact record (time, control
+ *  block, format and raw arguments) in a ring buffer belonging to the
+ *  calling thread, without taking any locks.  Level checks still apply.
+ *  The records are formatted and written out by trc_ring_flush(), which
+ *  also happens at exit.  If a thread's ring fills up before it is
+ *  flushed, further records from that thread are dropped and counted.
+ *  NB: formats are kept by pointer, so they must be string literals. */
+void trc_ring_start(void);
+
+/** Formats and writes every record so far, from all threads, in time
+ *  order.  This may be called at any time, from any thread, even while
+ *  other threads are tracing (e.g. periodically, from a background
+ *  thread). */
+void trc_ring_flush(void);
+
+/** Flushes, then goes back to formatting messages as they are traced. */
+void trc_ring_stop(void);
     
 #ifdef __cplusplus
 };  // extern "C"